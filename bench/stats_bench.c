@@ -0,0 +1,584 @@
+/* stats_bench.c */
+
+/*
+ * Benchmarks of the stats library.
+ *
+ * Each benchmark prints one JSON object per line, so the output of two
+ * builds can be compared by a script. Latencies are reported as ns/op
+ * percentiles over many samples:
+ *
+ *   increment  - counter_increment throughput with 1..N threads and 1..N
+ *                processes writing one shared counter or a counter each.
+ *                A sample is the mean of a batch of BENCH_BATCH increments.
+ *   allocate   - stats_allocate_counter latency of new counters as the
+ *                counter table fills, per tenth of the table.
+ *   list       - stats_get_counter_list latency versus the counter count.
+ *   sample     - stats_get_sample latency versus the counter count.
+ *   lock       - time spent waiting for the stats lock with 1..N processes
+ *                taking it in a loop.
+ *   attach     - stats_open latency of an existing stats object with
+ *                ATTACHES processes opening it at once.
+ *
+ * allocate, list and sample are run against shared and private stats.
+ *
+ * usage: stats_bench [-n MAX_WORKERS] [-i INCREMENTS] [-a ATTACHES] [BENCHMARK...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+
+#define BENCH_BATCH                 1000
+#define BENCH_DEFAULT_WORKERS       4
+#define BENCH_DEFAULT_INCREMENTS    1000000
+#define BENCH_MAX_WORKERS           64
+#define BENCH_READ_REPEAT           1000
+#define BENCH_LOCK_REPEAT           10000
+#define BENCH_DEFAULT_ATTACHES      2000
+
+static int max_workers = BENCH_DEFAULT_WORKERS;
+static long long increments = BENCH_DEFAULT_INCREMENTS;
+static int attaches = BENCH_DEFAULT_ATTACHES;
+
+static const int counter_counts[] = { 16, 128, 512, 1024, 1536 };
+#define COUNTER_COUNTS (sizeof(counter_counts) / sizeof(counter_counts[0]))
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double percentile(double *sorted, int n, int p)
+{
+    return n ? sorted[(long long)(n - 1) * p / 100] : 0.0;
+}
+
+/* sorts the samples and prints the end of the JSON object started by the caller */
+static void report(double *samples, int n, long long ops, long long elapsed_ns)
+{
+    double sum = 0.0;
+    int i;
+
+    qsort(samples, n, sizeof(double), compare_double);
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+
+    printf("\"ops\":%lld,", ops);
+    if (elapsed_ns > 0)
+        printf("\"ops_per_sec\":%.0f,", ops * 1e9 / elapsed_ns);
+    printf("\"samples\":%d,\"mean_ns\":%.1f,\"p50_ns\":%.1f,\"p90_ns\":%.1f,\"p99_ns\":%.1f,\"max_ns\":%.1f}\n",
+        n, n ? sum / n : 0.0, percentile(samples, n, 50), percentile(samples, n, 90), percentile(samples, n, 99),
+        n ? samples[n - 1] : 0.0);
+    fflush(stdout);
+}
+
+static struct stats *bench_open(int flags)
+{
+    struct stats *stats = NULL;
+    char name[STATS_MAX_NAME_LEN];
+    int err;
+
+    snprintf(name, sizeof(name), "bench%d", (int) getpid());
+
+    err = stats_create_with_flags(name, flags, &stats);
+    if (err == S_OK)
+    {
+        err = stats_open(stats);
+        if (err != S_OK)
+            stats_free(stats);
+    }
+
+    if (err != S_OK)
+    {
+        fprintf(stderr, "stats_bench: cannot open stats %s: %s\n", name, error_message(err));
+        exit(1);
+    }
+
+    return stats;
+}
+
+static void bench_close(struct stats *stats)
+{
+    stats_close(stats);
+    stats_free(stats);
+}
+
+static struct stats_counter *bench_counter(struct stats *stats, const char *prefix, int i)
+{
+    struct stats_counter *ctr = NULL;
+    char name[MAX_COUNTER_KEY_LENGTH + 1];
+    int err;
+
+    snprintf(name, sizeof(name), "%s.%d", prefix, i);
+
+    err = stats_allocate_counter(stats, name, &ctr);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "stats_bench: cannot allocate %s: %s\n", name, error_message(err));
+        exit(1);
+    }
+
+    return ctr;
+}
+
+/* memory shared with forked workers, for their samples and the start flag */
+static void *shared_alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+    {
+        perror("stats_bench: mmap");
+        exit(1);
+    }
+
+    return p;
+}
+
+/* the worker counts 1, 2, 4, ... up to and including max_workers */
+static int next_workers(int workers)
+{
+    return (workers < max_workers && workers * 2 > max_workers) ? max_workers : workers * 2;
+}
+
+
+/*
+ * Workers are run as threads or forked processes. They wait for *go so
+ * they all start together, then write one sample per iteration into
+ * samples.
+ */
+
+
+struct worker;
+typedef void (*worker_fn)(struct worker *w);
+
+struct worker
+{
+    worker_fn fn;
+    struct stats *stats;
+    struct stats_counter *ctr;
+    double *samples;
+    int iterations;
+};
+
+static volatile int *go;
+
+static void increment_worker(struct worker *w)
+{
+    long long start;
+    int i, j;
+
+    for (i = 0; i < w->iterations; i++)
+    {
+        start = current_time();
+        for (j = 0; j < BENCH_BATCH; j++)
+            counter_increment(w->ctr);
+        w->samples[i] = (double) TIME_DELTA_TO_NANOS(start, current_time()) / BENCH_BATCH;
+    }
+}
+
+static void lock_worker(struct worker *w)
+{
+    long long start, acquired;
+    int i;
+
+    for (i = 0; i < w->iterations; i++)
+    {
+        start = current_time();
+        lock_acquire(&w->stats->lock);
+        acquired = current_time();
+        lock_release(&w->stats->lock);
+        w->samples[i] = (double) TIME_DELTA_TO_NANOS(start, acquired);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+
+    while (!*go)
+        sched_yield();
+
+    w->fn(w);
+
+    return NULL;
+}
+
+/*
+ * run_workers
+ *
+ * Runs the workers as threads, or as processes if processes is set, and
+ * returns the time from the start until the last one finished.
+ */
+static long long run_workers(struct worker *w, int workers, int processes)
+{
+    pthread_t threads[BENCH_MAX_WORKERS];
+    pid_t pids[BENCH_MAX_WORKERS];
+    long long start;
+    int i, n = 0;
+
+    *go = 0;
+
+    for (i = 0; i < workers; i++, n++)
+    {
+        if (processes)
+        {
+            pids[i] = fork();
+            if (pids[i] == 0)
+            {
+                worker_thread(w + i);
+                _exit(0);
+            }
+            if (pids[i] < 0)
+                break;
+        }
+        else if (pthread_create(threads + i, NULL, worker_thread, w + i) != 0)
+        {
+            break;
+        }
+    }
+
+    if (n < workers)
+        fprintf(stderr, "stats_bench: started %d of %d workers\n", n, workers);
+
+    start = current_time();
+    *go = 1;
+
+    for (i = 0; i < n; i++)
+    {
+        if (processes)
+            waitpid(pids[i], NULL, 0);
+        else
+            pthread_join(threads[i], NULL);
+    }
+
+    return TIME_DELTA_TO_NANOS(start, current_time());
+}
+
+static void bench_increment()
+{
+    static const char *modes[] = { "threads", "processes" };
+    struct worker w[BENCH_MAX_WORKERS];
+    struct stats *stats;
+    double *samples;
+    long long elapsed;
+    int batches, workers, mode, distinct, i;
+
+    batches = increments / BENCH_BATCH;
+    if (batches < 1)
+        batches = 1;
+
+    stats = bench_open(0);
+    samples = (double *) shared_alloc(sizeof(double) * batches * max_workers);
+
+    for (mode = 0; mode < 2; mode++)
+    {
+        for (distinct = 0; distinct < 2; distinct++)
+        {
+            for (workers = 1; workers <= max_workers; workers = next_workers(workers))
+            {
+                for (i = 0; i < workers; i++)
+                {
+                    w[i].fn = increment_worker;
+                    w[i].stats = stats;
+                    w[i].ctr = bench_counter(stats, "inc", distinct ? i + 1 : 0);
+                    w[i].samples = samples + i * batches;
+                    w[i].iterations = batches;
+                }
+
+                elapsed = run_workers(w, workers, mode);
+
+                printf("{\"bench\":\"increment\",\"mode\":\"%s\",\"counter\":\"%s\",\"workers\":%d,",
+                    modes[mode], distinct ? "distinct" : "shared", workers);
+                report(samples, workers * batches, (long long) workers * batches * BENCH_BATCH, elapsed);
+            }
+        }
+    }
+
+    munmap(samples, sizeof(double) * batches * max_workers);
+    bench_close(stats);
+}
+
+static void bench_lock()
+{
+    static const char *modes[] = { "threads", "processes" };
+    struct worker w[BENCH_MAX_WORKERS];
+    struct stats *stats;
+    double *samples;
+    long long elapsed;
+    int workers, mode, i;
+
+    stats = bench_open(0);
+    samples = (double *) shared_alloc(sizeof(double) * BENCH_LOCK_REPEAT * max_workers);
+
+    for (mode = 0; mode < 2; mode++)
+    {
+        for (workers = 1; workers <= max_workers; workers = next_workers(workers))
+        {
+            for (i = 0; i < workers; i++)
+            {
+                w[i].fn = lock_worker;
+                w[i].stats = stats;
+                w[i].ctr = NULL;
+                w[i].samples = samples + i * BENCH_LOCK_REPEAT;
+                w[i].iterations = BENCH_LOCK_REPEAT;
+            }
+
+            elapsed = run_workers(w, workers, mode);
+
+            printf("{\"bench\":\"lock\",\"mode\":\"%s\",\"workers\":%d,", modes[mode], workers);
+            report(samples, workers * BENCH_LOCK_REPEAT, (long long) workers * BENCH_LOCK_REPEAT, elapsed);
+        }
+    }
+
+    munmap(samples, sizeof(double) * BENCH_LOCK_REPEAT * max_workers);
+    bench_close(stats);
+}
+
+/*
+ * bench_attach
+ *
+ * Forks the attaching processes, which block reading a pipe, then closes
+ * the pipe to release them all at once.
+ */
+static void bench_attach()
+{
+    struct stats *stats, *child;
+    double *samples;
+    long long start;
+    char name[STATS_MAX_NAME_LEN];
+    int fds[2], i, n;
+    pid_t pid;
+
+    stats = bench_open(0);
+    snprintf(name, sizeof(name), "bench%d", (int) getpid());
+
+    samples = (double *) shared_alloc(sizeof(double) * attaches);
+    if (pipe(fds) != 0)
+    {
+        perror("stats_bench: pipe");
+        exit(1);
+    }
+
+    for (n = 0; n < attaches; n++)
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            close(fds[1]);
+            if (read(fds[0], &i, 1) != 0 || stats_create(name, &child) != S_OK)
+                _exit(1);
+
+            start = current_time();
+            if (stats_open(child) == S_OK)
+            {
+                samples[n] = (double) TIME_DELTA_TO_NANOS(start, current_time());
+                stats_close(child);
+            }
+            stats_free(child);
+            _exit(0);
+        }
+
+        if (pid < 0)
+        {
+            fprintf(stderr, "stats_bench: started %d of %d attaching processes\n", n, attaches);
+            break;
+        }
+    }
+
+    close(fds[0]);
+    start = current_time();
+    close(fds[1]);
+
+    while (wait(NULL) > 0)
+        ;
+
+    printf("{\"bench\":\"attach\",\"processes\":%d,", n);
+    report(samples, n, n, TIME_DELTA_TO_NANOS(start, current_time()));
+
+    munmap(samples, sizeof(double) * attaches);
+    bench_close(stats);
+}
+
+static void bench_allocate(int flags)
+{
+    struct stats_counter *ctr;
+    struct stats *stats;
+    double samples[COUNTER_TABLE_SIZE];
+    char name[MAX_COUNTER_KEY_LENGTH + 1];
+    long long start;
+    int i = 0, n, tenth, err = S_OK;
+
+    stats = bench_open(flags);
+
+    for (tenth = 0; tenth < 10 && err == S_OK; tenth++)
+    {
+        for (n = 0; i < COUNTER_TABLE_SIZE * (tenth + 1) / 10; i++)
+        {
+            snprintf(name, sizeof(name), "alloc.%d", i);
+
+            start = current_time();
+            err = stats_allocate_counter(stats, name, &ctr);
+            samples[n] = (double) TIME_DELTA_TO_NANOS(start, current_time());
+
+            if (err != S_OK)
+                break;
+            n++;
+        }
+
+        printf("{\"bench\":\"allocate\",\"stats\":\"%s\",\"fill_pct\":%d,",
+            (flags & STATS_FLAG_PRIVATE) ? "private" : "shared", tenth * 10);
+        report(samples, n, n, 0);
+    }
+
+    bench_close(stats);
+}
+
+static void bench_read(int flags, int list)
+{
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL;
+    struct stats *stats;
+    double samples[BENCH_READ_REPEAT];
+    long long start;
+    int c, i;
+
+    for (c = 0; c < COUNTER_COUNTS; c++)
+    {
+        stats = bench_open(flags);
+        for (i = 0; i < counter_counts[c]; i++)
+            bench_counter(stats, "read", i);
+
+        if (stats_cl_create(&cl) != S_OK || stats_sample_create_with_capacity(counter_counts[c], &sample) != S_OK)
+        {
+            fprintf(stderr, "stats_bench: out of memory\n");
+            exit(1);
+        }
+
+        stats_get_sample(stats, cl, sample);
+
+        for (i = 0; i < BENCH_READ_REPEAT; i++)
+        {
+            start = current_time();
+            if (list)
+                stats_get_counter_list(stats, cl);
+            else
+                stats_get_sample(stats, cl, sample);
+            samples[i] = (double) TIME_DELTA_TO_NANOS(start, current_time());
+        }
+
+        printf("{\"bench\":\"%s\",\"stats\":\"%s\",\"counters\":%d,", list ? "list" : "sample",
+            (flags & STATS_FLAG_PRIVATE) ? "private" : "shared", counter_counts[c]);
+        report(samples, BENCH_READ_REPEAT, BENCH_READ_REPEAT, 0);
+
+        stats_sample_free(sample);
+        stats_cl_free(cl);
+        bench_close(stats);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: stats_bench [-n MAX_WORKERS] [-i INCREMENTS] [-a ATTACHES] "
+        "[increment|allocate|list|sample|lock|attach...]\n");
+    exit(1);
+}
+
+static int selected(int argc, char **argv, const char *bench)
+{
+    int i;
+
+    if (argc == 0)
+        return 1;
+
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], bench) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *benches[] = { "increment", "allocate", "list", "sample", "lock", "attach" };
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "n:i:a:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            max_workers = atoi(optarg);
+            if (max_workers < 1 || max_workers > BENCH_MAX_WORKERS)
+                usage();
+            break;
+        case 'a':
+            attaches = atoi(optarg);
+            if (attaches < 1)
+                usage();
+            break;
+        case 'i':
+            increments = atoll(optarg);
+            if (increments < 1)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    for (i = 0; i < argc; i++)
+    {
+        for (j = 0; j < 6 && strcmp(argv[i], benches[j]) != 0; j++)
+            ;
+        if (j == 6)
+            usage();
+    }
+
+    go = (volatile int *) shared_alloc(sizeof(int));
+
+    if (selected(argc, argv, "increment"))
+        bench_increment();
+
+    if (selected(argc, argv, "allocate"))
+    {
+        bench_allocate(0);
+        bench_allocate(STATS_FLAG_PRIVATE);
+    }
+
+    if (selected(argc, argv, "list"))
+    {
+        bench_read(0, 1);
+        bench_read(STATS_FLAG_PRIVATE, 1);
+    }
+
+    if (selected(argc, argv, "sample"))
+    {
+        bench_read(0, 0);
+        bench_read(STATS_FLAG_PRIVATE, 0);
+    }
+
+    if (selected(argc, argv, "lock"))
+        bench_lock();
+
+    if (selected(argc, argv, "attach"))
+        bench_attach();
+
+    return 0;
+}
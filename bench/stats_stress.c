@@ -0,0 +1,716 @@
+/* stats_stress.c */
+
+/*
+ * Multi-process stress and soak test of the stats library.
+ *
+ * The supervisor opens the stats and forks writer and reader processes
+ * which run until the end of the test:
+ *
+ *   writers    allocate counters from a pool of names, increment the
+ *              checked counters and the allocated ones, and reset the
+ *              counters at random intervals.
+ *   readers    take samples and counter lists and check that every
+ *              counter is monotonic within a reset epoch, that the
+ *              sequence number never goes backwards and that counter
+ *              lists are in allocation order.
+ *
+ * The supervisor kills a random worker with SIGKILL at random intervals
+ * and starts a new one in its place. At every checkpoint it pauses the
+ * writers and checks that no increment of the checked counters was lost:
+ * each writer tallies the increments which happened entirely within one
+ * reset epoch, so the value of a checked counter must be at least the
+ * sum of the tallies of the current epoch. Increments which raced a reset
+ * or were interrupted by a kill may or may not be in the value, so they
+ * only widen the upper bound.
+ *
+ * Each process records the latency of every call in log2 histograms in
+ * memory shared with the supervisor, which prints the throughput and
+ * latency percentiles of each API once per interval, one JSON object per
+ * line, followed by a summary. The exit status is 1 if any invariant was
+ * violated.
+ *
+ * usage: stats_stress [-w WRITERS] [-r READERS] [-d SECONDS] [-k KILL_MS] [-R RESET_MS]
+ *                     [-C CHECK_MS] [-i REPORT_S] [-c CHECKED] [-p POOL] [-s READ_US] [NAME]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+
+#define STRESS_MAX_SLOTS        128
+#define STRESS_MAX_CHECKED      64
+#define STRESS_HIST_BUCKETS     40
+#define STRESS_TICK_US          10000
+#define STRESS_PAUSE_TIMEOUT_NS 2000000000ll
+#define STRESS_MAX_MESSAGES     5
+
+enum { API_ALLOCATE, API_INCREMENT, API_RESET, API_LIST, API_SAMPLE, API_COUNT };
+static const char *api_names[API_COUNT] = { "allocate", "increment", "reset", "list", "sample" };
+
+enum { V_LOST, V_EXTRA, V_MONOTONIC, V_SEQUENCE, V_ORDER, V_API_ERROR, V_CRASH, V_STUCK, V_COUNT };
+static const char *violation_names[V_COUNT] = {
+    "lost_increment", "extra_increment", "not_monotonic", "sequence_backwards", "list_order",
+    "api_error", "crash", "stuck"
+};
+
+enum { ROLE_WRITER, ROLE_READER };
+
+/* a worker process's part of the shared memory
+ *
+ * pid is the worker in the slot, or 0 while it is being replaced.
+ * epoch is the reset epoch the tallies were counted in.
+ * inflight is the checked counter index + 1 being incremented, so an
+ *      increment interrupted by a kill is known to be uncertain.
+ * tally counts increments of each checked counter which happened
+ *      entirely within epoch, ambiguous those which raced a reset and
+ *      uncertain those interrupted by a kill.
+ * hist counts calls of each API by log2 of their latency in ns.
+ */
+struct stress_slot
+{
+    volatile int pid;
+    int role;
+    volatile int paused;
+    volatile int inflight;
+    volatile int epoch;
+    int reserved;
+    volatile long long tally[STRESS_MAX_CHECKED];
+    volatile long long ambiguous[STRESS_MAX_CHECKED];
+    volatile long long uncertain[STRESS_MAX_CHECKED];
+    volatile long long hist[API_COUNT][STRESS_HIST_BUCKETS];
+};
+
+struct stress_control
+{
+    volatile int pause;
+    volatile int stop;
+    long long violations[V_COUNT];
+    long long resets;
+    struct stress_slot slot[STRESS_MAX_SLOTS];
+};
+
+static int writers = 4;
+static int readers = 2;
+static int duration_s = 60;
+static int kill_ms = 0;
+static int reset_ms = 0;
+static int check_ms = 1000;
+static int report_s = 1;
+static int checked = 16;
+static int pool = 1000;
+static int read_us = 1000;
+
+static struct stress_control *control;
+static struct stats *stats;
+static struct stats_counter *checked_ctr[STRESS_MAX_CHECKED];
+
+
+/* the supervisor's counts */
+static int kills, restarts;
+static pid_t last_killed;
+
+
+static void violation(int type, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void violation(int type, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (__sync_add_and_fetch(&control->violations[type], 1) <= STRESS_MAX_MESSAGES)
+    {
+        fprintf(stderr, "stats_stress: %d: %s: ", (int) getpid(), violation_names[type]);
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+    }
+}
+
+static void record(struct stress_slot *slot, int api, long long start)
+{
+    long long ns = TIME_DELTA_TO_NANOS(start, current_time());
+    int b = 0;
+
+    while (ns > 1 && b < STRESS_HIST_BUCKETS - 1)
+    {
+        ns >>= 1;
+        b++;
+    }
+
+    slot->hist[api][b]++;
+}
+
+static long long ms_to_ns(int ms)
+{
+    return ms * 1000000ll;
+}
+
+/* a random time in [0, 2 * ms) from now, or 0 if ms is 0 */
+static long long next_time(unsigned int *seed, int ms)
+{
+    if (ms <= 0)
+        return 0;
+
+    return current_time() + (long long)(rand_r(seed) % (2 * ms)) * 1000000ll;
+}
+
+
+/*
+ * writer
+ */
+
+static void writer_pause(struct stress_slot *slot)
+{
+    slot->paused = 1;
+    while (control->pause && !control->stop)
+        usleep(100);
+    slot->paused = 0;
+}
+
+static void writer_increment_checked(struct stress_slot *slot, int c)
+{
+    volatile int *reset_epoch = &stats->data->hdr.stats_reset_epoch;
+    long long start;
+    int e1, e2;
+
+    e1 = *reset_epoch;
+    slot->inflight = c + 1;
+    __sync_synchronize();
+
+    start = current_time();
+    counter_increment(checked_ctr[c]);
+    record(slot, API_INCREMENT, start);
+
+    __sync_synchronize();
+    e2 = *reset_epoch;
+
+    if (slot->epoch != e2)
+    {
+        memset((void *) slot->tally, 0, sizeof(slot->tally));
+        memset((void *) slot->ambiguous, 0, sizeof(slot->ambiguous));
+        memset((void *) slot->uncertain, 0, sizeof(slot->uncertain));
+        slot->epoch = e2;
+    }
+
+    if (e1 == e2 && !(e1 & 1))
+        slot->tally[c]++;
+    else
+        slot->ambiguous[c]++;
+
+    __sync_synchronize();
+    slot->inflight = 0;
+}
+
+static void writer(struct stress_slot *slot)
+{
+    struct stats_counter **churn;
+    struct stats_counter *ctr;
+    char name[MAX_COUNTER_KEY_LENGTH + 1];
+    unsigned int seed = getpid() ^ (unsigned int) time(NULL);
+    long long start, reset_time;
+    int n = 0, r, err;
+
+    churn = (struct stats_counter **) calloc(pool, sizeof(struct stats_counter *));
+    if (churn == NULL)
+        exit(1);
+
+    /* the last writer in this slot was killed in the middle of an increment */
+    if (slot->inflight)
+    {
+        slot->uncertain[slot->inflight - 1]++;
+        slot->inflight = 0;
+    }
+
+    reset_time = next_time(&seed, reset_ms * writers);
+
+    while (!control->stop)
+    {
+        if (control->pause)
+            writer_pause(slot);
+
+        r = rand_r(&seed) % 1000;
+
+        if (r < 5)
+        {
+            snprintf(name, sizeof(name), "stress.churn.%d", rand_r(&seed) % pool);
+
+            start = current_time();
+            err = stats_allocate_counter(stats, name, &ctr);
+            record(slot, API_ALLOCATE, start);
+
+            if (err == S_OK && n < pool)
+                churn[n++] = ctr;
+            else if (err != S_OK && err != ERROR_STATS_CANNOT_ALLOCATE_COUNTER)
+                violation(V_API_ERROR, "stats_allocate_counter %s: %s", name, error_message(err));
+        }
+        else if (r < 500 || n == 0)
+        {
+            writer_increment_checked(slot, rand_r(&seed) % checked);
+        }
+        else
+        {
+            start = current_time();
+            counter_increment(churn[rand_r(&seed) % n]);
+            record(slot, API_INCREMENT, start);
+        }
+
+        if (reset_time && current_time() > reset_time)
+        {
+            start = current_time();
+            stats_reset_counters(stats);
+            record(slot, API_RESET, start);
+
+            __sync_fetch_and_add(&control->resets, 1);
+            reset_time = next_time(&seed, reset_ms * writers);
+        }
+    }
+}
+
+
+/*
+ * reader
+ */
+
+static void reader_check_list(struct stats_counter_list *cl)
+{
+    int i, seq, prev_seq = -1;
+
+    for (i = 0; i < cl->cl_count; i++)
+    {
+        seq = stats->data->ctr[cl->cl_slot[i]].ctr_allocation_seq;
+        if (seq <= prev_seq)
+        {
+            violation(V_ORDER, "counter %d of %d has allocation seq %d after %d", i, cl->cl_count, seq, prev_seq);
+            return;
+        }
+        prev_seq = seq;
+    }
+}
+
+static void reader_check_sample(struct stats_sample *sample, struct stats_sample *prev)
+{
+    long long value, prev_value;
+    int i, n;
+
+    if (prev->sample_count == 0)
+        return;
+
+    if (sample->sample_seq_no < prev->sample_seq_no)
+        violation(V_SEQUENCE, "sequence %d after %d", sample->sample_seq_no, prev->sample_seq_no);
+
+    /* a sample with an odd epoch was taken after waiting out a killed reset */
+    if (sample->sample_reset_epoch != prev->sample_reset_epoch || (sample->sample_reset_epoch & 1))
+        return;
+
+    n = sample->sample_count < prev->sample_count ? sample->sample_count : prev->sample_count;
+    for (i = 0; i < n; i++)
+    {
+        value = stats_sample_get_value(sample, i);
+        prev_value = stats_sample_get_value(prev, i);
+        if (value < prev_value)
+        {
+            violation(V_MONOTONIC, "counter %d went from %lld to %lld in epoch %d", i, prev_value, value,
+                sample->sample_reset_epoch);
+            return;
+        }
+    }
+}
+
+static void reader(struct stress_slot *slot)
+{
+    struct stats_counter_list *cl = NULL, *list_cl = NULL;
+    struct stats_sample *sample = NULL, *prev = NULL, *tmp;
+    long long start;
+    int i, err;
+
+    if (stats_cl_create(&cl) != S_OK || stats_cl_create(&list_cl) != S_OK ||
+        stats_sample_create_with_capacity(COUNTER_TABLE_SIZE, &sample) != S_OK ||
+        stats_sample_create_with_capacity(COUNTER_TABLE_SIZE, &prev) != S_OK)
+    {
+        exit(1);
+    }
+
+    for (i = 0; !control->stop; i++)
+    {
+        start = current_time();
+        err = stats_get_sample(stats, cl, sample);
+        record(slot, API_SAMPLE, start);
+
+        if (err != S_OK)
+        {
+            violation(V_API_ERROR, "stats_get_sample: %s", error_message(err));
+        }
+        else
+        {
+            reader_check_sample(sample, prev);
+
+            tmp = prev;
+            prev = sample;
+            sample = tmp;
+        }
+
+        if (i % 16 == 0)
+        {
+            start = current_time();
+            err = stats_get_counter_list(stats, list_cl);
+            record(slot, API_LIST, start);
+
+            if (err != S_OK)
+                violation(V_API_ERROR, "stats_get_counter_list: %s", error_message(err));
+            else
+                reader_check_list(list_cl);
+        }
+
+        if (read_us > 0)
+            usleep(read_us);
+    }
+}
+
+
+/*
+ * supervisor
+ */
+
+static void start_worker(int i)
+{
+    struct stress_slot *slot = control->slot + i;
+    pid_t pid;
+
+    slot->pid = 0;
+    slot->paused = 0;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        slot->pid = getpid();
+        if (slot->role == ROLE_WRITER)
+            writer(slot);
+        else
+            reader(slot);
+        _exit(0);
+    }
+
+    if (pid < 0)
+    {
+        perror("stats_stress: fork");
+        exit(1);
+    }
+
+    slot->pid = pid;
+}
+
+static int find_slot(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < writers + readers; i++)
+    {
+        if (control->slot[i].pid == pid)
+            return i;
+    }
+
+    return -1;
+}
+
+/* restarts the workers which have exited */
+static void reap_workers()
+{
+    pid_t pid;
+    int status, i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        i = find_slot(pid);
+        if (i < 0)
+            continue;
+
+        if (!(pid == last_killed && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL))
+        {
+            if (WIFSIGNALED(status))
+                violation(V_CRASH, "worker %d was killed by signal %d", (int) pid, WTERMSIG(status));
+            else
+                violation(V_CRASH, "worker %d exited with status %d", (int) pid, WEXITSTATUS(status));
+        }
+
+        if (!control->stop)
+        {
+            start_worker(i);
+            restarts++;
+        }
+    }
+}
+
+/*
+ * checkpoint
+ *
+ * Pauses the writers and checks the checked counters against the
+ * tallies. Returns 1 if the check was made.
+ */
+static int checkpoint()
+{
+    struct stress_slot *slot;
+    long long start, value, low, high;
+    int i, c, epoch, waiting;
+
+    control->pause = 1;
+    __sync_synchronize();
+
+    start = current_time();
+    do
+    {
+        /* a worker killed just before the pause is restarted, and pauses */
+        reap_workers();
+
+        waiting = 0;
+        for (i = 0; i < writers; i++)
+        {
+            slot = control->slot + i;
+            if (slot->pid != 0 && !slot->paused && kill(slot->pid, 0) == 0)
+                waiting++;
+        }
+
+        if (waiting && TIME_DELTA_TO_NANOS(start, current_time()) > STRESS_PAUSE_TIMEOUT_NS)
+        {
+            violation(V_STUCK, "%d writers did not pause", waiting);
+            control->pause = 0;
+            return 0;
+        }
+
+        if (waiting)
+            usleep(100);
+    }
+    while (waiting);
+
+    __sync_synchronize();
+
+    epoch = stats->data->hdr.stats_reset_epoch;
+    if (epoch & 1)
+    {
+        /* a writer was killed while resetting. finish its reset */
+        stats_reset_counters(stats);
+        control->pause = 0;
+        return 0;
+    }
+
+    for (c = 0; c < checked; c++)
+    {
+        value = counter_get_value(checked_ctr[c]);
+        low = high = 0;
+
+        for (i = 0; i < writers; i++)
+        {
+            slot = control->slot + i;
+            if (slot->epoch != epoch)
+                continue;
+
+            low += slot->tally[c];
+            high += slot->tally[c] + slot->ambiguous[c] + slot->uncertain[c] + (slot->inflight == c + 1);
+        }
+
+        if (value < low)
+            violation(V_LOST, "checked counter %d is %lld, %lld increments were made in epoch %d", c, value, low, epoch);
+        else if (value > high)
+            violation(V_EXTRA, "checked counter %d is %lld, at most %lld increments were made in epoch %d", c, value,
+                high, epoch);
+    }
+
+    control->pause = 0;
+
+    return 1;
+}
+
+static long long hist_percentile(long long *hist, long long total, int permille)
+{
+    long long n = 0, rank = (total * permille + 999) / 1000;
+    int b;
+
+    for (b = 0; b < STRESS_HIST_BUCKETS; b++)
+    {
+        n += hist[b];
+        if (n >= rank && n > 0)
+            return 1ll << (b + 1);
+    }
+
+    return 0;
+}
+
+static void report(long long elapsed_ns, long long interval_ns, long long (*prev)[STRESS_HIST_BUCKETS])
+{
+    long long hist[STRESS_HIST_BUCKETS], total, v;
+    int api, b, i, max;
+
+    for (api = 0; api < API_COUNT; api++)
+    {
+        total = 0;
+        max = -1;
+        for (b = 0; b < STRESS_HIST_BUCKETS; b++)
+        {
+            v = 0;
+            for (i = 0; i < writers + readers; i++)
+                v += control->slot[i].hist[api][b];
+
+            hist[b] = v - prev[api][b];
+            prev[api][b] = v;
+            total += hist[b];
+            if (hist[b])
+                max = b;
+        }
+
+        printf("{\"t\":%.1f,\"api\":\"%s\",\"ops\":%lld,\"ops_per_sec\":%.0f,\"p50_ns\":%lld,\"p99_ns\":%lld,"
+            "\"p999_ns\":%lld,\"max_ns\":%lld}\n", elapsed_ns / 1e9, api_names[api], total,
+            interval_ns > 0 ? total * 1e9 / interval_ns : 0.0, hist_percentile(hist, total, 500),
+            hist_percentile(hist, total, 990), hist_percentile(hist, total, 999), max < 0 ? 0 : 1ll << (max + 1));
+    }
+
+    fflush(stdout);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: stats_stress [-w WRITERS] [-r READERS] [-d SECONDS] [-k KILL_MS] [-R RESET_MS]\n"
+                    "                    [-C CHECK_MS] [-i REPORT_S] [-c CHECKED] [-p POOL] [-s READ_US] [NAME]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static long long prev_hist[API_COUNT][STRESS_HIST_BUCKETS];
+    const char *name = "stress";
+    unsigned int seed = getpid();
+    long long start, now, last_report, next_check, next_kill, violations;
+    int c, i, err, checks = 0;
+
+    while ((c = getopt(argc, argv, "w:r:d:k:R:C:i:c:p:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'w': writers = atoi(optarg); break;
+        case 'r': readers = atoi(optarg); break;
+        case 'd': duration_s = atoi(optarg); break;
+        case 'k': kill_ms = atoi(optarg); break;
+        case 'R': reset_ms = atoi(optarg); break;
+        case 'C': check_ms = atoi(optarg); break;
+        case 'i': report_s = atoi(optarg); break;
+        case 'c': checked = atoi(optarg); break;
+        case 'p': pool = atoi(optarg); break;
+        case 's': read_us = atoi(optarg); break;
+        default: usage();
+        }
+    }
+
+    if (optind < argc)
+        name = argv[optind];
+
+    if (writers < 1 || readers < 0 || writers + readers > STRESS_MAX_SLOTS || checked < 1 ||
+        checked > STRESS_MAX_CHECKED || pool < 1 || report_s < 1 || check_ms < 1)
+    {
+        usage();
+    }
+
+    control = (struct stress_control *) mmap(NULL, sizeof(struct stress_control), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (control == MAP_FAILED)
+    {
+        perror("stats_stress: mmap");
+        return 1;
+    }
+
+    err = stats_create(name, &stats);
+    if (err == S_OK)
+        err = stats_open(stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "stats_stress: cannot open stats %s: %s\n", name, error_message(err));
+        return 1;
+    }
+
+    for (i = 0; i < checked; i++)
+    {
+        char ctr_name[MAX_COUNTER_KEY_LENGTH + 1];
+
+        snprintf(ctr_name, sizeof(ctr_name), "stress.checked.%d", i);
+        err = stats_allocate_counter(stats, ctr_name, checked_ctr + i);
+        if (err != S_OK)
+        {
+            fprintf(stderr, "stats_stress: cannot allocate %s: %s\n", ctr_name, error_message(err));
+            return 1;
+        }
+    }
+
+    stats_reset_counters(stats);
+
+    for (i = 0; i < writers + readers; i++)
+    {
+        control->slot[i].role = i < writers ? ROLE_WRITER : ROLE_READER;
+        start_worker(i);
+    }
+
+    start = last_report = current_time();
+    next_check = start + ms_to_ns(check_ms);
+    next_kill = kill_ms > 0 ? start + ms_to_ns(rand_r(&seed) % (2 * kill_ms)) : 0;
+
+    while (TIME_DELTA_TO_NANOS(start, current_time()) < duration_s * 1000000000ll)
+    {
+        usleep(STRESS_TICK_US);
+        now = current_time();
+
+        reap_workers();
+
+        if (next_kill && now > next_kill)
+        {
+            i = rand_r(&seed) % (writers + readers);
+            last_killed = control->slot[i].pid;
+            if (last_killed > 0 && kill(last_killed, SIGKILL) == 0)
+                kills++;
+            next_kill = now + ms_to_ns(rand_r(&seed) % (2 * kill_ms));
+        }
+
+        if (now > next_check)
+        {
+            checks += checkpoint();
+            next_check = current_time() + ms_to_ns(check_ms);
+        }
+
+        if (TIME_DELTA_TO_NANOS(last_report, now) >= report_s * 1000000000ll)
+        {
+            report(TIME_DELTA_TO_NANOS(start, now), TIME_DELTA_TO_NANOS(last_report, now), prev_hist);
+            last_report = now;
+        }
+    }
+
+    reap_workers();
+    checks += checkpoint();
+
+    control->stop = 1;
+    for (i = 0; i < writers + readers; i++)
+    {
+        if (control->slot[i].pid > 0)
+            waitpid(control->slot[i].pid, NULL, 0);
+    }
+
+    printf("{\"summary\":true,\"seconds\":%d,\"writers\":%d,\"readers\":%d,\"kills\":%d,\"restarts\":%d,"
+        "\"resets\":%lld,\"checkpoints\":%d", duration_s, writers, readers, kills, restarts, control->resets, checks);
+
+    violations = 0;
+    for (i = 0; i < V_COUNT; i++)
+    {
+        printf(",\"%s\":%lld", violation_names[i], control->violations[i]);
+        violations += control->violations[i];
+    }
+    printf("}\n");
+
+    stats_close(stats);
+    stats_free(stats);
+
+    return violations ? 1 : 0;
+}
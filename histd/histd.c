@@ -646,7 +646,7 @@ void udp_read_callback(int fd, short flags, void *arg)
     unsigned int addr_len;
     struct sockaddr_in addr;
     int n = 0;
-    char buffer[2048];
+    char buffer[HISTD_PROTO_MAX_MESSAGE_SIZE];
     char time_buf[32];
     char addr_buf[32];
     struct tm tm;
@@ -657,7 +657,7 @@ void udp_read_callback(int fd, short flags, void *arg)
 
     addr_len = sizeof(addr);
 
-    n = recvfrom(fd, buffer, 2048, 0, (struct sockaddr *)&addr, &addr_len);
+    n = recvfrom(fd, buffer, HISTD_PROTO_MAX_MESSAGE_SIZE, 0, (struct sockaddr *)&addr, &addr_len);
     if (n == -1)
     {
         printf("recvfrom: error %d.\n", errno);
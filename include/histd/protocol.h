@@ -7,6 +7,9 @@
 
 #define HISTD_PROTO_MAX_METRIC_NAME_LEN         32
 
+/* the largest datagram histd receives */
+#define HISTD_PROTO_MAX_MESSAGE_SIZE            2048
+
 
 /* message types */
 #define HISTD_PROTO_UPDATE_MESSAGE_TYPE         1
@@ -0,0 +1,76 @@
+/* capture.h */
+
+#ifndef _CAPTURE_H_INCLUDED_
+#define _CAPTURE_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * High frequency capture.
+ *
+ * A stats_capture keeps samples of selected counters, taken every few
+ * milliseconds, in a ring preallocated for a fixed number of samples, so
+ * bursts hidden by the usual once a second sampling can be seen. When the
+ * ring is full the oldest samples are overwritten; stats_capture_write
+ * dumps the samples in the ring to a file.
+ *
+ * stats_capture_sample takes a sample with stats_get_sample and keeps the
+ * values of the selected counters. The caller passes the time the sample
+ * was due, and the difference to the time it was taken is kept as the
+ * jitter of the capture, so a dump says how evenly it was sampled.
+ *
+ * A capture is started by a capture process (statscapture) on a signal,
+ * or when a process with the stats open calls stats_request_capture,
+ * which increments a count in the stats segment that the capture process
+ * watches.
+ */
+
+/* cap_count counters are selected
+ * cap_index is the index of each selected counter in the counter list
+ * cap_samples is the number of samples taken; the ring holds the last
+ *      cap_capacity of them, sample i at i % cap_capacity
+ * cap_time and cap_value are the ring: the time of each sample and the
+ *      cap_stride values of each. stats_capture_reset allocates cap_value
+ *      for the counters selected, so cap_stride is cap_count once a
+ *      capture is reset after selecting.
+ * cap_jitter_* are in nanoseconds, over all the samples taken
+ * cap_missed is the number of samples which were not taken at all
+ *      because the caller was too late for them; the caller counts them
+ */
+struct stats_capture
+{
+    int cap_capacity;
+    int cap_count;
+    int cap_stride;
+    int cap_reserved;
+    long long cap_samples;
+    long long cap_missed;
+    long long cap_jitter_min;
+    long long cap_jitter_max;
+    long long cap_jitter_sum;
+    double cap_jitter_sum_sq;
+    int *cap_index;
+    int *cap_flags;
+    char (*cap_key)[MAX_COUNTER_KEY_LENGTH+1];
+    long long *cap_time;
+    long long *cap_value;
+    struct stats_sample *cap_sample;
+};
+
+int stats_capture_create(int capacity, struct stats_capture **cap_out);
+void stats_capture_free(struct stats_capture *cap);
+int stats_capture_select(struct stats_capture *cap, struct stats *stats, struct stats_counter_list *cl, const char *prefix);
+int stats_capture_reset(struct stats_capture *cap);
+int stats_capture_sample(struct stats_capture *cap, struct stats *stats, struct stats_counter_list *cl, long long due_time);
+int stats_capture_write(struct stats_capture *cap, const char *name, int interval_us, const char *path);
+
+int stats_request_capture(struct stats *stats);
+int stats_capture_requests(struct stats *stats);
+
+/* the samples in the ring, sample 0 being the oldest */
+#define stats_capture_size(cap) ((cap)->cap_samples < (cap)->cap_capacity ? (int)(cap)->cap_samples : (cap)->cap_capacity)
+#define stats_capture_slot(cap,i) ((int)(((cap)->cap_samples - stats_capture_size(cap) + (i)) % (cap)->cap_capacity))
+#define stats_capture_get_time(cap,i) ((cap)->cap_time[stats_capture_slot(cap,i)])
+#define stats_capture_get_value(cap,i,j) ((cap)->cap_value[stats_capture_slot(cap,i) * (cap)->cap_stride + (j)])
+
+#endif
@@ -0,0 +1,91 @@
+/* derived.h */
+
+#ifndef _DERIVED_H_INCLUDED_
+#define _DERIVED_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * Derived counters.
+ *
+ * A derived counter is a named expression over the values of other
+ * counters, for example
+ *
+ *      http.error_pct = 100 * http.errors / http.requests
+ *      http.qps = rate(http.requests)
+ *
+ * Expressions are compiled once into a small stack bytecode. Counter
+ * names in the code are bound to counter list indexes when the counter
+ * list changes, so evaluating a sample is a loop over the bytecode with
+ * no name lookups. The results are stored in the sample after the counter
+ * values (see stats_sample_get_derived), so every consumer of the sample
+ * sees the same values.
+ *
+ * Expressions support numbers, counter names, earlier derived names,
+ * + - * / and parentheses, and the functions delta(name) (the change
+ * since the previous sample) and rate(name) (the change per second).
+ * Arithmetic is done in double precision and the result is kept as a
+ * double (stats_sample_get_derived_double), so a ratio such as
+ * errors / requests keeps its fraction; stats_sample_get_derived rounds
+ * it to an integer. Division by zero gives 0.
+ *
+ * A definitions file has one "name = expression" per line. Blank lines
+ * and lines starting with # are ignored.
+ */
+
+#define STATS_DERIVED_MAX           STATS_SAMPLE_MAX_DERIVED
+#define STATS_DERIVED_MAX_CODE      1024
+#define STATS_DERIVED_MAX_REFS      256
+#define STATS_DERIVED_MAX_STACK     16
+#define STATS_DERIVED_MAX_LINE      256
+
+/* do_op is one of the DERIVED_OP_ values in derived.c. do_arg is a
+ * reference index (counter or derived value) and do_value a constant.
+ */
+struct stats_derived_op
+{
+    int do_op;
+    int do_arg;
+    double do_value;
+};
+
+/* de_code and de_code_len locate the expression's code in dv_code */
+struct stats_derived_expr
+{
+    char de_name[MAX_COUNTER_KEY_LENGTH+1];
+    int de_code;
+    int de_code_len;
+};
+
+/* dv_seq_no is the cl_seq_no the references were bound for.
+ * dv_ref_name are the names used by the expressions, and dv_ref_index
+ *      their bound counter list index, or -1 if there is no such counter.
+ *      dv_ref_flags are the ctr_flags of the bound counters, used to
+ *      decode their values. dv_ref_derived is the index of the derived
+ *      value if the name is an earlier derived counter, or -1.
+ */
+struct stats_derived
+{
+    int dv_count;
+    int dv_code_count;
+    int dv_ref_count;
+    int dv_seq_no;
+    struct stats_derived_expr dv_expr[STATS_DERIVED_MAX];
+    struct stats_derived_op dv_code[STATS_DERIVED_MAX_CODE];
+    char dv_ref_name[STATS_DERIVED_MAX_REFS][MAX_COUNTER_KEY_LENGTH+1];
+    int dv_ref_index[STATS_DERIVED_MAX_REFS];
+    int dv_ref_flags[STATS_DERIVED_MAX_REFS];
+    int dv_ref_derived[STATS_DERIVED_MAX_REFS];
+};
+
+int stats_derived_create(struct stats_derived **dv_out);
+void stats_derived_free(struct stats_derived *dv);
+int stats_derived_add(struct stats_derived *dv, const char *name, const char *expression);
+int stats_derived_load(struct stats_derived *dv, const char *path, int *line_out);
+int stats_derived_evaluate(struct stats *stats, struct stats_derived *dv, struct stats_counter_list *cl,
+    struct stats_sample *sample, struct stats_sample *prev_sample);
+
+#define stats_derived_count(dv) ((dv)->dv_count)
+#define stats_derived_get_name(dv,i) ((dv)->dv_expr[i].de_name)
+
+#endif
@@ -43,6 +43,20 @@
 
 #define ERROR_STATS_CANNOT_ALLOCATE_COUNTER             ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0001))
 #define ERROR_STATS_KEY_TOO_LONG                        ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0002))
+#define ERROR_STATS_COUNTER_NOT_FOUND                   ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0003))
+#define ERROR_STATS_SAMPLE_TOO_SMALL                    ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0004))
+#define ERROR_STATS_WRONG_COUNTER_TYPE                  ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0005))
+#define ERROR_STATS_CANNOT_ALLOCATE_SKETCH              ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0006))
+#define ERROR_STATS_DERIVED_SYNTAX                      ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0007))
+#define ERROR_STATS_DERIVED_TOO_LARGE                   ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0008))
+#define ERROR_STATS_TOO_MANY_PROVIDERS                  ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0009))
+#define ERROR_STATS_PROVIDER_TIMEOUT                    ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x000A))
+#define ERROR_STATS_LAYOUT_VERSION                      ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x000B))
+#define ERROR_STATS_LAYOUT_FEATURES                     ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x000C))
+#define ERROR_STATS_RECORD_IO                           ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x000D))
+#define ERROR_STATS_RECORD_FORMAT                       ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x000E))
+#define ERROR_STATS_RECORD_END                          ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x000F))
+#define ERROR_STATS_RESET_TIMEOUT                       ((int)(ERROR_FLAG | ERROR_FACILITY_STATS | 0x0010))
 
 const char * error_message(int code);
 
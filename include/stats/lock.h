@@ -19,6 +19,7 @@ void lock_free(struct lock *lock);
 
 #define lock_init(lock,name) semaphore_init(&(lock)->sem,name,1)
 #define lock_open(lock) semaphore_open_and_set(&(lock)->sem,1)
+#define lock_attach(lock) semaphore_attach(&(lock)->sem)
 #define lock_acquire(lock) semaphore_P(&(lock)->sem,0)
 #define lock_release(lock) semaphore_V(&(lock)->sem,0)
 #define lock_close(lock,remove) semaphore_close(&(lock)->sem,(remove));
@@ -0,0 +1,110 @@
+/* merge.h */
+
+#ifndef _MERGE_H_INCLUDED_
+#define _MERGE_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * Cross-segment aggregation.
+ *
+ * A stats_merge joins the counters of several stats objects (a canary
+ * and the main processes, each with its own segment name) by key, and
+ * keeps the sum, minimum and maximum of each key over the sources which
+ * have it, as three samples indexed by merged key.
+ *
+ * stats_sample_merge folds a sample of one source into the merge. Each
+ * source's counter list is joined to the merged keys through a hash of
+ * the keys, and since counter lists only grow, only counters added since
+ * the last call are looked up. The last value merged from each source is
+ * kept, so only the keys whose value changed in some source are
+ * recomputed. stats_merge_update samples every source and merges it.
+ *
+ * A counter is merged with the counters of the same key and type. One
+ * with the key of a counter of another type (or a fixed point counter
+ * with other digits) is left out, as are sketch counters, whose sample
+ * values (such as an HLL estimate) cannot be summed; their sketches can
+ * be merged with stats_sketch_merge instead. Double counters are summed
+ * as doubles.
+ *
+ * The change of each key is also kept, as the sum of the changes of the
+ * sources, each taken against the source's own last value and reset
+ * epoch, so a reset of one source only drops that source's value to what
+ * it counted since the reset. stats_merge_update starts the changes over,
+ * so after it stats_merge_get_delta is the change since the previous
+ * update. The sample_reset_epoch of the merged samples is the sum of the
+ * reset epochs of the sources, which changes whenever any source is
+ * reset, so stats_sample_get_delta on copies of the merged samples counts
+ * the whole value of every source across a reset of any one of them.
+ */
+
+#define STATS_MERGE_MAX_SOURCES 16
+
+/* mk_flags is the type of the counters merged into the key (ctr_flags
+ *      without the sketch or breakdown index)
+ * mk_present has a bit for each source which has the key
+ */
+struct stats_merge_key
+{
+    char mk_key[MAX_COUNTER_KEY_LENGTH+1];
+    int mk_flags;
+    unsigned int mk_present;
+};
+
+/* ms_counters is the number of counters of ms_cl joined to the keys
+ * ms_key is the merged key index of each of them, or -1 if left out
+ */
+struct stats_merge_source
+{
+    struct stats *ms_stats;
+    struct stats_sample *ms_sample;
+    int ms_seq_no;
+    int ms_counters;
+    int ms_reset_epoch;
+    struct stats_counter_list ms_cl;
+    int ms_key[COUNTER_TABLE_SIZE];
+};
+
+/* mg_value is the last value merged from each source, STATS_MERGE_MAX_SOURCES
+ *      per key
+ * mg_delta is the change of each key since stats_merge_clear_deltas, stored
+ *      like the values of its type (the bits of a double for doubles)
+ * mg_dirty lists the keys to recompute, mg_is_dirty flags them
+ * mg_hash maps keys to key index + 1 (0 is an empty bucket)
+ */
+struct stats_merge
+{
+    int mg_sources;
+    int mg_count;
+    int mg_capacity;
+    int mg_hash_size;
+    int mg_dirty_count;
+    struct stats_merge_source *mg_source[STATS_MERGE_MAX_SOURCES];
+    struct stats_merge_key *mg_key;
+    long long *mg_value;
+    long long *mg_delta;
+    int *mg_dirty;
+    char *mg_is_dirty;
+    int *mg_hash;
+    struct stats_sample *mg_sum;
+    struct stats_sample *mg_min;
+    struct stats_sample *mg_max;
+};
+
+int stats_merge_create(struct stats_merge **m_out);
+void stats_merge_free(struct stats_merge *m);
+int stats_merge_add_source(struct stats_merge *m, struct stats *stats, int *source_out);
+int stats_sample_merge(struct stats_merge *m, int source, struct stats_counter_list *cl, struct stats_sample *sample);
+int stats_merge_update(struct stats_merge *m);
+int stats_merge_find(struct stats_merge *m, const char *key);
+void stats_merge_clear_deltas(struct stats_merge *m);
+
+#define stats_merge_count(m) ((m)->mg_count)
+#define stats_merge_get_key(m,i) ((m)->mg_key[i].mk_key)
+#define stats_merge_get_flags(m,i) ((m)->mg_key[i].mk_flags)
+#define stats_merge_get_sum(m,i) stats_sample_get_value((m)->mg_sum,i)
+#define stats_merge_get_min(m,i) stats_sample_get_value((m)->mg_min,i)
+#define stats_merge_get_max(m,i) stats_sample_get_value((m)->mg_max,i)
+#define stats_merge_get_delta(m,i) ((m)->mg_delta[i])
+
+#endif
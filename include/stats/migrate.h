@@ -0,0 +1,51 @@
+/* migrate.h */
+
+#ifndef _MIGRATE_H_INCLUDED_
+#define _MIGRATE_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * Counter migration.
+ *
+ * stats_migrate copies the counters of one open stats object into
+ * another of the same layout, under another name. Both must be opened by
+ * this build, so data of another layout (see STATS_LAYOUT_VERSION) cannot
+ * be copied from. Processes are moved over by restarting them against the
+ * new stats one at a time; until every process writing the old stats has
+ * been restarted, calling stats_migrate periodically keeps adding what
+ * they write to the new stats.
+ *
+ * The first call copies every counter. Later calls add what each counter
+ * gained since the previous call, or its whole value if the old stats
+ * were reset in between, so the new counters also keep what is written
+ * to them directly. Gauges are copied as they are. Counters are created
+ * in the new stats with the same type; a name which exists there with
+ * another type is skipped. HLL sketches are merged with stats_sketch_merge
+ * on every call, which is safe to repeat since an HLL merge keeps the
+ * larger of each register. Top-k and quantile sketches are skipped: they
+ * merge by adding, so merging them on every call would count what was
+ * already copied again. They can be merged once with stats_sketch_merge
+ * when nothing writes to the old stats anymore. Per-process counters are
+ * added to as a whole, in the migrating process's column.
+ */
+
+/* mg_ctr caches the new counter of each index of mg_cl, NULL until looked
+ *      up or if it was skipped.
+ * mg_copied is the sample of the old stats taken by the previous call.
+ */
+struct stats_migration
+{
+    struct stats_counter_list mg_cl;
+    struct stats_sample *mg_copied;
+    struct stats_sample *mg_sample;
+    struct stats_counter *mg_ctr[COUNTER_TABLE_SIZE];
+    char mg_looked_up[COUNTER_TABLE_SIZE];
+};
+
+int stats_migration_create(struct stats_migration **mg_out);
+void stats_migration_free(struct stats_migration *mg);
+
+int stats_migrate(struct stats *from, struct stats *to, struct stats_migration *mg, int *migrated_out);
+
+#endif
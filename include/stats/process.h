@@ -0,0 +1,80 @@
+/* process.h */
+
+#ifndef _PROCESS_H_INCLUDED_
+#define _PROCESS_H_INCLUDED_
+
+/*
+ * Per-process attribution.
+ *
+ * Every process which opens the stats claims an entry in the process
+ * table in the stats data. A counter allocated with
+ * stats_allocate_per_process_counter (CTR_FLAG_PER_PROCESS) also gets a
+ * breakdown entry with one column per process table entry. Writes add to
+ * the counter's value as usual, so the total is read as cheaply as any
+ * other counter, and also to the writing process's column. counter_set
+ * and counter_clear set the process's column and move the total by the
+ * same amount.
+ *
+ * Entries of processes which have exited are reclaimed when a process
+ * opens the stats and when the breakdown is read; their columns are
+ * zeroed when the entry is claimed again, while the total keeps what they
+ * wrote. A child created with fork claims its own entry on its first
+ * write. If the process table is full a process's writes only go to the
+ * total, and the column it would have is kept in the process instead, so
+ * counter_set and counter_clear still only move the total by the change
+ * of the process's own value.
+ */
+
+#define STATS_PROCESS_TABLE_SIZE        64
+#define STATS_BREAKDOWN_TABLE_SIZE      64
+
+/* proc_pid is the pid of the process using the entry, or 0 if free
+ * proc_refs is the number of times the process has the stats open
+ * proc_providers is the number of provider threads the process runs (see
+ *      provider.h). Readers waiting for providers only count those of
+ *      processes which are alive.
+ */
+struct stats_process
+{
+    int proc_pid;
+    int proc_refs;
+    int proc_providers;
+    int proc_reserved;
+};
+
+/* bd_value has one column per process table entry */
+struct stats_breakdown
+{
+    int bd_allocated;
+    int bd_reserved;
+    long long bd_value[STATS_PROCESS_TABLE_SIZE];
+};
+
+/* one column of a breakdown, as returned by stats_counter_get_breakdown */
+struct stats_process_value
+{
+    int pv_pid;
+    int pv_reserved;
+    long long pv_value;
+};
+
+struct stats;
+struct stats_data;
+struct stats_counter;
+
+int stats_allocate_per_process_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out);
+int stats_counter_get_breakdown(struct stats *stats, struct stats_counter *ctr, struct stats_process_value *values,
+    int max_values, int *count_out);
+
+/* used by stats_open, stats_close, stats_reset_counters and the counter write functions */
+void stats_process_attach(struct stats_data *data);
+void stats_process_detach(struct stats_data *data);
+void stats_process_add(struct stats_counter *ctr, long long val);
+void stats_process_set(struct stats_counter *ctr, long long val);
+void stats_breakdown_clear(struct stats_data *data, struct stats_counter *ctr);
+
+/* used by the provider thread and stats_refresh_providers */
+int stats_process_add_provider(struct stats_data *data, int delta);
+int stats_process_count_providers(struct stats_data *data);
+
+#endif
@@ -0,0 +1,63 @@
+/* profile.h */
+
+#ifndef _PROFILE_H_INCLUDED_
+#define _PROFILE_H_INCLUDED_
+
+/*
+ * Hot counter contention profiling.
+ *
+ * When the library is built with STATS_PROFILE=1 (make PROFILE=1), one in
+ * every STATS_PROFILE_SAMPLE_RATE counter writes made by a thread records
+ * the CPU and time of the write in a per-counter side table in the stats
+ * data. statsprof reads the table to find the counters which are written
+ * at high rates from many CPUs.
+ *
+ * The side table is always part of the stats data, so profiled and
+ * unprofiled processes can share the same stats. When STATS_PROFILE is 0
+ * the write path is not changed at all.
+ */
+
+#ifndef STATS_PROFILE
+#define STATS_PROFILE 0
+#endif
+
+#ifndef STATS_PROFILE_SAMPLE_RATE
+#define STATS_PROFILE_SAMPLE_RATE 64
+#endif
+
+/* stats_profile_entry is the profile data for one counter
+ *
+ * prof_writes is the number of sampled writes.
+ * prof_cpu_switches is the number of sampled writes made on a different
+ *      cpu than the previous sampled write.
+ * prof_first_time and prof_last_time are the times (current_time()) of
+ *      the first and most recent sampled writes.
+ * prof_cpu_mask has bit (cpu % 64) set for every cpu seen writing.
+ * prof_last_cpu is the cpu of the most recent sampled write.
+ */
+struct stats_profile_entry
+{
+    long long prof_writes;
+    long long prof_cpu_switches;
+    long long prof_first_time;
+    long long prof_last_time;
+    unsigned long long prof_cpu_mask;
+    int prof_last_cpu;
+    int prof_reserved;
+};
+
+struct stats_data;
+struct stats_counter;
+
+void stats_profile_attach(struct stats_data *data);
+void stats_profile_detach(struct stats_data *data);
+void stats_profile_write(struct stats_counter *ctr);
+
+#if STATS_PROFILE
+extern __thread int stats_profile_countdown;
+#define STATS_PROFILE_WRITE(ctr) do { if (--stats_profile_countdown <= 0) stats_profile_write(ctr); } while (0)
+#else
+#define STATS_PROFILE_WRITE(ctr) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/* provider.h */
+
+#ifndef _PROVIDER_H_INCLUDED_
+#define _PROVIDER_H_INCLUDED_
+
+/*
+ * Gauge providers.
+ *
+ * A provider is a callback which computes the value of a gauge, for
+ * values which are too expensive to keep current on every change (heap
+ * size, pool occupancy, cache fill). Providers are only called when a
+ * reader asks for a fresh sample, so no work is done while nobody is
+ * looking.
+ *
+ * The first stats_provider_register in a process starts a provider
+ * thread, which sleeps on the doorbell in the stats segment. A reader
+ * calling stats_get_fresh_sample rings the doorbell and waits (up to
+ * STATS_PROVIDER_TIMEOUT_MS) for the provider thread of each process to
+ * call its providers and store their values, then takes the sample.
+ *
+ * Providers run on the provider thread, so they must be thread safe and
+ * should be quick; a slow provider delays every fresh sample.
+ *
+ * The doorbell and wait are futexes on Linux. Elsewhere the provider
+ * thread and the reader poll every STATS_PROVIDER_POLL_US.
+ */
+
+#define STATS_PROVIDER_MAX          64
+#define STATS_PROVIDER_TIMEOUT_MS   50
+#define STATS_PROVIDER_POLL_US      1000
+
+struct stats;
+struct stats_counter;
+struct stats_counter_list;
+struct stats_sample;
+
+/* stats_doorbell is kept in the stats segment
+ *
+ * The provider threads of each process are counted in its process table
+ * entry (see process.h), so a reader only waits for processes which are
+ * alive, and a process killed without calling stats_close is not waited
+ * for.
+ *
+ * db_request is incremented by readers asking for a refresh. Provider
+ *      threads wait for it to change.
+ * db_completed is incremented by a provider thread each time it has
+ *      refreshed its providers. Readers wait for it to advance by the
+ *      number of provider threads.
+ * db_capture is incremented by stats_request_capture to ask a capture
+ *      process to start a capture (see capture.h).
+ */
+struct stats_doorbell
+{
+    int db_request;
+    int db_completed;
+    int db_capture;
+    int db_reserved;
+};
+
+typedef long long (*stats_provider_fn)(void *arg);
+
+int stats_provider_register(struct stats *stats, struct stats_counter *ctr, stats_provider_fn fn, void *arg);
+int stats_provider_unregister(struct stats *stats, struct stats_counter *ctr);
+
+int stats_refresh_providers(struct stats *stats, int timeout_ms);
+int stats_get_fresh_sample(struct stats *stats, struct stats_counter_list *cl, struct stats_sample *sample);
+
+/* stops the provider thread of this process. called by stats_close */
+void stats_providers_stop(struct stats *stats);
+
+#endif
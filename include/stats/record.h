@@ -0,0 +1,156 @@
+/* record.h */
+
+#ifndef _RECORD_H_INCLUDED_
+#define _RECORD_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * Flight recording.
+ *
+ * A stats_recorder appends samples to a recording on disk, so the
+ * counters can be played back after the fact (statsrecord records,
+ * statsview --replay plays back). A recording is a rotation of files
+ * PATH.0 to PATH.(N-1) of a fixed size, each memory mapped while it is
+ * written. When a file is full the recorder moves on to the next one,
+ * overwriting the oldest, so a recording keeps the most recent N files
+ * worth of samples. Frames are written to the mapping and the length in
+ * the file header is advanced after each, so a recorder which is killed
+ * leaves every frame it completed.
+ *
+ * A file is a header followed by frames. A frame is a type byte, the
+ * varint length of its payload and the payload:
+ *
+ *      'L' counter list: seq_no, count, then the flags, key length and
+ *          key of each counter. Written at the start of each file and
+ *          when the sample_seq_no changes.
+ *      'S' sample: the change of the time since the previous sample, the
+ *          change of the reset epoch, the count, the number of values whose change
+ *          changed, then for each of them the gap in index from the
+ *          previous one and the change of its change.
+ *
+ * Integers are varints and signed ones zigzag encoded. Values are encoded
+ * as delta-of-delta: the difference between their change since the
+ * previous sample in the same file and the change before that, so a
+ * counter which did not change, or which grows at a steady rate, costs
+ * nothing. Sample times are kept in STATS_RECORD_TIME_UNIT steps of
+ * current_time() (microseconds) from the start of the file and encoded
+ * the same way, so samples at a steady interval cost a byte for the
+ * jitter of the timing. A file can be decoded on its own: the first
+ * sample of each file is against zeros with no change before it.
+ *
+ * Measured with statsrecord -i 10 (100 samples a second) of 2000
+ * counters, leaving out the counter list at the start of each file:
+ *
+ *      all idle                                7 bytes/sample, 2.5 MB/hour
+ *      50 at a steady rate, 20 gauges which
+ *          change about once a minute          12 bytes/sample, 4.1 MB/hour
+ *      and 150 which change irregularly
+ *          every sample                        315 bytes/sample, 108 MB/hour
+ *
+ * A counter which changes irregularly every sample costs about 2 bytes
+ * per sample, so recordings at 100Hz stay at a few MB/hour only while few
+ * counters are that noisy.
+ */
+
+#define STATS_RECORD_MAGIC              'srec'
+#define STATS_RECORD_VERSION            3
+
+#define STATS_RECORD_FRAME_LIST         'L'
+#define STATS_RECORD_FRAME_SAMPLE       'S'
+
+/* current_time() units per step of recorded sample times */
+#define STATS_RECORD_TIME_UNIT          1000
+
+#define STATS_RECORD_MAX_FILES          64
+#define STATS_RECORD_MIN_FILE_SIZE      (256 * 1024)
+
+/* the largest frames: a list of every counter, and a sample changing every value */
+#define STATS_RECORD_MAX_FRAME          (64 + COUNTER_TABLE_SIZE * (5 + 1 + MAX_COUNTER_KEY_LENGTH))
+
+/* rf_generation orders the files of a recording; the oldest has the lowest
+ * rf_used is the number of bytes of the file written, header included
+ * rf_start_time is the current_time() of the first sample, and
+ *      rf_wall_time the wall clock time at that moment (ns since the epoch)
+ */
+struct stats_record_header
+{
+    int rf_magic;
+    int rf_version;
+    int rf_files;
+    int rf_size;
+    long long rf_generation;
+    long long rf_used;
+    long long rf_start_time;
+    long long rf_wall_time;
+    int rf_interval_ms;
+    int rf_reserved;
+    char rf_name[STATS_MAX_NAME_LEN + 1];
+};
+
+/* rec_prev is the previous sample written to the current file, and
+ *      rec_delta the change of each of its values from the one before,
+ *      rec_time_delta that of its time in STATS_RECORD_TIME_UNIT steps
+ * rec_buf holds the frame being encoded
+ */
+struct stats_recorder
+{
+    char rec_path[MAX_PATH];
+    int rec_files;
+    int rec_size;
+    int rec_file;
+    int rec_interval_ms;
+    int rec_seq_no;
+    long long rec_generation;
+    long long rec_frames;
+    long long rec_bytes;
+    long long rec_time_delta;
+    char rec_name[STATS_MAX_NAME_LEN + 1];
+    struct stats_record_header *rec_hdr;
+    struct stats_sample *rec_prev;
+    long long *rec_delta;
+    unsigned char *rec_buf;
+};
+
+int stats_recorder_create(const char *path, int file_size, int files, struct stats_recorder **rec_out);
+int stats_recorder_open(struct stats_recorder *rec, const char *name, int interval_ms);
+int stats_record_sample(struct stats_recorder *rec, struct stats *stats, struct stats_counter_list *cl,
+    struct stats_sample *sample);
+int stats_recorder_close(struct stats_recorder *rec);
+void stats_recorder_free(struct stats_recorder *rec);
+
+/* rp_order is the index of the files in rp_path order by generation
+ * rp_count is the number of counters in the current list, and rp_ctr
+ *      holds their flags and keys
+ * rp_value holds the rp_sample_count values of the last sample decoded,
+ *      and rp_delta their change from the sample before. rp_time_delta
+ *      is the change of rp_time in STATS_RECORD_TIME_UNIT steps
+ */
+struct stats_replay
+{
+    char rp_path[MAX_PATH];
+    int rp_files;
+    int rp_order[STATS_RECORD_MAX_FILES];
+    int rp_next_file;
+    int rp_seq_no;
+    int rp_count;
+    int rp_sample_count;
+    int rp_reset_epoch;
+    long long rp_time;
+    long long rp_time_delta;
+    long long rp_offset;
+    long long rp_map_size;
+    struct stats_record_header *rp_hdr;
+    struct stats_counter rp_ctr[COUNTER_TABLE_SIZE];
+    long long rp_value[COUNTER_TABLE_SIZE];
+    long long rp_delta[COUNTER_TABLE_SIZE];
+};
+
+int stats_replay_create(const char *path, struct stats_replay **rp_out);
+int stats_replay_next(struct stats_replay *rp, struct stats_sample *sample);
+void stats_replay_free(struct stats_replay *rp);
+
+#define stats_replay_get_counter(rp,i) (&(rp)->rp_ctr[i])
+#define stats_replay_get_header(rp) ((rp)->rp_hdr)
+
+#endif
@@ -0,0 +1,107 @@
+/* registry.h */
+
+#ifndef _REGISTRY_H_INCLUDED_
+#define _REGISTRY_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * Host registry of stats segments.
+ *
+ * Every name passed to stats_create is its own segment. So that a reader
+ * can find all of them without knowing their names, stats_open adds the
+ * name of each shared stats object to a registry segment which every
+ * process on the host attaches to, and stats_close removes it when the
+ * segment is destroyed. The registry segment is never destroyed and its
+ * entries are claimed without a lock, so registering costs a process a
+ * scan of the table when it opens a stats object.
+ *
+ * stats_enumerate lists the registered segments which still exist, with
+ * their creator, size and number of attached processes taken from the
+ * segment itself. Entries of segments which are gone (removed by hand, or
+ * whose last process was killed) are dropped as they are found.
+ *
+ * A stats_group keeps every registered segment open, so a reader can
+ * sample all of them in one pass. stats_group_refresh opens the segments
+ * registered since the last call and closes the ones which have gone.
+ * Segments are only ever attached by the group, never created, but like
+ * any reader the group keeps the segments it has open from being
+ * destroyed when their last writer closes them.
+ */
+
+#define STATS_REGISTRY_NAME             "stats_registry.reg"
+#define STATS_REGISTRY_SIZE             256
+#define STATS_REGISTRY_MAGIC            'sreg'
+
+/* flags for the re_state field */
+#define REGISTRY_ENTRY_FREE             0
+#define REGISTRY_ENTRY_CLAIMED          -1   /* being written by the registering process */
+#define REGISTRY_ENTRY_REGISTERED       1
+
+/* re_pid and re_uid are the process which registered the name
+ * re_version is the STATS_LAYOUT_VERSION, which is also the ftok id of
+ *      the segment
+ */
+struct stats_registry_entry
+{
+    int re_state;
+    int re_pid;
+    int re_uid;
+    int re_version;
+    int re_size;
+    int re_reserved[3];
+    char re_name[STATS_MAX_NAME_LEN + 1];
+};
+
+struct stats_registry
+{
+    int rg_magic;
+    int rg_reserved[7];
+    struct stats_registry_entry rg_entry[STATS_REGISTRY_SIZE];
+};
+
+/* si_owner_pid and si_owner_uid are the creator of the segment
+ * si_attached is the number of processes attached to it
+ */
+struct stats_segment_info
+{
+    char si_name[STATS_MAX_NAME_LEN + 1];
+    int si_owner_pid;
+    int si_owner_uid;
+    int si_size;
+    int si_attached;
+    int si_version;
+};
+
+int stats_enumerate(struct stats_segment_info *infos, int max_infos, int *count_out);
+
+/* gm_seen is used by stats_group_refresh to find the segments which have gone */
+struct stats_group_member
+{
+    struct stats *gm_stats;
+    struct stats_counter_list *gm_cl;
+    struct stats_sample *gm_sample;
+    struct stats_sample *gm_prev_sample;
+    struct stats_segment_info gm_info;
+    int gm_seen;
+};
+
+struct stats_group
+{
+    int g_count;
+    struct stats_group_member g_member[STATS_REGISTRY_SIZE];
+};
+
+int stats_group_create(struct stats_group **group_out);
+void stats_group_free(struct stats_group *group);
+int stats_group_refresh(struct stats_group *group);
+int stats_group_sample(struct stats_group *group);
+
+#define stats_group_count(g) ((g)->g_count)
+#define stats_group_get_member(g,i) (&(g)->g_member[i])
+
+/* used by stats_open and stats_close */
+void stats_registry_add(struct stats *stats);
+void stats_registry_remove(struct stats *stats);
+
+#endif
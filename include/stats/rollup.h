@@ -0,0 +1,69 @@
+/* rollup.h */
+
+#ifndef _ROLLUP_H_INCLUDED_
+#define _ROLLUP_H_INCLUDED_
+
+#include "stats.h"
+
+/*
+ * Prefix rollups.
+ *
+ * Counter keys are dotted names (http.api.orders.count). A stats_rollup
+ * is a tree of every dotted prefix of the keys in a counter list (http,
+ * http.api, http.api.orders) which sums the sample values of all of the
+ * counters below each prefix. Rollups are reported with a ".*" suffix
+ * (http.api.*).
+ *
+ * Counter lists are ordered by allocation and counters are never freed,
+ * so when the list changes stats_rollup_update only adds the new counters
+ * to the tree. Parent prefixes are always added before their children,
+ * which lets stats_rollup_compute total the whole tree in one pass over
+ * the counters and one pass over the prefixes.
+ *
+ * Sketch, double and fixed point counters are not included in rollups,
+ * since their sample values cannot be added to the others.
+ */
+
+#define STATS_ROLLUP_SUFFIX ".*"
+
+/* rn_prefix is the prefix, without the ".*" suffix.
+ * rn_parent is the index of the next shorter prefix, or -1.
+ * rn_counters is the number of counters below the prefix.
+ */
+struct stats_rollup_node
+{
+    char rn_prefix[MAX_COUNTER_KEY_LENGTH+1];
+    int rn_parent;
+    int rn_counters;
+};
+
+/* ru_seq_no is the cl_seq_no of the counter list the tree was built from.
+ * ru_counters is the number of counters of the list in the tree.
+ * ru_counter_node is the deepest prefix of each counter, or -1.
+ * ru_count is the number of prefixes in ru_node and ru_value.
+ * ru_hash maps prefixes to node index + 1 (0 is an empty bucket).
+ */
+struct stats_rollup
+{
+    int ru_seq_no;
+    int ru_counters;
+    int ru_count;
+    int ru_capacity;
+    int ru_hash_size;
+    int ru_counter_node[COUNTER_TABLE_SIZE];
+    struct stats_rollup_node *ru_node;
+    long long *ru_value;
+    int *ru_hash;
+};
+
+int stats_rollup_create(struct stats_rollup **ru_out);
+void stats_rollup_free(struct stats_rollup *ru);
+int stats_rollup_update(struct stats *stats, struct stats_rollup *ru, struct stats_counter_list *cl);
+int stats_rollup_compute(struct stats_rollup *ru, struct stats_sample *sample, struct stats_sample *prev_sample);
+int stats_rollup_find(struct stats_rollup *ru, const char *prefix);
+
+#define stats_rollup_count(ru) ((ru)->ru_count)
+#define stats_rollup_get_prefix(ru,i) ((ru)->ru_node[i].rn_prefix)
+#define stats_rollup_get_value(ru,i) ((ru)->ru_value[i])
+
+#endif
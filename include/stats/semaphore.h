@@ -34,6 +34,7 @@ int semaphore_create(const char *name, unsigned short size, struct semaphore **s
 int semaphore_init(struct semaphore *sem, const char *name, unsigned short size);
 int semaphore_open(struct semaphore *sem, int flags);
 int semaphore_open_and_set(struct semaphore *sem, ... );
+int semaphore_attach(struct semaphore *sem);
 int semaphore_set_value(struct semaphore *sem, unsigned short nsem, unsigned short value);
 int semaphore_set_values(struct semaphore *sem, unsigned short *values);
 int semaphore_P(struct semaphore *sem, unsigned short nsem);
@@ -22,6 +22,7 @@ struct shared_memory {
     int size;
     char name[SHARED_MEMORY_MAX_NAME_LEN + 1];
     key_t shmkey;
+    int key_id;
     int shmid;
     short int created;
     void * ptr;
@@ -30,6 +31,8 @@ struct shared_memory {
 int shared_memory_create(const char *name, int flags, int size, struct shared_memory **shmem_out);
 int shared_memory_init(struct shared_memory *shmem, const char *name, int flags, int size);
 int shared_memory_open(struct shared_memory *shmem);
+int shared_memory_attach(struct shared_memory *shmem);
+void shared_memory_detach(struct shared_memory *shmem);
 int shared_memory_close(struct shared_memory *shmem, int* did_destroy);
 void shared_memory_free(struct shared_memory *shmem);
 int shared_memory_nattach(struct shared_memory *shmem, int *attach_count_out);
@@ -40,6 +43,10 @@ int shared_memory_nattach(struct shared_memory *shmem, int *attach_count_out);
 #define shared_memory_was_created(s) ((s)->created)
 #define shared_memory_is_open(s) ((s)->shmid != -1 && (s)->ptr != NULL)
 
+/* the ftok project id, 1 unless set before opening. segments with the same
+   name and different ids are different segments */
+#define shared_memory_set_key_id(s,id) ((s)->key_id = (id))
+
 #define SHARED_MEMORY_DIRECTORY "/tmp"
 #define MAX_PATH 255
 
@@ -0,0 +1,138 @@
+/* sketch.h */
+
+#ifndef _SKETCH_H_INCLUDED_
+#define _SKETCH_H_INCLUDED_
+
+/*
+ * Sketch counters.
+ *
+ * A sketch counter is a stats_counter whose data lives in one of the
+ * sketch tables at the end of the stats data. The counter carries the
+ * sketch type in ctr_flags and the index of its sketch in the upper bits
+ * of ctr_flags, so sketch counters are allocated, listed and sampled like
+ * any other counter:
+ *
+ * stats_hll - a HyperLogLog register block estimating the number of
+ *      distinct items added. Registers are updated with an atomic max,
+ *      so any number of processes can add items without locking. The
+ *      sample value of an HLL counter is the cardinality estimate.
+ *
+ * stats_topk - a space-saving table tracking the STATS_TOPK_SIZE most
+ *      frequent keys. Updates are serialized by a per-table spin lock
+ *      (never the stats lock). The sample value of a top-k counter is
+ *      the total count of everything added.
+ *
+ * stats_quantile - a DDSketch style quantile sketch. Values are counted
+ *      in logarithmically sized buckets, so any quantile is reported with
+ *      a relative error of at most STATS_QUANTILE_ACCURACY. Buckets are
+ *      updated with atomic adds, and two sketches are merged by adding
+ *      their buckets, so merged quantiles keep the same error bound. The
+ *      sample value of a quantile counter is the number of values added.
+ *
+ * Sketches contain no pointers, so they can be copied out of the stats
+ * and merged with sketches from other stats.
+ */
+
+#define STATS_HLL_PRECISION     11
+#define STATS_HLL_REGISTERS     (1 << STATS_HLL_PRECISION)
+#define STATS_HLL_TABLE_SIZE    16
+
+#define STATS_TOPK_SIZE         32
+#define STATS_TOPK_KEY_LENGTH   32
+#define STATS_TOPK_TABLE_SIZE   16
+
+/* values below 1 (eg, sub-microsecond latencies) are counted in bucket 0.
+ * with 1024 buckets and 2% accuracy the largest distinct value is ~6e17 */
+#define STATS_QUANTILE_ACCURACY     0.02
+#define STATS_QUANTILE_BUCKETS      1024
+#define STATS_QUANTILE_TABLE_SIZE   16
+
+/* hll_allocated is non-zero when the hll belongs to a counter.
+ * hll_register holds the registers, one byte each.
+ */
+struct stats_hll
+{
+    int hll_allocated;
+    int hll_reserved;
+    unsigned char hll_register[STATS_HLL_REGISTERS];
+};
+
+/* topk_count is the (over-)estimated count of the key, and topk_error is
+ * the maximum amount by which topk_count overestimates it.
+ */
+struct stats_topk_entry
+{
+    char topk_key[STATS_TOPK_KEY_LENGTH];
+    int topk_key_len;
+    int topk_reserved;
+    long long topk_count;
+    long long topk_error;
+};
+
+/* topk_lock is the pid of the process updating the table, or 0.
+ * topk_total is the total count of everything added to the table.
+ * topk_entry holds the tracked keys. Entries with topk_key_len 0 are free.
+ */
+struct stats_topk
+{
+    int topk_allocated;
+    int topk_lock;
+    long long topk_total;
+    struct stats_topk_entry topk_entry[STATS_TOPK_SIZE];
+};
+
+/* qs_zero counts values <= 0. qs_sum is the sum of the values added,
+ * rounded to integers. qs_bucket[i] counts the values in
+ * (gamma^(i-1), gamma^i], where gamma = (1 + accuracy) / (1 - accuracy).
+ */
+struct stats_quantile
+{
+    int qs_allocated;
+    int qs_reserved;
+    long long qs_count;
+    long long qs_zero;
+    long long qs_sum;
+    long long qs_bucket[STATS_QUANTILE_BUCKETS];
+};
+
+struct stats;
+struct stats_data;
+struct stats_counter;
+
+int stats_allocate_hll(struct stats *stats, const char *name, struct stats_hll **hll_out);
+void stats_hll_add(struct stats_hll *hll, const void *item, int len);
+void stats_hll_add_hash(struct stats_hll *hll, unsigned long long hash);
+long long stats_hll_estimate(struct stats_hll *hll);
+void stats_hll_merge(struct stats_hll *dst, struct stats_hll *src);
+void stats_hll_clear(struct stats_hll *hll);
+
+int stats_allocate_topk(struct stats *stats, const char *name, struct stats_topk **topk_out);
+void stats_topk_add(struct stats_topk *topk, const char *key, int len, long long count);
+int stats_topk_get(struct stats_topk *topk, struct stats_topk_entry *entries, int max_entries);
+void stats_topk_merge(struct stats_topk *dst, struct stats_topk *src);
+void stats_topk_clear(struct stats_topk *topk);
+
+int stats_allocate_quantile(struct stats *stats, const char *name, struct stats_quantile **quantile_out);
+void stats_quantile_add(struct stats_quantile *qs, double value);
+double stats_quantile_get(struct stats_quantile *qs, double q);
+long long stats_quantile_count(struct stats_quantile *qs);
+void stats_quantile_merge(struct stats_quantile *dst, struct stats_quantile *src);
+void stats_quantile_delta(struct stats_quantile *out, struct stats_quantile *cur, struct stats_quantile *prev);
+void stats_quantile_clear(struct stats_quantile *qs);
+
+/* look up the sketch which belongs to a sketch counter */
+struct stats_hll *stats_counter_get_hll(struct stats *stats, struct stats_counter *ctr);
+struct stats_topk *stats_counter_get_topk(struct stats *stats, struct stats_counter *ctr);
+struct stats_quantile *stats_counter_get_quantile(struct stats *stats, struct stats_counter *ctr);
+
+/* merge the sketch of src_ctr in src into the sketch of dst_ctr in dst.
+ * the counters must have the same sketch type */
+int stats_sketch_merge(struct stats *dst, struct stats_counter *dst_ctr, struct stats *src, struct stats_counter *src_ctr);
+
+/* used by stats_get_sample and stats_reset_counters */
+long long stats_sketch_value(struct stats_data *data, struct stats_counter *ctr);
+void stats_sketch_clear(struct stats_data *data, struct stats_counter *ctr);
+
+unsigned long long stats_sketch_hash(const void *item, int len);
+
+#endif
@@ -3,8 +3,17 @@
 #ifndef _STATS_H_INCLUDED_
 #define _STATS_H_INCLUDED_
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include "shared_mem.h"
 #include "lock.h"
+#include "profile.h"
+#include "sketch.h"
+#include "timer.h"
+#include "trace.h"
+#include "provider.h"
+#include "process.h"
 
 #ifdef LINUX
 size_t strlcat(char *dst, const char *src, size_t siz);
@@ -39,7 +48,7 @@ typedef union {
 } STATS_VALUE;
 
 
-/* stats_header is the first 16 bytes of the stats shared memory
+/* stats_header is the first 48 bytes of the stats shared memory
  *
  * The stats_header should be aligned to a 16-byte boundary to
  * preserve alignment of the stats counter data.
@@ -47,15 +56,59 @@ typedef union {
  * stats_magic is the magic number STATS_MAGIC from above.
  * stats_sequence_number is a value which starts at 0 and is incremented
  *      each time a new counter is allocated.
- * reserved is there to align the structure to a multipe of 16 bytes.
+ * stats_reset_epoch is incremented twice by stats_reset_counters: once
+ *      before the counters are zeroed and once after. An odd value means
+ *      a reset is in progress. Samples record the epoch so that deltas
+ *      across a reset can be detected.
+ * stats_reset_pid is the pid of the process resetting the counters while
+ *      the epoch is odd, and 0 otherwise. An epoch left odd by a resetter
+ *      which has exited is moved on to the next even value by the next
+ *      sample or reset, as is one left odd for longer than a backstop of
+ *      seconds.
+ * stats_timer_sample_rate is the 1-in-N rate used by sampled timers (see
+ *      timer.h). 0 means STATS_TIMER_DEFAULT_SAMPLE_RATE.
+ * stats_ready is set to 1 once the creator has initialized the data. It
+ *      is written after everything else, so a process which sees it set
+ *      can attach without taking the lock (see stats_open).
+ * stats_version is the STATS_LAYOUT_VERSION of the build which created
+ *      the data, and stats_size its sizeof(struct stats_data). Data with
+ *      another version or size is not opened.
+ * stats_features are the STATS_FEATURE_ bits of the counter types in use.
+ *      The low 16 bits are compatible features, which a build that does
+ *      not know them can ignore (showing raw values). A build does not
+ *      open data with an incompatible feature (high 16 bits) it does not
+ *      know.
  */
 struct stats_header
 {
     int stats_magic;
     int stats_sequence_number;
-    char reserved[8];
+    int stats_reset_epoch;
+    int stats_reset_pid;
+    int stats_timer_sample_rate;
+    int stats_ready;
+    int stats_version;
+    int stats_features;
+    int stats_size;
+    int stats_reserved[3];
 };
 
+/* the layout of struct stats_data. Changing the layout of the counter
+ * table, or of anything before it, needs a new version. The version is
+ * also the ftok project id of the shared memory, so data of a later
+ * layout with the same name is a separate segment, and processes of both
+ * builds can run side by side. A build only opens data of its own
+ * layout. Data created before the header had a version has the same
+ * project id and a smaller size, and is refused by stats_open.
+ */
+#define STATS_LAYOUT_VERSION            2
+
+#define STATS_FEATURE_REAL              0x00000001   /* double or fixed point counters */
+#define STATS_FEATURE_PER_PROCESS       0x00000002   /* per-process counters */
+#define STATS_FEATURE_SKETCH            0x00000004   /* sketch counters */
+#define STATS_FEATURE_INCOMPAT_MASK     0xffff0000
+#define STATS_FEATURES_KNOWN            (STATS_FEATURE_REAL | STATS_FEATURE_PER_PROCESS | STATS_FEATURE_SKETCH)
+
 
 /* stats_counter is the data for each counter
  *
@@ -95,6 +148,26 @@ struct stats_header
 
 #define CTR_FLAG_TIMER          0x00000010
 #define CTR_FLAG_GAUGE          0x00000020
+#define CTR_FLAG_HLL            0x00000040   /* see sketch.h */
+#define CTR_FLAG_TOPK           0x00000080   /* see sketch.h */
+#define CTR_FLAG_QUANTILE       0x00000100   /* see sketch.h */
+#define CTR_FLAG_PER_PROCESS    0x00000200   /* see process.h */
+#define CTR_FLAG_DOUBLE         0x00000400   /* ctr_value holds the bits of a double */
+#define CTR_FLAG_FIXED          0x00000800   /* ctr_value is scaled by 10^digits */
+
+#define CTR_FLAG_TYPE_MASK      0x00000ff0
+#define CTR_FLAG_SKETCH_MASK    (CTR_FLAG_HLL | CTR_FLAG_TOPK | CTR_FLAG_QUANTILE)
+#define CTR_FLAG_REAL_MASK      (CTR_FLAG_DOUBLE | CTR_FLAG_FIXED)
+
+/* fixed point counters keep their number of decimal digits in bits 12-15 */
+#define CTR_FLAG_FIXED_SHIFT    12
+#define CTR_FLAG_FIXED_MAX_DIGITS 15
+#define CTR_FLAG_FIXED_DIGITS(f) ((((unsigned int)(f)) >> CTR_FLAG_FIXED_SHIFT) & 0xf)
+
+/* sketch counters keep (index + 1) of their sketch in the upper 16 bits,
+ * and per-process counters the index + 1 of their breakdown entry */
+#define CTR_FLAG_SKETCH_SHIFT   16
+#define CTR_FLAG_SKETCH_INDEX(f) ((((unsigned int)(f)) >> CTR_FLAG_SKETCH_SHIFT) - 1)
 
 struct stats_counter
 {
@@ -110,7 +183,11 @@ struct stats_counter
 /* stats_data is the layout of the shared memory data.
  *
  * It contains a header followed by a fixed size hash table
- * containing the counters.
+ * containing the counters, followed by the contention profiling
+ * side table (see profile.h), which has one entry per counter slot,
+ * the tables of sketches used by sketch counters (see sketch.h), the
+ * gauge provider doorbell (see provider.h) and the process table and
+ * per-process breakdowns (see process.h).
  *
  * The size of the hash table should be a prime number for better
  * hashing. Right now, we are using 2003, which is the smallest
@@ -120,34 +197,68 @@ struct stats_counter
 
 #define COUNTER_TABLE_SIZE 2003
 
+/* prof_sample_rate is the rate that writes are sampled at. It is 0 until
+ *      a profiling process records its first write.
+ */
+struct stats_profile
+{
+    int prof_sample_rate;
+    int prof_reserved[3];
+    struct stats_profile_entry prof_entry[COUNTER_TABLE_SIZE];
+};
+
 struct stats_data
 {
     struct stats_header     hdr;
     struct stats_counter    ctr[COUNTER_TABLE_SIZE];
+    struct stats_profile    prof;
+    struct stats_hll        hll[STATS_HLL_TABLE_SIZE];
+    struct stats_topk       topk[STATS_TOPK_TABLE_SIZE];
+    struct stats_quantile   quantile[STATS_QUANTILE_TABLE_SIZE];
+    struct stats_doorbell   doorbell;
+    struct stats_process    process[STATS_PROCESS_TABLE_SIZE];
+    struct stats_breakdown  breakdown[STATS_BREAKDOWN_TABLE_SIZE];
 };
 
 
 /* struct stats
  *
  * the in-memory stats object
+ *
+ * flags are the STATS_FLAG_ values passed to stats_create_with_flags.
+ * shmem and lock are used for shared stats, mutex for private stats.
+ * providers are the gauge providers registered by this process, or NULL
+ *      (see provider.h).
  */
 
+#define STATS_FLAG_PRIVATE          0x00000001
+#define STATS_FLAG_OPEN_EXISTING    0x00000002
+
 struct stats
 {
     int magic;
+    int flags;
     struct shared_memory shmem;
     struct lock lock;
+    pthread_mutex_t mutex;
     struct stats_data *data;
+    struct stats_providers *providers;
 };
 
 int stats_create(const char *name, struct stats **stats_out);
+int stats_create_with_flags(const char *name, int flags, struct stats **stats_out);
 int stats_open(struct stats *stats);
 int stats_close(struct stats *stats);
 int stats_free(struct stats *stats);
 
 int stats_allocate_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out);
+int stats_allocate_counter_with_flags(struct stats *stats, const char *name, int flags, struct stats_counter **ctr_out);
+
+/* look up existing counters without allocating them or taking the lock */
+int stats_find_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out);
+int stats_find_counters(struct stats *stats, const char **names, int count, struct stats_counter **ctrs_out, int *found_out);
 
-/* clear all of the counters in the structure to 0 */
+/* clear all of the counters in the structure to 0 and advance the reset epoch */
 int stats_reset_counters(struct stats *stats);
 
 /* deprecated. use stats_counter_list instead */
@@ -163,16 +274,22 @@ int stats_get_counters(struct stats *stats, struct stats_counter **counters, int
  * cl_seq_no - represents the point in time which this counter list represents
  *      this value is copied from the stats.stats_sequence_number at the time
  *      the counter list is captured.
- * cl_count - the number of counters in cl_ctr
- * cl_ctr - a contiguous array of pointers to stats_counter objects
- *     from [0,cl_count-1]
+ * cl_count - the number of counters in cl_slot
+ * cl_slot - a contiguous array of indexes into stats_data.ctr from
+ *     [0,cl_count-1]. Slot indexes are the same in every process attached
+ *     to the stats, so the list can be copied between processes. Use
+ *     stats_cl_get_counter to turn an entry into a stats_counter pointer.
  */
 
+#if COUNTER_TABLE_SIZE > 65535
+#error "COUNTER_TABLE_SIZE is too large for 16 bit counter slots"
+#endif
+
 struct stats_counter_list
 {
     int cl_seq_no;
     int cl_count;
-    struct stats_counter *cl_ctr[COUNTER_TABLE_SIZE];
+    uint16_t cl_slot[COUNTER_TABLE_SIZE];
 };
 
 int stats_get_counter_list(struct stats *stats, struct stats_counter_list *cl);
@@ -181,9 +298,30 @@ void stats_cl_init(struct stats_counter_list *cl);
 void stats_cl_free(struct stats_counter_list *cl);
 int stats_cl_is_updated(struct stats *stats, struct stats_counter_list *cl);
 
+#define stats_cl_get_counter(s,cl,i) ((s)->data->ctr + (cl)->cl_slot[i])
+
 
 /**
  * stats_sample
+ *
+ * stats_sample holds the values of the counters in a counter list at a
+ * point in time. The sample contains no pointers, so the first
+ * stats_sample_size() bytes can be written to a file, sent over the wire
+ * or copied into shared memory as-is.
+ *
+ * sample_seq_no - the cl_seq_no of the counter list the sample was taken from
+ * sample_count - the number of values in sample_value
+ * sample_time - the time the sample was taken
+ * sample_reset_epoch - the stats_reset_epoch at the time the sample was
+ *      taken. stats_sample_get_delta uses it to detect that the counters
+ *      were reset between two samples.
+ * sample_capacity - the number of values the sample was allocated with
+ * sample_derived_count - the number of derived values (see derived.h)
+ *      stored after the counter values. stats_get_sample sets it to 0.
+ * sample_flags - STATS_SAMPLE_FLAG_DERIVED_DOUBLE if the derived values are
+ *      stored as the bits of doubles. stats_get_sample clears it.
+ * sample_value - the counter values, indexed the same as the counter list,
+ *      followed by the derived values
  */
 
 struct stats_sample
@@ -191,17 +329,39 @@ struct stats_sample
     int sample_seq_no;
     int sample_count;
     long long sample_time;
-    STATS_VALUE sample_value[COUNTER_TABLE_SIZE];
+    int sample_reset_epoch;
+    int sample_capacity;
+    int sample_derived_count;
+    int sample_flags;
+    STATS_VALUE sample_value[];
 };
 
+#define STATS_SAMPLE_FLAG_DERIVED_DOUBLE    0x00000001
+
+/* the number of derived values a sample from stats_sample_create can hold */
+#define STATS_SAMPLE_MAX_DERIVED 64
+
+#define stats_sample_size_for(n) (sizeof(struct stats_sample) + (n) * sizeof(STATS_VALUE))
+#define stats_sample_size(s) stats_sample_size_for((s)->sample_count + (s)->sample_derived_count)
+
+/* stats_sample_create allocates room for a full counter table and STATS_SAMPLE_MAX_DERIVED derived values */
 int stats_sample_create(struct stats_sample **sample_out);
-void stats_sample_init(struct stats_sample *sample);
+int stats_sample_create_with_capacity(int capacity, struct stats_sample **sample_out);
+void stats_sample_init(struct stats_sample *sample, int capacity);
 void stats_sample_free(struct stats_sample *sample);
+int stats_sample_copy(struct stats_sample *dst, struct stats_sample *src);
 long long stats_sample_get_value(struct stats_sample *sample, int index);
 long long stats_sample_get_delta(struct stats_sample *sample, struct stats_sample *prev_sample, int index);
+long long stats_sample_get_derived(struct stats_sample *sample, int index);
 
 int stats_get_sample(struct stats *stats, struct stats_counter_list *cl, struct stats_sample *sample);
 
+/* decode sample values of any counter type; flags are the counter's ctr_flags */
+double stats_value_to_double(int flags, long long value);
+double stats_sample_get_double(struct stats_sample *sample, int flags, int index);
+double stats_sample_get_delta_double(struct stats_sample *sample, struct stats_sample *prev_sample, int flags, int index);
+double stats_sample_get_derived_double(struct stats_sample *sample, int index);
+
 
 
 void counter_get_key(struct stats_counter *ctr, char *buf, int buflen);
@@ -211,6 +371,28 @@ void counter_increment_by(struct stats_counter *ctr, long long val);
 void counter_clear(struct stats_counter *ctr);
 void counter_set(struct stats_counter *ctr, long long val);
 
+/*
+ * Floating point and fixed point counters.
+ *
+ * A CTR_FLAG_DOUBLE counter stores the bits of a double in ctr_value;
+ * counter_add_double updates it with a compare-and-swap loop. A
+ * CTR_FLAG_FIXED counter stores its value times 10^digits, with the
+ * digits declared in ctr_flags, so it can be added to atomically and
+ * summed like an integer. The integer write functions write the stored
+ * (scaled) value of a fixed point counter, and the value of a double
+ * counter. counter_get_value returns the stored value of a fixed point
+ * counter and the rounded value of a double counter.
+ *
+ * Sample values are the stored values; decode them with
+ * stats_sample_get_double.
+ */
+int stats_allocate_double_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out);
+int stats_allocate_fixed_counter(struct stats *stats, const char *name, int digits, struct stats_counter **ctr_out);
+double counter_get_double(struct stats_counter *ctr);
+void counter_set_double(struct stats_counter *ctr, double val);
+void counter_add_double(struct stats_counter *ctr, double val);
+
 #define stats_get_sequence_number(s) ((s)->data->hdr.stats_sequence_number)
+#define stats_get_reset_epoch(s) ((s)->data->hdr.stats_reset_epoch)
 
 #endif
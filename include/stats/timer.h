@@ -0,0 +1,70 @@
+/* timer.h */
+
+#ifndef _TIMER_H_INCLUDED_
+#define _TIMER_H_INCLUDED_
+
+/*
+ * Sampled timers.
+ *
+ * A sampled timer only takes timestamps on about 1 in N calls, where N is
+ * the stats_timer_sample_rate in the stats header, so timing a very short
+ * function costs a thread-local decrement on most calls. Each sampled call
+ * adds its elapsed time times N to the "<name>" counter (microseconds) and
+ * N to the "<name>.count" counter, so both are unbiased estimates of the
+ * totals for all calls.
+ *
+ * The countdown between samples is drawn at random with a mean of N so
+ * that call patterns cannot line up with the sampling. The rate is read
+ * from the stats at every sample, so stats_set_timer_sample_rate changes
+ * it for every process using the stats (eg, set it to 1 to time every
+ * call during an incident). A thread picks up a new rate when its current
+ * countdown runs out.
+ *
+ * Each thread keeps a countdown for each of the first STATS_TIMER_SLOTS
+ * stats a process times (later ones share them), so the timers of one
+ * stats are sampled at its own rate. A sampled call is scaled by the rate
+ * the countdown which ran out was drawn with. That rate is returned in
+ * the start value along with the time, so nested calls are each scaled
+ * by their own.
+ *
+ * Usage:
+ *      long long start = stats_timer_start(&tmr);
+ *      ...
+ *      stats_timer_stop(&tmr, start);
+ */
+
+#define STATS_TIMER_DEFAULT_SAMPLE_RATE     16
+#define STATS_TIMER_MAX_SAMPLE_RATE         65536
+
+#define STATS_TIMER_COUNT_SUFFIX            ".count"
+
+#define STATS_TIMER_SLOTS                   8
+
+struct stats;
+struct stats_data;
+struct stats_counter;
+
+struct stats_timer
+{
+    struct stats_data *tmr_data;
+    struct stats_counter *tmr_total;
+    struct stats_counter *tmr_count;
+    int tmr_slot;
+};
+
+int stats_timer_create(struct stats *stats, const char *name, struct stats_timer **tmr_out);
+int stats_timer_init(struct stats_timer *tmr, struct stats *stats, const char *name);
+void stats_timer_free(struct stats_timer *tmr);
+
+long long stats_timer_sampled_start(struct stats_timer *tmr);
+void stats_timer_stop(struct stats_timer *tmr, long long start_time);
+
+int stats_get_timer_sample_rate(struct stats *stats);
+int stats_set_timer_sample_rate(struct stats *stats, int rate);
+
+/* returns the start of a sampled call (its time and rate), or 0 if the
+   call is not sampled */
+extern __thread int stats_timer_countdown[STATS_TIMER_SLOTS];
+#define stats_timer_start(tmr) (--stats_timer_countdown[(tmr)->tmr_slot] > 0 ? 0ll : stats_timer_sampled_start(tmr))
+
+#endif
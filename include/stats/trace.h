@@ -0,0 +1,91 @@
+/* trace.h */
+
+#ifndef _TRACE_H_INCLUDED_
+#define _TRACE_H_INCLUDED_
+
+#include "shared_mem.h"
+
+/*
+ * Event tracing.
+ *
+ * A stats_trace is a ring of small fixed size event records in its own
+ * shared memory segment, "<name>.trc", next to the "<name>.mem" segment of
+ * the stats with the same name. Any number of processes append records
+ * without locking: a writer claims a sequence number with one atomic add
+ * and publishes the record by writing its sequence number last. A reader
+ * (statstrace) follows the ring with a cursor, and detects records that
+ * were overwritten before it got to them.
+ *
+ * The ring is shared by all writers rather than split per cpu, so that the
+ * reader sees events in the order they were claimed.
+ */
+
+#define STATS_TRACE_MAGIC               'trce'
+
+/* must be a power of 2 */
+#define STATS_TRACE_DEFAULT_RECORDS     65536
+
+/* tr_seq is the record's sequence number plus 1, or 0 while the record
+ *      is being written.
+ * tr_time is the trace clock when the record was written. The trace clock
+ *      is the cpu timestamp counter on x86 and current_time() elsewhere;
+ *      stats_trace_read converts it to current_time() units.
+ * tr_id identifies the event. stats_trace_counter uses the counter's
+ *      slot in the stats, so readers can print the counter name.
+ * tr_pid is the process which wrote the record.
+ * tr_arg is a value attached to the event (eg, a latency).
+ */
+struct stats_trace_record
+{
+    long long tr_seq;
+    long long tr_time;
+    int tr_id;
+    int tr_pid;
+    long long tr_arg;
+};
+
+/* trh_magic is 0 until the process which created the ring has measured
+ *      the trace clock, and STATS_TRACE_MAGIC after.
+ * trh_next is the sequence number the next writer will claim.
+ * trh_clock_base and trh_time_base are a trace clock reading and the
+ *      current_time() at the same moment, and trh_time_per_tick is the
+ *      number of current_time() units per trace clock tick.
+ */
+struct stats_trace_header
+{
+    int trh_magic;
+    int trh_records;
+    long long trh_next;
+    long long trh_clock_base;
+    long long trh_time_base;
+    double trh_time_per_tick;
+    char reserved[24];
+};
+
+struct stats_trace
+{
+    int magic;
+    int records;
+    struct shared_memory shmem;
+    struct stats_trace_header *hdr;
+    struct stats_trace_record *rec;
+};
+
+struct stats;
+struct stats_counter;
+
+int stats_trace_create(const char *name, int records, struct stats_trace **trace_out);
+int stats_trace_open(struct stats_trace *trace);
+int stats_trace_close(struct stats_trace *trace);
+void stats_trace_free(struct stats_trace *trace);
+
+void stats_trace_event(struct stats_trace *trace, int id, long long arg);
+void stats_trace_counter(struct stats_trace *trace, struct stats *stats, struct stats_counter *ctr, long long arg);
+
+int stats_trace_read(struct stats_trace *trace, long long *cursor, struct stats_trace_record *records, int max_records,
+    int *count_out, long long *dropped_out);
+long long stats_trace_oldest(struct stats_trace *trace);
+
+#define stats_trace_next(t) ((t)->hdr->trh_next)
+
+#endif
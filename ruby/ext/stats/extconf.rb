@@ -7,6 +7,9 @@ $CFLAGS << ' -Wextra -O0 -ggdb3' if ENV['DEBUG']
 $CFLAGS << ' -DDEBUG=1' if ENV['DEBUG']
 $CFLAGS << ' -DDEBUG=0' unless ENV['DEBUG']
 
+have_library('pthread','pthread_mutex_init') && append_library($libs,'pthread')
+have_library('m','log') && append_library($libs,'m')
+
 $uname = `uname -a`
 if /linux/i =~ $uname
   $CFLAGS << ' -DLINUX'
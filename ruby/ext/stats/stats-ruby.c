@@ -10,6 +10,7 @@
 static VALUE stats_class = Qnil;
 static VALUE ctr_class = Qnil;
 static VALUE tmr_class = Qnil;
+static VALUE stmr_class = Qnil;
 static VALUE sample_class = Qnil;
 
 #define STATS_MAGIC  'stat'
@@ -38,7 +39,9 @@ static void rbctr_free(void *p);
 static VALUE rbtmr_alloc(struct stats_counter *counter);
 static void rbtmr_free(void *p);
 
-static VALUE rbsample_alloc(struct stats_counter_list *cl, struct stats_sample *sample);
+static void rbstmr_free(void *p);
+
+static VALUE rbsample_alloc(struct stats *stats, struct stats_counter_list *cl, struct stats_sample *sample);
 static void rbsample_free(void *p);
 
 
@@ -312,6 +315,57 @@ static VALUE rbstats_get_tmr(VALUE self, VALUE rbkey)
     return ret;
 }
 
+static VALUE rbstats_get_stmr(VALUE self, VALUE rbkey)
+{
+    struct rbstats *stats;
+    struct stats_timer *tmr = NULL;
+    VALUE ret = Qnil;
+
+    Check_Type(rbkey, T_STRING);
+
+    stats = rbstats_get_wrapped_stats(self);
+    if (stats)
+    {
+        if (stats_timer_create(stats->stats, StringValueCStr(rbkey), &tmr) == S_OK)
+        {
+            ret = Data_Wrap_Struct(stmr_class, 0, rbstmr_free, tmr);
+        }
+    }
+
+    return ret;
+}
+
+static VALUE rbstats_get_timer_sample_rate(VALUE self)
+{
+    struct rbstats *stats;
+    VALUE ret = Qnil;
+
+    stats = rbstats_get_wrapped_stats(self);
+    if (stats)
+    {
+        ret = INT2FIX(stats_get_timer_sample_rate(stats->stats));
+    }
+
+    return ret;
+}
+
+static VALUE rbstats_set_timer_sample_rate(VALUE self, VALUE rate)
+{
+    struct rbstats *stats;
+    VALUE ret = Qnil;
+
+    Check_Type(rate, T_FIXNUM);
+
+    stats = rbstats_get_wrapped_stats(self);
+    if (stats)
+    {
+        if (stats_set_timer_sample_rate(stats->stats, FIX2INT(rate)) == S_OK)
+            ret = rate;
+    }
+
+    return ret;
+}
+
 static VALUE rbstats_inc(VALUE self, VALUE rbkey)
 {
     struct rbstats *stats;
@@ -422,7 +476,7 @@ static VALUE rbstats_sample(VALUE self)
     if (stats_get_sample(stats->stats, cl, sample) != S_OK)
         goto exit;
 
-    ret = rbsample_alloc(cl, sample);
+    ret = rbsample_alloc(stats->stats, cl, sample);
     if (ret != Qnil)
     {
         cl = NULL;
@@ -495,6 +549,8 @@ VALUE rbctr_get(VALUE self)
     long long val;
 
     Data_Get_Struct(self, struct stats_counter, counter);
+    if (counter->ctr_flags & CTR_FLAG_REAL_MASK)
+        return rb_float_new(counter_get_double(counter));
     val = counter_get_value(counter);
     return LONG2FIX(val);
 }
@@ -595,6 +651,31 @@ static void rbtmr_free(void *p)
 }
 
 
+/******************************************************************
+ *
+ *  Ruby SampledTimer
+ *
+ */
+
+VALUE rbstmr_time(VALUE self)
+{
+    struct stats_timer *tmr;
+    long long start_time;
+    VALUE ret;
+
+    Data_Get_Struct(self, struct stats_timer, tmr);
+    start_time = stats_timer_start(tmr);
+    ret = rb_yield(self);
+    stats_timer_stop(tmr, start_time);
+    return ret;
+}
+
+static void rbstmr_free(void *p)
+{
+    stats_timer_free((struct stats_timer *)p);
+}
+
+
 /******************************************************************
  *
  *  Ruby Sample
@@ -603,12 +684,13 @@ static void rbtmr_free(void *p)
 
 struct rb_sample_data
 {
+    struct stats *stats;
     struct stats_counter_list *cl;
     struct stats_sample *sample;
 };
 
 
-static VALUE rbsample_alloc(struct stats_counter_list *cl, struct stats_sample *sample)
+static VALUE rbsample_alloc(struct stats *stats, struct stats_counter_list *cl, struct stats_sample *sample)
 {
     VALUE tdata = Qnil;
     struct rb_sample_data *sd;
@@ -616,6 +698,7 @@ static VALUE rbsample_alloc(struct stats_counter_list *cl, struct stats_sample *
     sd = (struct rb_sample_data *) malloc(sizeof(struct rb_sample_data));
     if (sd)
     {
+        sd->stats = stats;
         sd->cl = cl;
         sd->sample = sample;
         tdata = Data_Wrap_Struct(sample_class, 0, rbsample_free, sd);
@@ -646,7 +729,7 @@ static VALUE rbsample_keys(VALUE self)
     {
         for (i = 0; i < sd->cl->cl_count; i++)
         {
-            counter_get_key(sd->cl->cl_ctr[i],counter_name,MAX_COUNTER_KEY_LENGTH+1);
+            counter_get_key(stats_cl_get_counter(sd->stats,sd->cl,i),counter_name,MAX_COUNTER_KEY_LENGTH+1);
             rb_ary_push(keys, rb_str_new_cstr(counter_name));
         }
     }
@@ -672,12 +755,22 @@ static VALUE rbsample_count(VALUE self)
     return LONG2FIX(sd->cl->cl_count);
 }
 
+/* double and fixed point values are returned as Floats */
+static VALUE rbsample_value(struct rb_sample_data *sd, int i)
+{
+    struct stats_counter *ctr = stats_cl_get_counter(sd->stats,sd->cl,i);
+
+    if (ctr->ctr_flags & CTR_FLAG_REAL_MASK)
+        return rb_float_new(stats_sample_get_double(sd->sample, ctr->ctr_flags, i));
+
+    return LONG2FIX(stats_sample_get_value(sd->sample, i));
+}
+
 static VALUE rbsample_get(VALUE self, VALUE key_arg)
 {
     struct rb_sample_data *sd = NULL;
     int i;
     char counter_name[MAX_COUNTER_KEY_LENGTH+1], *key;
-    long long val;
 
     Check_Type(key_arg,T_STRING);
 
@@ -686,12 +779,9 @@ static VALUE rbsample_get(VALUE self, VALUE key_arg)
 
     for (i = 0; i < sd->cl->cl_count; i++)
     {
-        counter_get_key(sd->cl->cl_ctr[i],counter_name,MAX_COUNTER_KEY_LENGTH+1);
+        counter_get_key(stats_cl_get_counter(sd->stats,sd->cl,i),counter_name,MAX_COUNTER_KEY_LENGTH+1);
         if (strcmp(key, counter_name) == 0)
-        {
-            val = stats_sample_get_value(sd->sample, i);
-            return LONG2FIX(val);
-        }
+            return rbsample_value(sd, i);
     }
 
     return Qnil;
@@ -702,17 +792,15 @@ static VALUE rbsample_each(VALUE self)
     struct rb_sample_data *sd = NULL;
     int i;
     char counter_name[MAX_COUNTER_KEY_LENGTH+1];
-    long long val;
     VALUE key;
 
     Data_Get_Struct(self, struct rb_sample_data, sd);
 
     for (i = 0; i < sd->cl->cl_count; i++)
     {
-        counter_get_key(sd->cl->cl_ctr[i],counter_name,MAX_COUNTER_KEY_LENGTH+1);
+        counter_get_key(stats_cl_get_counter(sd->stats,sd->cl,i),counter_name,MAX_COUNTER_KEY_LENGTH+1);
         key = rb_str_new_cstr(counter_name);
-        val = stats_sample_get_value(sd->sample, i);
-        rb_yield_values(2, key, LONG2FIX(val));
+        rb_yield_values(2, key, rbsample_value(sd, i));
     }
 
     return self;
@@ -734,6 +822,9 @@ void Init_stats()
     rb_define_method(stats_class, "sample", rbstats_sample, 0);
     rb_define_method(stats_class, "get", rbstats_get, 1);
     rb_define_method(stats_class, "timer", rbstats_get_tmr, 1);
+    rb_define_method(stats_class, "sampled_timer", rbstats_get_stmr, 1);
+    rb_define_method(stats_class, "timer_sample_rate", rbstats_get_timer_sample_rate, 0);
+    rb_define_method(stats_class, "timer_sample_rate=", rbstats_set_timer_sample_rate, 1);
     rb_define_method(stats_class, "inc", rbstats_inc, 1);
     rb_define_method(stats_class, "add", rbstats_add, 2);
     rb_define_method(stats_class, "set", rbstats_set, 2);
@@ -751,6 +842,9 @@ void Init_stats()
     rb_define_method(tmr_class, "exit", rbtmr_exit, 0);
     rb_define_method(tmr_class, "time", rbtmr_time, 0);
 
+    stmr_class = rb_define_class("SampledTimer", rb_cObject);
+    rb_define_method(stmr_class, "time", rbstmr_time, 0);
+
     sample_class = rb_define_class("Sample", rb_cObject);
     rb_define_method(sample_class, "keys", rbsample_keys, 0);
     rb_define_method(sample_class, "time", rbsample_time, 0);
@@ -26,4 +26,13 @@ end
 
 raise "unexpected sample data" unless h == {"ctr" => 1}
 
+s.timer_sample_rate = 1
+t = s.sampled_timer("stmr")
+3.times { t.time { } }
+
+raise "unexpected sample rate" unless s.timer_sample_rate == 1
+raise "unexpected sampled timer count" unless s.sample['stmr.count'] == 3
+
+s.timer_sample_rate = 0
+
 puts "TEST STATS: OK"
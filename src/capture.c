@@ -0,0 +1,296 @@
+/* capture.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/capture.h"
+#include "stats/debug.h"
+
+
+/*
+ * stats_capture_create
+ *
+ * Allocates a capture with a ring of capacity samples. The ring is
+ * allocated for the selected counters by stats_capture_reset, so taking
+ * samples allocates nothing.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - cap_out is NULL or capacity is not positive
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_capture_create(int capacity, struct stats_capture **cap_out)
+{
+    struct stats_capture *cap;
+    int err;
+
+    if (cap_out == NULL || capacity <= 0)
+        return ERROR_INVALID_PARAMETERS;
+
+    cap = (struct stats_capture *) calloc(1, sizeof(struct stats_capture));
+    if (cap == NULL)
+        return ERROR_MEMORY;
+
+    cap->cap_capacity = capacity;
+    cap->cap_index = (int *) calloc(COUNTER_TABLE_SIZE, sizeof(int));
+    cap->cap_flags = (int *) calloc(COUNTER_TABLE_SIZE, sizeof(int));
+    cap->cap_key = calloc(COUNTER_TABLE_SIZE, MAX_COUNTER_KEY_LENGTH+1);
+    cap->cap_time = (long long *) calloc(capacity, sizeof(long long));
+    err = stats_sample_create(&cap->cap_sample);
+
+    if (err != S_OK || cap->cap_index == NULL || cap->cap_flags == NULL || cap->cap_key == NULL || cap->cap_time == NULL)
+    {
+        stats_capture_free(cap);
+        return ERROR_MEMORY;
+    }
+
+    *cap_out = cap;
+
+    return S_OK;
+}
+
+void stats_capture_free(struct stats_capture *cap)
+{
+    if (cap == NULL)
+        return;
+
+    free(cap->cap_index);
+    free(cap->cap_flags);
+    free(cap->cap_key);
+    free(cap->cap_time);
+    free(cap->cap_value);
+    if (cap->cap_sample)
+        stats_sample_free(cap->cap_sample);
+    free(cap);
+}
+
+/*
+ * stats_capture_select
+ *
+ * Selects the counters of cl whose key starts with prefix (every counter
+ * if prefix is NULL or empty) which are not selected yet. The capture
+ * must be sampled with the same counter list.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - cap, stats or cl is NULL
+ */
+int stats_capture_select(struct stats_capture *cap, struct stats *stats, struct stats_counter_list *cl, const char *prefix)
+{
+    struct stats_counter *ctr;
+    int i, j, prefix_len;
+
+    if (cap == NULL || stats == NULL || cl == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    prefix_len = prefix ? strlen(prefix) : 0;
+
+    for (i = 0; i < cl->cl_count; i++)
+    {
+        ctr = stats_cl_get_counter(stats, cl, i);
+        if (prefix_len > 0 && (ctr->ctr_key_len < prefix_len || memcmp(ctr->ctr_key, prefix, prefix_len) != 0))
+            continue;
+
+        for (j = 0; j < cap->cap_count && cap->cap_index[j] != i; j++)
+            ;
+        if (j < cap->cap_count)
+            continue;
+
+        cap->cap_index[j] = i;
+        cap->cap_flags[j] = ctr->ctr_flags;
+        counter_get_key(ctr, cap->cap_key[j], MAX_COUNTER_KEY_LENGTH+1);
+        cap->cap_count++;
+    }
+
+    return S_OK;
+}
+
+/*
+ * stats_capture_reset
+ *
+ * Empties the ring and the jitter statistics for a new capture, keeping
+ * the selection. If counters were selected since the ring was allocated
+ * it is allocated again for them.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - cap is NULL
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_capture_reset(struct stats_capture *cap)
+{
+    long long *value;
+
+    if (cap == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (cap->cap_value == NULL || cap->cap_stride != cap->cap_count)
+    {
+        value = (long long *) malloc((size_t) cap->cap_capacity * (cap->cap_count > 0 ? cap->cap_count : 1) * sizeof(long long));
+        if (value == NULL)
+            return ERROR_MEMORY;
+        free(cap->cap_value);
+        cap->cap_value = value;
+        cap->cap_stride = cap->cap_count;
+    }
+
+    cap->cap_samples = 0;
+    cap->cap_missed = 0;
+    cap->cap_jitter_min = 0;
+    cap->cap_jitter_max = 0;
+    cap->cap_jitter_sum = 0;
+    cap->cap_jitter_sum_sq = 0.0;
+
+    return S_OK;
+}
+
+/*
+ * stats_capture_sample
+ *
+ * Takes a sample and adds the values of the selected counters to the
+ * ring, overwriting the oldest sample if it is full. The capture must
+ * have been reset since counters were last selected. due_time is the
+ * current_time() the sample was due at, for the jitter statistics.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL, or the capture was not reset after selecting
+ *    any error of stats_get_sample
+ */
+int stats_capture_sample(struct stats_capture *cap, struct stats *stats, struct stats_counter_list *cl, long long due_time)
+{
+    long long *value, jitter;
+    int err, slot, j;
+
+    if (cap == NULL || stats == NULL || cl == NULL || cap->cap_value == NULL || cap->cap_stride != cap->cap_count)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = stats_get_sample(stats, cl, cap->cap_sample);
+    if (err != S_OK)
+        return err;
+
+    slot = (int) (cap->cap_samples % cap->cap_capacity);
+    cap->cap_time[slot] = cap->cap_sample->sample_time;
+    value = cap->cap_value + (size_t) slot * cap->cap_stride;
+    for (j = 0; j < cap->cap_count; j++)
+        value[j] = stats_sample_get_value(cap->cap_sample, cap->cap_index[j]);
+
+    jitter = TIME_DELTA_TO_NANOS(due_time, cap->cap_sample->sample_time);
+    if (cap->cap_samples == 0 || jitter < cap->cap_jitter_min)
+        cap->cap_jitter_min = jitter;
+    if (cap->cap_samples == 0 || jitter > cap->cap_jitter_max)
+        cap->cap_jitter_max = jitter;
+    cap->cap_jitter_sum += jitter;
+    cap->cap_jitter_sum_sq += (double) jitter * jitter;
+    cap->cap_samples++;
+
+    return S_OK;
+}
+
+/*
+ * stats_capture_write
+ *
+ * Writes the samples in the ring to path as CSV: comment lines (starting
+ * with #) describing the capture of the stats named name every
+ * interval_us and its jitter, a header line "time_us,KEY,..." and a line
+ * per sample with its time since the oldest sample and the values. Double
+ * and fixed point values are written with a fraction.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - cap or path is NULL
+ *    ERROR_STATS_RECORD_IO             - the file could not be written
+ */
+int stats_capture_write(struct stats_capture *cap, const char *name, int interval_us, const char *path)
+{
+    FILE *f;
+    long long first;
+    double mean = 0.0, var = 0.0, d;
+    int i, j, n, flags;
+
+    if (cap == NULL || path == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    f = fopen(path, "w");
+    if (f == NULL)
+        return ERROR_STATS_RECORD_IO;
+
+    if (cap->cap_samples > 0)
+    {
+        mean = (double) cap->cap_jitter_sum / cap->cap_samples;
+        var = cap->cap_jitter_sum_sq / cap->cap_samples - mean * mean;
+    }
+
+    n = stats_capture_size(cap);
+    fprintf(f, "# capture of %s every %d us: %d samples of %lld taken, %lld missed\n", name ? name : "stats",
+        interval_us, n, cap->cap_samples, cap->cap_missed);
+    fprintf(f, "# jitter us: min %.1f mean %.1f max %.1f stddev %.1f\n", cap->cap_jitter_min / 1000.0,
+        mean / 1000.0, cap->cap_jitter_max / 1000.0, var > 0.0 ? sqrt(var) / 1000.0 : 0.0);
+
+    fprintf(f, "time_us");
+    for (j = 0; j < cap->cap_count; j++)
+        fprintf(f, ",%s", cap->cap_key[j]);
+    fprintf(f, "\n");
+
+    first = n > 0 ? stats_capture_get_time(cap, 0) : 0;
+    for (i = 0; i < n; i++)
+    {
+        fprintf(f, "%lld", TIME_DELTA_TO_NANOS(first, stats_capture_get_time(cap, i)) / 1000);
+        for (j = 0; j < cap->cap_count; j++)
+        {
+            flags = cap->cap_flags[j];
+            if (flags & CTR_FLAG_REAL_MASK)
+            {
+                d = stats_value_to_double(flags, stats_capture_get_value(cap, i, j));
+                if (flags & CTR_FLAG_FIXED)
+                    fprintf(f, ",%.*f", CTR_FLAG_FIXED_DIGITS(flags), d);
+                else
+                    fprintf(f, ",%.17g", d);
+            }
+            else
+            {
+                fprintf(f, ",%lld", stats_capture_get_value(cap, i, j));
+            }
+        }
+        fprintf(f, "\n");
+    }
+
+    if (fclose(f) != 0)
+        return ERROR_STATS_RECORD_IO;
+
+    return S_OK;
+}
+
+/*
+ * stats_request_capture
+ *
+ * Asks the capture process watching the stats (if any) to start a
+ * capture, by incrementing the capture request count in the stats.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - the stats is NULL or not open
+ */
+int stats_request_capture(struct stats *stats)
+{
+    if (stats == NULL || stats->data == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    __sync_fetch_and_add(&stats->data->doorbell.db_capture, 1);
+
+    return S_OK;
+}
+
+/* the number of captures requested of the stats; a capture process
+   starts a capture when it changes */
+int stats_capture_requests(struct stats *stats)
+{
+    if (stats == NULL || stats->data == NULL)
+        return 0;
+
+    return *(volatile int *) &stats->data->doorbell.db_capture;
+}
@@ -0,0 +1,558 @@
+/* derived.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/derived.h"
+#include "stats/debug.h"
+
+#define DERIVED_OP_CONST        1
+#define DERIVED_OP_VALUE        2
+#define DERIVED_OP_DELTA        3
+#define DERIVED_OP_RATE         4
+#define DERIVED_OP_DERIVED      5
+#define DERIVED_OP_ADD          6
+#define DERIVED_OP_SUB          7
+#define DERIVED_OP_MUL          8
+#define DERIVED_OP_DIV          9
+#define DERIVED_OP_NEG          10
+
+struct parser
+{
+    struct stats_derived *dv;
+    const char *p;
+    int depth;
+    int err;
+};
+
+static void parse_expr(struct parser *ps);
+
+
+int stats_derived_create(struct stats_derived **dv_out)
+{
+    struct stats_derived *dv;
+
+    if (dv_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    dv = (struct stats_derived *) malloc(sizeof(struct stats_derived));
+    if (dv == NULL)
+        return ERROR_MEMORY;
+
+    memset(dv, 0, sizeof(struct stats_derived));
+    dv->dv_seq_no = -1;
+
+    *dv_out = dv;
+
+    return S_OK;
+}
+
+void stats_derived_free(struct stats_derived *dv)
+{
+    free(dv);
+}
+
+static int is_name_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_' || c == '.';
+}
+
+static void skip_space(struct parser *ps)
+{
+    while (isspace((unsigned char) *ps->p))
+        ps->p++;
+}
+
+static int find_derived(struct stats_derived *dv, const char *name, int len)
+{
+    int i;
+
+    for (i = 0; i < dv->dv_count; i++)
+    {
+        if (strncmp(dv->dv_expr[i].de_name, name, len) == 0 && dv->dv_expr[i].de_name[len] == '\0')
+            return i;
+    }
+
+    return -1;
+}
+
+/* returns the reference index of name, adding it if needed */
+static int add_ref(struct parser *ps, const char *name, int len)
+{
+    struct stats_derived *dv = ps->dv;
+    int i, derived;
+
+    if (len > MAX_COUNTER_KEY_LENGTH)
+    {
+        ps->err = ERROR_STATS_KEY_TOO_LONG;
+        return -1;
+    }
+
+    /* a name refers to a derived counter only if that was defined first */
+    derived = find_derived(dv, name, len);
+
+    for (i = 0; i < dv->dv_ref_count; i++)
+    {
+        if (dv->dv_ref_derived[i] == derived && strncmp(dv->dv_ref_name[i], name, len) == 0 && dv->dv_ref_name[i][len] == '\0')
+            return i;
+    }
+
+    if (dv->dv_ref_count == STATS_DERIVED_MAX_REFS)
+    {
+        ps->err = ERROR_STATS_DERIVED_TOO_LARGE;
+        return -1;
+    }
+
+    i = dv->dv_ref_count++;
+    memcpy(dv->dv_ref_name[i], name, len);
+    dv->dv_ref_name[i][len] = '\0';
+    dv->dv_ref_index[i] = -1;
+    dv->dv_ref_derived[i] = derived;
+
+    /* new references are bound on the next evaluation */
+    dv->dv_seq_no = -1;
+
+    return i;
+}
+
+static void emit(struct parser *ps, int op, int arg, double value)
+{
+    struct stats_derived_op *code;
+
+    if (ps->err != S_OK)
+        return;
+
+    if (ps->dv->dv_code_count == STATS_DERIVED_MAX_CODE)
+    {
+        ps->err = ERROR_STATS_DERIVED_TOO_LARGE;
+        return;
+    }
+
+    switch (op)
+    {
+    case DERIVED_OP_ADD:
+    case DERIVED_OP_SUB:
+    case DERIVED_OP_MUL:
+    case DERIVED_OP_DIV:
+        ps->depth--;
+        break;
+    case DERIVED_OP_NEG:
+        break;
+    default:
+        if (++ps->depth > STATS_DERIVED_MAX_STACK)
+        {
+            ps->err = ERROR_STATS_DERIVED_TOO_LARGE;
+            return;
+        }
+        break;
+    }
+
+    code = ps->dv->dv_code + ps->dv->dv_code_count++;
+    code->do_op = op;
+    code->do_arg = arg;
+    code->do_value = value;
+}
+
+/* primary := number | name | rate(name) | delta(name) | ( expr ) */
+static void parse_primary(struct parser *ps)
+{
+    const char *start, *fn;
+    char *end;
+    int len, fn_len, ref, op;
+    double value;
+
+    skip_space(ps);
+
+    if (*ps->p == '(')
+    {
+        ps->p++;
+        parse_expr(ps);
+        skip_space(ps);
+        if (*ps->p != ')')
+        {
+            ps->err = ERROR_STATS_DERIVED_SYNTAX;
+            return;
+        }
+        ps->p++;
+        return;
+    }
+
+    if (isdigit((unsigned char) *ps->p))
+    {
+        value = strtod(ps->p, &end);
+        ps->p = end;
+        emit(ps, DERIVED_OP_CONST, 0, value);
+        return;
+    }
+
+    start = ps->p;
+    while (is_name_char(*ps->p))
+        ps->p++;
+    len = ps->p - start;
+
+    if (len == 0)
+    {
+        ps->err = ERROR_STATS_DERIVED_SYNTAX;
+        return;
+    }
+
+    skip_space(ps);
+    if (*ps->p != '(')
+    {
+        ref = add_ref(ps, start, len);
+        if (ref >= 0)
+            emit(ps, ps->dv->dv_ref_derived[ref] >= 0 ? DERIVED_OP_DERIVED : DERIVED_OP_VALUE, ref, 0.0);
+        return;
+    }
+
+    /* function call */
+    fn = start;
+    fn_len = len;
+    if (fn_len == 4 && strncmp(fn, "rate", 4) == 0)
+        op = DERIVED_OP_RATE;
+    else if (fn_len == 5 && strncmp(fn, "delta", 5) == 0)
+        op = DERIVED_OP_DELTA;
+    else
+    {
+        ps->err = ERROR_STATS_DERIVED_SYNTAX;
+        return;
+    }
+
+    ps->p++;
+    skip_space(ps);
+    start = ps->p;
+    while (is_name_char(*ps->p))
+        ps->p++;
+    len = ps->p - start;
+    skip_space(ps);
+
+    if (len == 0 || *ps->p != ')')
+    {
+        ps->err = ERROR_STATS_DERIVED_SYNTAX;
+        return;
+    }
+    ps->p++;
+
+    ref = add_ref(ps, start, len);
+    if (ref < 0)
+        return;
+
+    /* only counters have deltas */
+    if (ps->dv->dv_ref_derived[ref] >= 0)
+    {
+        ps->err = ERROR_STATS_DERIVED_SYNTAX;
+        return;
+    }
+
+    emit(ps, op, ref, 0.0);
+}
+
+/* unary := - unary | primary */
+static void parse_unary(struct parser *ps)
+{
+    skip_space(ps);
+    if (*ps->p == '-')
+    {
+        ps->p++;
+        parse_unary(ps);
+        emit(ps, DERIVED_OP_NEG, 0, 0.0);
+        return;
+    }
+
+    parse_primary(ps);
+}
+
+/* term := unary ((* | /) unary)* */
+static void parse_term(struct parser *ps)
+{
+    char c;
+
+    parse_unary(ps);
+    while (ps->err == S_OK)
+    {
+        skip_space(ps);
+        c = *ps->p;
+        if (c != '*' && c != '/')
+            break;
+        ps->p++;
+        parse_unary(ps);
+        emit(ps, c == '*' ? DERIVED_OP_MUL : DERIVED_OP_DIV, 0, 0.0);
+    }
+}
+
+/* expr := term ((+ | -) term)* */
+static void parse_expr(struct parser *ps)
+{
+    char c;
+
+    parse_term(ps);
+    while (ps->err == S_OK)
+    {
+        skip_space(ps);
+        c = *ps->p;
+        if (c != '+' && c != '-')
+            break;
+        ps->p++;
+        parse_term(ps);
+        emit(ps, c == '+' ? DERIVED_OP_ADD : DERIVED_OP_SUB, 0, 0.0);
+    }
+}
+
+/*
+ * stats_derived_add
+ *
+ * Compiles expression and adds it as the derived counter name.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_STATS_KEY_TOO_LONG          - a name is longer than MAX_COUNTER_KEY_LENGTH
+ *    ERROR_STATS_DERIVED_SYNTAX        - the name or expression is not valid, or the name is already used
+ *    ERROR_STATS_DERIVED_TOO_LARGE     - there are too many derived counters, names or operations
+ */
+int stats_derived_add(struct stats_derived *dv, const char *name, const char *expression)
+{
+    struct parser ps;
+    struct stats_derived_expr *e;
+    int len, ref_count;
+
+    if (dv == NULL || name == NULL || expression == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    len = strlen(name);
+    if (len == 0)
+        return ERROR_STATS_DERIVED_SYNTAX;
+    if (len > MAX_COUNTER_KEY_LENGTH)
+        return ERROR_STATS_KEY_TOO_LONG;
+    if (find_derived(dv, name, len) >= 0)
+        return ERROR_STATS_DERIVED_SYNTAX;
+    if (dv->dv_count == STATS_DERIVED_MAX)
+        return ERROR_STATS_DERIVED_TOO_LARGE;
+
+    e = dv->dv_expr + dv->dv_count;
+    e->de_code = dv->dv_code_count;
+    ref_count = dv->dv_ref_count;
+
+    ps.dv = dv;
+    ps.p = expression;
+    ps.depth = 0;
+    ps.err = S_OK;
+
+    parse_expr(&ps);
+    skip_space(&ps);
+
+    if (ps.err == S_OK && *ps.p != '\0')
+        ps.err = ERROR_STATS_DERIVED_SYNTAX;
+
+    if (ps.err != S_OK)
+    {
+        dv->dv_code_count = e->de_code;
+        dv->dv_ref_count = ref_count;
+        return ps.err;
+    }
+
+    strcpy(e->de_name, name);
+    e->de_code_len = dv->dv_code_count - e->de_code;
+    dv->dv_count++;
+
+    return S_OK;
+}
+
+static char *trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char) *s))
+        s++;
+
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+/*
+ * stats_derived_load
+ *
+ * Adds the derived counters defined in the file at path. If a definition
+ * cannot be added, its line number is stored in *line_out.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_FAIL                        - the file could not be read
+ *    ERROR_STATS_DERIVED_SYNTAX        - a line is not "name = expression"
+ *    any error returned by stats_derived_add
+ */
+int stats_derived_load(struct stats_derived *dv, const char *path, int *line_out)
+{
+    FILE *f;
+    char line[STATS_DERIVED_MAX_LINE];
+    char *name, *expression, *eq;
+    int err = S_OK, line_no = 0;
+
+    if (dv == NULL || path == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return ERROR_FAIL;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line_no++;
+
+        name = trim(line);
+        if (*name == '\0' || *name == '#')
+            continue;
+
+        eq = strchr(name, '=');
+        if (eq == NULL)
+        {
+            err = ERROR_STATS_DERIVED_SYNTAX;
+            break;
+        }
+
+        *eq = '\0';
+        name = trim(name);
+        expression = trim(eq + 1);
+
+        err = stats_derived_add(dv, name, expression);
+        if (err != S_OK)
+            break;
+    }
+
+    fclose(f);
+
+    if (err != S_OK && line_out)
+        *line_out = line_no;
+
+    return err;
+}
+
+/* binds the names used by the expressions to counter list indexes */
+static void derived_bind(struct stats *stats, struct stats_derived *dv, struct stats_counter_list *cl)
+{
+    struct stats_counter *ctr;
+    int i, j, slot;
+
+    for (i = 0; i < dv->dv_ref_count; i++)
+    {
+        dv->dv_ref_index[i] = -1;
+
+        if (dv->dv_ref_derived[i] >= 0)
+            continue;
+
+        if (stats_find_counter(stats, dv->dv_ref_name[i], &ctr) != S_OK)
+            continue;
+
+        slot = ctr - stats->data->ctr;
+        for (j = 0; j < cl->cl_count; j++)
+        {
+            if (cl->cl_slot[j] == slot)
+            {
+                dv->dv_ref_index[i] = j;
+                dv->dv_ref_flags[i] = ctr->ctr_flags;
+                break;
+            }
+        }
+    }
+
+    dv->dv_seq_no = cl->cl_seq_no;
+}
+
+/*
+ * stats_derived_evaluate
+ *
+ * Evaluates the derived counters over sample, which must have just been
+ * taken with cl, and stores the results after the counter values.
+ * prev_sample is used by delta() and rate() and may be NULL, in which case
+ * they are 0.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_STATS_SAMPLE_TOO_SMALL      - the sample cannot hold the derived values
+ */
+int stats_derived_evaluate(struct stats *stats, struct stats_derived *dv, struct stats_counter_list *cl,
+    struct stats_sample *sample, struct stats_sample *prev_sample)
+{
+    struct stats_derived_op *op, *end;
+    double stack[STATS_DERIVED_MAX_STACK];
+    double result[STATS_DERIVED_MAX];
+    double seconds = 0.0, a, b;
+    int i, sp, index;
+
+    if (stats == NULL || dv == NULL || cl == NULL || sample == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (sample->sample_count + dv->dv_count > sample->sample_capacity)
+        return ERROR_STATS_SAMPLE_TOO_SMALL;
+
+    if (dv->dv_seq_no != cl->cl_seq_no)
+        derived_bind(stats, dv, cl);
+
+    /* a sample which was never taken has no time */
+    if (prev_sample && prev_sample->sample_count > 0)
+        seconds = TIME_DELTA_TO_NANOS(prev_sample->sample_time, sample->sample_time) / 1000000000.0;
+
+    for (i = 0; i < dv->dv_count; i++)
+    {
+        sp = 0;
+        op = dv->dv_code + dv->dv_expr[i].de_code;
+        end = op + dv->dv_expr[i].de_code_len;
+
+        for (; op < end; op++)
+        {
+            switch (op->do_op)
+            {
+            case DERIVED_OP_CONST:
+                stack[sp++] = op->do_value;
+                break;
+            case DERIVED_OP_VALUE:
+                index = dv->dv_ref_index[op->do_arg];
+                stack[sp++] = index >= 0 ? stats_sample_get_double(sample, dv->dv_ref_flags[op->do_arg], index) : 0.0;
+                break;
+            case DERIVED_OP_DELTA:
+                index = dv->dv_ref_index[op->do_arg];
+                stack[sp++] = index >= 0 ? stats_sample_get_delta_double(sample, prev_sample, dv->dv_ref_flags[op->do_arg], index) : 0.0;
+                break;
+            case DERIVED_OP_RATE:
+                index = dv->dv_ref_index[op->do_arg];
+                stack[sp++] = index >= 0 && seconds > 0.0 ?
+                    stats_sample_get_delta_double(sample, prev_sample, dv->dv_ref_flags[op->do_arg], index) / seconds : 0.0;
+                break;
+            case DERIVED_OP_DERIVED:
+                stack[sp++] = result[dv->dv_ref_derived[op->do_arg]];
+                break;
+            case DERIVED_OP_NEG:
+                stack[sp-1] = -stack[sp-1];
+                break;
+            default:
+                b = stack[--sp];
+                a = stack[sp-1];
+                if (op->do_op == DERIVED_OP_ADD)
+                    stack[sp-1] = a + b;
+                else if (op->do_op == DERIVED_OP_SUB)
+                    stack[sp-1] = a - b;
+                else if (op->do_op == DERIVED_OP_MUL)
+                    stack[sp-1] = a * b;
+                else
+                    stack[sp-1] = b != 0.0 ? a / b : 0.0;
+                break;
+            }
+        }
+
+        result[i] = sp > 0 ? stack[0] : 0.0;
+        memcpy(&sample->sample_value[sample->sample_count + i].val64, &result[i], sizeof(double));
+    }
+
+    sample->sample_derived_count = dv->dv_count;
+    sample->sample_flags |= STATS_SAMPLE_FLAG_DERIVED_DOUBLE;
+
+    return S_OK;
+}
@@ -36,6 +36,20 @@ const char * error_message(int code)
 
     case ERROR_STATS_CANNOT_ALLOCATE_COUNTER:       return "ERROR_STATS_CANNOT_ALLOCATE_COUNTER";
     case ERROR_STATS_KEY_TOO_LONG:                  return "ERROR_STATS_KEY_TOO_LONG";
+    case ERROR_STATS_COUNTER_NOT_FOUND:             return "ERROR_STATS_COUNTER_NOT_FOUND";
+    case ERROR_STATS_SAMPLE_TOO_SMALL:              return "ERROR_STATS_SAMPLE_TOO_SMALL";
+    case ERROR_STATS_WRONG_COUNTER_TYPE:            return "ERROR_STATS_WRONG_COUNTER_TYPE";
+    case ERROR_STATS_CANNOT_ALLOCATE_SKETCH:        return "ERROR_STATS_CANNOT_ALLOCATE_SKETCH";
+    case ERROR_STATS_DERIVED_SYNTAX:                return "ERROR_STATS_DERIVED_SYNTAX";
+    case ERROR_STATS_DERIVED_TOO_LARGE:             return "ERROR_STATS_DERIVED_TOO_LARGE";
+    case ERROR_STATS_TOO_MANY_PROVIDERS:            return "ERROR_STATS_TOO_MANY_PROVIDERS";
+    case ERROR_STATS_PROVIDER_TIMEOUT:              return "ERROR_STATS_PROVIDER_TIMEOUT";
+    case ERROR_STATS_LAYOUT_VERSION:                return "ERROR_STATS_LAYOUT_VERSION";
+    case ERROR_STATS_LAYOUT_FEATURES:               return "ERROR_STATS_LAYOUT_FEATURES";
+    case ERROR_STATS_RECORD_IO:                     return "ERROR_STATS_RECORD_IO";
+    case ERROR_STATS_RECORD_FORMAT:                 return "ERROR_STATS_RECORD_FORMAT";
+    case ERROR_STATS_RECORD_END:                    return "ERROR_STATS_RECORD_END";
+    case ERROR_STATS_RESET_TIMEOUT:                 return "ERROR_STATS_RESET_TIMEOUT";
 
     }
     return "UNKNOWN_ERROR";
@@ -0,0 +1,497 @@
+/* merge.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/merge.h"
+#include "stats/hash.h"
+#include "stats/debug.h"
+
+#define MERGE_INITIAL_CAPACITY 256
+
+/* the flags which must match for counters to be merged */
+#define MERGE_TYPE_MASK ((CTR_FLAG_TYPE_MASK | (0xf << CTR_FLAG_FIXED_SHIFT)) & ~CTR_FLAG_PER_PROCESS)
+
+#define merge_value(m,k,s) ((m)->mg_value[(k) * STATS_MERGE_MAX_SOURCES + (s)])
+
+
+int stats_merge_create(struct stats_merge **m_out)
+{
+    struct stats_merge *m;
+
+    if (m_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    m = (struct stats_merge *) calloc(1, sizeof(struct stats_merge));
+    if (m == NULL)
+        return ERROR_MEMORY;
+
+    *m_out = m;
+
+    return S_OK;
+}
+
+void stats_merge_free(struct stats_merge *m)
+{
+    int i;
+
+    if (m == NULL)
+        return;
+
+    for (i = 0; i < m->mg_sources; i++)
+    {
+        stats_sample_free(m->mg_source[i]->ms_sample);
+        free(m->mg_source[i]);
+    }
+
+    free(m->mg_key);
+    free(m->mg_value);
+    free(m->mg_delta);
+    free(m->mg_dirty);
+    free(m->mg_is_dirty);
+    free(m->mg_hash);
+    free(m->mg_sum);
+    free(m->mg_min);
+    free(m->mg_max);
+    free(m);
+}
+
+/*
+ * stats_merge_add_source
+ *
+ * Adds a stats object to the merge. The stats must stay open while the
+ * merge is used. source_out is the index of the source, to pass to
+ * stats_sample_merge.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or there are already STATS_MERGE_MAX_SOURCES sources
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_merge_add_source(struct stats_merge *m, struct stats *stats, int *source_out)
+{
+    struct stats_merge_source *ms;
+    int err;
+
+    if (m == NULL || stats == NULL || m->mg_sources == STATS_MERGE_MAX_SOURCES)
+        return ERROR_INVALID_PARAMETERS;
+
+    ms = (struct stats_merge_source *) malloc(sizeof(struct stats_merge_source));
+    if (ms == NULL)
+        return ERROR_MEMORY;
+
+    err = stats_sample_create(&ms->ms_sample);
+    if (err != S_OK)
+    {
+        free(ms);
+        return err;
+    }
+
+    ms->ms_stats = stats;
+    ms->ms_seq_no = -1;
+    ms->ms_counters = 0;
+    ms->ms_reset_epoch = 0;
+    stats_cl_init(&ms->ms_cl);
+
+    if (source_out)
+        *source_out = m->mg_sources;
+    m->mg_source[m->mg_sources++] = ms;
+
+    return S_OK;
+}
+
+static int merge_probe(struct stats_merge *m, const char *key)
+{
+    int k;
+
+    for (k = fast_hash(key, strlen(key)) & (m->mg_hash_size - 1); m->mg_hash[k] != 0; k = (k + 1) & (m->mg_hash_size - 1))
+    {
+        if (strcmp(m->mg_key[m->mg_hash[k] - 1].mk_key, key) == 0)
+            break;
+    }
+
+    return k;
+}
+
+static int merge_grow_sample(struct stats_sample **sample, int capacity)
+{
+    struct stats_sample *s;
+
+    s = (struct stats_sample *) realloc(*sample, stats_sample_size_for(capacity));
+    if (s == NULL)
+        return ERROR_MEMORY;
+
+    if (*sample == NULL)
+        stats_sample_init(s, capacity);
+    s->sample_capacity = capacity;
+    *sample = s;
+
+    return S_OK;
+}
+
+/* doubles the key arrays and rebuilds the hash. the hash is kept at most half full */
+static int merge_grow(struct stats_merge *m)
+{
+    struct stats_merge_key *key;
+    long long *value, *delta;
+    int *dirty, *hash;
+    char *is_dirty;
+    int i, capacity;
+
+    capacity = m->mg_capacity ? m->mg_capacity * 2 : MERGE_INITIAL_CAPACITY;
+
+    key = (struct stats_merge_key *) realloc(m->mg_key, capacity * sizeof(struct stats_merge_key));
+    if (key == NULL)
+        return ERROR_MEMORY;
+    m->mg_key = key;
+
+    value = (long long *) realloc(m->mg_value, capacity * STATS_MERGE_MAX_SOURCES * sizeof(long long));
+    if (value == NULL)
+        return ERROR_MEMORY;
+    m->mg_value = value;
+
+    delta = (long long *) realloc(m->mg_delta, capacity * sizeof(long long));
+    if (delta == NULL)
+        return ERROR_MEMORY;
+    m->mg_delta = delta;
+
+    dirty = (int *) realloc(m->mg_dirty, capacity * sizeof(int));
+    if (dirty == NULL)
+        return ERROR_MEMORY;
+    m->mg_dirty = dirty;
+
+    is_dirty = (char *) realloc(m->mg_is_dirty, capacity);
+    if (is_dirty == NULL)
+        return ERROR_MEMORY;
+    m->mg_is_dirty = is_dirty;
+
+    if (merge_grow_sample(&m->mg_sum, capacity) != S_OK || merge_grow_sample(&m->mg_min, capacity) != S_OK ||
+        merge_grow_sample(&m->mg_max, capacity) != S_OK)
+        return ERROR_MEMORY;
+
+    hash = (int *) calloc(capacity * 2, sizeof(int));
+    if (hash == NULL)
+        return ERROR_MEMORY;
+
+    free(m->mg_hash);
+    m->mg_hash = hash;
+    m->mg_hash_size = capacity * 2;
+    m->mg_capacity = capacity;
+
+    for (i = 0; i < m->mg_count; i++)
+    {
+        m->mg_hash[merge_probe(m, m->mg_key[i].mk_key)] = i + 1;
+    }
+
+    return S_OK;
+}
+
+/* finds or adds the key of a counter. returns -1 in key_out if it is left out */
+static int merge_join_counter(struct stats_merge *m, struct stats_counter *ctr, int *key_out)
+{
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+    int k, key, flags, err;
+
+    *key_out = -1;
+
+    if (ctr->ctr_flags & CTR_FLAG_SKETCH_MASK)
+        return S_OK;
+
+    if (m->mg_count == m->mg_capacity)
+    {
+        err = merge_grow(m);
+        if (err != S_OK)
+            return err;
+    }
+
+    counter_get_key(ctr, counter_name, MAX_COUNTER_KEY_LENGTH+1);
+    flags = ctr->ctr_flags & MERGE_TYPE_MASK;
+
+    k = merge_probe(m, counter_name);
+    if (m->mg_hash[k] == 0)
+    {
+        key = m->mg_count++;
+        strcpy(m->mg_key[key].mk_key, counter_name);
+        m->mg_key[key].mk_flags = flags;
+        m->mg_key[key].mk_present = 0;
+        m->mg_is_dirty[key] = 0;
+        m->mg_delta[key] = 0;
+        m->mg_sum->sample_value[key].val64 = 0;
+        m->mg_min->sample_value[key].val64 = 0;
+        m->mg_max->sample_value[key].val64 = 0;
+        m->mg_hash[k] = key + 1;
+    }
+    else
+    {
+        key = m->mg_hash[k] - 1;
+        if (m->mg_key[key].mk_flags != flags)
+        {
+            DPRINTF("Not merging %s, it exists with another type\n", counter_name);
+            return S_OK;
+        }
+    }
+
+    *key_out = key;
+
+    return S_OK;
+}
+
+/* joins the counters added to a source's list since the last call */
+static int merge_join(struct stats_merge *m, int source, struct stats_counter_list *cl)
+{
+    struct stats_merge_source *ms = m->mg_source[source];
+    int i, key, err;
+
+    if (ms->ms_seq_no == cl->cl_seq_no && ms->ms_counters == cl->cl_count)
+        return S_OK;
+
+    /* a shorter list is not the list the source was joined from. start over */
+    if (cl->cl_count < ms->ms_counters)
+    {
+        for (i = 0; i < ms->ms_counters; i++)
+        {
+            key = ms->ms_key[i];
+            if (key >= 0)
+            {
+                m->mg_key[key].mk_present &= ~(1u << source);
+                if (!m->mg_is_dirty[key])
+                {
+                    m->mg_is_dirty[key] = 1;
+                    m->mg_dirty[m->mg_dirty_count++] = key;
+                }
+            }
+        }
+        ms->ms_counters = 0;
+    }
+
+    for (i = ms->ms_counters; i < cl->cl_count; i++)
+    {
+        err = merge_join_counter(m, stats_cl_get_counter(ms->ms_stats, cl, i), &ms->ms_key[i]);
+        if (err != S_OK)
+        {
+            ms->ms_counters = i;
+            return err;
+        }
+    }
+
+    DPRINTF("merge: source %d has %d counters, %d keys\n", source, cl->cl_count, m->mg_count);
+
+    ms->ms_counters = cl->cl_count;
+    ms->ms_seq_no = cl->cl_seq_no;
+
+    return S_OK;
+}
+
+/* adds the change of a source's value of a key from old to v (from 0 if
+   the source was reset) to the change of the key */
+static void merge_add_delta(struct stats_merge *m, int key, long long old, long long v, int reset)
+{
+    int flags = m->mg_key[key].mk_flags;
+    double d;
+
+    if (flags & CTR_FLAG_DOUBLE)
+    {
+        d = stats_value_to_double(flags, m->mg_delta[key]) + stats_value_to_double(flags, v);
+        if (!reset)
+            d -= stats_value_to_double(flags, old);
+        memcpy(&m->mg_delta[key], &d, sizeof(d));
+    }
+    else
+    {
+        m->mg_delta[key] += reset ? v : v - old;
+    }
+}
+
+/* recomputes the sum, minimum and maximum of a key over its sources */
+static void merge_compute(struct stats_merge *m, int key)
+{
+    struct stats_merge_key *mk = &m->mg_key[key];
+    long long v, sum = 0, min = 0, max = 0;
+    double d, dsum = 0.0, dmin = 0.0, dmax = 0.0;
+    int s, first = 1;
+
+    for (s = 0; s < m->mg_sources; s++)
+    {
+        if (!(mk->mk_present & (1u << s)))
+            continue;
+
+        v = merge_value(m, key, s);
+        if (mk->mk_flags & CTR_FLAG_DOUBLE)
+        {
+            d = stats_value_to_double(mk->mk_flags, v);
+            dsum += d;
+            if (first || d < dmin)
+                dmin = d;
+            if (first || d > dmax)
+                dmax = d;
+        }
+        else
+        {
+            sum += v;
+            if (first || v < min)
+                min = v;
+            if (first || v > max)
+                max = v;
+        }
+        first = 0;
+    }
+
+    if (mk->mk_flags & CTR_FLAG_DOUBLE)
+    {
+        memcpy(&sum, &dsum, sizeof(sum));
+        memcpy(&min, &dmin, sizeof(min));
+        memcpy(&max, &dmax, sizeof(max));
+    }
+
+    m->mg_sum->sample_value[key].val64 = sum;
+    m->mg_min->sample_value[key].val64 = min;
+    m->mg_max->sample_value[key].val64 = max;
+}
+
+/*
+ * stats_sample_merge
+ *
+ * Folds a sample of a source into the merged samples. sample must have
+ * been taken with cl from the stats of the source. New counters in cl are
+ * joined to the merged keys, and the keys whose value changed since the
+ * source was last merged are recomputed. The change of the source's
+ * values since it was last merged, or since its last reset if it was
+ * reset since, is added to the changes of the keys.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or source is not a source of the merge
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_sample_merge(struct stats_merge *m, int source, struct stats_counter_list *cl, struct stats_sample *sample)
+{
+    struct stats_merge_source *ms;
+    long long v;
+    int i, key, count, reset, present, err;
+
+    if (m == NULL || cl == NULL || sample == NULL || source < 0 || source >= m->mg_sources)
+        return ERROR_INVALID_PARAMETERS;
+
+    ms = m->mg_source[source];
+
+    err = merge_join(m, source, cl);
+    if (err != S_OK)
+        return err;
+
+    count = sample->sample_count < ms->ms_counters ? sample->sample_count : ms->ms_counters;
+
+    /* a value the source did not have before has no change */
+    reset = sample->sample_reset_epoch != ms->ms_reset_epoch;
+
+    for (i = 0; i < count; i++)
+    {
+        key = ms->ms_key[i];
+        if (key < 0)
+            continue;
+
+        v = sample->sample_value[i].val64;
+        present = m->mg_key[key].mk_present & (1u << source);
+        if (present && !reset && merge_value(m, key, source) == v)
+            continue;
+
+        if (present)
+            merge_add_delta(m, key, merge_value(m, key, source), v, reset);
+
+        m->mg_key[key].mk_present |= 1u << source;
+        merge_value(m, key, source) = v;
+        if (!m->mg_is_dirty[key])
+        {
+            m->mg_is_dirty[key] = 1;
+            m->mg_dirty[m->mg_dirty_count++] = key;
+        }
+    }
+
+    for (i = 0; i < m->mg_dirty_count; i++)
+    {
+        key = m->mg_dirty[i];
+        merge_compute(m, key);
+        m->mg_is_dirty[key] = 0;
+    }
+
+    DPRINTF("merge: source %d changed %d keys\n", source, m->mg_dirty_count);
+    m->mg_dirty_count = 0;
+
+    /* the epoch of the merged samples is the sum of the source epochs,
+       which only grow */
+    m->mg_sum->sample_reset_epoch += sample->sample_reset_epoch - ms->ms_reset_epoch;
+    ms->ms_reset_epoch = sample->sample_reset_epoch;
+
+    if (sample->sample_time > m->mg_sum->sample_time)
+        m->mg_sum->sample_time = sample->sample_time;
+    m->mg_sum->sample_seq_no = m->mg_count;
+    m->mg_sum->sample_count = m->mg_count;
+
+    m->mg_min->sample_seq_no = m->mg_max->sample_seq_no = m->mg_sum->sample_seq_no;
+    m->mg_min->sample_count = m->mg_max->sample_count = m->mg_sum->sample_count;
+    m->mg_min->sample_time = m->mg_max->sample_time = m->mg_sum->sample_time;
+    m->mg_min->sample_reset_epoch = m->mg_max->sample_reset_epoch = m->mg_sum->sample_reset_epoch;
+
+    return S_OK;
+}
+
+/*
+ * stats_merge_update
+ *
+ * Takes a sample of every source and merges it, after starting the
+ * changes of the keys over.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - m is NULL
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_merge_update(struct stats_merge *m)
+{
+    struct stats_merge_source *ms;
+    int i, err;
+
+    if (m == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    stats_merge_clear_deltas(m);
+
+    for (i = 0; i < m->mg_sources; i++)
+    {
+        ms = m->mg_source[i];
+
+        err = stats_get_sample(ms->ms_stats, &ms->ms_cl, ms->ms_sample);
+        if (err != S_OK)
+            return err;
+
+        err = stats_sample_merge(m, i, &ms->ms_cl, ms->ms_sample);
+        if (err != S_OK)
+            return err;
+    }
+
+    return S_OK;
+}
+
+/* returns the index of a merged key, or -1 */
+int stats_merge_find(struct stats_merge *m, const char *key)
+{
+    int k;
+
+    if (m == NULL || key == NULL || m->mg_count == 0)
+        return -1;
+
+    k = merge_probe(m, key);
+
+    return m->mg_hash[k] - 1;
+}
+
+/* starts the changes of the keys over */
+void stats_merge_clear_deltas(struct stats_merge *m)
+{
+    if (m == NULL || m->mg_count == 0)
+        return;
+
+    memset(m->mg_delta, 0, m->mg_count * sizeof(long long));
+}
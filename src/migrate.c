@@ -0,0 +1,169 @@
+/* migrate.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/migrate.h"
+#include "stats/debug.h"
+
+/* the ctr_flags bits which describe the type, without the sketch or breakdown index */
+#define MIGRATE_TYPE_FLAGS(f) ((f) & ((1 << CTR_FLAG_SKETCH_SHIFT) - 1))
+
+
+int stats_migration_create(struct stats_migration **mg_out)
+{
+    struct stats_migration *mg;
+
+    if (mg_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    mg = (struct stats_migration *) malloc(sizeof(struct stats_migration));
+    if (mg == NULL)
+        return ERROR_MEMORY;
+
+    memset(mg, 0, sizeof(struct stats_migration));
+
+    if (stats_sample_create(&mg->mg_copied) != S_OK || stats_sample_create(&mg->mg_sample) != S_OK)
+    {
+        stats_migration_free(mg);
+        return ERROR_MEMORY;
+    }
+
+    *mg_out = mg;
+
+    return S_OK;
+}
+
+void stats_migration_free(struct stats_migration *mg)
+{
+    if (mg == NULL)
+        return;
+
+    if (mg->mg_copied)
+        stats_sample_free(mg->mg_copied);
+    if (mg->mg_sample)
+        stats_sample_free(mg->mg_sample);
+    free(mg);
+}
+
+/* finds or creates the counter in to with the name and type of src */
+static int migrate_allocate(struct stats *to, struct stats_counter *src, struct stats_counter **ctr_out)
+{
+    char key[MAX_COUNTER_KEY_LENGTH + 1];
+    struct stats_hll *hll;
+    int err;
+
+    counter_get_key(src, key, sizeof(key));
+
+    if (src->ctr_flags & CTR_FLAG_HLL)
+    {
+        err = stats_allocate_hll(to, key, &hll);
+        if (err != S_OK)
+            return err;
+        return stats_find_counter(to, key, ctr_out);
+    }
+
+    if (src->ctr_flags & CTR_FLAG_PER_PROCESS)
+        return stats_allocate_per_process_counter(to, key, ctr_out);
+
+    return stats_allocate_counter_with_flags(to, key, MIGRATE_TYPE_FLAGS(src->ctr_flags), ctr_out);
+}
+
+/*
+ * stats_migrate
+ *
+ * Copies the counters of from into to, as described in migrate.h. mg
+ * keeps what was copied between calls and must only be used with the
+ * same pair of stats.
+ *
+ * Returns:
+ *    S_OK                              - success, with the number of counters copied in *migrated_out
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or a stats is not open
+ *    any error returned by stats_get_sample, stats_allocate_counter or stats_sketch_merge
+ */
+int stats_migrate(struct stats *from, struct stats *to, struct stats_migration *mg, int *migrated_out)
+{
+    struct stats_counter *src, *ctr;
+    long long value, prev;
+    int i, n = 0, err, flags, fresh;
+
+    if (from == NULL || to == NULL || mg == NULL || from->data == NULL || to->data == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = stats_get_sample(from, &mg->mg_cl, mg->mg_sample);
+    if (err != S_OK)
+        return err;
+
+    /* copy whole values the first time and after from was reset */
+    fresh = mg->mg_copied->sample_count == 0 || mg->mg_copied->sample_reset_epoch != mg->mg_sample->sample_reset_epoch;
+
+    for (i = 0; i < mg->mg_sample->sample_count; i++)
+    {
+        src = stats_cl_get_counter(from, &mg->mg_cl, i);
+        flags = src->ctr_flags;
+
+        /* only HLL sketches can be merged again on every call */
+        if ((flags & CTR_FLAG_SKETCH_MASK) && !(flags & CTR_FLAG_HLL))
+            continue;
+
+        if (!mg->mg_looked_up[i])
+        {
+            err = migrate_allocate(to, src, mg->mg_ctr + i);
+            if (err == ERROR_STATS_WRONG_COUNTER_TYPE)
+            {
+                DPRINTF("Not migrating %.*s, it exists with another type\n", src->ctr_key_len, src->ctr_key);
+            }
+            else if (err != S_OK)
+            {
+                return err;
+            }
+            mg->mg_looked_up[i] = 1;
+        }
+
+        ctr = mg->mg_ctr[i];
+        if (ctr == NULL)
+            continue;
+
+        value = stats_sample_get_value(mg->mg_sample, i);
+
+        if (flags & CTR_FLAG_HLL)
+        {
+            err = stats_sketch_merge(to, ctr, from, src);
+            if (err != S_OK)
+                return err;
+        }
+        else if (flags & CTR_FLAG_GAUGE)
+        {
+            if (flags & CTR_FLAG_DOUBLE)
+                counter_set_double(ctr, stats_value_to_double(flags, value));
+            else
+                counter_set(ctr, value);
+        }
+        else
+        {
+            prev = (fresh || i >= mg->mg_copied->sample_count) ? 0 : stats_sample_get_value(mg->mg_copied, i);
+
+            if (flags & CTR_FLAG_DOUBLE)
+            {
+                if (value != prev)
+                    counter_add_double(ctr, stats_value_to_double(flags, value) - stats_value_to_double(flags, prev));
+            }
+            else if (value != prev)
+            {
+                counter_increment_by(ctr, value - prev);
+            }
+        }
+
+        n++;
+    }
+
+    stats_sample_copy(mg->mg_copied, mg->mg_sample);
+
+    if (migrated_out)
+        *migrated_out = n;
+
+    return S_OK;
+}
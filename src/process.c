@@ -0,0 +1,414 @@
+/* process.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/debug.h"
+
+/*
+ * As in the profiler, the write path only has a pointer to the counter,
+ * so this process keeps a small table of the stats data it has attached
+ * and the process table entry it claimed in each.
+ *
+ * ap_slot is the claimed entry + 1, 0 if the entry must be claimed on the
+ * next write (in a forked child) and -1 if the process table was full.
+ * ap_value holds the columns of a process with no entry, and ap_epoch is
+ * the reset epoch they were written in: a reset zeroes them.
+ */
+
+#define PROCESS_MAX_ATTACHED 16
+
+struct attached_process
+{
+    struct stats_data *ap_data;
+    int ap_slot;
+    int ap_epoch;
+    long long ap_value[STATS_BREAKDOWN_TABLE_SIZE];
+};
+
+static struct attached_process attached[PROCESS_MAX_ATTACHED];
+static pthread_once_t process_atfork_once = PTHREAD_ONCE_INIT;
+
+
+static void process_atfork_child()
+{
+    int i;
+
+    for (i = 0; i < PROCESS_MAX_ATTACHED; i++)
+    {
+        if (attached[i].ap_data)
+        {
+            attached[i].ap_slot = 0;
+            memset(attached[i].ap_value, 0, sizeof(attached[i].ap_value));
+        }
+    }
+}
+
+static void process_register_atfork()
+{
+    pthread_atfork(NULL, NULL, process_atfork_child);
+}
+
+/* frees the process table entries of processes which have exited */
+static void process_reclaim(struct stats_data *data)
+{
+    int i, pid;
+
+    for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+    {
+        pid = data->process[i].proc_pid;
+        if (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH)
+        {
+            DPRINTF("Reclaiming process table entry %d of exited process %d\n", i, pid);
+            __sync_bool_compare_and_swap(&data->process[i].proc_pid, pid, 0);
+        }
+    }
+}
+
+/*
+ * process_claim
+ *
+ * Returns the process table entry of this process, claiming a free entry
+ * if it has none, or -1 if the table is full. The same stats can be
+ * opened more than once, so attachments are counted in proc_refs.
+ */
+static int process_claim(struct stats_data *data)
+{
+    int i, j, pid = getpid();
+
+    process_reclaim(data);
+
+    for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+    {
+        if (data->process[i].proc_pid == pid)
+        {
+            __sync_fetch_and_add(&data->process[i].proc_refs, 1);
+            return i;
+        }
+    }
+
+    for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+    {
+        if (data->process[i].proc_pid == 0 && __sync_bool_compare_and_swap(&data->process[i].proc_pid, 0, pid))
+        {
+            data->process[i].proc_refs = 1;
+            data->process[i].proc_providers = 0;
+
+            /* the columns may hold the values of the entry's last owner */
+            for (j = 0; j < STATS_BREAKDOWN_TABLE_SIZE; j++)
+                __sync_lock_test_and_set(&data->breakdown[j].bd_value[i], 0ll);
+
+            return i;
+        }
+    }
+
+    DPRINTF("Process table is full, not attributing writes of process %d\n", pid);
+
+    return -1;
+}
+
+static void process_release(struct stats_data *data, int slot)
+{
+    if (__sync_sub_and_fetch(&data->process[slot].proc_refs, 1) <= 0)
+        __sync_bool_compare_and_swap(&data->process[slot].proc_pid, getpid(), 0);
+}
+
+void stats_process_attach(struct stats_data *data)
+{
+    int i;
+
+    pthread_once(&process_atfork_once, process_register_atfork);
+
+    for (i = 0; i < PROCESS_MAX_ATTACHED; i++)
+    {
+        if (__sync_bool_compare_and_swap(&attached[i].ap_data, NULL, data))
+        {
+            memset(attached[i].ap_value, 0, sizeof(attached[i].ap_value));
+            attached[i].ap_epoch = data->hdr.stats_reset_epoch;
+            attached[i].ap_slot = process_claim(data) + 1;
+            if (attached[i].ap_slot == 0)
+                attached[i].ap_slot = -1;
+            return;
+        }
+    }
+
+    DPRINTF("Too many attached stats, not attributing writes to 0x%016lx\n", (intptr_t) data);
+}
+
+void stats_process_detach(struct stats_data *data)
+{
+    int i;
+
+    for (i = 0; i < PROCESS_MAX_ATTACHED; i++)
+    {
+        if (attached[i].ap_data == data)
+        {
+            if (attached[i].ap_slot > 0)
+                process_release(data, attached[i].ap_slot - 1);
+            attached[i].ap_slot = 0;
+            __sync_bool_compare_and_swap(&attached[i].ap_data, data, NULL);
+        }
+    }
+}
+
+/* returns this process's entry in the process table of an attached
+   data, claiming it in a forked child, or -1 if it has none */
+static int process_slot(struct attached_process *ap)
+{
+    if (ap->ap_slot == 0)
+    {
+        ap->ap_slot = process_claim(ap->ap_data) + 1;
+        if (ap->ap_slot == 0)
+            ap->ap_slot = -1;
+    }
+
+    return ap->ap_slot - 1;
+}
+
+/* returns the column kept in the process, for a process with no entry */
+static long long *process_local_column(struct attached_process *ap, int index)
+{
+    int epoch = ap->ap_data->hdr.stats_reset_epoch;
+
+    if (epoch != ap->ap_epoch)
+    {
+        memset(ap->ap_value, 0, sizeof(ap->ap_value));
+        ap->ap_epoch = epoch;
+    }
+
+    return ap->ap_value + index;
+}
+
+/* returns the column of ctr written by this process, or NULL */
+static long long *process_column(struct stats_counter *ctr)
+{
+    struct attached_process *ap;
+    struct stats_data *data;
+    int i, index, slot;
+
+    for (i = 0; i < PROCESS_MAX_ATTACHED; i++)
+    {
+        ap = attached + i;
+        data = ap->ap_data;
+        if (data != NULL && ctr >= data->ctr && ctr < data->ctr + COUNTER_TABLE_SIZE)
+            break;
+    }
+
+    if (i == PROCESS_MAX_ATTACHED)
+        return NULL;
+
+    slot = process_slot(ap);
+    index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+    if (index < 0 || index >= STATS_BREAKDOWN_TABLE_SIZE)
+        return NULL;
+
+    if (slot < 0)
+        return process_local_column(ap, index);
+
+    return data->breakdown[index].bd_value + slot;
+}
+
+void stats_process_add(struct stats_counter *ctr, long long val)
+{
+    long long *column = process_column(ctr);
+
+    if (column)
+        __sync_fetch_and_add(column, val);
+}
+
+/*
+ * stats_process_set
+ *
+ * Sets this process's column of ctr and moves the total by the same
+ * amount, so the total stays the sum of the columns (and of the columns
+ * kept by processes with no entry).
+ */
+void stats_process_set(struct stats_counter *ctr, long long val)
+{
+    long long *column = process_column(ctr);
+    long long old;
+
+    if (column == NULL)
+    {
+        __sync_lock_test_and_set(&ctr->ctr_value.val64, val);
+        return;
+    }
+
+    old = __sync_lock_test_and_set(column, val);
+    __sync_fetch_and_add(&ctr->ctr_value.val64, val - old);
+}
+
+/*
+ * stats_process_add_provider
+ *
+ * Adds delta to the number of provider threads this process runs for
+ * data, kept in its process table entry.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_STATS_TOO_MANY_PROVIDERS    - the process has no entry (the process table is full)
+ */
+int stats_process_add_provider(struct stats_data *data, int delta)
+{
+    int i, slot;
+
+    for (i = 0; i < PROCESS_MAX_ATTACHED; i++)
+    {
+        if (attached[i].ap_data == data)
+            break;
+    }
+
+    if (i == PROCESS_MAX_ATTACHED || (slot = process_slot(attached + i)) < 0)
+        return ERROR_STATS_TOO_MANY_PROVIDERS;
+
+    __sync_fetch_and_add(&data->process[slot].proc_providers, delta);
+
+    return S_OK;
+}
+
+/*
+ * stats_process_count_providers
+ *
+ * Returns the number of provider threads of the processes in the process
+ * table, reclaiming the entries of processes with providers which have
+ * exited, so a process killed without calling stats_close is not waited
+ * for.
+ */
+int stats_process_count_providers(struct stats_data *data)
+{
+    int i, pid, n, providers = 0;
+
+    for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+    {
+        n = data->process[i].proc_providers;
+        pid = data->process[i].proc_pid;
+        if (n <= 0 || pid == 0)
+            continue;
+
+        if (kill(pid, 0) == -1 && errno == ESRCH)
+        {
+            DPRINTF("Reclaiming process table entry %d of exited provider process %d\n", i, pid);
+            if (__sync_bool_compare_and_swap(&data->process[i].proc_pid, pid, 0))
+                data->process[i].proc_providers = 0;
+            continue;
+        }
+
+        providers += n;
+    }
+
+    return providers;
+}
+
+void stats_breakdown_clear(struct stats_data *data, struct stats_counter *ctr)
+{
+    int i, index;
+
+    index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+    if (index < 0 || index >= STATS_BREAKDOWN_TABLE_SIZE)
+        return;
+
+    for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+        __sync_lock_test_and_set(&data->breakdown[index].bd_value[i], 0ll);
+}
+
+/*
+ * stats_allocate_per_process_counter
+ *
+ * Allocates (or finds) the 64 bit counter named name and binds it to a
+ * breakdown entry, with compare-and-swap as sketches are.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - a counter with that name exists and is not per-process
+ *    ERROR_STATS_CANNOT_ALLOCATE_SKETCH - all of the breakdown entries are in use
+ *    any error returned by stats_allocate_counter
+ */
+int stats_allocate_per_process_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out)
+{
+    struct stats_counter *ctr = NULL;
+    struct stats_breakdown *bd;
+    int err, i, type = CTR_FLAG_PER_PROCESS | CTR_FLAG_64BIT;
+
+    if (ctr_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = stats_allocate_counter_with_flags(stats, name, type, &ctr);
+    if (err != S_OK)
+        return err;
+
+    if ((((unsigned int) ctr->ctr_flags) >> CTR_FLAG_SKETCH_SHIFT) == 0)
+    {
+        for (i = 0; i < STATS_BREAKDOWN_TABLE_SIZE; i++)
+        {
+            bd = stats->data->breakdown + i;
+            if (bd->bd_allocated == 0 && __sync_bool_compare_and_swap(&bd->bd_allocated, 0, 1))
+                break;
+        }
+
+        if (i == STATS_BREAKDOWN_TABLE_SIZE)
+            return ERROR_STATS_CANNOT_ALLOCATE_SKETCH;
+
+        memset(bd->bd_value, 0, sizeof(bd->bd_value));
+
+        if (!__sync_bool_compare_and_swap(&ctr->ctr_flags, type, type | ((i + 1) << CTR_FLAG_SKETCH_SHIFT)))
+        {
+            /* another process bound the counter first. give back our entry */
+            __sync_lock_release(&bd->bd_allocated);
+        }
+    }
+
+    *ctr_out = ctr;
+
+    return S_OK;
+}
+
+/*
+ * stats_counter_get_breakdown
+ *
+ * Copies the pid and column of each process in the process table, up to
+ * max_values of them, for the per-process counter ctr.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or stats is not open
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - ctr is not a per-process counter
+ */
+int stats_counter_get_breakdown(struct stats *stats, struct stats_counter *ctr, struct stats_process_value *values,
+    int max_values, int *count_out)
+{
+    struct stats_data *data;
+    int i, n = 0, pid, index;
+
+    if (stats == NULL || stats->data == NULL || ctr == NULL || values == NULL || count_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+    if (!(ctr->ctr_flags & CTR_FLAG_PER_PROCESS) || index < 0 || index >= STATS_BREAKDOWN_TABLE_SIZE)
+        return ERROR_STATS_WRONG_COUNTER_TYPE;
+
+    data = stats->data;
+    process_reclaim(data);
+
+    for (i = 0; i < STATS_PROCESS_TABLE_SIZE && n < max_values; i++)
+    {
+        pid = data->process[i].proc_pid;
+        if (pid == 0)
+            continue;
+
+        values[n].pv_pid = pid;
+        values[n].pv_reserved = 0;
+        values[n].pv_value = data->breakdown[index].bd_value[i];
+        n++;
+    }
+
+    *count_out = n;
+
+    return S_OK;
+}
@@ -0,0 +1,107 @@
+/* profile.c */
+
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/debug.h"
+
+/*
+ * The write path only has a pointer to the counter, so the profiler keeps
+ * a small table of the stats data attached by this process to find the
+ * side table entry that belongs to a counter.
+ */
+
+#define STATS_PROFILE_MAX_ATTACHED 16
+
+static struct stats_data *attached_data[STATS_PROFILE_MAX_ATTACHED];
+
+__thread int stats_profile_countdown = STATS_PROFILE_SAMPLE_RATE;
+
+
+void stats_profile_attach(struct stats_data *data)
+{
+#if STATS_PROFILE
+    int i;
+
+    for (i = 0; i < STATS_PROFILE_MAX_ATTACHED; i++)
+    {
+        if (__sync_bool_compare_and_swap(&attached_data[i], NULL, data))
+            return;
+    }
+
+    DPRINTF("profile: too many attached stats, not profiling 0x%016lx\n", (intptr_t) data);
+#endif
+}
+
+void stats_profile_detach(struct stats_data *data)
+{
+#if STATS_PROFILE
+    int i;
+
+    for (i = 0; i < STATS_PROFILE_MAX_ATTACHED; i++)
+    {
+        __sync_bool_compare_and_swap(&attached_data[i], data, NULL);
+    }
+#endif
+}
+
+static int current_cpu()
+{
+#ifdef LINUX
+    return sched_getcpu();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * stats_profile_write
+ *
+ * Records a sampled write to ctr. Called from the counter write functions
+ * when the thread's countdown expires.
+ */
+void stats_profile_write(struct stats_counter *ctr)
+{
+    struct stats_data *data;
+    struct stats_profile_entry *e;
+    long long now, writes;
+    int i, cpu, last_cpu;
+
+    stats_profile_countdown = STATS_PROFILE_SAMPLE_RATE;
+
+    for (i = 0; i < STATS_PROFILE_MAX_ATTACHED; i++)
+    {
+        data = attached_data[i];
+        if (data != NULL && ctr >= data->ctr && ctr < data->ctr + COUNTER_TABLE_SIZE)
+            break;
+    }
+
+    if (i == STATS_PROFILE_MAX_ATTACHED)
+        return;
+
+    e = data->prof.prof_entry + (ctr - data->ctr);
+    now = current_time();
+    cpu = current_cpu();
+    if (cpu < 0)
+        cpu = 0;
+
+    if (data->prof.prof_sample_rate != STATS_PROFILE_SAMPLE_RATE)
+        data->prof.prof_sample_rate = STATS_PROFILE_SAMPLE_RATE;
+
+    writes = __sync_fetch_and_add(&e->prof_writes, 1ll);
+    last_cpu = __sync_lock_test_and_set(&e->prof_last_cpu, cpu);
+    if (writes > 0 && last_cpu != cpu)
+        __sync_fetch_and_add(&e->prof_cpu_switches, 1ll);
+
+    __sync_fetch_and_or(&e->prof_cpu_mask, 1ull << (cpu % 64));
+    __sync_bool_compare_and_swap(&e->prof_first_time, 0ll, now);
+    __sync_lock_test_and_set(&e->prof_last_time, now);
+}
@@ -0,0 +1,335 @@
+/* provider.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/debug.h"
+
+/* how long the provider thread sleeps before checking if it was stopped */
+#define PROVIDER_THREAD_WAIT_US     1000000
+
+struct provider_entry
+{
+    struct stats_counter *pe_ctr;
+    stats_provider_fn pe_fn;
+    void *pe_arg;
+};
+
+/* the providers registered by this process
+ *
+ * sp_mutex protects sp_entry and sp_count against the provider thread.
+ * sp_seen is the last db_request the provider thread has handled.
+ * sp_pid is the process which started the thread. A child created with
+ *      fork has a copy of this struct but no provider thread.
+ */
+struct stats_providers
+{
+    pthread_mutex_t sp_mutex;
+    pthread_t sp_thread;
+    pid_t sp_pid;
+    volatile int sp_running;
+    int sp_seen;
+    int sp_count;
+    struct provider_entry sp_entry[STATS_PROVIDER_MAX];
+};
+
+
+/* waits up to timeout_us for *addr to change from value */
+static void doorbell_wait(volatile int *addr, int value, long timeout_us)
+{
+#ifdef LINUX
+    struct timespec ts;
+
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+    if (*addr == value)
+        usleep(timeout_us < STATS_PROVIDER_POLL_US ? timeout_us : STATS_PROVIDER_POLL_US);
+#endif
+}
+
+static void doorbell_wake(volatile int *addr)
+{
+#ifdef LINUX
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void providers_refresh(struct stats_providers *sp)
+{
+    struct provider_entry *pe;
+    int i;
+
+    pthread_mutex_lock(&sp->sp_mutex);
+    for (i = 0; i < sp->sp_count; i++)
+    {
+        pe = sp->sp_entry + i;
+        counter_set(pe->pe_ctr, pe->pe_fn(pe->pe_arg));
+    }
+    pthread_mutex_unlock(&sp->sp_mutex);
+}
+
+static void *provider_thread(void *arg)
+{
+    struct stats *stats = (struct stats *) arg;
+    struct stats_providers *sp = stats->providers;
+    struct stats_doorbell *db = &stats->data->doorbell;
+    int request;
+
+    while (sp->sp_running)
+    {
+        doorbell_wait(&db->db_request, sp->sp_seen, PROVIDER_THREAD_WAIT_US);
+
+        request = db->db_request;
+        if (!sp->sp_running || request == sp->sp_seen)
+            continue;
+
+        sp->sp_seen = request;
+        providers_refresh(sp);
+
+        __sync_fetch_and_add(&db->db_completed, 1);
+        doorbell_wake(&db->db_completed);
+    }
+
+    return NULL;
+}
+
+static int providers_start(struct stats *stats)
+{
+    struct stats_providers *sp;
+    struct stats_doorbell *db = &stats->data->doorbell;
+    int err;
+
+    sp = (struct stats_providers *) malloc(sizeof(struct stats_providers));
+    if (sp == NULL)
+        return ERROR_MEMORY;
+
+    memset(sp, 0, sizeof(struct stats_providers));
+    pthread_mutex_init(&sp->sp_mutex, NULL);
+    sp->sp_running = 1;
+    sp->sp_pid = getpid();
+
+    /* read the request before counting this process, so any reader which
+     * counts it rings after the value the thread starts waiting on
+     */
+    sp->sp_seen = db->db_request;
+    __sync_synchronize();
+    err = stats_process_add_provider(stats->data, 1);
+    if (err != S_OK)
+    {
+        pthread_mutex_destroy(&sp->sp_mutex);
+        free(sp);
+        return err;
+    }
+
+    stats->providers = sp;
+
+    if (pthread_create(&sp->sp_thread, NULL, provider_thread, stats) != 0)
+    {
+        stats_process_add_provider(stats->data, -1);
+        stats->providers = NULL;
+        pthread_mutex_destroy(&sp->sp_mutex);
+        free(sp);
+        return ERROR_FAIL;
+    }
+
+    DPRINTF("Started provider thread\n");
+
+    return S_OK;
+}
+
+void stats_providers_stop(struct stats *stats)
+{
+    struct stats_providers *sp = stats->providers;
+
+    if (sp == NULL)
+        return;
+
+    if (sp->sp_pid == getpid())
+    {
+        sp->sp_running = 0;
+        doorbell_wake(&stats->data->doorbell.db_request);
+        pthread_join(sp->sp_thread, NULL);
+
+        stats_process_add_provider(stats->data, -1);
+    }
+
+    pthread_mutex_destroy(&sp->sp_mutex);
+    free(sp);
+    stats->providers = NULL;
+}
+
+/*
+ * stats_provider_register
+ *
+ * Registers fn to compute the value of the gauge ctr. fn(arg) is called on
+ * the provider thread whenever a reader asks for a fresh sample, and the
+ * value it returns is stored in ctr. Registering a counter again replaces
+ * its provider.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or stats is not open
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - ctr is not a CTR_FLAG_GAUGE counter
+ *    ERROR_STATS_TOO_MANY_PROVIDERS    - STATS_PROVIDER_MAX providers are already registered, or
+ *                                        the process has no process table entry to count its thread in
+ *    ERROR_MEMORY, ERROR_FAIL          - the provider thread could not be started
+ */
+int stats_provider_register(struct stats *stats, struct stats_counter *ctr, stats_provider_fn fn, void *arg)
+{
+    struct stats_providers *sp;
+    struct provider_entry *pe = NULL;
+    int i, err;
+
+    if (stats == NULL || stats->data == NULL || ctr == NULL || fn == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (!(ctr->ctr_flags & CTR_FLAG_GAUGE))
+        return ERROR_STATS_WRONG_COUNTER_TYPE;
+
+    if (stats->providers == NULL)
+    {
+        err = providers_start(stats);
+        if (err != S_OK)
+            return err;
+    }
+
+    sp = stats->providers;
+
+    pthread_mutex_lock(&sp->sp_mutex);
+
+    for (i = 0; i < sp->sp_count; i++)
+    {
+        if (sp->sp_entry[i].pe_ctr == ctr)
+            pe = sp->sp_entry + i;
+    }
+
+    if (pe == NULL && sp->sp_count < STATS_PROVIDER_MAX)
+        pe = sp->sp_entry + sp->sp_count++;
+
+    if (pe)
+    {
+        pe->pe_ctr = ctr;
+        pe->pe_fn = fn;
+        pe->pe_arg = arg;
+    }
+
+    pthread_mutex_unlock(&sp->sp_mutex);
+
+    return pe ? S_OK : ERROR_STATS_TOO_MANY_PROVIDERS;
+}
+
+/*
+ * stats_provider_unregister
+ *
+ * Removes the provider of ctr. Once this returns the provider will not be
+ * called again.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_STATS_COUNTER_NOT_FOUND     - ctr has no provider
+ */
+int stats_provider_unregister(struct stats *stats, struct stats_counter *ctr)
+{
+    struct stats_providers *sp;
+    int i, err = ERROR_STATS_COUNTER_NOT_FOUND;
+
+    if (stats == NULL || ctr == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    sp = stats->providers;
+    if (sp == NULL)
+        return ERROR_STATS_COUNTER_NOT_FOUND;
+
+    pthread_mutex_lock(&sp->sp_mutex);
+
+    for (i = 0; i < sp->sp_count; i++)
+    {
+        if (sp->sp_entry[i].pe_ctr == ctr)
+        {
+            sp->sp_entry[i] = sp->sp_entry[--sp->sp_count];
+            err = S_OK;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sp->sp_mutex);
+
+    return err;
+}
+
+/*
+ * stats_refresh_providers
+ *
+ * Rings the doorbell and waits up to timeout_ms for every process with
+ * providers to refresh its gauges. Returns immediately if there are no
+ * providers.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - stats is not open
+ *    ERROR_STATS_PROVIDER_TIMEOUT      - not every process refreshed in time
+ */
+int stats_refresh_providers(struct stats *stats, int timeout_ms)
+{
+    struct stats_doorbell *db;
+    long long start_time, remaining;
+    int providers, completed, start;
+
+    if (stats == NULL || stats->data == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    db = &stats->data->doorbell;
+
+    providers = stats_process_count_providers(stats->data);
+    if (providers <= 0)
+        return S_OK;
+
+    start = db->db_completed;
+    __sync_synchronize();
+
+    __sync_fetch_and_add(&db->db_request, 1);
+    doorbell_wake(&db->db_request);
+
+    start_time = current_time();
+
+    /* a refresh started for a concurrent reader also counts */
+    while ((completed = db->db_completed) - start < providers)
+    {
+        remaining = timeout_ms * 1000000ll - TIME_DELTA_TO_NANOS(start_time, current_time());
+        if (remaining <= 0)
+            return ERROR_STATS_PROVIDER_TIMEOUT;
+
+        doorbell_wait(&db->db_completed, completed, (long)(remaining / 1000));
+    }
+
+    return S_OK;
+}
+
+/*
+ * stats_get_fresh_sample
+ *
+ * Same as stats_get_sample, after asking the providers to refresh their
+ * gauges. If the providers time out the sample is still taken, with the
+ * gauges that were not refreshed holding their previous values.
+ */
+int stats_get_fresh_sample(struct stats *stats, struct stats_counter_list *cl, struct stats_sample *sample)
+{
+    stats_refresh_providers(stats, STATS_PROVIDER_TIMEOUT_MS);
+
+    return stats_get_sample(stats, cl, sample);
+}
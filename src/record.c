@@ -0,0 +1,678 @@
+/* record.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/record.h"
+#include "stats/debug.h"
+
+#define zigzag(v) ((((unsigned long long)(v)) << 1) ^ (unsigned long long)((long long)(v) >> 63))
+#define unzigzag(u) ((long long)((u) >> 1) ^ -(long long)((u) & 1))
+
+/* room for PATH.N */
+#define RECORD_FILE_PATH_SIZE (MAX_PATH + 16)
+
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+static int get_varint(const unsigned char **pp, const unsigned char *end, unsigned long long *v_out)
+{
+    const unsigned char *p = *pp;
+    unsigned long long v = 0;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+            return ERROR_STATS_RECORD_FORMAT;
+        v |= (unsigned long long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+        {
+            *pp = p;
+            *v_out = v;
+            return S_OK;
+        }
+    }
+
+    return ERROR_STATS_RECORD_FORMAT;
+}
+
+static void record_file_path(const char *path, int file, char *buf)
+{
+    snprintf(buf, RECORD_FILE_PATH_SIZE, "%s.%d", path, file);
+}
+
+/* reads the header of a recording file. returns ERROR_STATS_RECORD_IO if it does not exist */
+static int record_read_header(const char *path, int file, struct stats_record_header *hdr)
+{
+    char file_path[RECORD_FILE_PATH_SIZE];
+    int fd, n;
+
+    record_file_path(path, file, file_path);
+
+    fd = open(file_path, O_RDONLY);
+    if (fd == -1)
+        return ERROR_STATS_RECORD_IO;
+
+    n = pread(fd, hdr, sizeof(struct stats_record_header), 0);
+    close(fd);
+
+    if (n != sizeof(struct stats_record_header) || hdr->rf_magic != STATS_RECORD_MAGIC ||
+        hdr->rf_version != STATS_RECORD_VERSION)
+        return ERROR_STATS_RECORD_FORMAT;
+
+    return S_OK;
+}
+
+
+/*
+ * stats_recorder_create
+ *
+ * Creates a recorder writing the files PATH.0 to PATH.(files-1), each
+ * file_size bytes.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - the path is too long, or the size or number of files is out of range
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_recorder_create(const char *path, int file_size, int files, struct stats_recorder **rec_out)
+{
+    struct stats_recorder *rec;
+
+    if (path == NULL || rec_out == NULL || strlen(path) + 4 >= MAX_PATH ||
+        file_size < STATS_RECORD_MIN_FILE_SIZE || files < 1 || files > STATS_RECORD_MAX_FILES)
+        return ERROR_INVALID_PARAMETERS;
+
+    rec = (struct stats_recorder *) calloc(1, sizeof(struct stats_recorder));
+    if (rec == NULL)
+        return ERROR_MEMORY;
+
+    rec->rec_buf = (unsigned char *) malloc(2 * STATS_RECORD_MAX_FRAME);
+    rec->rec_delta = (long long *) calloc(COUNTER_TABLE_SIZE, sizeof(long long));
+    if (rec->rec_buf == NULL || rec->rec_delta == NULL || stats_sample_create(&rec->rec_prev) != S_OK)
+    {
+        free(rec->rec_buf);
+        free(rec->rec_delta);
+        free(rec);
+        return ERROR_MEMORY;
+    }
+
+    strcpy(rec->rec_path, path);
+    rec->rec_size = file_size;
+    rec->rec_files = files;
+
+    *rec_out = rec;
+
+    return S_OK;
+}
+
+/*
+ * stats_recorder_open
+ *
+ * Prepares to record samples of the stats named name, taken every
+ * interval_ms. If the recording already has files, recording continues
+ * after the newest of them. The first file is started by the first
+ * sample.
+ */
+int stats_recorder_open(struct stats_recorder *rec, const char *name, int interval_ms)
+{
+    struct stats_record_header hdr;
+    int i;
+
+    if (rec == NULL || name == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    snprintf(rec->rec_name, sizeof(rec->rec_name), "%s", name);
+    rec->rec_interval_ms = interval_ms;
+    rec->rec_generation = 1;
+    rec->rec_file = rec->rec_files - 1;
+    rec->rec_seq_no = -1;
+    rec->rec_frames = 0;
+    rec->rec_bytes = 0;
+
+    for (i = 0; i < rec->rec_files; i++)
+    {
+        if (record_read_header(rec->rec_path, i, &hdr) == S_OK && hdr.rf_generation >= rec->rec_generation)
+        {
+            rec->rec_generation = hdr.rf_generation + 1;
+            rec->rec_file = i;
+        }
+    }
+
+    return S_OK;
+}
+
+/* moves on to the next file of the rotation, which starts against zeros */
+static int record_start_file(struct stats_recorder *rec, long long start_time)
+{
+    struct stats_record_header *hdr;
+    struct timespec ts;
+    char file_path[RECORD_FILE_PATH_SIZE];
+    void *ptr;
+    int fd;
+
+    if (rec->rec_hdr)
+    {
+        munmap(rec->rec_hdr, rec->rec_size);
+        rec->rec_hdr = NULL;
+    }
+
+    rec->rec_file = (rec->rec_file + 1) % rec->rec_files;
+    record_file_path(rec->rec_path, rec->rec_file, file_path);
+
+    fd = open(file_path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return ERROR_STATS_RECORD_IO;
+
+    if (ftruncate(fd, rec->rec_size) != 0)
+    {
+        close(fd);
+        return ERROR_STATS_RECORD_IO;
+    }
+
+    ptr = mmap(NULL, rec->rec_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return ERROR_STATS_RECORD_IO;
+
+    DPRINTF("Recording to %s, generation %lld\n", file_path, rec->rec_generation);
+
+    /* a reader never sees the new header with the old frames */
+    hdr = (struct stats_record_header *) ptr;
+    hdr->rf_magic = 0;
+    __sync_synchronize();
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    hdr->rf_version = STATS_RECORD_VERSION;
+    hdr->rf_files = rec->rec_files;
+    hdr->rf_size = rec->rec_size;
+    hdr->rf_generation = rec->rec_generation++;
+    hdr->rf_used = sizeof(struct stats_record_header);
+    hdr->rf_start_time = start_time;
+    hdr->rf_wall_time = (long long) ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    hdr->rf_interval_ms = rec->rec_interval_ms;
+    hdr->rf_reserved = 0;
+    memset(hdr->rf_name, 0, sizeof(hdr->rf_name));
+    strcpy(hdr->rf_name, rec->rec_name);
+    __sync_synchronize();
+    hdr->rf_magic = STATS_RECORD_MAGIC;
+
+    rec->rec_hdr = hdr;
+
+    rec->rec_prev->sample_count = 0;
+    rec->rec_prev->sample_reset_epoch = 0;
+    rec->rec_prev->sample_time = start_time;
+    rec->rec_time_delta = 0;
+
+    return S_OK;
+}
+
+/* writes a frame header and payload at p */
+static unsigned char *record_put_frame(unsigned char *p, int type, unsigned char *payload, int len)
+{
+    *p++ = (unsigned char) type;
+    p = put_varint(p, len);
+    memcpy(p, payload, len);
+    return p + len;
+}
+
+static int record_encode_list(unsigned char *buf, struct stats *stats, struct stats_counter_list *cl, int count)
+{
+    struct stats_counter *ctr;
+    unsigned char *p = buf;
+    int i, len;
+
+    p = put_varint(p, cl->cl_seq_no);
+    p = put_varint(p, count);
+    for (i = 0; i < count; i++)
+    {
+        ctr = stats_cl_get_counter(stats, cl, i);
+        len = ctr->ctr_key_len > MAX_COUNTER_KEY_LENGTH ? MAX_COUNTER_KEY_LENGTH : ctr->ctr_key_len;
+        p = put_varint(p, (unsigned int) ctr->ctr_flags);
+        p = put_varint(p, len);
+        memcpy(p, ctr->ctr_key, len);
+        p += len;
+    }
+
+    return p - buf;
+}
+
+/* the change of value i from prev to sample. values prev does not have are
+   against 0, and the arithmetic wraps like the counters do */
+static unsigned long long record_delta(struct stats_sample *prev, struct stats_sample *sample, int i)
+{
+    unsigned long long base = i < prev->sample_count ? (unsigned long long) prev->sample_value[i].val64 : 0;
+
+    return (unsigned long long) sample->sample_value[i].val64 - base;
+}
+
+/* the change of the time from the previous sample, in STATS_RECORD_TIME_UNIT
+   steps from the start of the file so the rounding does not add up */
+static long long record_time_delta(struct stats_recorder *rec, struct stats_sample *sample)
+{
+    long long start = rec->rec_hdr->rf_start_time;
+
+    return (sample->sample_time - start) / STATS_RECORD_TIME_UNIT -
+        (rec->rec_prev->sample_time - start) / STATS_RECORD_TIME_UNIT;
+}
+
+static int record_encode_sample(unsigned char *buf, struct stats_recorder *rec, struct stats_sample *sample)
+{
+    struct stats_sample *prev = rec->rec_prev;
+    long long *prev_delta = rec->rec_delta;
+    unsigned char *p = buf;
+    unsigned long long dd;
+    int i, changed = 0, last = -1;
+
+    p = put_varint(p, zigzag(record_time_delta(rec, sample) - rec->rec_time_delta));
+    p = put_varint(p, zigzag((long long) sample->sample_reset_epoch - prev->sample_reset_epoch));
+    p = put_varint(p, sample->sample_count);
+
+    for (i = 0; i < sample->sample_count; i++)
+    {
+        if (record_delta(prev, sample, i) != (i < prev->sample_count ? (unsigned long long) prev_delta[i] : 0))
+            changed++;
+    }
+    p = put_varint(p, changed);
+
+    for (i = 0; i < sample->sample_count && changed > 0; i++)
+    {
+        dd = record_delta(prev, sample, i) - (i < prev->sample_count ? (unsigned long long) prev_delta[i] : 0);
+        if (dd == 0)
+            continue;
+
+        p = put_varint(p, i - last - 1);
+        p = put_varint(p, zigzag((long long) dd));
+        last = i;
+    }
+
+    return p - buf;
+}
+
+/*
+ * stats_record_sample
+ *
+ * Appends a sample to the recording, preceded by the counter list if it
+ * changed. sample must have been taken from stats with cl. Starts the next
+ * file when the current one is full.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or the recorder is not open
+ *    ERROR_STATS_RECORD_IO             - a file could not be created or mapped
+ */
+int stats_record_sample(struct stats_recorder *rec, struct stats *stats, struct stats_counter_list *cl,
+    struct stats_sample *sample)
+{
+    struct stats_record_header *hdr;
+    unsigned char *list = NULL, *samp, *p;
+    int list_len = 0, sample_len, count, err, i;
+    long long need;
+
+    if (rec == NULL || stats == NULL || cl == NULL || sample == NULL || rec->rec_name[0] == '\0')
+        return ERROR_INVALID_PARAMETERS;
+
+    count = sample->sample_count < cl->cl_count ? sample->sample_count : cl->cl_count;
+    samp = rec->rec_buf + STATS_RECORD_MAX_FRAME;
+
+    for (;;)
+    {
+        if (rec->rec_hdr == NULL)
+        {
+            err = record_start_file(rec, sample->sample_time);
+            if (err != S_OK)
+                return err;
+        }
+        hdr = rec->rec_hdr;
+
+        /* every file starts with the counter list */
+        if (hdr->rf_used == sizeof(struct stats_record_header) || sample->sample_seq_no != rec->rec_seq_no)
+        {
+            list = rec->rec_buf;
+            list_len = record_encode_list(list, stats, cl, count);
+        }
+
+        sample_len = record_encode_sample(samp, rec, sample);
+
+        /* the type and length of each frame take at most 6 bytes */
+        need = (list ? list_len + 6 : 0) + sample_len + 6;
+        if (hdr->rf_used + need <= rec->rec_size)
+            break;
+
+        err = record_start_file(rec, sample->sample_time);
+        if (err != S_OK)
+            return err;
+    }
+
+    p = (unsigned char *) hdr + hdr->rf_used;
+    if (list)
+    {
+        p = record_put_frame(p, STATS_RECORD_FRAME_LIST, list, list_len);
+        rec->rec_frames++;
+    }
+    p = record_put_frame(p, STATS_RECORD_FRAME_SAMPLE, samp, sample_len);
+    rec->rec_frames++;
+
+    /* publish the frames to readers following the file */
+    __sync_synchronize();
+    rec->rec_bytes += (p - (unsigned char *) hdr) - hdr->rf_used;
+    hdr->rf_used = p - (unsigned char *) hdr;
+
+    rec->rec_seq_no = sample->sample_seq_no;
+    rec->rec_time_delta = record_time_delta(rec, sample);
+    for (i = 0; i < sample->sample_count; i++)
+        rec->rec_delta[i] = (long long) record_delta(rec->rec_prev, sample, i);
+    stats_sample_copy(rec->rec_prev, sample);
+
+    return S_OK;
+}
+
+int stats_recorder_close(struct stats_recorder *rec)
+{
+    if (rec == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (rec->rec_hdr)
+    {
+        munmap(rec->rec_hdr, rec->rec_size);
+        rec->rec_hdr = NULL;
+    }
+
+    return S_OK;
+}
+
+void stats_recorder_free(struct stats_recorder *rec)
+{
+    if (rec)
+    {
+        stats_sample_free(rec->rec_prev);
+        free(rec->rec_delta);
+        free(rec->rec_buf);
+        free(rec);
+    }
+}
+
+
+/*
+ * stats_replay_create
+ *
+ * Opens the recording written to PATH.0, PATH.1, ... for playback from
+ * its oldest file.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or the path is too long
+ *    ERROR_MEMORY                      - out of memory
+ *    ERROR_STATS_RECORD_IO             - there is no recording at path
+ *    ERROR_STATS_RECORD_FORMAT         - the files at path are not a recording
+ */
+int stats_replay_create(const char *path, struct stats_replay **rp_out)
+{
+    struct stats_replay *rp;
+    struct stats_record_header hdr;
+    long long generation[STATS_RECORD_MAX_FILES];
+    int i, j, n = 0, err, found = 0;
+
+    if (path == NULL || rp_out == NULL || strlen(path) + 4 >= MAX_PATH)
+        return ERROR_INVALID_PARAMETERS;
+
+    rp = (struct stats_replay *) calloc(1, sizeof(struct stats_replay));
+    if (rp == NULL)
+        return ERROR_MEMORY;
+
+    strcpy(rp->rp_path, path);
+
+    /* insert each file in order of generation */
+    for (i = 0; i < STATS_RECORD_MAX_FILES; i++)
+    {
+        err = record_read_header(path, i, &hdr);
+        if (err == ERROR_STATS_RECORD_IO)
+            continue;
+        found = 1;
+        if (err != S_OK)
+            continue;
+
+        for (j = n; j > 0 && generation[j - 1] > hdr.rf_generation; j--)
+        {
+            generation[j] = generation[j - 1];
+            rp->rp_order[j] = rp->rp_order[j - 1];
+        }
+        generation[j] = hdr.rf_generation;
+        rp->rp_order[j] = i;
+        n++;
+    }
+
+    if (n == 0)
+    {
+        free(rp);
+        return found ? ERROR_STATS_RECORD_FORMAT : ERROR_STATS_RECORD_IO;
+    }
+
+    rp->rp_files = n;
+    rp->rp_seq_no = -1;
+
+    *rp_out = rp;
+
+    return S_OK;
+}
+
+static void replay_unmap(struct stats_replay *rp)
+{
+    if (rp->rp_hdr)
+    {
+        munmap(rp->rp_hdr, rp->rp_map_size);
+        rp->rp_hdr = NULL;
+    }
+}
+
+static int replay_map_next_file(struct stats_replay *rp)
+{
+    char file_path[RECORD_FILE_PATH_SIZE];
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    record_file_path(rp->rp_path, rp->rp_order[rp->rp_next_file++], file_path);
+
+    fd = open(file_path, O_RDONLY);
+    if (fd == -1)
+        return ERROR_STATS_RECORD_IO;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct stats_record_header))
+    {
+        close(fd);
+        return ERROR_STATS_RECORD_FORMAT;
+    }
+
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return ERROR_STATS_RECORD_IO;
+
+    rp->rp_hdr = (struct stats_record_header *) ptr;
+    rp->rp_map_size = st.st_size;
+
+    if (rp->rp_hdr->rf_magic != STATS_RECORD_MAGIC || rp->rp_hdr->rf_used > rp->rp_map_size)
+    {
+        replay_unmap(rp);
+        return ERROR_STATS_RECORD_FORMAT;
+    }
+
+    DPRINTF("Replaying %s, generation %lld\n", file_path, rp->rp_hdr->rf_generation);
+
+    rp->rp_offset = sizeof(struct stats_record_header);
+    rp->rp_time = rp->rp_hdr->rf_start_time;
+    rp->rp_time_delta = 0;
+    rp->rp_reset_epoch = 0;
+    rp->rp_sample_count = 0;
+
+    return S_OK;
+}
+
+static int replay_decode_list(struct stats_replay *rp, const unsigned char *p, const unsigned char *end)
+{
+    struct stats_counter *ctr;
+    unsigned long long seq_no, count, flags, len;
+    int i;
+
+    if (get_varint(&p, end, &seq_no) != S_OK || get_varint(&p, end, &count) != S_OK || count > COUNTER_TABLE_SIZE)
+        return ERROR_STATS_RECORD_FORMAT;
+
+    for (i = 0; i < count; i++)
+    {
+        if (get_varint(&p, end, &flags) != S_OK || get_varint(&p, end, &len) != S_OK ||
+            len > MAX_COUNTER_KEY_LENGTH || len > end - p)
+            return ERROR_STATS_RECORD_FORMAT;
+
+        ctr = &rp->rp_ctr[i];
+        memset(ctr, 0, sizeof(struct stats_counter));
+        ctr->ctr_allocation_status = ALLOCATION_STATUS_ALLOCATED;
+        ctr->ctr_allocation_seq = i;
+        ctr->ctr_flags = (int) flags;
+        ctr->ctr_key_len = len;
+        memcpy(ctr->ctr_key, p, len);
+        p += len;
+    }
+
+    rp->rp_seq_no = seq_no;
+    rp->rp_count = count;
+
+    return S_OK;
+}
+
+static int replay_decode_sample(struct stats_replay *rp, const unsigned char *p, const unsigned char *end,
+    struct stats_sample *sample)
+{
+    unsigned long long time_delta, epoch_delta, count, changed, gap, dd;
+    int i, j;
+
+    if (get_varint(&p, end, &time_delta) != S_OK || get_varint(&p, end, &epoch_delta) != S_OK ||
+        get_varint(&p, end, &count) != S_OK || get_varint(&p, end, &changed) != S_OK ||
+        count > rp->rp_count || changed > count)
+        return ERROR_STATS_RECORD_FORMAT;
+
+    if (count > sample->sample_capacity)
+        return ERROR_STATS_SAMPLE_TOO_SMALL;
+
+    for (i = rp->rp_sample_count; i < count; i++)
+        rp->rp_value[i] = rp->rp_delta[i] = 0;
+
+    for (i = -1, j = 0; j < changed; j++)
+    {
+        if (get_varint(&p, end, &gap) != S_OK || get_varint(&p, end, &dd) != S_OK || gap >= count - (i + 1))
+            return ERROR_STATS_RECORD_FORMAT;
+        i += gap + 1;
+        rp->rp_delta[i] = (long long)((unsigned long long) rp->rp_delta[i] + (unsigned long long) unzigzag(dd));
+    }
+
+    /* the values which did not change their change keep it */
+    for (i = 0; i < count; i++)
+        rp->rp_value[i] = (long long)((unsigned long long) rp->rp_value[i] + (unsigned long long) rp->rp_delta[i]);
+
+    rp->rp_time_delta += unzigzag(time_delta);
+    rp->rp_time += rp->rp_time_delta * STATS_RECORD_TIME_UNIT;
+    rp->rp_reset_epoch += unzigzag(epoch_delta);
+    rp->rp_sample_count = count;
+
+    sample->sample_seq_no = rp->rp_seq_no;
+    sample->sample_count = count;
+    sample->sample_time = rp->rp_time;
+    sample->sample_reset_epoch = rp->rp_reset_epoch;
+    sample->sample_derived_count = 0;
+    sample->sample_flags = 0;
+    for (i = 0; i < count; i++)
+        sample->sample_value[i].val64 = rp->rp_value[i];
+
+    return S_OK;
+}
+
+/*
+ * stats_replay_next
+ *
+ * Decodes the next sample of the recording into sample. The counters of
+ * the sample are described by stats_replay_get_counter, and the file it
+ * came from by stats_replay_get_header.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_STATS_RECORD_END            - there are no more samples
+ *    ERROR_STATS_RECORD_FORMAT         - a file is damaged
+ *    ERROR_STATS_SAMPLE_TOO_SMALL      - sample cannot hold the values
+ */
+int stats_replay_next(struct stats_replay *rp, struct stats_sample *sample)
+{
+    const unsigned char *base, *p, *end;
+    unsigned long long len;
+    int type, err;
+
+    if (rp == NULL || sample == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    for (;;)
+    {
+        if (rp->rp_hdr && rp->rp_offset >= rp->rp_hdr->rf_used)
+            replay_unmap(rp);
+
+        if (rp->rp_hdr == NULL)
+        {
+            if (rp->rp_next_file == rp->rp_files)
+                return ERROR_STATS_RECORD_END;
+
+            /* a file which was removed or overwritten is skipped */
+            err = replay_map_next_file(rp);
+            if (err != S_OK)
+                continue;
+        }
+
+        base = (const unsigned char *) rp->rp_hdr;
+        p = base + rp->rp_offset;
+        end = base + rp->rp_hdr->rf_used;
+
+        type = *p++;
+        if (get_varint(&p, end, &len) != S_OK || len > end - p)
+            return ERROR_STATS_RECORD_FORMAT;
+
+        rp->rp_offset = (p - base) + len;
+
+        if (type == STATS_RECORD_FRAME_LIST)
+        {
+            err = replay_decode_list(rp, p, p + len);
+            if (err != S_OK)
+                return err;
+        }
+        else if (type == STATS_RECORD_FRAME_SAMPLE)
+        {
+            return replay_decode_sample(rp, p, p + len, sample);
+        }
+        /* frames of other types are skipped */
+    }
+}
+
+void stats_replay_free(struct stats_replay *rp)
+{
+    if (rp)
+    {
+        replay_unmap(rp);
+        free(rp);
+    }
+}
@@ -0,0 +1,469 @@
+/* registry.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/registry.h"
+#include "stats/debug.h"
+
+/*
+ * The registry is attached once per process, the first time it is
+ * needed, and stays attached until the process exits. A child created
+ * with fork inherits the attachment.
+ */
+
+static struct shared_memory registry_shmem;
+static struct stats_registry *registry = NULL;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+
+static void registry_open()
+{
+    struct stats_registry *rg;
+
+    if (shared_memory_init(&registry_shmem, STATS_REGISTRY_NAME, OMODE_OPEN_OR_CREATE, sizeof(struct stats_registry)) != S_OK)
+        return;
+
+    if (shared_memory_open(&registry_shmem) != S_OK)
+    {
+        DPRINTF("Cannot open the stats registry\n");
+        return;
+    }
+
+    /* a new segment is zero filled, which is an empty table */
+    rg = (struct stats_registry *) shared_memory_ptr(&registry_shmem);
+    __sync_bool_compare_and_swap(&rg->rg_magic, 0, STATS_REGISTRY_MAGIC);
+    if (rg->rg_magic != STATS_REGISTRY_MAGIC)
+    {
+        DPRINTF("The stats registry has a bad magic number %08x\n", rg->rg_magic);
+        shared_memory_detach(&registry_shmem);
+        return;
+    }
+
+    registry = rg;
+}
+
+static struct stats_registry *registry_get()
+{
+    pthread_once(&registry_once, registry_open);
+    return registry;
+}
+
+/* the name passed to stats_create, without the .mem of the segment */
+static void registry_stats_name(struct stats *stats, char *buf)
+{
+    const char *mem_name = shared_memory_name(&stats->shmem);
+
+    snprintf(buf, STATS_MAX_NAME_LEN + 1, "%.*s", (int) strlen(mem_name) - 4, mem_name);
+}
+
+/*
+ * registry_stat
+ *
+ * Looks up the segment of a registry entry.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_SHARED_MEM_DOES_NOT_EXIST   - the segment or its file is gone
+ *    ERROR_SHARED_MEM_CANNOT_STAT      - the segment exists but cannot be read
+ */
+static int registry_stat(struct stats_registry_entry *re, struct shmid_ds *ds)
+{
+    char path[MAX_PATH];
+    key_t key;
+    int shmid;
+
+    snprintf(path, sizeof(path), "%s/%.*s.mem", SHARED_MEMORY_DIRECTORY, STATS_MAX_NAME_LEN, re->re_name);
+
+    key = ftok(path, re->re_version);
+    if (key == -1)
+        return ERROR_SHARED_MEM_DOES_NOT_EXIST;
+
+    shmid = shmget(key, 0, 0);
+    if (shmid == -1)
+        return errno == ENOENT ? ERROR_SHARED_MEM_DOES_NOT_EXIST : ERROR_SHARED_MEM_CANNOT_STAT;
+
+    if (shmctl(shmid, IPC_STAT, ds) != 0)
+        return errno == EIDRM || errno == EINVAL ? ERROR_SHARED_MEM_DOES_NOT_EXIST : ERROR_SHARED_MEM_CANNOT_STAT;
+
+    return S_OK;
+}
+
+/*
+ * registry_drop
+ *
+ * Frees a registered entry if its segment is gone. The entry is claimed
+ * before the segment is looked up, so a process creating the segment
+ * again at the same time either is seen here or does not find the entry
+ * and registers the name in another one.
+ */
+static void registry_drop(struct stats_registry_entry *re)
+{
+    struct shmid_ds ds;
+
+    if (!__sync_bool_compare_and_swap(&re->re_state, REGISTRY_ENTRY_REGISTERED, REGISTRY_ENTRY_CLAIMED))
+        return;
+
+    if (registry_stat(re, &ds) != ERROR_SHARED_MEM_DOES_NOT_EXIST)
+    {
+        re->re_state = REGISTRY_ENTRY_REGISTERED;
+        return;
+    }
+
+    DPRINTF("Removing %.*s from the stats registry\n", STATS_MAX_NAME_LEN, re->re_name);
+
+    re->re_pid = 0;
+    __sync_synchronize();
+    re->re_state = REGISTRY_ENTRY_FREE;
+}
+
+static int registry_find(struct stats_registry *rg, const char *name, int from)
+{
+    int i;
+
+    for (i = from; i < STATS_REGISTRY_SIZE; i++)
+    {
+        if (rg->rg_entry[i].re_state == REGISTRY_ENTRY_REGISTERED &&
+            strncmp(rg->rg_entry[i].re_name, name, STATS_MAX_NAME_LEN) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * stats_registry_add
+ *
+ * Adds the name of a shared stats object to the registry if it is not
+ * there. Called by stats_open. Two processes opening a new name at once
+ * may both add it; stats_enumerate drops the second entry.
+ */
+void stats_registry_add(struct stats *stats)
+{
+    struct stats_registry *rg;
+    struct stats_registry_entry *re;
+    char name[STATS_MAX_NAME_LEN + 1];
+    int i;
+
+    if (stats->flags & STATS_FLAG_PRIVATE)
+        return;
+
+    rg = registry_get();
+    if (rg == NULL)
+        return;
+
+    registry_stats_name(stats, name);
+    if (registry_find(rg, name, 0) >= 0)
+        return;
+
+    for (i = 0; i < STATS_REGISTRY_SIZE; i++)
+    {
+        re = &rg->rg_entry[i];
+        if (re->re_state != REGISTRY_ENTRY_FREE ||
+            !__sync_bool_compare_and_swap(&re->re_state, REGISTRY_ENTRY_FREE, REGISTRY_ENTRY_CLAIMED))
+            continue;
+
+        re->re_pid = getpid();
+        re->re_uid = getuid();
+        re->re_version = STATS_LAYOUT_VERSION;
+        re->re_size = sizeof(struct stats_data);
+        strncpy(re->re_name, name, sizeof(re->re_name));
+
+        /* publish the entry to stats_enumerate */
+        __sync_synchronize();
+        re->re_state = REGISTRY_ENTRY_REGISTERED;
+        return;
+    }
+
+    DPRINTF("The stats registry is full, %s is not registered\n", name);
+}
+
+/*
+ * stats_registry_remove
+ *
+ * Removes the name of a shared stats object whose segment was destroyed.
+ * Called by stats_close.
+ */
+void stats_registry_remove(struct stats *stats)
+{
+    struct stats_registry *rg;
+    char name[STATS_MAX_NAME_LEN + 1];
+    int i;
+
+    if (stats->flags & STATS_FLAG_PRIVATE)
+        return;
+
+    rg = registry_get();
+    if (rg == NULL)
+        return;
+
+    registry_stats_name(stats, name);
+    for (i = registry_find(rg, name, 0); i >= 0; i = registry_find(rg, name, i + 1))
+        registry_drop(&rg->rg_entry[i]);
+}
+
+/*
+ * stats_enumerate
+ *
+ * Copies the information of each registered stats segment which exists,
+ * up to max_infos of them. The entries of segments which are gone and of
+ * names registered twice are freed.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_SHARED_MEM_CANNOT_OPEN      - the registry cannot be opened
+ */
+int stats_enumerate(struct stats_segment_info *infos, int max_infos, int *count_out)
+{
+    struct stats_registry *rg;
+    struct stats_registry_entry *re;
+    struct stats_segment_info *si;
+    struct shmid_ds ds;
+    int i, j, err, n = 0;
+
+    if (infos == NULL || count_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    rg = registry_get();
+    if (rg == NULL)
+        return ERROR_SHARED_MEM_CANNOT_OPEN;
+
+    for (i = 0; i < STATS_REGISTRY_SIZE && n < max_infos; i++)
+    {
+        re = &rg->rg_entry[i];
+
+        if (*(volatile int *) &re->re_state != REGISTRY_ENTRY_REGISTERED)
+            continue;
+        __sync_synchronize();
+
+        j = registry_find(rg, re->re_name, 0);
+        if (j >= 0 && j < i)
+        {
+            /* registered twice. the segment is the same */
+            if (__sync_bool_compare_and_swap(&re->re_state, REGISTRY_ENTRY_REGISTERED, REGISTRY_ENTRY_FREE))
+                DPRINTF("Removing duplicate %.*s from the stats registry\n", STATS_MAX_NAME_LEN, re->re_name);
+            continue;
+        }
+
+        err = registry_stat(re, &ds);
+        if (err == ERROR_SHARED_MEM_DOES_NOT_EXIST)
+        {
+            registry_drop(re);
+            continue;
+        }
+
+        si = &infos[n++];
+        snprintf(si->si_name, sizeof(si->si_name), "%.*s", STATS_MAX_NAME_LEN, re->re_name);
+        si->si_version = re->re_version;
+        if (err == S_OK)
+        {
+            si->si_owner_pid = ds.shm_cpid;
+            si->si_owner_uid = ds.shm_perm.cuid;
+            si->si_size = ds.shm_segsz;
+            si->si_attached = ds.shm_nattch;
+        }
+        else
+        {
+            /* not readable by this user. report what the entry says */
+            si->si_owner_pid = re->re_pid;
+            si->si_owner_uid = re->re_uid;
+            si->si_size = re->re_size;
+            si->si_attached = -1;
+        }
+    }
+
+    *count_out = n;
+
+    return S_OK;
+}
+
+
+static void group_member_close(struct stats_group_member *gm)
+{
+    stats_close(gm->gm_stats);
+    stats_free(gm->gm_stats);
+    stats_cl_free(gm->gm_cl);
+    stats_sample_free(gm->gm_sample);
+    stats_sample_free(gm->gm_prev_sample);
+    memset(gm, 0, sizeof(struct stats_group_member));
+}
+
+/* attaches to a registered segment. fails if it is gone or not yet initialized */
+static int group_member_open(struct stats_group_member *gm, struct stats_segment_info *si)
+{
+    int err;
+
+    memset(gm, 0, sizeof(struct stats_group_member));
+
+    err = stats_create_with_flags(si->si_name, STATS_FLAG_OPEN_EXISTING, &gm->gm_stats);
+    if (err != S_OK)
+        return err;
+
+    err = stats_open(gm->gm_stats);
+    if (err != S_OK)
+    {
+        stats_free(gm->gm_stats);
+        gm->gm_stats = NULL;
+        return err;
+    }
+
+    if (stats_cl_create(&gm->gm_cl) != S_OK || stats_sample_create(&gm->gm_sample) != S_OK ||
+        stats_sample_create(&gm->gm_prev_sample) != S_OK)
+    {
+        if (gm->gm_cl)
+            stats_cl_free(gm->gm_cl);
+        if (gm->gm_sample)
+            stats_sample_free(gm->gm_sample);
+        stats_close(gm->gm_stats);
+        stats_free(gm->gm_stats);
+        memset(gm, 0, sizeof(struct stats_group_member));
+        return ERROR_MEMORY;
+    }
+
+    gm->gm_info = *si;
+    gm->gm_seen = 1;
+
+    return S_OK;
+}
+
+int stats_group_create(struct stats_group **group_out)
+{
+    struct stats_group *group;
+
+    if (group_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    group = (struct stats_group *) calloc(1, sizeof(struct stats_group));
+    if (group == NULL)
+        return ERROR_MEMORY;
+
+    *group_out = group;
+    return S_OK;
+}
+
+void stats_group_free(struct stats_group *group)
+{
+    int i;
+
+    if (group == NULL)
+        return;
+
+    for (i = 0; i < group->g_count; i++)
+        group_member_close(&group->g_member[i]);
+
+    free(group);
+}
+
+/*
+ * stats_group_refresh
+ *
+ * Opens the registered segments which are not yet in the group and closes
+ * the members which are no longer registered. Segments of another layout
+ * version, or which are still being created, are left out until a later
+ * call.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - group is NULL
+ *    ERROR_SHARED_MEM_CANNOT_OPEN      - the registry cannot be opened
+ */
+int stats_group_refresh(struct stats_group *group)
+{
+    struct stats_segment_info infos[STATS_REGISTRY_SIZE];
+    int i, j, n, err;
+
+    if (group == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = stats_enumerate(infos, STATS_REGISTRY_SIZE, &n);
+    if (err != S_OK)
+        return err;
+
+    for (j = 0; j < group->g_count; j++)
+        group->g_member[j].gm_seen = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (infos[i].si_version != STATS_LAYOUT_VERSION)
+            continue;
+
+        for (j = 0; j < group->g_count; j++)
+        {
+            if (strcmp(group->g_member[j].gm_info.si_name, infos[i].si_name) == 0)
+                break;
+        }
+
+        if (j < group->g_count)
+        {
+            group->g_member[j].gm_info = infos[i];
+            group->g_member[j].gm_seen = 1;
+        }
+        else if (group->g_count < STATS_REGISTRY_SIZE && group_member_open(&group->g_member[group->g_count], &infos[i]) == S_OK)
+        {
+            group->g_count++;
+        }
+    }
+
+    /* close the members which have gone, keeping the others in order */
+    for (i = 0, j = 0; i < group->g_count; i++)
+    {
+        if (!group->g_member[i].gm_seen)
+        {
+            group_member_close(&group->g_member[i]);
+            continue;
+        }
+        if (j != i)
+            group->g_member[j] = group->g_member[i];
+        j++;
+    }
+    group->g_count = j;
+
+    return S_OK;
+}
+
+/*
+ * stats_group_sample
+ *
+ * Takes a fresh sample of every member, keeping the previous one in
+ * gm_prev_sample for deltas. A member which fails keeps its previous
+ * samples and the first error is returned after the others are sampled.
+ */
+int stats_group_sample(struct stats_group *group)
+{
+    struct stats_group_member *gm;
+    struct stats_sample *tmp;
+    int i, err, ret = S_OK;
+
+    if (group == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    for (i = 0; i < group->g_count; i++)
+    {
+        gm = &group->g_member[i];
+
+        tmp = gm->gm_prev_sample;
+        gm->gm_prev_sample = gm->gm_sample;
+        gm->gm_sample = tmp;
+
+        err = stats_get_fresh_sample(gm->gm_stats, gm->gm_cl, gm->gm_sample);
+        if (err != S_OK)
+        {
+            tmp = gm->gm_prev_sample;
+            gm->gm_prev_sample = gm->gm_sample;
+            gm->gm_sample = tmp;
+            if (ret == S_OK)
+                ret = err;
+        }
+    }
+
+    return ret;
+}
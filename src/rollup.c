@@ -0,0 +1,267 @@
+/* rollup.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/rollup.h"
+#include "stats/hash.h"
+#include "stats/debug.h"
+
+#define ROLLUP_INITIAL_CAPACITY 256
+
+
+int stats_rollup_create(struct stats_rollup **ru_out)
+{
+    struct stats_rollup *ru;
+
+    if (ru_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    ru = (struct stats_rollup *) malloc(sizeof(struct stats_rollup));
+    if (ru == NULL)
+        return ERROR_MEMORY;
+
+    memset(ru, 0, sizeof(struct stats_rollup));
+    ru->ru_seq_no = -1;
+
+    *ru_out = ru;
+
+    return S_OK;
+}
+
+void stats_rollup_free(struct stats_rollup *ru)
+{
+    if (ru)
+    {
+        free(ru->ru_node);
+        free(ru->ru_value);
+        free(ru->ru_hash);
+        free(ru);
+    }
+}
+
+static int rollup_probe(struct stats_rollup *ru, const char *prefix, int len)
+{
+    uint32_t h;
+    int k, node;
+
+    h = fast_hash(prefix, len);
+    for (k = h & (ru->ru_hash_size - 1); ru->ru_hash[k] != 0; k = (k + 1) & (ru->ru_hash_size - 1))
+    {
+        node = ru->ru_hash[k] - 1;
+        if (strncmp(ru->ru_node[node].rn_prefix, prefix, len) == 0 && ru->ru_node[node].rn_prefix[len] == '\0')
+            break;
+    }
+
+    return k;
+}
+
+/* doubles the node arrays and rebuilds the hash. the hash is kept at most half full */
+static int rollup_grow(struct stats_rollup *ru)
+{
+    struct stats_rollup_node *node;
+    long long *value;
+    int *hash;
+    int i, capacity;
+
+    capacity = ru->ru_capacity ? ru->ru_capacity * 2 : ROLLUP_INITIAL_CAPACITY;
+
+    node = (struct stats_rollup_node *) realloc(ru->ru_node, capacity * sizeof(struct stats_rollup_node));
+    if (node == NULL)
+        return ERROR_MEMORY;
+    ru->ru_node = node;
+
+    value = (long long *) realloc(ru->ru_value, capacity * sizeof(long long));
+    if (value == NULL)
+        return ERROR_MEMORY;
+    ru->ru_value = value;
+
+    hash = (int *) calloc(capacity * 2, sizeof(int));
+    if (hash == NULL)
+        return ERROR_MEMORY;
+
+    free(ru->ru_hash);
+    ru->ru_hash = hash;
+    ru->ru_hash_size = capacity * 2;
+    ru->ru_capacity = capacity;
+
+    for (i = 0; i < ru->ru_count; i++)
+    {
+        ru->ru_hash[rollup_probe(ru, ru->ru_node[i].rn_prefix, strlen(ru->ru_node[i].rn_prefix))] = i + 1;
+    }
+
+    return S_OK;
+}
+
+/* adds a counter to every prefix of its key, creating prefixes as needed */
+static int rollup_add_counter(struct stats_rollup *ru, const char *key, int *node_out)
+{
+    struct stats_rollup_node *n;
+    int len, k, node, parent = -1, err;
+    const char *dot;
+
+    for (dot = strchr(key, '.'); dot != NULL; dot = strchr(dot + 1, '.'))
+    {
+        len = dot - key;
+        if (len == 0)
+            continue;
+
+        if (ru->ru_count == ru->ru_capacity)
+        {
+            err = rollup_grow(ru);
+            if (err != S_OK)
+                return err;
+        }
+
+        k = rollup_probe(ru, key, len);
+        if (ru->ru_hash[k] == 0)
+        {
+            node = ru->ru_count++;
+            n = ru->ru_node + node;
+            memcpy(n->rn_prefix, key, len);
+            n->rn_prefix[len] = '\0';
+            n->rn_parent = parent;
+            n->rn_counters = 0;
+            ru->ru_value[node] = 0;
+            ru->ru_hash[k] = node + 1;
+        }
+        else
+        {
+            node = ru->ru_hash[k] - 1;
+        }
+
+        ru->ru_node[node].rn_counters++;
+        parent = node;
+    }
+
+    *node_out = parent;
+
+    return S_OK;
+}
+
+/*
+ * stats_rollup_update
+ *
+ * Brings the prefix tree up to date with the counter list, which should
+ * have just been updated by stats_get_counter_list or stats_get_sample.
+ * Only counters added to the list since the last update are processed.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_rollup_update(struct stats *stats, struct stats_rollup *ru, struct stats_counter_list *cl)
+{
+    struct stats_counter *ctr;
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+    int i, err;
+
+    if (stats == NULL || ru == NULL || cl == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (ru->ru_seq_no == cl->cl_seq_no && ru->ru_counters == cl->cl_count)
+        return S_OK;
+
+    /* a shorter list is not the list the tree was built from. start over */
+    if (cl->cl_count < ru->ru_counters)
+    {
+        ru->ru_counters = 0;
+        ru->ru_count = 0;
+        if (ru->ru_hash)
+            memset(ru->ru_hash, 0, ru->ru_hash_size * sizeof(int));
+    }
+
+    for (i = ru->ru_counters; i < cl->cl_count; i++)
+    {
+        ctr = stats_cl_get_counter(stats, cl, i);
+        ru->ru_counter_node[i] = -1;
+
+        /* sketches and real valued counters cannot be summed with the rest */
+        if (ctr->ctr_flags & (CTR_FLAG_SKETCH_MASK | CTR_FLAG_REAL_MASK))
+            continue;
+
+        counter_get_key(ctr, counter_name, MAX_COUNTER_KEY_LENGTH+1);
+        err = rollup_add_counter(ru, counter_name, &ru->ru_counter_node[i]);
+        if (err != S_OK)
+        {
+            ru->ru_counters = i;
+            return err;
+        }
+    }
+
+    DPRINTF("rollup: %d counters, %d prefixes\n", cl->cl_count, ru->ru_count);
+
+    ru->ru_counters = cl->cl_count;
+    ru->ru_seq_no = cl->cl_seq_no;
+
+    return S_OK;
+}
+
+/*
+ * stats_rollup_compute
+ *
+ * Sets the value of every prefix to the sum of the values of the counters
+ * below it in sample, or to the sum of their deltas from prev_sample if
+ * prev_sample is not NULL. sample must be from the counter list passed to
+ * stats_rollup_update.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ */
+int stats_rollup_compute(struct stats_rollup *ru, struct stats_sample *sample, struct stats_sample *prev_sample)
+{
+    int i, node, count;
+
+    if (ru == NULL || sample == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (ru->ru_count == 0)
+        return S_OK;
+
+    memset(ru->ru_value, 0, ru->ru_count * sizeof(long long));
+
+    count = sample->sample_count < ru->ru_counters ? sample->sample_count : ru->ru_counters;
+
+    for (i = 0; i < count; i++)
+    {
+        node = ru->ru_counter_node[i];
+        if (node < 0)
+            continue;
+
+        if (prev_sample)
+            ru->ru_value[node] += stats_sample_get_delta(sample, prev_sample, i);
+        else
+            ru->ru_value[node] += stats_sample_get_value(sample, i);
+    }
+
+    /* children always come after their parents */
+    for (i = ru->ru_count - 1; i >= 0; i--)
+    {
+        if (ru->ru_node[i].rn_parent >= 0)
+            ru->ru_value[ru->ru_node[i].rn_parent] += ru->ru_value[i];
+    }
+
+    return S_OK;
+}
+
+/* returns the index of prefix (with or without the ".*" suffix), or -1 */
+int stats_rollup_find(struct stats_rollup *ru, const char *prefix)
+{
+    int len, k;
+
+    if (ru == NULL || prefix == NULL || ru->ru_count == 0)
+        return -1;
+
+    len = strlen(prefix);
+    if (len >= 2 && strcmp(prefix + len - 2, STATS_ROLLUP_SUFFIX) == 0)
+        len -= 2;
+
+    k = rollup_probe(ru, prefix, len);
+
+    return ru->ru_hash[k] - 1;
+}
@@ -138,6 +138,40 @@ int semaphore_open(struct semaphore * sem, int flags)
     return S_OK;
 }
 
+/*
+ * semaphore_attach
+ *
+ * Opens a semaphore which already exists, without the directory and
+ * placeholder file checks of semaphore_open. The semaphore is never
+ * created.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_SEMAPHORE_DOES_NOT_EXIST    - the placeholder file or the semaphore does not exist
+ */
+int semaphore_attach(struct semaphore *sem)
+{
+    char path[MAX_PATH];
+
+    if (sem == NULL || sem->magic != SEMAPHORE_MAGIC)
+        return ERROR_INVALID_PARAMETERS;
+
+    sprintf(path, "%s/%s", SEMAPHORE_DIRECTORY, sem->name);
+
+    sem->semkey = ftok(path, 1);
+    if (sem->semkey == -1)
+        return ERROR_SEMAPHORE_DOES_NOT_EXIST;
+
+    sem->semid = semget(sem->semkey, sem->size, 0644);
+    if (sem->semid == -1)
+    {
+        sem->semkey = -1;
+        return ERROR_SEMAPHORE_DOES_NOT_EXIST;
+    }
+
+    return S_OK;
+}
+
 int semaphore_set_value(struct semaphore *sem, unsigned short nsem, unsigned short value)
 {
     union semun s;
@@ -48,6 +48,7 @@ int shared_memory_init(struct shared_memory *shmem, const char *name, int flags,
 
     shmem->magic = SHARED_MEMORY_MAGIC;
     shmem->shmkey = -1;
+    shmem->key_id = 1;
     shmem->shmid = -1;
     shmem->flags = flags;
     shmem->size = size;
@@ -93,7 +94,7 @@ int shared_memory_open(struct shared_memory * shmem)
         close(fd);
     }
 
-    shmem->shmkey = ftok(path, 1);
+    shmem->shmkey = ftok(path, shmem->key_id);
     if (shmem->shmkey == -1)
     {
         return ERROR_SHARED_MEM_CANNOT_CREATE_IPC_TOKEN;
@@ -157,6 +158,66 @@ int shared_memory_open(struct shared_memory * shmem)
     return S_OK;
 }
 
+/*
+ * shared_memory_attach
+ *
+ * Attaches to a segment which already exists, without the directory and
+ * placeholder file checks of shared_memory_open and without the IPC_STAT
+ * to find out who created it. The segment is never created.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_SHARED_MEM_DOES_NOT_EXIST   - the placeholder file or the segment does not exist
+ *    ERROR_SHARED_MEM_INVALID_SIZE     - the segment exists with a different size
+ *    ERROR_SHARED_MEM_CANNOT_ATTACH    - shmat failed
+ */
+int shared_memory_attach(struct shared_memory *shmem)
+{
+    char path[MAX_PATH];
+
+    if (shmem == NULL || shmem->magic != SHARED_MEMORY_MAGIC)
+        return ERROR_INVALID_PARAMETERS;
+
+    sprintf(path, "%s/%s", SHARED_MEMORY_DIRECTORY, shmem->name);
+
+    shmem->shmkey = ftok(path, shmem->key_id);
+    if (shmem->shmkey == -1)
+        return ERROR_SHARED_MEM_DOES_NOT_EXIST;
+
+    shmem->shmid = shmget(shmem->shmkey, shmem->size, 0644);
+    if (shmem->shmid == -1)
+    {
+        shmem->shmkey = -1;
+        return errno == EINVAL ? ERROR_SHARED_MEM_INVALID_SIZE : ERROR_SHARED_MEM_DOES_NOT_EXIST;
+    }
+
+    shmem->ptr = shmat(shmem->shmid, NULL, 0);
+    if ((intptr_t)shmem->ptr == -1)
+    {
+        shmem->ptr = NULL;
+        shmem->shmid = -1;
+        shmem->shmkey = -1;
+        return ERROR_SHARED_MEM_CANNOT_ATTACH;
+    }
+
+    shmem->created = FALSE;
+
+    DPRINTF("Attached shm 0x%08x for %s at 0x%016lx\n", shmem->shmkey, shmem->name, (intptr_t) shmem->ptr);
+
+    return S_OK;
+}
+
+/* detaches from the segment without ever destroying it */
+void shared_memory_detach(struct shared_memory *shmem)
+{
+    if (shmem->ptr)
+        shmdt(shmem->ptr);
+
+    shmem->ptr = NULL;
+    shmem->shmid = -1;
+    shmem->shmkey = -1;
+}
+
 
 int shared_memory_nattach(struct shared_memory *shmem, int *attach_count_out)
 {
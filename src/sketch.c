@@ -0,0 +1,738 @@
+/* sketch.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/debug.h"
+
+/* how many times to spin on a top-k lock before checking that its holder is still alive */
+#define TOPK_SPIN_CHECK 1000
+
+
+/**
+ * sketch allocation
+ */
+
+/*
+ * sketch_bind
+ *
+ * Binds a sketch counter to a free entry in one of the sketch tables.
+ * Each table entry starts with an int "allocated" flag; first_allocated
+ * points to the flag of entry 0 and stride is the size of an entry.
+ * Entries are claimed and counters bound with compare-and-swap, so this
+ * does not need the stats lock.
+ *
+ * Returns the index of the counter's sketch, or -1 if the table is full.
+ */
+static int sketch_bind(struct stats_counter *ctr, int type, int *first_allocated, int stride, int table_size, void (*clear)(void *))
+{
+    int i, *allocated;
+
+    if ((((unsigned int) ctr->ctr_flags) >> CTR_FLAG_SKETCH_SHIFT) != 0)
+        return CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+
+    for (i = 0; i < table_size; i++)
+    {
+        allocated = (int *)((char *)first_allocated + i * stride);
+        if (*allocated == 0 && __sync_bool_compare_and_swap(allocated, 0, 1))
+            break;
+    }
+
+    if (i == table_size)
+        return -1;
+
+    clear((char *)first_allocated + i * stride);
+
+    if (!__sync_bool_compare_and_swap(&ctr->ctr_flags, type, type | ((i + 1) << CTR_FLAG_SKETCH_SHIFT)))
+    {
+        /* another process bound the counter first. give back our entry */
+        __sync_lock_release(allocated);
+    }
+
+    return CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+}
+
+static int sketch_allocate(struct stats *stats, const char *name, int type, int *first_allocated, int stride, int table_size, void (*clear)(void *), int *index_out)
+{
+    struct stats_counter *ctr = NULL;
+    int err, index;
+
+    err = stats_allocate_counter_with_flags(stats, name, type, &ctr);
+    if (err != S_OK)
+        return err;
+
+    index = sketch_bind(ctr, type, first_allocated, stride, table_size, clear);
+    if (index < 0 || index >= table_size)
+        return ERROR_STATS_CANNOT_ALLOCATE_SKETCH;
+
+    *index_out = index;
+
+    return S_OK;
+}
+
+static void hll_clear(void *p)
+{
+    stats_hll_clear((struct stats_hll *)p);
+}
+
+static void topk_clear(void *p)
+{
+    stats_topk_clear((struct stats_topk *)p);
+}
+
+static void quantile_clear(void *p)
+{
+    stats_quantile_clear((struct stats_quantile *)p);
+}
+
+/*
+ * stats_sketch_hash
+ *
+ * 64 bit FNV-1a followed by the murmur3 finalizer, so that every bit of
+ * the result depends on every byte of the item.
+ */
+unsigned long long stats_sketch_hash(const void *item, int len)
+{
+    const unsigned char *p = (const unsigned char *) item;
+    unsigned long long h = 14695981039346656037ull;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+
+/**
+ * HyperLogLog
+ */
+
+/*
+ * stats_allocate_hll
+ *
+ * Allocates (or finds) the HLL counter named name.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - a counter with that name exists and is not an HLL
+ *    ERROR_STATS_CANNOT_ALLOCATE_SKETCH - all of the HLL sketches are in use
+ *    any error returned by stats_allocate_counter
+ */
+int stats_allocate_hll(struct stats *stats, const char *name, struct stats_hll **hll_out)
+{
+    int err, index;
+
+    if (!stats || stats->data == NULL || hll_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = sketch_allocate(stats, name, CTR_FLAG_HLL, &stats->data->hll[0].hll_allocated,
+        sizeof(struct stats_hll), STATS_HLL_TABLE_SIZE, hll_clear, &index);
+
+    *hll_out = (err == S_OK) ? stats->data->hll + index : NULL;
+
+    return err;
+}
+
+void stats_hll_add(struct stats_hll *hll, const void *item, int len)
+{
+    stats_hll_add_hash(hll, stats_sketch_hash(item, len));
+}
+
+static void hll_register_max(struct stats_hll *hll, int index, unsigned char rank)
+{
+    volatile unsigned char *reg = hll->hll_register + index;
+    unsigned char old;
+
+    old = *reg;
+    while (rank > old)
+    {
+        if (__sync_bool_compare_and_swap(reg, old, rank))
+            break;
+        old = *reg;
+    }
+}
+
+/* hash must be a well mixed 64 bit hash, such as one from stats_sketch_hash */
+void stats_hll_add_hash(struct stats_hll *hll, unsigned long long hash)
+{
+    int index;
+    unsigned long long w;
+
+    if (hll == NULL)
+        return;
+
+    index = (int)(hash >> (64 - STATS_HLL_PRECISION));
+
+    /* the rank is the position of the first 1 bit after the index bits. the
+       extra bit stops the count at the maximum possible rank */
+    w = (hash << STATS_HLL_PRECISION) | (1ull << (STATS_HLL_PRECISION - 1));
+
+    hll_register_max(hll, index, (unsigned char)(__builtin_clzll(w) + 1));
+}
+
+long long stats_hll_estimate(struct stats_hll *hll)
+{
+    double sum = 0.0, alpha, m, e;
+    int i, zeros = 0;
+    unsigned char r;
+
+    if (hll == NULL)
+        return 0;
+
+    m = STATS_HLL_REGISTERS;
+
+    for (i = 0; i < STATS_HLL_REGISTERS; i++)
+    {
+        r = hll->hll_register[i];
+        sum += ldexp(1.0, -r);
+        if (r == 0)
+            zeros++;
+    }
+
+    alpha = 0.7213 / (1.0 + 1.079 / m);
+    e = alpha * m * m / sum;
+
+    /* use linear counting while many registers are still empty */
+    if (e <= 2.5 * m && zeros > 0)
+        e = m * log(m / zeros);
+
+    return (long long)(e + 0.5);
+}
+
+/* merges src into dst. dst then estimates the size of the union of both */
+void stats_hll_merge(struct stats_hll *dst, struct stats_hll *src)
+{
+    int i;
+
+    if (dst == NULL || src == NULL)
+        return;
+
+    for (i = 0; i < STATS_HLL_REGISTERS; i++)
+    {
+        hll_register_max(dst, i, src->hll_register[i]);
+    }
+}
+
+void stats_hll_clear(struct stats_hll *hll)
+{
+    if (hll != NULL)
+        memset(hll->hll_register, 0, sizeof(hll->hll_register));
+}
+
+
+/**
+ * top-k (space-saving)
+ */
+
+static void topk_lock(struct stats_topk *topk)
+{
+    int pid = getpid();
+    int holder, spins = 0;
+
+    for (;;)
+    {
+        holder = topk->topk_lock;
+        if (holder == 0)
+        {
+            if (__sync_bool_compare_and_swap(&topk->topk_lock, 0, pid))
+                return;
+            continue;
+        }
+
+        if (++spins >= TOPK_SPIN_CHECK)
+        {
+            spins = 0;
+
+            /* if the holder died while updating the table, take over its lock */
+            if (kill(holder, 0) == -1 && errno == ESRCH)
+            {
+                if (__sync_bool_compare_and_swap(&topk->topk_lock, holder, pid))
+                    return;
+            }
+
+            sched_yield();
+        }
+    }
+}
+
+static void topk_unlock(struct stats_topk *topk)
+{
+    __sync_lock_release(&topk->topk_lock);
+}
+
+/*
+ * stats_allocate_topk
+ *
+ * Allocates (or finds) the top-k counter named name.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - a counter with that name exists and is not a top-k
+ *    ERROR_STATS_CANNOT_ALLOCATE_SKETCH - all of the top-k sketches are in use
+ *    any error returned by stats_allocate_counter
+ */
+int stats_allocate_topk(struct stats *stats, const char *name, struct stats_topk **topk_out)
+{
+    int err, index;
+
+    if (!stats || stats->data == NULL || topk_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = sketch_allocate(stats, name, CTR_FLAG_TOPK, &stats->data->topk[0].topk_allocated,
+        sizeof(struct stats_topk), STATS_TOPK_TABLE_SIZE, topk_clear, &index);
+
+    *topk_out = (err == S_OK) ? stats->data->topk + index : NULL;
+
+    return err;
+}
+
+/* adds count occurrences of key, which may already be overestimated by error. must hold the lock */
+static void topk_offer(struct stats_topk *topk, const char *key, int len, long long count, long long error)
+{
+    struct stats_topk_entry *e, *free_entry = NULL, *min_entry = NULL;
+    int i;
+
+    for (i = 0; i < STATS_TOPK_SIZE; i++)
+    {
+        e = topk->topk_entry + i;
+        if (e->topk_key_len == 0)
+        {
+            if (free_entry == NULL)
+                free_entry = e;
+        }
+        else if (e->topk_key_len == len && memcmp(e->topk_key, key, len) == 0)
+        {
+            e->topk_count += count;
+            e->topk_error += error;
+            return;
+        }
+        else if (min_entry == NULL || e->topk_count < min_entry->topk_count)
+        {
+            min_entry = e;
+        }
+    }
+
+    if (free_entry != NULL)
+    {
+        e = free_entry;
+        e->topk_count = count;
+        e->topk_error = error;
+    }
+    else
+    {
+        /* evict the smallest entry. the new key may have been counted as
+           part of the evicted entry, so its count starts there */
+        e = min_entry;
+        e->topk_error = e->topk_count + error;
+        e->topk_count = e->topk_count + count;
+    }
+
+    memcpy(e->topk_key, key, len);
+    e->topk_key_len = len;
+}
+
+void stats_topk_add(struct stats_topk *topk, const char *key, int len, long long count)
+{
+    if (topk == NULL || key == NULL || len <= 0)
+        return;
+
+    if (len > STATS_TOPK_KEY_LENGTH)
+        len = STATS_TOPK_KEY_LENGTH;
+
+    __sync_fetch_and_add(&topk->topk_total, count);
+
+    topk_lock(topk);
+    topk_offer(topk, key, len, count, 0);
+    topk_unlock(topk);
+}
+
+static int topk_entry_compare(const void *a, const void *b)
+{
+    const struct stats_topk_entry *ea = (const struct stats_topk_entry *)a;
+    const struct stats_topk_entry *eb = (const struct stats_topk_entry *)b;
+
+    if (ea->topk_count != eb->topk_count)
+        return ea->topk_count < eb->topk_count ? 1 : -1;
+    return 0;
+}
+
+/*
+ * stats_topk_get
+ *
+ * Copies the tracked keys into entries, most frequent first.
+ *
+ * Returns the number of entries copied.
+ */
+int stats_topk_get(struct stats_topk *topk, struct stats_topk_entry *entries, int max_entries)
+{
+    struct stats_topk_entry copy[STATS_TOPK_SIZE];
+    int i, n = 0;
+
+    if (topk == NULL || entries == NULL || max_entries <= 0)
+        return 0;
+
+    topk_lock(topk);
+    for (i = 0; i < STATS_TOPK_SIZE; i++)
+    {
+        if (topk->topk_entry[i].topk_key_len > 0)
+            copy[n++] = topk->topk_entry[i];
+    }
+    topk_unlock(topk);
+
+    qsort(copy, n, sizeof(struct stats_topk_entry), topk_entry_compare);
+
+    if (n > max_entries)
+        n = max_entries;
+
+    memcpy(entries, copy, n * sizeof(struct stats_topk_entry));
+
+    return n;
+}
+
+/* merges src into dst. the errors of merged keys are carried over */
+void stats_topk_merge(struct stats_topk *dst, struct stats_topk *src)
+{
+    struct stats_topk_entry entries[STATS_TOPK_SIZE];
+    int i, n;
+
+    if (dst == NULL || src == NULL || dst == src)
+        return;
+
+    n = stats_topk_get(src, entries, STATS_TOPK_SIZE);
+
+    __sync_fetch_and_add(&dst->topk_total, src->topk_total);
+
+    topk_lock(dst);
+    for (i = 0; i < n; i++)
+    {
+        topk_offer(dst, entries[i].topk_key, entries[i].topk_key_len, entries[i].topk_count, entries[i].topk_error);
+    }
+    topk_unlock(dst);
+}
+
+void stats_topk_clear(struct stats_topk *topk)
+{
+    if (topk == NULL)
+        return;
+
+    topk_lock(topk);
+    memset(topk->topk_entry, 0, sizeof(topk->topk_entry));
+    topk->topk_total = 0;
+    topk_unlock(topk);
+}
+
+
+/**
+ * quantiles (DDSketch)
+ */
+
+static double quantile_log_gamma()
+{
+    return log((1.0 + STATS_QUANTILE_ACCURACY) / (1.0 - STATS_QUANTILE_ACCURACY));
+}
+
+static int quantile_bucket(double value)
+{
+    int i;
+
+    i = (int) ceil(log(value) / quantile_log_gamma());
+    if (i < 0)
+        return 0;
+    if (i >= STATS_QUANTILE_BUCKETS)
+        return STATS_QUANTILE_BUCKETS - 1;
+    return i;
+}
+
+/* the value within the relative error of every value in bucket i */
+static double quantile_bucket_value(int i)
+{
+    double gamma = exp(quantile_log_gamma());
+
+    return 2.0 * exp(i * quantile_log_gamma()) / (gamma + 1.0);
+}
+
+/*
+ * stats_allocate_quantile
+ *
+ * Allocates (or finds) the quantile counter named name.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - a counter with that name exists and is not a quantile
+ *    ERROR_STATS_CANNOT_ALLOCATE_SKETCH - all of the quantile sketches are in use
+ *    any error returned by stats_allocate_counter
+ */
+int stats_allocate_quantile(struct stats *stats, const char *name, struct stats_quantile **quantile_out)
+{
+    int err, index;
+
+    if (!stats || stats->data == NULL || quantile_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = sketch_allocate(stats, name, CTR_FLAG_QUANTILE, &stats->data->quantile[0].qs_allocated,
+        sizeof(struct stats_quantile), STATS_QUANTILE_TABLE_SIZE, quantile_clear, &index);
+
+    *quantile_out = (err == S_OK) ? stats->data->quantile + index : NULL;
+
+    return err;
+}
+
+void stats_quantile_add(struct stats_quantile *qs, double value)
+{
+    if (qs == NULL)
+        return;
+
+    if (value > 0.0)
+        __sync_fetch_and_add(&qs->qs_bucket[quantile_bucket(value)], 1ll);
+    else
+        __sync_fetch_and_add(&qs->qs_zero, 1ll);
+
+    __sync_fetch_and_add(&qs->qs_sum, (long long)(value + 0.5));
+    __sync_fetch_and_add(&qs->qs_count, 1ll);
+}
+
+/*
+ * stats_quantile_get
+ *
+ * Returns the q quantile (0 <= q <= 1) of the values added, or 0 if no
+ * values have been added.
+ */
+double stats_quantile_get(struct stats_quantile *qs, double q)
+{
+    long long total, rank, seen;
+    int i, last = -1;
+
+    if (qs == NULL)
+        return 0.0;
+
+    /* count from the buckets rather than qs_count, which writers update last */
+    total = qs->qs_zero;
+    for (i = 0; i < STATS_QUANTILE_BUCKETS; i++)
+    {
+        if (qs->qs_bucket[i] != 0)
+        {
+            total += qs->qs_bucket[i];
+            last = i;
+        }
+    }
+
+    if (total == 0)
+        return 0.0;
+
+    if (q < 0.0)
+        q = 0.0;
+    if (q > 1.0)
+        q = 1.0;
+
+    rank = (long long)(q * (total - 1));
+
+    seen = qs->qs_zero;
+    if (rank < seen)
+        return 0.0;
+
+    for (i = 0; i < last; i++)
+    {
+        seen += qs->qs_bucket[i];
+        if (rank < seen)
+            return quantile_bucket_value(i);
+    }
+
+    return last >= 0 ? quantile_bucket_value(last) : 0.0;
+}
+
+long long stats_quantile_count(struct stats_quantile *qs)
+{
+    return qs != NULL ? qs->qs_count : 0;
+}
+
+/* merges src into dst. the merged quantiles have the same error bound */
+void stats_quantile_merge(struct stats_quantile *dst, struct stats_quantile *src)
+{
+    int i;
+
+    if (dst == NULL || src == NULL || dst == src)
+        return;
+
+    for (i = 0; i < STATS_QUANTILE_BUCKETS; i++)
+    {
+        if (src->qs_bucket[i] != 0)
+            __sync_fetch_and_add(&dst->qs_bucket[i], src->qs_bucket[i]);
+    }
+
+    __sync_fetch_and_add(&dst->qs_zero, src->qs_zero);
+    __sync_fetch_and_add(&dst->qs_sum, src->qs_sum);
+    __sync_fetch_and_add(&dst->qs_count, src->qs_count);
+}
+
+/*
+ * stats_quantile_delta
+ *
+ * Sets out to the values added between two copies of a sketch, so that
+ * quantiles can be reported for a time window. If the sketch was reset
+ * between the copies, out is a copy of cur.
+ */
+void stats_quantile_delta(struct stats_quantile *out, struct stats_quantile *cur, struct stats_quantile *prev)
+{
+    int i;
+
+    if (out == NULL || cur == NULL)
+        return;
+
+    if (prev == NULL || cur->qs_count < prev->qs_count)
+    {
+        memcpy(out, cur, sizeof(struct stats_quantile));
+        return;
+    }
+
+    out->qs_allocated = cur->qs_allocated;
+    out->qs_reserved = 0;
+    out->qs_count = cur->qs_count - prev->qs_count;
+    out->qs_zero = cur->qs_zero - prev->qs_zero;
+    out->qs_sum = cur->qs_sum - prev->qs_sum;
+
+    for (i = 0; i < STATS_QUANTILE_BUCKETS; i++)
+    {
+        out->qs_bucket[i] = cur->qs_bucket[i] - prev->qs_bucket[i];
+    }
+}
+
+void stats_quantile_clear(struct stats_quantile *qs)
+{
+    if (qs == NULL)
+        return;
+
+    memset(qs->qs_bucket, 0, sizeof(qs->qs_bucket));
+    qs->qs_zero = 0;
+    qs->qs_sum = 0;
+    qs->qs_count = 0;
+}
+
+
+/**
+ * sketch counters
+ */
+
+struct stats_hll *stats_counter_get_hll(struct stats *stats, struct stats_counter *ctr)
+{
+    unsigned int index;
+
+    if (!stats || stats->data == NULL || ctr == NULL || (ctr->ctr_flags & CTR_FLAG_HLL) == 0)
+        return NULL;
+
+    index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+
+    return index < STATS_HLL_TABLE_SIZE ? stats->data->hll + index : NULL;
+}
+
+struct stats_topk *stats_counter_get_topk(struct stats *stats, struct stats_counter *ctr)
+{
+    unsigned int index;
+
+    if (!stats || stats->data == NULL || ctr == NULL || (ctr->ctr_flags & CTR_FLAG_TOPK) == 0)
+        return NULL;
+
+    index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+
+    return index < STATS_TOPK_TABLE_SIZE ? stats->data->topk + index : NULL;
+}
+
+struct stats_quantile *stats_counter_get_quantile(struct stats *stats, struct stats_counter *ctr)
+{
+    unsigned int index;
+
+    if (!stats || stats->data == NULL || ctr == NULL || (ctr->ctr_flags & CTR_FLAG_QUANTILE) == 0)
+        return NULL;
+
+    index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+
+    return index < STATS_QUANTILE_TABLE_SIZE ? stats->data->quantile + index : NULL;
+}
+
+/*
+ * stats_sketch_merge
+ *
+ * Merges the sketch of src_ctr into the sketch of dst_ctr. The stats may
+ * be the same or different stats, so sketches can be aggregated across
+ * processes, segments and (with copies) time windows.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - the counters are not sketches of the same type
+ */
+int stats_sketch_merge(struct stats *dst, struct stats_counter *dst_ctr, struct stats *src, struct stats_counter *src_ctr)
+{
+    int type;
+
+    if (!dst || !dst_ctr || !src || !src_ctr)
+        return ERROR_INVALID_PARAMETERS;
+
+    type = dst_ctr->ctr_flags & CTR_FLAG_SKETCH_MASK;
+    if (type == 0 || type != (src_ctr->ctr_flags & CTR_FLAG_SKETCH_MASK))
+        return ERROR_STATS_WRONG_COUNTER_TYPE;
+
+    switch (type)
+    {
+    case CTR_FLAG_HLL:
+        stats_hll_merge(stats_counter_get_hll(dst, dst_ctr), stats_counter_get_hll(src, src_ctr));
+        break;
+    case CTR_FLAG_TOPK:
+        stats_topk_merge(stats_counter_get_topk(dst, dst_ctr), stats_counter_get_topk(src, src_ctr));
+        break;
+    case CTR_FLAG_QUANTILE:
+        stats_quantile_merge(stats_counter_get_quantile(dst, dst_ctr), stats_counter_get_quantile(src, src_ctr));
+        break;
+    default:
+        return ERROR_STATS_WRONG_COUNTER_TYPE;
+    }
+
+    return S_OK;
+}
+
+long long stats_sketch_value(struct stats_data *data, struct stats_counter *ctr)
+{
+    unsigned int index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+
+    if ((ctr->ctr_flags & CTR_FLAG_HLL) && index < STATS_HLL_TABLE_SIZE)
+        return stats_hll_estimate(data->hll + index);
+
+    if ((ctr->ctr_flags & CTR_FLAG_TOPK) && index < STATS_TOPK_TABLE_SIZE)
+        return data->topk[index].topk_total;
+
+    if ((ctr->ctr_flags & CTR_FLAG_QUANTILE) && index < STATS_QUANTILE_TABLE_SIZE)
+        return data->quantile[index].qs_count;
+
+    return 0;
+}
+
+void stats_sketch_clear(struct stats_data *data, struct stats_counter *ctr)
+{
+    unsigned int index = CTR_FLAG_SKETCH_INDEX(ctr->ctr_flags);
+
+    if ((ctr->ctr_flags & CTR_FLAG_HLL) && index < STATS_HLL_TABLE_SIZE)
+        stats_hll_clear(data->hll + index);
+
+    if ((ctr->ctr_flags & CTR_FLAG_TOPK) && index < STATS_TOPK_TABLE_SIZE)
+        stats_topk_clear(data->topk + index);
+
+    if ((ctr->ctr_flags & CTR_FLAG_QUANTILE) && index < STATS_QUANTILE_TABLE_SIZE)
+        stats_quantile_clear(data->quantile + index);
+}
@@ -7,19 +7,41 @@
 #include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #ifdef DARWIN
 #include <mach/mach_time.h>
 #endif
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 #include "stats/error.h"
 #include "stats/stats.h"
 #include "stats/hash.h"
+#include "stats/registry.h"
 #include "stats/debug.h"
 
 
 static void stats_init_data(struct stats *stats);
+static int stats_attach(struct stats *stats);
+static int stats_check_layout(struct stats_data *data);
+static int stats_open_private(struct stats *stats);
+static void stats_lock(struct stats *stats);
+static void stats_unlock(struct stats *stats);
 static int stats_hash_probe(struct stats_data *data, const char *key, int len);
+static int stats_wait_for_reset(struct stats_data *data);
+
+
+/* how long to wait for another process to finish resetting the counters
+   before ending its reset even though it has not exited. a backstop for a
+   resetter which is stuck, or died before recording its pid */
+#define STATS_RESET_TIMEOUT_NS      10000000000ll
 
 
 #ifdef DARWIN
@@ -84,6 +106,26 @@ long long time_delta_to_nanos(long long start, long long end)
  *    ERROR_MEMORY                      - out of memory / memory allocation error
  */
 int stats_create(const char *name, struct stats **stats_out)
+{
+    return stats_create_with_flags(name, 0, stats_out);
+}
+
+/*
+ * stats_create_with_flags
+ *
+ * Same as stats_create, with flags controlling how the stats are backed.
+ *
+ * STATS_FLAG_PRIVATE - the stats data lives in anonymous memory private to
+ *      this process and is protected by a pthread mutex instead of a
+ *      semaphore. No files or IPC objects are created, so nothing is left
+ *      behind if the process dies. Other processes cannot see the counters
+ *      (a child created with fork gets a copy-on-write snapshot).
+ *
+ * STATS_FLAG_OPEN_EXISTING - stats_open only attaches to data which exists
+ *      and is initialized, and fails otherwise. Used by readers which must
+ *      not bring back a segment that has gone (see registry.h).
+ */
+int stats_create_with_flags(const char *name, int flags, struct stats **stats_out)
 {
     struct stats * stats = NULL;
     int err;
@@ -91,7 +133,7 @@ int stats_create(const char *name, struct stats **stats_out)
     char mem_name[SHARED_MEMORY_MAX_NAME_LEN];
 
     /* printf("Sizeof stats counter is %ld\n",sizeof(struct stats_counter)); */
-    assert(sizeof(struct stats_header) == 16);
+    assert(sizeof(struct stats_header) == 48);
     assert(sizeof(struct stats_counter) == 56);
 
     if (stats_out == NULL)
@@ -116,7 +158,9 @@ int stats_create(const char *name, struct stats **stats_out)
     }
 
     stats->magic = STATS_MAGIC;
+    stats->flags = flags;
     stats->data = NULL;
+    stats->providers = NULL;
 
     err = lock_init(&stats->lock, lock_name);
     if (err != S_OK)
@@ -126,6 +170,8 @@ int stats_create(const char *name, struct stats **stats_out)
     if (err != S_OK)
         goto fail;
 
+    shared_memory_set_key_id(&stats->shmem, STATS_LAYOUT_VERSION);
+
     err = S_OK;
     goto ok;
 
@@ -148,6 +194,10 @@ ok:
  * Opens the resources needed for a stats object. After this call returns
  * successfully, the stats object is ready for use.
  *
+ * If the stats data already exists and is initialized, stats_open only
+ * attaches to it (see stats_attach). Otherwise it takes the lock, creates
+ * the files and shared memory as needed and initializes the data.
+ *
  * The resources allocated by stats_open must be freed by a corresponding
  * call to stats_close().
  *
@@ -162,10 +212,24 @@ int stats_open(struct stats *stats)
     if (!stats || stats->magic != STATS_MAGIC || stats->data != NULL)
         return ERROR_INVALID_PARAMETERS;
 
+    if (stats->flags & STATS_FLAG_PRIVATE)
+        return stats_open_private(stats);
+
     assert(!lock_is_open(&stats->lock));
     assert(!shared_memory_is_open(&stats->shmem));
     assert(stats->data == NULL);
 
+    err = stats_attach(stats);
+    if (err == S_OK)
+    {
+        stats_registry_add(stats);
+        return S_OK;
+    }
+
+    /* never create the data, or wait for it to be initialized */
+    if (stats->flags & STATS_FLAG_OPEN_EXISTING)
+        return err;
+
     /* open the lock */
     err = lock_open(&stats->lock);
     if (err == S_OK)
@@ -183,15 +247,40 @@ int stats_open(struct stats *stats)
             /* get the pointer to the shared memory and initialize it if this process created it */
             stats->data = (struct stats_data *) shared_memory_ptr(&stats->shmem);
 
-            if (shared_memory_was_created(&stats->shmem))
+            /* the segment is reported as created by this process when this
+               process created it earlier, so only initialize it once */
+            if (shared_memory_was_created(&stats->shmem) && stats->data->hdr.stats_magic != STATS_MAGIC)
             {
                 stats_init_data(stats);
             }
+            else if (stats->data->hdr.stats_ready != 1)
+            {
+                /* the creator initialized the data under the lock but died
+                   before setting stats_ready */
+                __sync_synchronize();
+                stats->data->hdr.stats_ready = 1;
+            }
 
             assert(stats->data->hdr.stats_magic == STATS_MAGIC);
+
+            err = stats_check_layout(stats->data);
+            if (err == S_OK)
+            {
+                stats_profile_attach(stats->data);
+                stats_process_attach(stats->data);
+                stats_registry_add(stats);
+            }
+            else
+            {
+                shared_memory_detach(&stats->shmem);
+                stats->data = NULL;
+            }
         }
 
         lock_release(&stats->lock);
+
+        if (err != S_OK)
+            lock_close(&stats->lock, 0);
     }
 
     assert((err == S_OK && stats->data != NULL) || (err != S_OK && stats->data == NULL));
@@ -199,19 +288,184 @@ int stats_open(struct stats *stats)
     return err;
 }
 
+/*
+ * stats_attach
+ *
+ * The fast path of stats_open. Many processes opening the same stats at
+ * once (a pre-forked server starting its children) would all queue on the
+ * lock, which is only needed to create and initialize the data. If the
+ * data already exists and stats_ready is set, it is attached without
+ * taking the lock, creating any files or asking who created the segment.
+ *
+ * Returns S_OK if attached. Otherwise nothing is left open and stats_open
+ * takes the slow path.
+ */
+static int stats_attach(struct stats *stats)
+{
+    struct stats_data *data;
+    int err;
+
+    err = lock_attach(&stats->lock);
+    if (err != S_OK)
+        return err;
+
+    err = shared_memory_attach(&stats->shmem);
+    if (err != S_OK)
+    {
+        lock_close(&stats->lock, 0);
+        return err;
+    }
+
+    data = (struct stats_data *) shared_memory_ptr(&stats->shmem);
+
+    /* stats_ready is written last by stats_init_data. read the rest after it.
+       data of another layout, or which needs an upgrade, is left to the
+       slow path */
+    if (data->hdr.stats_magic != STATS_MAGIC || *(volatile int *) &data->hdr.stats_ready != 1)
+        err = ERROR_FAIL;
+    else
+        err = stats_check_layout(data);
+
+    if (err != S_OK)
+    {
+        shared_memory_detach(&stats->shmem);
+        lock_close(&stats->lock, 0);
+        return err;
+    }
+    __sync_synchronize();
+
+    stats->data = data;
+    stats_profile_attach(stats->data);
+    stats_process_attach(stats->data);
+
+    return S_OK;
+}
+
+/*
+ * stats_check_layout
+ *
+ * Returns:
+ *    S_OK                              - the data has the layout of this build
+ *    ERROR_STATS_LAYOUT_VERSION        - the data has another layout version or size
+ *    ERROR_STATS_LAYOUT_FEATURES       - the data uses an incompatible feature this build does not know
+ */
+static int stats_check_layout(struct stats_data *data)
+{
+    if (data->hdr.stats_version != STATS_LAYOUT_VERSION || data->hdr.stats_size != sizeof(struct stats_data))
+    {
+        DPRINTF("Stats data has layout version %d size %d, expected %d size %d\n", data->hdr.stats_version,
+            data->hdr.stats_size, STATS_LAYOUT_VERSION, (int) sizeof(struct stats_data));
+        return ERROR_STATS_LAYOUT_VERSION;
+    }
+
+    if (data->hdr.stats_features & STATS_FEATURE_INCOMPAT_MASK & ~STATS_FEATURES_KNOWN)
+        return ERROR_STATS_LAYOUT_FEATURES;
+
+    return S_OK;
+}
+
+static int stats_counter_features(int flags)
+{
+    int features = 0;
+
+    if (flags & CTR_FLAG_REAL_MASK)
+        features |= STATS_FEATURE_REAL;
+    if (flags & CTR_FLAG_PER_PROCESS)
+        features |= STATS_FEATURE_PER_PROCESS;
+    if (flags & CTR_FLAG_SKETCH_MASK)
+        features |= STATS_FEATURE_SKETCH;
+
+    return features;
+}
+
+/*
+ * stats_open_private
+ *
+ * Opens a STATS_FLAG_PRIVATE stats object: the data is mapped from
+ * anonymous memory and the lock is a process local mutex.
+ */
+static int stats_open_private(struct stats *stats)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, sizeof(struct stats_data), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return ERROR_MEMORY;
+
+    if (pthread_mutex_init(&stats->mutex, NULL) != 0)
+    {
+        munmap(ptr, sizeof(struct stats_data));
+        return ERROR_FAIL;
+    }
+
+    DPRINTF("Opened private stats %s at 0x%016lx\n", shared_memory_name(&stats->shmem), (intptr_t) ptr);
+
+    stats->data = (struct stats_data *) ptr;
+    stats_init_data(stats);
+    stats_profile_attach(stats->data);
+    stats_process_attach(stats->data);
+
+    return S_OK;
+}
+
 static void stats_init_data(struct stats *stats)
 {
     DPRINTF("Intializing stats data\n");
 
     memset(stats->data,0,sizeof(struct stats_data));
     stats->data->hdr.stats_magic = STATS_MAGIC;
+    stats->data->hdr.stats_version = STATS_LAYOUT_VERSION;
+    stats->data->hdr.stats_size = sizeof(struct stats_data);
+
+    /* publish the initialized data to stats_attach */
+    __sync_synchronize();
+    stats->data->hdr.stats_ready = 1;
+}
+
+static void stats_lock(struct stats *stats)
+{
+    if (stats->flags & STATS_FLAG_PRIVATE)
+        pthread_mutex_lock(&stats->mutex);
+    else
+        lock_acquire(&stats->lock);
+}
+
+static void stats_unlock(struct stats *stats)
+{
+    if (stats->flags & STATS_FLAG_PRIVATE)
+        pthread_mutex_unlock(&stats->mutex);
+    else
+        lock_release(&stats->lock);
 }
 
 int stats_close(struct stats *stats)
 {
-    int shared_mem_destroyed;
+    int shared_mem_destroyed = 0;
+
+    stats_providers_stop(stats);
+
+    if (stats->data)
+    {
+        stats_profile_detach(stats->data);
+        stats_process_detach(stats->data);
+    }
+
+    if (stats->flags & STATS_FLAG_PRIVATE)
+    {
+        if (stats->data)
+        {
+            munmap(stats->data, sizeof(struct stats_data));
+            pthread_mutex_destroy(&stats->mutex);
+            stats->data = NULL;
+        }
+        return S_OK;
+    }
+
     shared_memory_close(&stats->shmem,&shared_mem_destroyed);
     lock_close(&stats->lock,shared_mem_destroyed);
+    if (shared_mem_destroyed)
+        stats_registry_remove(stats);
+    stats->data = NULL;
     return S_OK;
 }
 
@@ -222,6 +476,26 @@ int stats_free(struct stats *stats)
 }
 
 int stats_allocate_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out)
+{
+    return stats_allocate_counter_with_flags(stats, name, 0, ctr_out);
+}
+
+/*
+ * stats_allocate_counter_with_flags
+ *
+ * Allocates a counter like stats_allocate_counter. If the counter is
+ * created by this call, its ctr_flags are set to flags. If flags contains
+ * a counter type (CTR_FLAG_TYPE_MASK) and the counter already exists with
+ * a different type, the counter is not returned.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - the stats object or ctr_out was not valid
+ *    ERROR_STATS_KEY_TOO_LONG          - the name is longer than MAX_COUNTER_KEY_LENGTH
+ *    ERROR_STATS_CANNOT_ALLOCATE_COUNTER - the counter table is full
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - the counter exists with a different type
+ */
+int stats_allocate_counter_with_flags(struct stats *stats, const char *name, int flags, struct stats_counter **ctr_out)
 {
     int loc, key_len;
     int err = S_OK;
@@ -237,7 +511,7 @@ int stats_allocate_counter(struct stats *stats, const char *name, struct stats_c
     if (key_len > MAX_COUNTER_KEY_LENGTH)
         return ERROR_STATS_KEY_TOO_LONG;
 
-    lock_acquire(&stats->lock);
+    stats_lock(stats);
 
     loc = stats_hash_probe(stats->data, name, key_len);
     if (loc == -1)
@@ -249,14 +523,27 @@ int stats_allocate_counter(struct stats *stats, const char *name, struct stats_c
         ctr = stats->data->ctr + loc;
         if (ctr->ctr_allocation_status != ALLOCATION_STATUS_ALLOCATED)
         {
-            ctr->ctr_allocation_status = ALLOCATION_STATUS_ALLOCATED;
             ctr->ctr_allocation_seq = stats->data->hdr.stats_sequence_number++;
+            ctr->ctr_flags = flags;
+            if (stats_counter_features(flags) & ~stats->data->hdr.stats_features)
+                __sync_fetch_and_or(&stats->data->hdr.stats_features, stats_counter_features(flags));
             ctr->ctr_key_len = key_len;
             memcpy(ctr->ctr_key, name, key_len);
+
+            /* publish the counter only after the key is in place, so that
+               lock-free readers (stats_find_counter) never see a half
+               written key */
+            __sync_synchronize();
+            ctr->ctr_allocation_status = ALLOCATION_STATUS_ALLOCATED;
+        }
+        else if ((flags & CTR_FLAG_TYPE_MASK) != 0 && (ctr->ctr_flags & CTR_FLAG_TYPE_MASK) != (flags & CTR_FLAG_TYPE_MASK))
+        {
+            err = ERROR_STATS_WRONG_COUNTER_TYPE;
+            ctr = NULL;
         }
     }
 
-    lock_release(&stats->lock);
+    stats_unlock(stats);
 
     *ctr_out = ctr;
 
@@ -265,6 +552,128 @@ int stats_allocate_counter(struct stats *stats, const char *name, struct stats_c
     return err;
 }
 
+/*
+ * stats_allocate_double_counter
+ *
+ * Allocates (or finds) the CTR_FLAG_DOUBLE counter named name.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - a counter with that name exists with a different type
+ *    any error returned by stats_allocate_counter
+ */
+int stats_allocate_double_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out)
+{
+    return stats_allocate_counter_with_flags(stats, name, CTR_FLAG_DOUBLE | CTR_FLAG_64BIT, ctr_out);
+}
+
+/*
+ * stats_allocate_fixed_counter
+ *
+ * Allocates (or finds) the CTR_FLAG_FIXED counter named name, which holds
+ * values with digits decimal digits.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - digits is out of range
+ *    ERROR_STATS_WRONG_COUNTER_TYPE    - a counter with that name exists with a different type or digits
+ *    any error returned by stats_allocate_counter
+ */
+int stats_allocate_fixed_counter(struct stats *stats, const char *name, int digits, struct stats_counter **ctr_out)
+{
+    struct stats_counter *ctr = NULL;
+    int err;
+
+    if (digits < 0 || digits > CTR_FLAG_FIXED_MAX_DIGITS || ctr_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = stats_allocate_counter_with_flags(stats, name, CTR_FLAG_FIXED | CTR_FLAG_64BIT | (digits << CTR_FLAG_FIXED_SHIFT), &ctr);
+    if (err != S_OK)
+        return err;
+
+    if (CTR_FLAG_FIXED_DIGITS(ctr->ctr_flags) != digits)
+        return ERROR_STATS_WRONG_COUNTER_TYPE;
+
+    *ctr_out = ctr;
+
+    return S_OK;
+}
+
+/*
+ * stats_find_counter
+ *
+ * Looks up an existing counter by name. Unlike stats_allocate_counter, this
+ * never creates the counter and does not take the stats lock, so it is safe
+ * to use from read-only processes such as health checks.
+ *
+ * Returns:
+ *    S_OK                              - success, *ctr_out points to the counter
+ *    ERROR_INVALID_PARAMETERS          - the stats object or ctr_out was not valid
+ *    ERROR_STATS_KEY_TOO_LONG          - the name is longer than MAX_COUNTER_KEY_LENGTH
+ *    ERROR_STATS_COUNTER_NOT_FOUND     - no counter with that name has been allocated
+ */
+int stats_find_counter(struct stats *stats, const char *name, struct stats_counter **ctr_out)
+{
+    int loc, key_len;
+
+    if (!stats || stats->magic != STATS_MAGIC || stats->data == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (ctr_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    *ctr_out = NULL;
+
+    key_len = strlen(name);
+    if (key_len > MAX_COUNTER_KEY_LENGTH)
+        return ERROR_STATS_KEY_TOO_LONG;
+
+    /* the probe stops at the first free slot, and counters are never freed,
+       so a free slot (or a full probe sequence) means the key is not present */
+    loc = stats_hash_probe(stats->data, name, key_len);
+    if (loc == -1 || stats->data->ctr[loc].ctr_allocation_status != ALLOCATION_STATUS_ALLOCATED)
+        return ERROR_STATS_COUNTER_NOT_FOUND;
+
+    *ctr_out = stats->data->ctr + loc;
+
+    return S_OK;
+}
+
+/*
+ * stats_find_counters
+ *
+ * Batched version of stats_find_counter. ctrs_out[i] is set to the counter
+ * named names[i], or NULL if that counter does not exist. If found_out is
+ * not NULL, it receives the number of counters which were found.
+ *
+ * Returns:
+ *    S_OK                              - success (even if some names were not found)
+ *    ERROR_INVALID_PARAMETERS          - the stats object or arrays were not valid
+ */
+int stats_find_counters(struct stats *stats, const char **names, int count, struct stats_counter **ctrs_out, int *found_out)
+{
+    int i, n = 0;
+
+    if (!stats || stats->magic != STATS_MAGIC || stats->data == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (!names || !ctrs_out || count < 0)
+        return ERROR_INVALID_PARAMETERS;
+
+    for (i = 0; i < count; i++)
+    {
+        if (names[i] != NULL && stats_find_counter(stats, names[i], ctrs_out + i) == S_OK)
+            n++;
+        else
+            ctrs_out[i] = NULL;
+    }
+
+    if (found_out)
+        *found_out = n;
+
+    return S_OK;
+}
+
 static int ctr_compare(const void * a, const void * b)
 {
     const struct stats_counter *actr = *(struct stats_counter **)a;
@@ -290,7 +699,7 @@ int stats_get_counters(struct stats *stats, struct stats_counter **counters, int
     n = 0;
     i = 0;
 
-    lock_acquire(&stats->lock);
+    stats_lock(stats);
 
     while (i < COUNTER_TABLE_SIZE && n < counter_size)
     {
@@ -304,7 +713,7 @@ int stats_get_counters(struct stats *stats, struct stats_counter **counters, int
 
     seq_no = data->hdr.stats_sequence_number;
 
-    lock_release(&stats->lock);
+    stats_unlock(stats);
 
     qsort(counters,n,sizeof(struct stats_counter *),ctr_compare);
 
@@ -358,9 +767,65 @@ static int stats_hash_probe(struct stats_data *data, const char *key, int len)
     return -1;
 }
 
+/*
+ * stats_wait_for_reset
+ *
+ * Returns the current reset epoch once no reset is in progress. If the
+ * process resetting the counters has exited, or the epoch stays odd for
+ * longer than STATS_RESET_TIMEOUT_NS, its reset is ended by moving the
+ * epoch on to the next even value, so the values it left half cleared are
+ * treated as a reset by deltas and later callers do not wait again. A
+ * resetter which is only slow is waited for.
+ */
+static int stats_wait_for_reset(struct stats_data *data)
+{
+    volatile int *reset_epoch = &data->hdr.stats_reset_epoch;
+    volatile int *reset_pid = &data->hdr.stats_reset_pid;
+    long long deadline = 0;
+    int epoch, pid;
+
+    while ((epoch = *reset_epoch) & 1)
+    {
+        pid = *reset_pid;
+        if (deadline == 0)
+        {
+            deadline = current_time() + STATS_RESET_TIMEOUT_NS;
+        }
+        else if ((pid != 0 && kill(pid, 0) == -1 && errno == ESRCH) || current_time() > deadline)
+        {
+            /* whoever clears the pid ends the reset, so it is ended once */
+            if (__sync_bool_compare_and_swap(reset_pid, pid, 0))
+            {
+                DPRINTF("Ending reset epoch %d left by resetter %d which did not finish\n", epoch, pid);
+                __sync_bool_compare_and_swap(reset_epoch, epoch, epoch + 1);
+            }
+            deadline = 0;
+            continue;
+        }
+        sched_yield();
+    }
+
+    __sync_synchronize();
+
+    return epoch;
+}
+
+/*
+ * stats_reset_counters
+ *
+ * Zeroes every allocated counter without taking the stats lock. The reset
+ * epoch is made odd while the counters are being cleared and even again
+ * afterwards, which lets stats_get_sample avoid capturing a half-reset
+ * table and lets stats_sample_get_delta detect the reset.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - the stats object passed was not valid
+ *    ERROR_STATS_RESET_TIMEOUT         - the reset took so long that another process ended it
+ */
 int stats_reset_counters(struct stats *stats)
 {
-    int i;
+    int i, epoch, pid = getpid();
     struct stats_data *data;
 
     if (!stats || stats->magic != STATS_MAGIC || stats->data == NULL)
@@ -368,26 +833,53 @@ int stats_reset_counters(struct stats *stats)
 
     data = stats->data;
 
-    lock_acquire(&stats->lock);
+    /* claim the reset by moving the (even) epoch to the next odd value */
+    do
+    {
+        epoch = stats_wait_for_reset(data);
+    }
+    while (!__sync_bool_compare_and_swap(&data->hdr.stats_reset_epoch, epoch, epoch + 1));
+
+    /* until the pid is set waiters see 0 and wait, up to the backstop */
+    __sync_lock_test_and_set(&data->hdr.stats_reset_pid, pid);
 
     for (i = 0; i < COUNTER_TABLE_SIZE; i++)
     {
         if (data->ctr[i].ctr_allocation_status == ALLOCATION_STATUS_ALLOCATED)
         {
             __sync_lock_test_and_set(&data->ctr[i].ctr_value.val64,0ll);
+            if (data->ctr[i].ctr_flags & CTR_FLAG_SKETCH_MASK)
+                stats_sketch_clear(data, data->ctr + i);
+            else if (data->ctr[i].ctr_flags & CTR_FLAG_PER_PROCESS)
+                stats_breakdown_clear(data, data->ctr + i);
         }
     }
 
-    lock_release(&stats->lock);
+    /* fails if the reset took so long a waiter ended it */
+    if (!__sync_bool_compare_and_swap(&data->hdr.stats_reset_pid, pid, 0) ||
+        !__sync_bool_compare_and_swap(&data->hdr.stats_reset_epoch, epoch + 1, epoch + 2))
+        return ERROR_STATS_RESET_TIMEOUT;
 
     return S_OK;
 }
 
+struct slot_order
+{
+    int seq;
+    int slot;
+};
+
+static int slot_compare(const void * a, const void * b)
+{
+    return ((const struct slot_order *)a)->seq - ((const struct slot_order *)b)->seq;
+}
+
 int stats_get_counter_list(struct stats *stats, struct stats_counter_list *cl)
 {
     int err = S_OK;
     int i, n;
     struct stats_data *data;
+    struct slot_order order[COUNTER_TABLE_SIZE];
 
     if (!stats || stats->magic != STATS_MAGIC || stats->data == NULL)
         return ERROR_INVALID_PARAMETERS;
@@ -396,17 +888,17 @@ int stats_get_counter_list(struct stats *stats, struct stats_counter_list *cl)
         return ERROR_INVALID_PARAMETERS;
 
     data = stats->data;
-    memset(cl, 0, sizeof(struct stats_counter_list));
     n = 0;
     i = 0;
 
-    lock_acquire(&stats->lock);
+    stats_lock(stats);
 
     while (i < COUNTER_TABLE_SIZE)
     {
         if (data->ctr[i].ctr_allocation_status == ALLOCATION_STATUS_ALLOCATED)
         {
-            cl->cl_ctr[n] = data->ctr + i;
+            order[n].seq = data->ctr[i].ctr_allocation_seq;
+            order[n].slot = i;
             n++;
         }
         i++;
@@ -414,10 +906,16 @@ int stats_get_counter_list(struct stats *stats, struct stats_counter_list *cl)
 
     cl->cl_seq_no = data->hdr.stats_sequence_number;
 
-    lock_release(&stats->lock);
+    stats_unlock(stats);
+
+    qsort(order,n,sizeof(struct slot_order),slot_compare);
+
+    for (i = 0; i < n; i++)
+    {
+        cl->cl_slot[i] = (uint16_t) order[i].slot;
+    }
 
     cl->cl_count = n;
-    qsort(cl->cl_ctr,n,sizeof(struct stats_counter *),ctr_compare);
 
     return err;
 }
@@ -467,25 +965,44 @@ int stats_cl_is_updated(struct stats *stats, struct stats_counter_list *cl)
  */
 
 int stats_sample_create(struct stats_sample **sample_out)
+{
+    return stats_sample_create_with_capacity(COUNTER_TABLE_SIZE + STATS_SAMPLE_MAX_DERIVED, sample_out);
+}
+
+/*
+ * stats_sample_create_with_capacity
+ *
+ * Allocates a sample which can hold up to capacity counter values. Only
+ * the sample header is initialized; the values are written by
+ * stats_get_sample, so a sample of a short counter list only touches the
+ * memory it uses.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - sample_out was NULL or capacity was negative
+ *    ERROR_FAIL                        - out of memory
+ */
+int stats_sample_create_with_capacity(int capacity, struct stats_sample **sample_out)
 {
     struct stats_sample *sample;
 
-    if (sample_out == NULL)
+    if (sample_out == NULL || capacity < 0)
         return ERROR_INVALID_PARAMETERS;
 
-    sample = (struct stats_sample *)malloc(sizeof(struct stats_sample));
+    sample = (struct stats_sample *)malloc(stats_sample_size_for(capacity));
     if (!sample)
         return ERROR_FAIL;
 
-    stats_sample_init(sample);
+    stats_sample_init(sample, capacity);
     *sample_out = sample;
 
     return S_OK;
 }
 
-void stats_sample_init(struct stats_sample *sample)
+void stats_sample_init(struct stats_sample *sample, int capacity)
 {
     memset(sample,0,sizeof(struct stats_sample));
+    sample->sample_capacity = capacity;
 }
 
 void stats_sample_free(struct stats_sample *sample)
@@ -493,10 +1010,38 @@ void stats_sample_free(struct stats_sample *sample)
     free(sample);
 }
 
+/*
+ * stats_sample_copy
+ *
+ * Copies the header and values of src into dst. dst keeps its own capacity.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a sample was NULL
+ *    ERROR_STATS_SAMPLE_TOO_SMALL      - dst cannot hold all of the values in src
+ */
+int stats_sample_copy(struct stats_sample *dst, struct stats_sample *src)
+{
+    int capacity;
+
+    if (dst == NULL || src == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (src->sample_count + src->sample_derived_count > dst->sample_capacity)
+        return ERROR_STATS_SAMPLE_TOO_SMALL;
+
+    capacity = dst->sample_capacity;
+    memcpy(dst, src, stats_sample_size(src));
+    dst->sample_capacity = capacity;
+
+    return S_OK;
+}
+
 int stats_get_sample(struct stats *stats, struct stats_counter_list *cl, struct stats_sample *sample)
 {
+    struct stats_counter *ctr;
     long long sample_time;
-    int i, err;
+    int i, err, epoch;
 
     if (stats == NULL || cl == NULL || sample == NULL)
         return ERROR_INVALID_PARAMETERS;
@@ -514,26 +1059,49 @@ int stats_get_sample(struct stats *stats, struct stats_counter_list *cl, struct
             return err;
     }
 
+    if (cl->cl_count > sample->sample_capacity)
+        return ERROR_STATS_SAMPLE_TOO_SMALL;
+
     /* save the sequence number */
     sample->sample_seq_no = cl->cl_seq_no;
 
     /* save the sample time */
     sample->sample_time = sample_time;
 
-    /* save the sample data */
-    for (i = 0; i < cl->cl_count; i++)
+    /* save the sample data. if a reset starts while the values are being
+       copied, copy them again until the sample is entirely before or
+       entirely after a reset */
+    for (;;)
     {
-        sample->sample_value[i] = cl->cl_ctr[i]->ctr_value;
+        epoch = stats_wait_for_reset(stats->data);
+
+        for (i = 0; i < cl->cl_count; i++)
+        {
+            ctr = stats->data->ctr + cl->cl_slot[i];
+            if (ctr->ctr_flags & CTR_FLAG_SKETCH_MASK)
+                sample->sample_value[i].val64 = stats_sketch_value(stats->data, ctr);
+            else
+                sample->sample_value[i] = ctr->ctr_value;
+        }
+
+        __sync_synchronize();
+
+        if (stats->data->hdr.stats_reset_epoch == epoch)
+            break;
     }
 
+    sample->sample_reset_epoch = epoch;
+
     sample->sample_count = cl->cl_count;
+    sample->sample_derived_count = 0;
+    sample->sample_flags = 0;
 
     return S_OK;
 }
 
 long long stats_sample_get_value(struct stats_sample *sample, int index)
 {
-    if (sample == NULL || index > sample->sample_count)
+    if (sample == NULL || index < 0 || index >= sample->sample_count)
         return 0;
     return sample->sample_value[index].val64;
 }
@@ -541,11 +1109,94 @@ long long stats_sample_get_value(struct stats_sample *sample, int index)
 
 long long stats_sample_get_delta(struct stats_sample *sample, struct stats_sample *prev_sample, int index)
 {
-    if (sample == NULL || index > sample->sample_count || prev_sample == NULL || index > prev_sample->sample_count)
+    if (sample == NULL || index < 0 || index >= sample->sample_count || prev_sample == NULL || index >= prev_sample->sample_count)
         return 0;
+
+    /* if the counters were reset between the samples, the current value is
+       the change since the reset */
+    if (sample->sample_reset_epoch != prev_sample->sample_reset_epoch)
+        return sample->sample_value[index].val64;
+
     return sample->sample_value[index].val64 - prev_sample->sample_value[index].val64;
 }
 
+static const double fixed_scale[CTR_FLAG_FIXED_MAX_DIGITS + 1] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+static double bits_to_double(long long bits)
+{
+    union { long long i; double d; } u;
+
+    u.i = bits;
+    return u.d;
+}
+
+static long long double_to_bits(double d)
+{
+    union { long long i; double d; } u;
+
+    u.d = d;
+    return u.i;
+}
+
+static long long round_to_ll(double d)
+{
+    return (long long)(d < 0.0 ? d - 0.5 : d + 0.5);
+}
+
+/* returns the value of a counter with the given flags which stores value */
+double stats_value_to_double(int flags, long long value)
+{
+    if (flags & CTR_FLAG_DOUBLE)
+        return bits_to_double(value);
+    if (flags & CTR_FLAG_FIXED)
+        return value / fixed_scale[CTR_FLAG_FIXED_DIGITS(flags)];
+    return (double) value;
+}
+
+double stats_sample_get_double(struct stats_sample *sample, int flags, int index)
+{
+    return stats_value_to_double(flags, stats_sample_get_value(sample, index));
+}
+
+/* returns derived value index as a double */
+double stats_sample_get_derived_double(struct stats_sample *sample, int index)
+{
+    if (sample == NULL || index < 0 || index >= sample->sample_derived_count)
+        return 0.0;
+    if (sample->sample_flags & STATS_SAMPLE_FLAG_DERIVED_DOUBLE)
+        return bits_to_double(sample->sample_value[sample->sample_count + index].val64);
+    return (double) sample->sample_value[sample->sample_count + index].val64;
+}
+
+/* returns derived value index, which is stored after the counter values,
+   rounded to an integer */
+long long stats_sample_get_derived(struct stats_sample *sample, int index)
+{
+    if (sample == NULL || index < 0 || index >= sample->sample_derived_count)
+        return 0;
+    if (sample->sample_flags & STATS_SAMPLE_FLAG_DERIVED_DOUBLE)
+        return round_to_ll(stats_sample_get_derived_double(sample, index));
+    return sample->sample_value[sample->sample_count + index].val64;
+}
+
+/* same as stats_sample_get_delta, for values of any counter type */
+double stats_sample_get_delta_double(struct stats_sample *sample, struct stats_sample *prev_sample, int flags, int index)
+{
+    if (!(flags & CTR_FLAG_DOUBLE))
+        return stats_value_to_double(flags, stats_sample_get_delta(sample, prev_sample, index));
+
+    if (sample == NULL || index < 0 || index >= sample->sample_count || prev_sample == NULL || index >= prev_sample->sample_count)
+        return 0.0;
+
+    if (sample->sample_reset_epoch != prev_sample->sample_reset_epoch)
+        return bits_to_double(sample->sample_value[index].val64);
+
+    return bits_to_double(sample->sample_value[index].val64) - bits_to_double(prev_sample->sample_value[index].val64);
+}
+
 /**
  * counter functions
  */
@@ -568,7 +1219,15 @@ void counter_increment(struct stats_counter *ctr)
 {
     if (ctr != NULL)
     {
+        if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+        {
+            counter_add_double(ctr,1.0);
+            return;
+        }
         __sync_fetch_and_add(&ctr->ctr_value.val64,1ll);
+        if (ctr->ctr_flags & CTR_FLAG_PER_PROCESS)
+            stats_process_add(ctr,1ll);
+        STATS_PROFILE_WRITE(ctr);
     }
 }
 
@@ -576,6 +1235,8 @@ long long counter_get_value(struct stats_counter *ctr)
 {
     if (ctr != NULL)
     {
+        if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+            return round_to_ll(counter_get_double(ctr));
         return __sync_fetch_and_add(&ctr->ctr_value.val64,0);
     }
     else
@@ -588,7 +1249,15 @@ void counter_increment_by(struct stats_counter *ctr, long long val)
 {
     if (ctr != NULL)
     {
+        if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+        {
+            counter_add_double(ctr,(double)val);
+            return;
+        }
         __sync_fetch_and_add(&ctr->ctr_value.val64,val);
+        if (ctr->ctr_flags & CTR_FLAG_PER_PROCESS)
+            stats_process_add(ctr,val);
+        STATS_PROFILE_WRITE(ctr);
     }
 }
 
@@ -596,7 +1265,10 @@ void counter_clear(struct stats_counter *ctr)
 {
     if (ctr != NULL)
     {
-        __sync_lock_test_and_set(&ctr->ctr_value.val64,0ll);
+        if (ctr->ctr_flags & CTR_FLAG_PER_PROCESS)
+            stats_process_set(ctr,0ll);
+        else
+            __sync_lock_test_and_set(&ctr->ctr_value.val64,0ll);
     }
 }
 
@@ -604,6 +1276,66 @@ void counter_set(struct stats_counter *ctr, long long val)
 {
     if (ctr != NULL)
     {
-        __sync_lock_test_and_set(&ctr->ctr_value.val64,val);
+        if (ctr->ctr_flags & CTR_FLAG_PER_PROCESS)
+            stats_process_set(ctr,val);
+        else if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+            __sync_lock_test_and_set(&ctr->ctr_value.val64,double_to_bits((double)val));
+        else
+            __sync_lock_test_and_set(&ctr->ctr_value.val64,val);
+        STATS_PROFILE_WRITE(ctr);
+    }
+}
+
+double counter_get_double(struct stats_counter *ctr)
+{
+    if (ctr == NULL)
+        return 0.0;
+
+    return stats_value_to_double(ctr->ctr_flags, __sync_fetch_and_add(&ctr->ctr_value.val64,0));
+}
+
+void counter_set_double(struct stats_counter *ctr, double val)
+{
+    if (ctr == NULL)
+        return;
+
+    if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+        __sync_lock_test_and_set(&ctr->ctr_value.val64,double_to_bits(val));
+    else if (ctr->ctr_flags & CTR_FLAG_FIXED)
+        counter_set(ctr,round_to_ll(val * fixed_scale[CTR_FLAG_FIXED_DIGITS(ctr->ctr_flags)]));
+    else
+        counter_set(ctr,round_to_ll(val));
+}
+
+/*
+ * counter_add_double
+ *
+ * Adds val to a counter of any type. A double counter is updated by
+ * replacing the bits of its value with compare-and-swap until no other
+ * writer has changed it in between.
+ */
+void counter_add_double(struct stats_counter *ctr, double val)
+{
+    long long old;
+
+    if (ctr == NULL)
+        return;
+
+    if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+    {
+        do
+        {
+            old = ctr->ctr_value.val64;
+        }
+        while (!__sync_bool_compare_and_swap(&ctr->ctr_value.val64, old, double_to_bits(bits_to_double(old) + val)));
+        STATS_PROFILE_WRITE(ctr);
+    }
+    else if (ctr->ctr_flags & CTR_FLAG_FIXED)
+    {
+        counter_increment_by(ctr,round_to_ll(val * fixed_scale[CTR_FLAG_FIXED_DIGITS(ctr->ctr_flags)]));
+    }
+    else
+    {
+        counter_increment_by(ctr,round_to_ll(val));
     }
 }
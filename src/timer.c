@@ -0,0 +1,222 @@
+/* timer.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/debug.h"
+
+/* 0 makes the first call on each thread a sampled call */
+__thread int stats_timer_countdown[STATS_TIMER_SLOTS];
+
+/* the rate each of the thread's countdowns was drawn with: the number of
+   calls the call sampled when it runs out stands for */
+static __thread int timer_countdown_rate[STATS_TIMER_SLOTS];
+
+/* the stats each countdown slot is for */
+static struct stats_data *timer_slot_data[STATS_TIMER_SLOTS];
+
+/* a start is the time in microseconds, modulo 2^47, above the rate - 1 */
+#define TIMER_RATE_BITS         16
+#define TIMER_TIME_MASK         ((1ll << 47) - 1)
+
+static __thread unsigned int timer_random_state = 0;
+
+
+/* xorshift32. seeded per thread from the time, pid and the state's address */
+static unsigned int timer_random()
+{
+    unsigned int x = timer_random_state;
+
+    if (x == 0)
+    {
+        x = (unsigned int) current_time() ^ ((unsigned int) getpid() << 16) ^ (unsigned int)(intptr_t) &timer_random_state;
+        if (x == 0)
+            x = 0x9e3779b9;
+    }
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    timer_random_state = x;
+
+    return x;
+}
+
+static int timer_sample_rate(struct stats_data *data)
+{
+    int rate = data->hdr.stats_timer_sample_rate;
+
+    if (rate <= 0)
+        return STATS_TIMER_DEFAULT_SAMPLE_RATE;
+    if (rate > STATS_TIMER_MAX_SAMPLE_RATE)
+        return STATS_TIMER_MAX_SAMPLE_RATE;
+    return rate;
+}
+
+/* the countdown slot of the stats, claiming a free one the first time. when
+   they are all taken the stats share one */
+static int timer_slot(struct stats_data *data)
+{
+    int i;
+
+    for (i = 0; i < STATS_TIMER_SLOTS; i++)
+    {
+        if (timer_slot_data[i] == NULL)
+            __sync_bool_compare_and_swap(&timer_slot_data[i], NULL, data);
+        if (timer_slot_data[i] == data)
+            return i;
+    }
+
+    return (int)(((uintptr_t) data >> 12) % STATS_TIMER_SLOTS);
+}
+
+static long long timer_now_us()
+{
+    return TIME_DELTA_TO_NANOS(0ll, current_time()) / 1000ll;
+}
+
+/*
+ * stats_timer_create
+ *
+ * Allocates a sampled timer and its "<name>" and "<name>.count" counters.
+ *
+ * Returns:
+ *    S_OK                          - success
+ *    ERROR_INVALID_PARAMETERS      - a parameter is NULL
+ *    ERROR_MEMORY                  - out of memory
+ *    ERROR_STATS_KEY_TOO_LONG      - name plus ".count" is longer than MAX_COUNTER_KEY_LENGTH
+ *    any error returned by stats_allocate_counter
+ */
+int stats_timer_create(struct stats *stats, const char *name, struct stats_timer **tmr_out)
+{
+    struct stats_timer *tmr;
+    int err;
+
+    if (tmr_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    tmr = (struct stats_timer *) malloc(sizeof(struct stats_timer));
+    if (tmr == NULL)
+        return ERROR_MEMORY;
+
+    err = stats_timer_init(tmr, stats, name);
+    if (err != S_OK)
+    {
+        free(tmr);
+        return err;
+    }
+
+    *tmr_out = tmr;
+
+    return S_OK;
+}
+
+int stats_timer_init(struct stats_timer *tmr, struct stats *stats, const char *name)
+{
+    char count_name[MAX_COUNTER_KEY_LENGTH+1];
+    int err;
+
+    if (tmr == NULL || stats == NULL || stats->data == NULL || name == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    memset(tmr, 0, sizeof(struct stats_timer));
+
+    if (strlen(name) + strlen(STATS_TIMER_COUNT_SUFFIX) > MAX_COUNTER_KEY_LENGTH)
+        return ERROR_STATS_KEY_TOO_LONG;
+
+    snprintf(count_name, sizeof(count_name), "%s%s", name, STATS_TIMER_COUNT_SUFFIX);
+
+    err = stats_allocate_counter(stats, name, &tmr->tmr_total);
+    if (err != S_OK)
+        return err;
+
+    err = stats_allocate_counter(stats, count_name, &tmr->tmr_count);
+    if (err != S_OK)
+        return err;
+
+    tmr->tmr_data = stats->data;
+    tmr->tmr_slot = timer_slot(stats->data);
+
+    return S_OK;
+}
+
+void stats_timer_free(struct stats_timer *tmr)
+{
+    free(tmr);
+}
+
+/*
+ * stats_timer_sampled_start
+ *
+ * Called by stats_timer_start when the thread's countdown for the stats of
+ * tmr expires. Draws the next countdown uniformly from [1, 2N-1] so the
+ * mean distance between samples is N. Returns the time and the rate the
+ * countdown which ran out was drawn with, which stats_timer_stop scales
+ * the call by.
+ */
+long long stats_timer_sampled_start(struct stats_timer *tmr)
+{
+    long long start;
+    int rate, sampled_rate;
+
+    if (tmr == NULL || tmr->tmr_data == NULL)
+        return 0;
+
+    rate = timer_sample_rate(tmr->tmr_data);
+    sampled_rate = timer_countdown_rate[tmr->tmr_slot] > 0 ? timer_countdown_rate[tmr->tmr_slot] : rate;
+    stats_timer_countdown[tmr->tmr_slot] = 1 + (int)(timer_random() % (unsigned int)(2 * rate - 1));
+    timer_countdown_rate[tmr->tmr_slot] = rate;
+
+    start = ((timer_now_us() & TIMER_TIME_MASK) << TIMER_RATE_BITS) | (sampled_rate - 1);
+
+    /* 0 is a call which was not sampled */
+    return start != 0 ? start : 1ll << TIMER_RATE_BITS;
+}
+
+void stats_timer_stop(struct stats_timer *tmr, long long start_time)
+{
+    long long elapsed;
+    int rate;
+
+    if (start_time == 0 || tmr == NULL || tmr->tmr_data == NULL)
+        return;
+
+    elapsed = (timer_now_us() - (start_time >> TIMER_RATE_BITS)) & TIMER_TIME_MASK;
+    rate = (int)(start_time & ((1 << TIMER_RATE_BITS) - 1)) + 1;
+
+    counter_increment_by(tmr->tmr_total, elapsed * rate);
+    counter_increment_by(tmr->tmr_count, rate);
+}
+
+int stats_get_timer_sample_rate(struct stats *stats)
+{
+    if (stats == NULL || stats->data == NULL)
+        return STATS_TIMER_DEFAULT_SAMPLE_RATE;
+
+    return timer_sample_rate(stats->data);
+}
+
+/*
+ * stats_set_timer_sample_rate
+ *
+ * Sets the sample rate of every sampled timer using these stats. A rate
+ * of 1 times every call; 0 restores the default.
+ *
+ * Returns:
+ *    S_OK                          - success
+ *    ERROR_INVALID_PARAMETERS      - stats is not open or rate is out of range
+ */
+int stats_set_timer_sample_rate(struct stats *stats, int rate)
+{
+    if (stats == NULL || stats->data == NULL || rate < 0 || rate > STATS_TIMER_MAX_SAMPLE_RATE)
+        return ERROR_INVALID_PARAMETERS;
+
+    __sync_lock_test_and_set(&stats->data->hdr.stats_timer_sample_rate, rate);
+
+    return S_OK;
+}
@@ -0,0 +1,317 @@
+/* trace.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "stats/error.h"
+#include "stats/stats.h"
+#include "stats/debug.h"
+
+/*
+ * Record publication only needs the stores to the record to become
+ * visible before the store of tr_seq (and the reader's loads to happen in
+ * order). x86 already guarantees that, so a compiler barrier is enough
+ * and keeps the write path to one locked instruction.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define TRACE_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define TRACE_BARRIER() __sync_synchronize()
+#endif
+
+/* how long stats_trace_open spends measuring the trace clock */
+#define TRACE_CLOCK_CALIBRATION_US 10000
+
+/*
+ * clock_gettime costs more than the rest of stats_trace_event, so on x86
+ * records are stamped with the timestamp counter, which is constant rate
+ * and synchronized across cpus on any cpu this library runs on.
+ */
+static inline long long trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((long long) hi << 32) | lo;
+#else
+    return current_time();
+#endif
+}
+
+/* the pid written into records. cleared in forked children */
+static __thread int trace_pid = 0;
+static pthread_once_t trace_atfork_once = PTHREAD_ONCE_INIT;
+
+static void trace_atfork_child()
+{
+    trace_pid = 0;
+}
+
+static void trace_register_atfork()
+{
+    pthread_atfork(NULL, NULL, trace_atfork_child);
+}
+
+
+static void trace_calibrate(struct stats_trace_header *hdr, int records)
+{
+    long long clock0, time0, clock1, time1;
+
+    time0 = current_time();
+    clock0 = trace_clock();
+    usleep(TRACE_CLOCK_CALIBRATION_US);
+    time1 = current_time();
+    clock1 = trace_clock();
+
+    hdr->trh_records = records;
+    hdr->trh_clock_base = clock0;
+    hdr->trh_time_base = time0;
+    hdr->trh_time_per_tick = clock1 > clock0 ? (double)(time1 - time0) / (double)(clock1 - clock0) : 1.0;
+
+    __sync_synchronize();
+    hdr->trh_magic = STATS_TRACE_MAGIC;
+}
+
+/* converts a trace clock reading to current_time() units */
+static long long trace_time(struct stats_trace_header *hdr, long long clock)
+{
+    if (hdr->trh_magic != STATS_TRACE_MAGIC)
+        return clock;
+
+    return hdr->trh_time_base + (long long)((clock - hdr->trh_clock_base) * hdr->trh_time_per_tick);
+}
+
+/*
+ * stats_trace_create
+ *
+ * Creates a trace object for the "<name>.trc" ring with the given number
+ * of records (0 for STATS_TRACE_DEFAULT_RECORDS). Every process opening
+ * the same ring must use the same number of records.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - the name was too long or records is not a power of 2
+ *    ERROR_MEMORY                      - out of memory
+ */
+int stats_trace_create(const char *name, int records, struct stats_trace **trace_out)
+{
+    struct stats_trace *trace;
+    char mem_name[SHARED_MEMORY_MAX_NAME_LEN];
+    int err;
+
+    if (name == NULL || trace_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (records == 0)
+        records = STATS_TRACE_DEFAULT_RECORDS;
+    if (records < 0 || (records & (records - 1)) != 0)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (strlen(name) + 4 > SHARED_MEMORY_MAX_NAME_LEN)
+        return ERROR_INVALID_PARAMETERS;
+
+    strcpy(mem_name,name);
+    strcat(mem_name,".trc");
+
+    trace = (struct stats_trace *) malloc(sizeof(struct stats_trace));
+    if (trace == NULL)
+        return ERROR_MEMORY;
+
+    trace->magic = STATS_TRACE_MAGIC;
+    trace->records = records;
+    trace->hdr = NULL;
+    trace->rec = NULL;
+
+    err = shared_memory_init(&trace->shmem, mem_name, OMODE_OPEN_OR_CREATE | DESTROY_ON_CLOSE_IF_LAST,
+        sizeof(struct stats_trace_header) + records * sizeof(struct stats_trace_record));
+    if (err != S_OK)
+    {
+        free(trace);
+        return err;
+    }
+
+    *trace_out = trace;
+
+    return S_OK;
+}
+
+/*
+ * stats_trace_open
+ *
+ * Attaches the ring. New shared memory is zero filled, which is an empty
+ * ring, so no lock is needed to initialize it.
+ */
+int stats_trace_open(struct stats_trace *trace)
+{
+    int err;
+
+    assert(sizeof(struct stats_trace_header) == 64);
+    assert(sizeof(struct stats_trace_record) == 32);
+
+    if (!trace || trace->magic != STATS_TRACE_MAGIC || trace->hdr != NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    err = shared_memory_open(&trace->shmem);
+    if (err != S_OK)
+        return err;
+
+    pthread_once(&trace_atfork_once, trace_register_atfork);
+
+    trace->hdr = (struct stats_trace_header *) shared_memory_ptr(&trace->shmem);
+    trace->rec = (struct stats_trace_record *)(trace->hdr + 1);
+
+    /* the creator measures the trace clock. writers do not need to wait */
+    if (shared_memory_was_created(&trace->shmem))
+        trace_calibrate(trace->hdr, trace->records);
+
+    DPRINTF("Opened trace %s with %d records\n", shared_memory_name(&trace->shmem), trace->records);
+
+    return S_OK;
+}
+
+int stats_trace_close(struct stats_trace *trace)
+{
+    int destroyed;
+
+    if (!trace || trace->magic != STATS_TRACE_MAGIC)
+        return ERROR_INVALID_PARAMETERS;
+
+    if (trace->hdr)
+    {
+        shared_memory_close(&trace->shmem, &destroyed);
+        trace->hdr = NULL;
+        trace->rec = NULL;
+    }
+
+    return S_OK;
+}
+
+void stats_trace_free(struct stats_trace *trace)
+{
+    free(trace);
+}
+
+/*
+ * stats_trace_event
+ *
+ * Appends an event to the ring, overwriting the oldest record if the ring
+ * is full.
+ */
+void stats_trace_event(struct stats_trace *trace, int id, long long arg)
+{
+    struct stats_trace_record *r;
+    long long seq;
+
+    if (trace == NULL || trace->hdr == NULL)
+        return;
+
+    if (trace_pid == 0)
+        trace_pid = getpid();
+
+    seq = __sync_fetch_and_add(&trace->hdr->trh_next, 1ll);
+    r = trace->rec + (seq & (trace->records - 1));
+
+    r->tr_seq = 0;
+    TRACE_BARRIER();
+
+    r->tr_time = trace_clock();
+    r->tr_id = id;
+    r->tr_pid = trace_pid;
+    r->tr_arg = arg;
+
+    TRACE_BARRIER();
+    r->tr_seq = seq + 1;
+}
+
+void stats_trace_counter(struct stats_trace *trace, struct stats *stats, struct stats_counter *ctr, long long arg)
+{
+    if (stats == NULL || stats->data == NULL || ctr == NULL)
+        return;
+
+    stats_trace_event(trace, (int)(ctr - stats->data->ctr), arg);
+}
+
+/* the sequence number of the oldest record still in the ring */
+long long stats_trace_oldest(struct stats_trace *trace)
+{
+    long long next = trace->hdr->trh_next;
+
+    return next > trace->records ? next - trace->records : 0;
+}
+
+/*
+ * stats_trace_read
+ *
+ * Copies up to max_records records, starting at sequence number *cursor,
+ * and advances *cursor past them. Records which were overwritten before
+ * they could be read are skipped and counted in *dropped_out. Reading
+ * stops at a record which is still being written.
+ *
+ * Returns:
+ *    S_OK                              - success
+ *    ERROR_INVALID_PARAMETERS          - a parameter is NULL or the trace is not open
+ */
+int stats_trace_read(struct stats_trace *trace, long long *cursor, struct stats_trace_record *records, int max_records,
+    int *count_out, long long *dropped_out)
+{
+    struct stats_trace_record *r;
+    long long seq, next, oldest, dropped = 0;
+    int n = 0;
+
+    if (!trace || trace->hdr == NULL || cursor == NULL || records == NULL || count_out == NULL)
+        return ERROR_INVALID_PARAMETERS;
+
+    seq = *cursor;
+    next = trace->hdr->trh_next;
+    TRACE_BARRIER();
+
+    oldest = next > trace->records ? next - trace->records : 0;
+    if (seq < oldest)
+    {
+        dropped += oldest - seq;
+        seq = oldest;
+    }
+
+    while (seq < next && n < max_records)
+    {
+        r = trace->rec + (seq & (trace->records - 1));
+
+        records[n].tr_seq = r->tr_seq;
+        TRACE_BARRIER();
+        records[n].tr_time = r->tr_time;
+        records[n].tr_id = r->tr_id;
+        records[n].tr_pid = r->tr_pid;
+        records[n].tr_arg = r->tr_arg;
+        TRACE_BARRIER();
+
+        if (records[n].tr_seq == seq + 1 && r->tr_seq == seq + 1)
+        {
+            records[n].tr_time = trace_time(trace->hdr, records[n].tr_time);
+            n++;
+        }
+        else if (records[n].tr_seq > seq + 1 || r->tr_seq > seq + 1)
+        {
+            /* a writer has lapped the reader */
+            dropped++;
+        }
+        else
+        {
+            /* not published yet */
+            break;
+        }
+
+        seq++;
+    }
+
+    *cursor = seq;
+    *count_out = n;
+    if (dropped_out)
+        *dropped_out = dropped;
+
+    return S_OK;
+}
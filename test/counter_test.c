@@ -0,0 +1,1620 @@
+/* counter_test.c */
+
+/*
+ * Single process checks of the counter API. Each test opens the
+ * "ctrtest" stats object, exercises one area of the API and asserts on
+ * the results. The tests are run once against shared memory stats and
+ * once against private (STATS_FLAG_PRIVATE) stats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include "stats/stats.h"
+#include "stats/rollup.h"
+#include "stats/derived.h"
+#include "stats/migrate.h"
+#include "stats/registry.h"
+#include "stats/merge.h"
+#include "stats/record.h"
+#include "stats/capture.h"
+#include "stats/error.h"
+
+static int stats_flags = 0;
+
+static struct stats *open_stats_named(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create_with_flags(name,stats_flags,&stats);
+    if (err != S_OK)
+    {
+        printf("Failed to create stats: %s\n", error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        printf("Failed to open stats: %s\n", error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static struct stats *open_stats()
+{
+    return open_stats_named("ctrtest");
+}
+
+static void close_stats(struct stats *stats)
+{
+    stats_close(stats);
+    stats_free(stats);
+}
+
+int find_test()
+{
+    struct stats *stats;
+    struct stats_counter *ctr = NULL, *found = NULL;
+    struct stats_counter *ctrs[3];
+    const char *names[3] = { "find.a", "find.missing", "find.b" };
+    int err, seq, n;
+
+    printf("find test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    /* looking up a missing counter must not allocate it */
+    seq = stats_get_sequence_number(stats);
+    err = stats_find_counter(stats, "find.missing", &found);
+    assert(err == ERROR_STATS_COUNTER_NOT_FOUND);
+    assert(found == NULL);
+    assert(stats_get_sequence_number(stats) == seq);
+
+    err = stats_allocate_counter(stats, "find.a", &ctr);
+    assert(err == S_OK);
+    counter_increment_by(ctr, 42);
+
+    err = stats_find_counter(stats, "find.a", &found);
+    assert(err == S_OK);
+    assert(found == ctr);
+    assert(counter_get_value(found) == 42);
+
+    err = stats_allocate_counter(stats, "find.b", &ctr);
+    assert(err == S_OK);
+
+    err = stats_find_counters(stats, names, 3, ctrs, &n);
+    assert(err == S_OK);
+    assert(n == 2);
+    assert(ctrs[0] != NULL && ctrs[1] == NULL && ctrs[2] == ctr);
+
+    close_stats(stats);
+
+    return 0;
+}
+
+/* a resetter which is slow, but alive, ends its reset after 50ms */
+static void *slow_resetter(void *arg)
+{
+    struct stats *stats = (struct stats *) arg;
+
+    usleep(50000);
+    stats->data->hdr.stats_reset_pid = 0;
+    __sync_fetch_and_add(&stats->data->hdr.stats_reset_epoch, 1);
+
+    return NULL;
+}
+
+int reset_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *prev_sample = NULL;
+    struct stats_counter *ctr = NULL;
+    long long start;
+    pthread_t thread;
+    pid_t child;
+    int err, epoch, status;
+
+    printf("reset test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK || stats_sample_create(&prev_sample) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    err = stats_allocate_counter(stats, "reset.a", &ctr);
+    assert(err == S_OK);
+    counter_increment_by(ctr, 10);
+
+    err = stats_get_sample(stats, cl, prev_sample);
+    assert(err == S_OK);
+    epoch = prev_sample->sample_reset_epoch;
+    assert((epoch & 1) == 0);
+
+    err = stats_reset_counters(stats);
+    assert(err == S_OK);
+    assert(stats_get_reset_epoch(stats) == epoch + 2);
+    assert(counter_get_value(ctr) == 0);
+
+    counter_increment_by(ctr, 3);
+
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(sample->sample_reset_epoch == epoch + 2);
+
+    /* the delta across a reset is the change since the reset, not 3 - 10 */
+    assert(stats_sample_get_delta(sample, prev_sample, 0) == 3);
+
+    /* a resetter which exited leaves the epoch odd. the next sample sees
+       it has gone, then ends the reset and records it */
+    child = fork();
+    if (child == 0)
+        _exit(0);
+    waitpid(child, &status, 0);
+    stats->data->hdr.stats_reset_pid = child;
+    stats->data->hdr.stats_reset_epoch = epoch + 3;
+    err = stats_get_sample(stats, cl, prev_sample);
+    assert(err == S_OK);
+    assert(prev_sample->sample_reset_epoch == epoch + 4);
+    assert(stats_get_reset_epoch(stats) == epoch + 4);
+    assert(stats_sample_get_delta(prev_sample, sample, 0) == 3);
+    assert(stats->data->hdr.stats_reset_pid == 0);
+
+    start = current_time();
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(TIME_DELTA_TO_NANOS(start, current_time()) < 5000000ll);
+    assert(sample->sample_reset_epoch == epoch + 4);
+
+    err = stats_reset_counters(stats);
+    assert(err == S_OK);
+    assert(stats_get_reset_epoch(stats) == epoch + 6);
+    assert(stats->data->hdr.stats_reset_pid == 0);
+
+    /* a resetter which is alive is waited for however long it takes, and
+       its own end of the reset is the one recorded */
+    stats->data->hdr.stats_reset_pid = getpid();
+    stats->data->hdr.stats_reset_epoch = epoch + 7;
+    assert(pthread_create(&thread, NULL, slow_resetter, stats) == 0);
+    start = current_time();
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(TIME_DELTA_TO_NANOS(start, current_time()) >= 40000000ll);
+    pthread_join(thread, NULL);
+    assert(sample->sample_reset_epoch == epoch + 8);
+    assert(stats_get_reset_epoch(stats) == epoch + 8);
+
+    stats_sample_free(sample);
+    stats_sample_free(prev_sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+int sample_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *small = NULL, *sample = NULL, *copy = NULL;
+    struct stats_counter *a = NULL, *b = NULL;
+    int err;
+
+    printf("sample test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK ||
+        stats_sample_create_with_capacity(1, &small) != S_OK ||
+        stats_sample_create_with_capacity(2, &sample) != S_OK ||
+        stats_sample_create_with_capacity(2, &copy) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    stats_allocate_counter(stats, "sample.a", &a);
+    stats_allocate_counter(stats, "sample.b", &b);
+    counter_set(a, 7);
+    counter_set(b, 9);
+
+    err = stats_get_sample(stats, cl, small);
+    assert(err == ERROR_STATS_SAMPLE_TOO_SMALL);
+
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(cl->cl_count == 2 && sample->sample_count == 2);
+    assert(stats_cl_get_counter(stats, cl, 0) == a);
+    assert(stats_cl_get_counter(stats, cl, 1) == b);
+    assert(stats_sample_size(sample) == sizeof(struct stats_sample) + 2 * sizeof(STATS_VALUE));
+
+    /* samples contain no pointers, so a byte copy is a complete sample */
+    err = stats_sample_copy(copy, sample);
+    assert(err == S_OK);
+    assert(stats_sample_get_value(copy, 0) == 7);
+    assert(stats_sample_get_value(copy, 1) == 9);
+    assert(stats_sample_get_value(copy, 2) == 0);
+
+    err = stats_sample_copy(small, sample);
+    assert(err == ERROR_STATS_SAMPLE_TOO_SMALL);
+
+    stats_sample_free(small);
+    stats_sample_free(sample);
+    stats_sample_free(copy);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+int sketch_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL;
+    struct stats_counter *ctr = NULL;
+    struct stats_hll *hll = NULL, *again = NULL;
+    struct stats_topk *topk = NULL;
+    struct stats_topk_entry entries[STATS_TOPK_SIZE];
+    struct stats_hll other;
+    char key[32];
+    long long estimate;
+    int err, i, n;
+
+    printf("sketch test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    err = stats_allocate_hll(stats, "sketch.users", &hll);
+    assert(err == S_OK && hll != NULL);
+
+    err = stats_allocate_hll(stats, "sketch.users", &again);
+    assert(err == S_OK && again == hll);
+
+    /* a sketch counter cannot be reused as a different type */
+    err = stats_allocate_topk(stats, "sketch.users", &topk);
+    assert(err == ERROR_STATS_WRONG_COUNTER_TYPE);
+
+    for (i = 0; i < 10000; i++)
+    {
+        n = snprintf(key, sizeof(key), "user%d", i % 5000);
+        stats_hll_add(hll, key, n);
+    }
+
+    /* 2048 registers give a standard error of about 2.3% */
+    estimate = stats_hll_estimate(hll);
+    assert(estimate > 4750 && estimate < 5250);
+
+    /* merging a disjoint set roughly doubles the estimate */
+    memset(&other, 0, sizeof(other));
+    for (i = 0; i < 5000; i++)
+    {
+        n = snprintf(key, sizeof(key), "other%d", i);
+        stats_hll_add(&other, key, n);
+    }
+    stats_hll_merge(hll, &other);
+    estimate = stats_hll_estimate(hll);
+    assert(estimate > 9500 && estimate < 10500);
+
+    err = stats_allocate_topk(stats, "sketch.keys", &topk);
+    assert(err == S_OK && topk != NULL);
+
+    for (i = 0; i < 1000; i++)
+    {
+        n = snprintf(key, sizeof(key), "key%d", i);
+        stats_topk_add(topk, key, n, 1);
+        stats_topk_add(topk, "hot", 3, 5);
+    }
+
+    n = stats_topk_get(topk, entries, STATS_TOPK_SIZE);
+    assert(n == STATS_TOPK_SIZE);
+    assert(entries[0].topk_key_len == 3 && memcmp(entries[0].topk_key, "hot", 3) == 0);
+    assert(entries[0].topk_count == 5000 && entries[0].topk_error == 0);
+
+    /* the sample value of a sketch counter is its estimate or total */
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    for (i = 0; i < cl->cl_count; i++)
+    {
+        ctr = stats_cl_get_counter(stats, cl, i);
+        if (stats_counter_get_hll(stats, ctr) == hll)
+            assert(stats_sample_get_value(sample, i) == estimate);
+        if (stats_counter_get_topk(stats, ctr) == topk)
+            assert(stats_sample_get_value(sample, i) == 6000);
+    }
+
+    err = stats_reset_counters(stats);
+    assert(err == S_OK);
+    assert(stats_hll_estimate(hll) == 0);
+    assert(stats_topk_get(topk, entries, STATS_TOPK_SIZE) == 0);
+
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+int quantile_test()
+{
+    struct stats *stats;
+    struct stats_counter *a_ctr = NULL, *b_ctr = NULL;
+    struct stats_quantile *a = NULL, *b = NULL;
+    struct stats_quantile *prev, *window;
+    double p50, p99;
+    int err, i;
+
+    printf("quantile test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    prev = (struct stats_quantile *) malloc(sizeof(struct stats_quantile));
+    window = (struct stats_quantile *) malloc(sizeof(struct stats_quantile));
+    if (!prev || !window)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    err = stats_allocate_quantile(stats, "quantile.a", &a);
+    assert(err == S_OK && a != NULL);
+    err = stats_allocate_quantile(stats, "quantile.b", &b);
+    assert(err == S_OK && b != NULL && b != a);
+
+    assert(stats_quantile_get(a, 0.5) == 0.0);
+
+    /* a holds 1..1000 and b holds 1001..2000 */
+    for (i = 1; i <= 1000; i++)
+    {
+        stats_quantile_add(a, i);
+        stats_quantile_add(b, 1000 + i);
+    }
+
+    p50 = stats_quantile_get(a, 0.5);
+    p99 = stats_quantile_get(a, 0.99);
+    assert(p50 > 500 * 0.98 && p50 < 500 * 1.02);
+    assert(p99 > 990 * 0.98 && p99 < 990 * 1.02);
+    assert(stats_quantile_count(a) == 1000);
+
+    /* merged quantiles keep the same relative error */
+    stats_find_counter(stats, "quantile.a", &a_ctr);
+    stats_find_counter(stats, "quantile.b", &b_ctr);
+    err = stats_sketch_merge(stats, a_ctr, stats, b_ctr);
+    assert(err == S_OK);
+    p50 = stats_quantile_get(a, 0.5);
+    assert(p50 > 1000 * 0.98 && p50 < 1000 * 1.02);
+    assert(stats_quantile_count(a) == 2000);
+
+    /* the delta of two copies covers only the values added in between */
+    memcpy(prev, b, sizeof(struct stats_quantile));
+    for (i = 0; i < 100; i++)
+        stats_quantile_add(b, 10);
+    stats_quantile_delta(window, b, prev);
+    assert(window->qs_count == 100);
+    p99 = stats_quantile_get(window, 0.99);
+    assert(p99 > 10 * 0.98 && p99 < 10 * 1.02);
+
+    free(prev);
+    free(window);
+    close_stats(stats);
+
+    return 0;
+}
+
+int timer_test()
+{
+    struct stats *stats, *other;
+    struct stats_timer *tmr = NULL, *tmr_b = NULL;
+    struct stats_counter *count = NULL, *total = NULL;
+    long long start, inner;
+    int err, i, sampled, countdown;
+
+    printf("timer test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    assert(stats_get_timer_sample_rate(stats) == STATS_TIMER_DEFAULT_SAMPLE_RATE);
+    assert(stats_set_timer_sample_rate(stats, -1) == ERROR_INVALID_PARAMETERS);
+
+    err = stats_timer_create(stats, "timer.a", &tmr);
+    assert(err == S_OK);
+    err = stats_find_counter(stats, "timer.a.count", &count);
+    assert(err == S_OK);
+    err = stats_find_counter(stats, "timer.a", &total);
+    assert(err == S_OK);
+
+    /* a rate of 1 times every call, once the countdown drawn at the old rate runs out */
+    err = stats_set_timer_sample_rate(stats, 1);
+    assert(err == S_OK);
+    for (i = 0; i < 2 * STATS_TIMER_DEFAULT_SAMPLE_RATE; i++)
+    {
+        start = stats_timer_start(tmr);
+        stats_timer_stop(tmr, start);
+    }
+    counter_clear(count);
+    counter_clear(total);
+    for (i = 0; i < 100; i++)
+    {
+        start = stats_timer_start(tmr);
+        assert(start != 0);
+        usleep(10);
+        stats_timer_stop(tmr, start);
+    }
+    assert(counter_get_value(count) == 100);
+    assert(counter_get_value(total) >= 1000);
+
+    /* at a rate of 8 about 1 in 8 calls is timed and the count is scaled by
+       8, except the first, whose countdown was drawn at a rate of 1 */
+    counter_clear(count);
+    err = stats_set_timer_sample_rate(stats, 8);
+    assert(err == S_OK);
+    sampled = 0;
+    for (i = 0; i < 8000; i++)
+    {
+        start = stats_timer_start(tmr);
+        if (start != 0)
+            sampled++;
+        stats_timer_stop(tmr, start);
+    }
+    assert(sampled > 700 && sampled < 1300);
+    assert(counter_get_value(count) == 1 + 8ll * (sampled - 1));
+
+    /* the timers of other stats have their own countdown and rate, and a
+       call nested in a sampled call does not change the rate it is
+       scaled by */
+    other = open_stats_named("ctrtimer");
+    assert(other != NULL);
+    assert(stats_set_timer_sample_rate(other, 1) == S_OK);
+    assert(stats_timer_create(other, "timer.b", &tmr_b) == S_OK);
+    assert(tmr_b->tmr_slot != tmr->tmr_slot);
+    while (stats_timer_countdown[tmr->tmr_slot] > 1)
+    {
+        start = stats_timer_start(tmr);
+        stats_timer_stop(tmr, start);
+    }
+    counter_clear(count);
+    start = stats_timer_start(tmr);
+    assert(start != 0);
+    countdown = stats_timer_countdown[tmr->tmr_slot];
+    for (i = 0; i < 10; i++)
+    {
+        inner = stats_timer_start(tmr_b);
+        assert(inner != 0);
+        stats_timer_stop(tmr_b, inner);
+    }
+    stats_timer_stop(tmr, start);
+    assert(counter_get_value(tmr_b->tmr_count) == 10);
+    assert(counter_get_value(count) == 8);
+    assert(stats_timer_countdown[tmr->tmr_slot] == countdown);
+    stats_timer_free(tmr_b);
+    close_stats(other);
+
+    stats_set_timer_sample_rate(stats, 0);
+    stats_timer_free(tmr);
+    close_stats(stats);
+
+    return 0;
+}
+
+int trace_test()
+{
+    struct stats *stats;
+    struct stats_trace *trace = NULL;
+    struct stats_trace_record records[16];
+    struct stats_counter *ctr = NULL;
+    long long cursor = 0, dropped = 0;
+    int err, i, n;
+
+    printf("trace test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    err = stats_trace_create("ctrtest", 12, &trace);
+    assert(err == ERROR_INVALID_PARAMETERS);
+
+    err = stats_trace_create("ctrtest", 16, &trace);
+    assert(err == S_OK);
+    err = stats_trace_open(trace);
+    assert(err == S_OK);
+
+    stats_allocate_counter(stats, "trace.a", &ctr);
+    for (i = 0; i < 10; i++)
+        stats_trace_counter(trace, stats, ctr, i);
+
+    err = stats_trace_read(trace, &cursor, records, 16, &n, &dropped);
+    assert(err == S_OK);
+    assert(n == 10 && dropped == 0 && cursor == 10);
+    for (i = 0; i < n; i++)
+    {
+        assert(stats->data->ctr + records[i].tr_id == ctr);
+        assert(records[i].tr_arg == i && records[i].tr_pid == getpid());
+        assert(i == 0 || records[i].tr_time >= records[i-1].tr_time);
+    }
+
+    /* lapping the reader drops the records it had not read yet */
+    for (i = 10; i < 40; i++)
+        stats_trace_event(trace, 7, i);
+
+    err = stats_trace_read(trace, &cursor, records, 16, &n, &dropped);
+    assert(err == S_OK);
+    assert(n == 16 && dropped == 14 && cursor == 40);
+    assert(records[0].tr_arg == 24 && records[15].tr_arg == 39);
+
+    err = stats_trace_read(trace, &cursor, records, 16, &n, &dropped);
+    assert(err == S_OK && n == 0 && dropped == 0);
+
+    stats_trace_close(trace);
+    stats_trace_free(trace);
+    close_stats(stats);
+
+    return 0;
+}
+
+int rollup_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *prev_sample = NULL;
+    struct stats_rollup *ru = NULL;
+    struct stats_counter *ctr = NULL;
+    int err, i;
+
+    printf("rollup test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK ||
+        stats_sample_create(&prev_sample) != S_OK || stats_rollup_create(&ru) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    stats_allocate_counter(stats, "http.api.orders.count", &ctr);
+    counter_set(ctr, 5);
+    stats_allocate_counter(stats, "http.api.users.count", &ctr);
+    counter_set(ctr, 7);
+    stats_allocate_counter(stats, "http.static", &ctr);
+    counter_set(ctr, 11);
+
+    err = stats_get_sample(stats, cl, prev_sample);
+    assert(err == S_OK);
+    err = stats_rollup_update(stats, ru, cl);
+    assert(err == S_OK);
+    err = stats_rollup_compute(ru, prev_sample, NULL);
+    assert(err == S_OK);
+
+    assert(stats_rollup_get_value(ru, stats_rollup_find(ru, "http.*")) == 23);
+    assert(stats_rollup_get_value(ru, stats_rollup_find(ru, "http.api.*")) == 12);
+    assert(stats_rollup_get_value(ru, stats_rollup_find(ru, "http.api.orders")) == 5);
+    assert(stats_rollup_find(ru, "http.static") == -1);
+
+    /* counters added later are added to the existing tree */
+    stats_allocate_counter(stats, "http.api.orders.errors", &ctr);
+    counter_set(ctr, 2);
+    stats_allocate_counter(stats, "db.queries", &ctr);
+    counter_set(ctr, 100);
+    stats_find_counter(stats, "http.api.users.count", &ctr);
+    counter_increment_by(ctr, 3);
+
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    err = stats_rollup_update(stats, ru, cl);
+    assert(err == S_OK);
+    assert(ru->ru_counters == cl->cl_count);
+
+    err = stats_rollup_compute(ru, sample, NULL);
+    assert(err == S_OK);
+    assert(stats_rollup_get_value(ru, stats_rollup_find(ru, "http.*")) == 28);
+    assert(stats_rollup_get_value(ru, stats_rollup_find(ru, "db.*")) == 100);
+
+    /* deltas are only taken for counters in both samples, as in stats_sample_get_delta */
+    err = stats_rollup_compute(ru, sample, prev_sample);
+    assert(err == S_OK);
+    assert(stats_rollup_get_value(ru, stats_rollup_find(ru, "http.api.*")) == 3);
+
+    for (i = 0; i < stats_rollup_count(ru); i++)
+        assert(ru->ru_node[i].rn_parent < i);
+
+    stats_rollup_free(ru);
+    stats_sample_free(sample);
+    stats_sample_free(prev_sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+int derived_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *prev_sample = NULL;
+    struct stats_derived *dv = NULL;
+    struct stats_counter *requests = NULL, *errors = NULL;
+    char expr[64];
+    int err, i, refs;
+
+    printf("derived test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK ||
+        stats_sample_create(&prev_sample) != S_OK || stats_derived_create(&dv) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    assert(stats_derived_add(dv, "error_pct", "100 * http.errors / http.requests") == S_OK);
+    assert(stats_derived_add(dv, "qps", "rate(http.requests)") == S_OK);
+    assert(stats_derived_add(dv, "ok", "http.requests - http.errors") == S_OK);
+    assert(stats_derived_add(dv, "ok_neg", "-(ok) + delta(http.requests) * 0 + missing / 0") == S_OK);
+    assert(stats_derived_add(dv, "error_ratio", "http.errors / http.requests") == S_OK);
+
+    assert(stats_derived_add(dv, "bad", "1 +") == ERROR_STATS_DERIVED_SYNTAX);
+    assert(stats_derived_add(dv, "bad", "(1") == ERROR_STATS_DERIVED_SYNTAX);
+    assert(stats_derived_add(dv, "bad", "sqrt(x)") == ERROR_STATS_DERIVED_SYNTAX);
+    assert(stats_derived_add(dv, "qps", "1") == ERROR_STATS_DERIVED_SYNTAX);
+    assert(stats_derived_count(dv) == 5);
+
+    /* rejected expressions do not keep the references they made */
+    refs = dv->dv_ref_count;
+    for (i = 0; i < 2 * STATS_DERIVED_MAX_REFS; i++)
+    {
+        snprintf(expr, sizeof(expr), "bad.ref%d +", i);
+        assert(stats_derived_add(dv, "bad", expr) == ERROR_STATS_DERIVED_SYNTAX);
+    }
+    assert(dv->dv_ref_count == refs);
+
+    stats_allocate_counter(stats, "http.requests", &requests);
+    stats_allocate_counter(stats, "http.errors", &errors);
+    counter_set(requests, 100);
+    counter_set(errors, 5);
+
+    err = stats_get_sample(stats, cl, prev_sample);
+    assert(err == S_OK);
+    err = stats_derived_evaluate(stats, dv, cl, prev_sample, NULL);
+    assert(err == S_OK);
+    assert(stats_sample_get_derived(prev_sample, 0) == 5);
+    assert(stats_sample_get_derived(prev_sample, 1) == 0);
+    assert(stats_sample_get_derived(prev_sample, 2) == 95);
+    assert(stats_sample_get_derived(prev_sample, 3) == -95);
+
+    /* derived values keep their fraction */
+    assert(prev_sample->sample_flags & STATS_SAMPLE_FLAG_DERIVED_DOUBLE);
+    assert(stats_sample_get_derived_double(prev_sample, 4) == 0.05);
+    assert(stats_sample_get_derived(prev_sample, 4) == 0);
+
+    counter_increment_by(requests, 300);
+    counter_increment_by(errors, 3);
+
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    prev_sample->sample_time = sample->sample_time - 2000000000ll;
+    err = stats_derived_evaluate(stats, dv, cl, sample, prev_sample);
+    assert(err == S_OK);
+    assert(sample->sample_derived_count == 5);
+    assert(stats_sample_get_derived(sample, 0) == 2);
+    assert(stats_sample_get_derived(sample, 1) == 150);
+    assert(stats_sample_get_derived(sample, 2) == 392);
+    assert(stats_sample_get_derived_double(sample, 4) == 8.0 / 400.0);
+
+    /* derived values are copied with the sample */
+    err = stats_sample_copy(prev_sample, sample);
+    assert(err == S_OK);
+    assert(stats_sample_get_derived(prev_sample, 1) == 150);
+
+    stats_derived_free(dv);
+    stats_sample_free(sample);
+    stats_sample_free(prev_sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+static long long provider_calls = 0;
+
+static long long test_provider(void *arg)
+{
+    provider_calls++;
+    return *(long long *) arg;
+}
+
+int provider_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL;
+    struct stats_counter *gauge = NULL, *ctr = NULL;
+    long long heap = 1234;
+    int err;
+
+    printf("provider test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    /* no providers, so nothing to wait for */
+    assert(stats_refresh_providers(stats, 0) == S_OK);
+
+    stats_allocate_counter(stats, "provider.counter", &ctr);
+    assert(stats_provider_register(stats, ctr, test_provider, &heap) == ERROR_STATS_WRONG_COUNTER_TYPE);
+
+    stats_allocate_counter_with_flags(stats, "provider.heap", CTR_FLAG_GAUGE | CTR_FLAG_64BIT, &gauge);
+    err = stats_provider_register(stats, gauge, test_provider, &heap);
+    assert(err == S_OK);
+    assert(stats_process_count_providers(stats->data) == 1);
+
+    /* providers are only called when a reader asks */
+    usleep(10000);
+    assert(provider_calls == 0);
+    assert(counter_get_value(gauge) == 0);
+
+    err = stats_get_fresh_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(provider_calls == 1);
+    assert(stats_sample_get_value(sample, 1) == 1234);
+
+    heap = 5678;
+    err = stats_refresh_providers(stats, STATS_PROVIDER_TIMEOUT_MS);
+    assert(err == S_OK);
+    assert(counter_get_value(gauge) == 5678);
+
+    err = stats_provider_unregister(stats, gauge);
+    assert(err == S_OK);
+    assert(stats_provider_unregister(stats, gauge) == ERROR_STATS_COUNTER_NOT_FOUND);
+
+    heap = 1;
+    err = stats_refresh_providers(stats, STATS_PROVIDER_TIMEOUT_MS);
+    assert(err == S_OK);
+    assert(counter_get_value(gauge) == 5678);
+    assert(provider_calls == 2);
+
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    provider_calls = 0;
+
+    return 0;
+}
+
+int provider_exit_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL;
+    struct stats_counter *gauge = NULL;
+    long long value = 42, start;
+    int err, i, status, fds[2];
+    char c;
+    pid_t child;
+
+    /* private stats are not shared with a child */
+    if (stats_flags & STATS_FLAG_PRIVATE)
+        return 0;
+
+    printf("provider exit test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK || pipe(fds) != 0)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    stats_allocate_counter_with_flags(stats, "provider.child", CTR_FLAG_GAUGE | CTR_FLAG_64BIT, &gauge);
+
+    child = fork();
+    if (child == 0)
+    {
+        if (stats_provider_register(stats, gauge, test_provider, &value) == S_OK)
+            c = 1;
+        else
+            c = 0;
+        if (write(fds[1], &c, 1) != 1)
+            _exit(1);
+        for (;;)
+            pause();
+    }
+    assert(read(fds[0], &c, 1) == 1 && c == 1);
+
+    assert(stats_process_count_providers(stats->data) == 1);
+    err = stats_get_fresh_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(counter_get_value(gauge) == 42);
+
+    /* a provider process killed without closing the stats is not waited for */
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+
+    start = current_time();
+    for (i = 0; i < 10; i++)
+    {
+        err = stats_get_fresh_sample(stats, cl, sample);
+        assert(err == S_OK);
+    }
+    assert(TIME_DELTA_TO_NANOS(start, current_time()) < STATS_PROVIDER_TIMEOUT_MS * 1000000ll);
+    assert(stats_process_count_providers(stats->data) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    provider_calls = 0;
+
+    return 0;
+}
+
+int process_test()
+{
+    struct stats *stats;
+    struct stats_counter *ctr = NULL;
+    struct stats_process_value values[STATS_PROCESS_TABLE_SIZE];
+    int err, i, n, status;
+    pid_t child;
+
+    printf("process test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    err = stats_allocate_per_process_counter(stats, "requests", &ctr);
+    assert(err == S_OK);
+    assert(ctr->ctr_flags & CTR_FLAG_PER_PROCESS);
+
+    counter_increment(ctr);
+    counter_increment_by(ctr, 2);
+
+    /* a child claims its own entry on its first write */
+    child = fork();
+    if (child == 0)
+    {
+        counter_increment_by(ctr, 5);
+        _exit(0);
+    }
+    waitpid(child, &status, 0);
+
+    /* private stats are copied into the child, so its writes are not seen */
+    assert(counter_get_value(ctr) == ((stats_flags & STATS_FLAG_PRIVATE) ? 3 : 8));
+
+    /* the child has exited without closing the stats, so its entry is reclaimed */
+    err = stats_counter_get_breakdown(stats, ctr, values, STATS_PROCESS_TABLE_SIZE, &n);
+    assert(err == S_OK);
+    assert(n == 1);
+    assert(values[0].pv_pid == getpid());
+    assert(values[0].pv_value == 3);
+
+    /* setting moves the total by the change in this process's column */
+    counter_set(ctr, 10);
+    assert(counter_get_value(ctr) == ((stats_flags & STATS_FLAG_PRIVATE) ? 10 : 15));
+
+    stats_reset_counters(stats);
+    err = stats_counter_get_breakdown(stats, ctr, values, STATS_PROCESS_TABLE_SIZE, &n);
+    assert(err == S_OK);
+    assert(values[0].pv_value == 0);
+
+    /* a child which finds the table full keeps its column itself, so
+       setting still only moves the total by the change of its value */
+    if (!(stats_flags & STATS_FLAG_PRIVATE))
+    {
+        counter_set(ctr, 10);
+        for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+        {
+            if (stats->data->process[i].proc_pid == 0)
+                stats->data->process[i].proc_pid = 1;
+        }
+
+        child = fork();
+        if (child == 0)
+        {
+            counter_set(ctr, 7);
+            counter_increment(ctr);
+            counter_set(ctr, 4);
+            _exit(0);
+        }
+        waitpid(child, &status, 0);
+        assert(counter_get_value(ctr) == 14);
+
+        for (i = 0; i < STATS_PROCESS_TABLE_SIZE; i++)
+        {
+            if (stats->data->process[i].proc_pid == 1)
+                stats->data->process[i].proc_pid = 0;
+        }
+    }
+
+    stats_allocate_counter(stats, "plain", &ctr);
+    assert(stats_counter_get_breakdown(stats, ctr, values, STATS_PROCESS_TABLE_SIZE, &n) == ERROR_STATS_WRONG_COUNTER_TYPE);
+
+    close_stats(stats);
+
+    return 0;
+}
+
+int real_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *prev_sample = NULL;
+    struct stats_counter *load = NULL, *temp = NULL, *ctr = NULL;
+    int err;
+
+    printf("real test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK || stats_sample_create(&prev_sample) != S_OK)
+    {
+        printf("failed to allocate memory\n");
+        return 1;
+    }
+
+    err = stats_allocate_double_counter(stats, "load", &load);
+    assert(err == S_OK);
+    err = stats_allocate_fixed_counter(stats, "temp", 2, &temp);
+    assert(err == S_OK);
+    assert(CTR_FLAG_FIXED_DIGITS(temp->ctr_flags) == 2);
+    assert(stats_allocate_fixed_counter(stats, "temp", 3, &ctr) == ERROR_STATS_WRONG_COUNTER_TYPE);
+    assert(stats_allocate_fixed_counter(stats, "bad", 16, &ctr) == ERROR_INVALID_PARAMETERS);
+    assert(stats_allocate_double_counter(stats, "temp", &ctr) == ERROR_STATS_WRONG_COUNTER_TYPE);
+
+    counter_set_double(load, 0.25);
+    counter_add_double(load, 1.5);
+    counter_increment(load);
+    assert(counter_get_double(load) == 2.75);
+    assert(counter_get_value(load) == 3);
+
+    counter_set_double(temp, 21.5);
+    counter_add_double(temp, 0.125);
+    assert(counter_get_value(temp) == 2163);
+    assert(counter_get_double(temp) == 21.63);
+
+    err = stats_get_sample(stats, cl, prev_sample);
+    assert(err == S_OK);
+
+    counter_add_double(load, -1.0);
+    counter_add_double(temp, 1.0);
+
+    err = stats_get_sample(stats, cl, sample);
+    assert(err == S_OK);
+    assert(stats_sample_get_double(sample, load->ctr_flags, 0) == 1.75);
+    assert(stats_sample_get_double(sample, temp->ctr_flags, 1) == 22.63);
+    assert(stats_sample_get_delta_double(sample, prev_sample, load->ctr_flags, 0) == -1.0);
+    assert(stats_sample_get_delta_double(sample, prev_sample, temp->ctr_flags, 1) == 1.0);
+
+    stats_sample_free(sample);
+    stats_sample_free(prev_sample);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+int attach_test()
+{
+    struct stats *stats, *attached, *opened;
+    struct stats_counter *ctr = NULL, *found = NULL;
+    int err;
+
+    printf("attach test\n");
+
+    stats = open_stats();
+    if (!stats)
+        return 1;
+
+    assert(stats->data->hdr.stats_ready == 1);
+
+    err = stats_allocate_counter(stats, "attached", &ctr);
+    assert(err == S_OK);
+    counter_increment_by(ctr, 7);
+
+    /* the data is initialized, so this takes the fast path */
+    attached = open_stats();
+    assert(attached != NULL);
+    err = stats_find_counter(attached, "attached", &found);
+    if (stats_flags & STATS_FLAG_PRIVATE)
+    {
+        assert(err == ERROR_STATS_COUNTER_NOT_FOUND);
+    }
+    else
+    {
+        assert(err == S_OK);
+        assert(counter_get_value(found) == 7);
+    }
+
+    /* data which is not ready is opened under the lock */
+    stats->data->hdr.stats_ready = 0;
+    opened = open_stats();
+    assert(opened != NULL);
+    if (!(stats_flags & STATS_FLAG_PRIVATE))
+    {
+        assert(stats_find_counter(opened, "attached", &found) == S_OK);
+        assert(counter_get_value(found) == 7);
+        assert(stats->data->hdr.stats_ready == 1);
+    }
+    stats->data->hdr.stats_ready = 1;
+
+    close_stats(opened);
+    close_stats(attached);
+    close_stats(stats);
+
+    return 0;
+}
+
+int migrate_test()
+{
+    struct stats *from, *to, *other;
+    struct stats_migration *mg = NULL;
+    struct stats_counter *count, *gauge, *load, *typed, *ctr;
+    struct stats_hll *hll;
+    struct stats_quantile *qs;
+    int err, n;
+
+    printf("migrate test\n");
+
+    from = open_stats();
+    to = open_stats_named("ctrmigr");
+    if (!from || !to)
+        return 1;
+
+    assert(from->data->hdr.stats_version == STATS_LAYOUT_VERSION);
+    assert(from->data->hdr.stats_size == sizeof(struct stats_data));
+    assert(from->data->hdr.stats_features == 0);
+
+    stats_allocate_counter(from, "mg.count", &count);
+    stats_allocate_counter_with_flags(from, "mg.gauge", CTR_FLAG_GAUGE, &gauge);
+    stats_allocate_double_counter(from, "mg.load", &load);
+    stats_allocate_counter_with_flags(from, "mg.typed", CTR_FLAG_GAUGE, &typed);
+    stats_allocate_double_counter(to, "mg.typed", &ctr);
+    assert(from->data->hdr.stats_features == STATS_FEATURE_REAL);
+    stats_allocate_hll(from, "mg.users", &hll);
+    stats_allocate_quantile(from, "mg.latency", &qs);
+
+    counter_increment_by(count, 5);
+    stats_hll_add(hll, "a", 1);
+    stats_hll_add(hll, "b", 1);
+    stats_quantile_add(qs, 10.0);
+    counter_set(gauge, 7);
+    counter_set_double(load, 1.5);
+    counter_increment(typed);
+
+    err = stats_migration_create(&mg);
+    assert(err == S_OK);
+
+    /* the first pass copies everything but the counter which exists with
+       another type and the quantile sketch */
+    err = stats_migrate(from, to, mg, &n);
+    assert(err == S_OK);
+    assert(n == 4);
+    assert(stats_find_counter(to, "mg.users", &ctr) == S_OK && stats_sketch_value(to->data, ctr) == 2);
+    assert(stats_find_counter(to, "mg.latency", &ctr) == ERROR_STATS_COUNTER_NOT_FOUND);
+    assert(stats_find_counter(to, "mg.count", &ctr) == S_OK && counter_get_value(ctr) == 5);
+    assert(stats_find_counter(to, "mg.gauge", &ctr) == S_OK && counter_get_value(ctr) == 7);
+    assert(ctr->ctr_flags & CTR_FLAG_GAUGE);
+    assert(stats_find_counter(to, "mg.load", &ctr) == S_OK && counter_get_double(ctr) == 1.5);
+    assert(stats_find_counter(to, "mg.typed", &ctr) == S_OK && counter_get_value(ctr) == 0);
+
+    /* later passes add what was written since, and keep direct writes to the new counters */
+    counter_increment_by(count, 2);
+    counter_set(gauge, 3);
+    counter_add_double(load, 1.0);
+    stats_find_counter(to, "mg.count", &ctr);
+    counter_increment(ctr);
+
+    err = stats_migrate(from, to, mg, &n);
+    assert(err == S_OK);
+    assert(counter_get_value(ctr) == 8);
+    assert(stats_find_counter(to, "mg.gauge", &ctr) == S_OK && counter_get_value(ctr) == 3);
+    assert(stats_find_counter(to, "mg.load", &ctr) == S_OK && counter_get_double(ctr) == 2.5);
+    assert(stats_find_counter(to, "mg.users", &ctr) == S_OK && stats_sketch_value(to->data, ctr) == 2);
+
+    /* after a reset the whole value is new */
+    stats_reset_counters(from);
+    counter_increment(count);
+    err = stats_migrate(from, to, mg, &n);
+    assert(err == S_OK);
+    assert(stats_find_counter(to, "mg.count", &ctr) == S_OK && counter_get_value(ctr) == 9);
+
+    stats_migration_free(mg);
+
+    if (!(stats_flags & STATS_FLAG_PRIVATE))
+    {
+        /* data of another layout is not opened */
+        from->data->hdr.stats_version = STATS_LAYOUT_VERSION + 1;
+        stats_create("ctrtest", &other);
+        assert(stats_open(other) == ERROR_STATS_LAYOUT_VERSION);
+        assert(other->data == NULL);
+
+        from->data->hdr.stats_version = STATS_LAYOUT_VERSION;
+        from->data->hdr.stats_features |= 0x00010000;
+        assert(stats_open(other) == ERROR_STATS_LAYOUT_FEATURES);
+        from->data->hdr.stats_features &= ~0x00010000;
+
+        /* nor is data from before the header had a version */
+        from->data->hdr.stats_version = 0;
+        from->data->hdr.stats_size = 0;
+        assert(stats_open(other) == ERROR_STATS_LAYOUT_VERSION);
+        from->data->hdr.stats_version = STATS_LAYOUT_VERSION;
+        from->data->hdr.stats_size = sizeof(struct stats_data);
+        stats_free(other);
+    }
+
+    close_stats(to);
+    close_stats(from);
+
+    return 0;
+}
+
+int registry_test()
+{
+    struct stats *stats, *other, *missing;
+    struct stats_segment_info infos[STATS_REGISTRY_SIZE];
+    struct stats_group *group = NULL;
+    struct stats_group_member *gm;
+    struct stats_counter *ctr;
+    int err, i, n, found = 0, members = 0;
+
+    printf("registry test\n");
+
+    stats = open_stats();
+    other = open_stats_named("ctrreg");
+    if (!stats || !other)
+        return 1;
+
+    stats_allocate_counter(other, "reg.count", &ctr);
+    counter_increment_by(ctr, 3);
+
+    err = stats_enumerate(infos, STATS_REGISTRY_SIZE, &n);
+    assert(err == S_OK);
+    for (i = 0; i < n; i++)
+    {
+        if (strcmp(infos[i].si_name, "ctrtest") != 0 && strcmp(infos[i].si_name, "ctrreg") != 0)
+            continue;
+        assert(infos[i].si_owner_pid == getpid());
+        assert(infos[i].si_size == sizeof(struct stats_data));
+        assert(infos[i].si_version == STATS_LAYOUT_VERSION);
+        assert(infos[i].si_attached >= 1);
+        found++;
+    }
+    /* private stats are not registered */
+    assert(found == ((stats_flags & STATS_FLAG_PRIVATE) ? 0 : 2));
+
+    /* a group samples every registered segment */
+    err = stats_group_create(&group);
+    assert(err == S_OK);
+    err = stats_group_refresh(group);
+    assert(err == S_OK);
+    assert(stats_group_sample(group) == S_OK);
+    for (i = 0; i < stats_group_count(group); i++)
+    {
+        gm = stats_group_get_member(group, i);
+        if (strcmp(gm->gm_info.si_name, "ctrreg") != 0)
+            continue;
+        assert(gm->gm_cl->cl_count == 1);
+        assert(stats_sample_get_value(gm->gm_sample, 0) == 3);
+        members++;
+    }
+    assert(members == found / 2);
+    stats_group_free(group);
+
+    /* a group never creates a segment */
+    stats_create_with_flags("ctrnone", STATS_FLAG_OPEN_EXISTING, &missing);
+    assert(stats_open(missing) != S_OK);
+    assert(access(SHARED_MEMORY_DIRECTORY "/ctrnone.mem", F_OK) != 0);
+    stats_free(missing);
+
+    /* the entry goes when the segment is destroyed */
+    close_stats(other);
+    err = stats_enumerate(infos, STATS_REGISTRY_SIZE, &n);
+    assert(err == S_OK);
+    for (i = 0; i < n; i++)
+        assert(strcmp(infos[i].si_name, "ctrreg") != 0);
+
+    close_stats(stats);
+
+    return 0;
+}
+
+int merge_test()
+{
+    struct stats *main_stats, *canary;
+    struct stats_merge *m = NULL;
+    struct stats_sample *prev = NULL;
+    struct stats_counter *req, *canary_req, *ctr;
+    int err, k;
+
+    printf("merge test\n");
+
+    main_stats = open_stats();
+    canary = open_stats_named("ctrcanary");
+    if (!main_stats || !canary)
+        return 1;
+
+    stats_allocate_counter(main_stats, "m.req", &req);
+    stats_allocate_counter(canary, "m.req", &canary_req);
+    counter_increment_by(req, 5);
+    counter_increment_by(canary_req, 3);
+    stats_allocate_counter(canary, "m.only", &ctr);
+    counter_increment_by(ctr, 2);
+    stats_allocate_double_counter(main_stats, "m.load", &ctr);
+    counter_set_double(ctr, 1.5);
+    stats_allocate_double_counter(canary, "m.load", &ctr);
+    counter_set_double(ctr, 2.0);
+    stats_allocate_counter_with_flags(main_stats, "m.typed", CTR_FLAG_GAUGE, &ctr);
+    counter_set(ctr, 4);
+    stats_allocate_counter(canary, "m.typed", &ctr);
+    counter_increment_by(ctr, 100);
+
+    err = stats_merge_create(&m);
+    assert(err == S_OK);
+    assert(stats_merge_add_source(m, main_stats, NULL) == S_OK);
+    assert(stats_merge_add_source(m, canary, NULL) == S_OK);
+
+    err = stats_merge_update(m);
+    assert(err == S_OK);
+    assert(stats_merge_count(m) == 4);
+
+    k = stats_merge_find(m, "m.req");
+    assert(k >= 0);
+    assert(stats_merge_get_sum(m, k) == 8 && stats_merge_get_min(m, k) == 3 && stats_merge_get_max(m, k) == 5);
+
+    k = stats_merge_find(m, "m.only");
+    assert(stats_merge_get_sum(m, k) == 2 && stats_merge_get_min(m, k) == 2 && stats_merge_get_max(m, k) == 2);
+
+    k = stats_merge_find(m, "m.load");
+    assert(stats_sample_get_double(m->mg_sum, stats_merge_get_flags(m, k), k) == 3.5);
+    assert(stats_sample_get_double(m->mg_min, stats_merge_get_flags(m, k), k) == 1.5);
+    assert(stats_sample_get_double(m->mg_max, stats_merge_get_flags(m, k), k) == 2.0);
+
+    /* a counter of another type is left out */
+    k = stats_merge_find(m, "m.typed");
+    assert(stats_merge_get_sum(m, k) == 4);
+    assert(stats_merge_find(m, "m.none") == -1);
+
+    /* later merges pick up changes and new counters */
+    stats_sample_create(&prev);
+    stats_sample_copy(prev, m->mg_sum);
+    counter_increment_by(canary_req, 4);
+    stats_allocate_counter(main_stats, "m.new", &ctr);
+    counter_increment(ctr);
+    err = stats_merge_update(m);
+    assert(err == S_OK);
+    k = stats_merge_find(m, "m.req");
+    assert(stats_merge_get_sum(m, k) == 12 && stats_merge_get_max(m, k) == 7);
+    assert(stats_sample_get_delta(m->mg_sum, prev, k) == 4);
+    assert(stats_merge_get_delta(m, k) == 4);
+    assert(stats_merge_get_sum(m, stats_merge_find(m, "m.new")) == 1);
+    assert(stats_merge_get_delta(m, stats_merge_find(m, "m.new")) == 0);
+
+    /* a reset of one source shows in the merged epoch, and only that
+       source's change is counted from the reset */
+    stats_sample_copy(prev, m->mg_sum);
+    stats_reset_counters(canary);
+    counter_increment_by(canary_req, 2);
+    counter_increment_by(req, 1);
+    stats_find_counter(canary, "m.load", &ctr);
+    counter_set_double(ctr, 0.5);
+    err = stats_merge_update(m);
+    assert(err == S_OK);
+    assert(stats_merge_get_sum(m, k) == 8 && stats_merge_get_min(m, k) == 2);
+    assert(m->mg_sum->sample_reset_epoch != prev->sample_reset_epoch);
+    assert(stats_merge_get_delta(m, k) == 3);
+    k = stats_merge_find(m, "m.load");
+    assert(stats_value_to_double(stats_merge_get_flags(m, k), stats_merge_get_delta(m, k)) == 0.5);
+
+    stats_sample_free(prev);
+    stats_merge_free(m);
+
+    close_stats(canary);
+    close_stats(main_stats);
+
+    return 0;
+}
+
+int record_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *replayed = NULL;
+    struct stats_recorder *rec = NULL;
+    struct stats_replay *rp = NULL;
+    struct stats_counter *ctrs[200], *gauge;
+    char name[MAX_COUNTER_KEY_LENGTH+1];
+    long long bytes = 0, start = 0;
+    int err, i, j, first = -1, last = -1, lists = 0;
+
+    printf("record test\n");
+
+    stats = open_stats_named("ctrrec");
+    if (!stats)
+        return 1;
+
+    unlink("/tmp/ctrrec.0");
+    unlink("/tmp/ctrrec.1");
+
+    stats_cl_create(&cl);
+    stats_sample_create(&sample);
+    stats_sample_create(&replayed);
+
+    err = stats_recorder_create("/tmp/ctrrec", STATS_RECORD_MIN_FILE_SIZE, 2, &rec);
+    assert(err == S_OK);
+    assert(stats_recorder_open(rec, "ctrtest", 10) == S_OK);
+
+    /* enough samples changing the rate of every counter to go around the files */
+    stats_allocate_counter_with_flags(stats, "rec.gauge", CTR_FLAG_GAUGE, &gauge);
+    for (i = 0; i < 1000; i++)
+    {
+        if (i < 200)
+        {
+            snprintf(name, sizeof(name), "rec.ctr%d", i);
+            stats_allocate_counter(stats, name, &ctrs[i]);
+        }
+        for (j = 0; j < 200 && j <= i; j++)
+            counter_increment_by(ctrs[j], j + 1 + i % 2);
+        counter_set(gauge, i % 2 ? -i : i);
+
+        assert(stats_get_sample(stats, cl, sample) == S_OK);
+        assert(stats_record_sample(rec, stats, cl, sample) == S_OK);
+    }
+    assert(rec->rec_generation > 3);
+
+    stats_recorder_close(rec);
+    stats_recorder_free(rec);
+
+    /* the replay starts at the beginning of the older file and ends with the last sample */
+    err = stats_replay_create("/tmp/ctrrec", &rp);
+    assert(err == S_OK);
+    while ((err = stats_replay_next(rp, replayed)) == S_OK)
+    {
+        assert(stats_replay_get_counter(rp, 0)->ctr_flags & CTR_FLAG_GAUGE);
+        counter_get_key(stats_replay_get_counter(rp, 1), name, sizeof(name));
+        assert(strcmp(name, "rec.ctr0") == 0);
+
+        /* the gauge tells which sample this is */
+        i = stats_sample_get_value(replayed, 0);
+        if (i < 0)
+            i = -i;
+        assert(last < 0 || i == last + 1);
+        if (first < 0)
+            first = i;
+        last = i;
+        if (replayed->sample_seq_no != lists)
+        {
+            assert(replayed->sample_seq_no > lists);
+            lists = replayed->sample_seq_no;
+        }
+
+        assert(replayed->sample_count == (i < 200 ? i + 2 : 201));
+        for (j = 0; j + 1 < replayed->sample_count; j++)
+            assert(stats_sample_get_value(replayed, j + 1) == (long long)(i - j + 1) * (j + 1) + (i + 1) / 2 - j / 2);
+    }
+    assert(err == ERROR_STATS_RECORD_END);
+    assert(first > 0 && last == 999);
+
+    stats_replay_free(rp);
+
+    /* counters growing at a steady rate, sampled at a steady interval, cost
+       nothing once their rate is known: a frame is its type, length, the
+       time, epoch, count (two bytes) and number changed */
+    err = stats_recorder_create("/tmp/ctrrec", STATS_RECORD_MIN_FILE_SIZE, 2, &rec);
+    assert(err == S_OK);
+    assert(stats_recorder_open(rec, "ctrtest", 10) == S_OK);
+    for (i = 0; i < 10; i++)
+    {
+        if (i == 2)
+            bytes = rec->rec_bytes;
+        for (j = 0; j < 200; j++)
+            counter_increment_by(ctrs[j], j + 1);
+        assert(stats_get_sample(stats, cl, sample) == S_OK);
+        if (i == 0)
+            start = sample->sample_time;
+        sample->sample_time = start + i * 10000000ll;
+        assert(stats_record_sample(rec, stats, cl, sample) == S_OK);
+    }
+    assert(rec->rec_bytes - bytes == 8 * 7);
+    stats_recorder_close(rec);
+    stats_recorder_free(rec);
+
+    assert(stats_replay_create("/tmp/ctrrec", &rp) == S_OK);
+    while ((err = stats_replay_next(rp, replayed)) == S_OK)
+        ;
+    assert(err == ERROR_STATS_RECORD_END);
+    assert(replayed->sample_time == sample->sample_time);
+    assert(stats_sample_get_value(replayed, 1) == stats_sample_get_value(sample, 1));
+    assert(stats_sample_get_value(replayed, 200) == stats_sample_get_value(sample, 200));
+    stats_replay_free(rp);
+    stats_sample_free(replayed);
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+
+    unlink("/tmp/ctrrec.0");
+    unlink("/tmp/ctrrec.1");
+    assert(stats_replay_create("/tmp/ctrrec", &rp) == ERROR_STATS_RECORD_IO);
+
+    close_stats(stats);
+
+    return 0;
+}
+
+int capture_test()
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_capture *cap = NULL;
+    struct stats_counter *a, *b, *other;
+    char line[256];
+    FILE *f;
+    int i, requests, lines = 0;
+
+    printf("capture test\n");
+
+    stats = open_stats_named("ctrcap");
+    if (!stats)
+        return 1;
+
+    stats_cl_create(&cl);
+    stats_allocate_counter(stats, "cap.a", &a);
+    stats_allocate_counter_with_flags(stats, "cap.b", CTR_FLAG_GAUGE, &b);
+    stats_allocate_counter(stats, "other", &other);
+    stats_get_counter_list(stats, cl);
+
+    assert(stats_capture_create(4, &cap) == S_OK);
+    assert(stats_capture_select(cap, stats, cl, "cap.") == S_OK);
+    assert(stats_capture_select(cap, stats, cl, "cap.a") == S_OK);
+    assert(cap->cap_count == 2);
+
+    /* the ring has to be allocated for the selection before sampling */
+    assert(stats_capture_sample(cap, stats, cl, current_time()) == ERROR_INVALID_PARAMETERS);
+    assert(stats_capture_reset(cap) == S_OK);
+
+    /* six samples in a ring of four keeps the last four */
+    for (i = 1; i <= 6; i++)
+    {
+        counter_increment(a);
+        counter_set(b, -i);
+        counter_increment(other);
+        assert(stats_capture_sample(cap, stats, cl, current_time()) == S_OK);
+    }
+    assert(cap->cap_samples == 6);
+    assert(stats_capture_size(cap) == 4);
+    for (i = 0; i < 4; i++)
+    {
+        assert(stats_capture_get_value(cap, i, 0) == i + 3);
+        assert(stats_capture_get_value(cap, i, 1) == -(i + 3));
+        assert(i == 0 || stats_capture_get_time(cap, i) >= stats_capture_get_time(cap, i - 1));
+    }
+    assert(cap->cap_jitter_min >= 0 && cap->cap_jitter_max >= cap->cap_jitter_min);
+
+    assert(stats_capture_write(cap, "ctrcap", 1000, "/tmp/ctrcap.csv") == S_OK);
+    f = fopen("/tmp/ctrcap.csv", "r");
+    assert(f != NULL);
+    while (fgets(line, sizeof(line), f))
+    {
+        if (lines == 2)
+            assert(strcmp(line, "time_us,cap.a,cap.b\n") == 0);
+        if (lines == 3)
+            assert(strcmp(line, "0,3,-3\n") == 0);
+        lines++;
+    }
+    fclose(f);
+    unlink("/tmp/ctrcap.csv");
+    assert(lines == 7);
+
+    /* a reset keeps the selection and empties the ring */
+    assert(stats_capture_reset(cap) == S_OK);
+    assert(cap->cap_count == 2 && stats_capture_size(cap) == 0);
+
+    requests = stats_capture_requests(stats);
+    assert(stats_request_capture(stats) == S_OK);
+    assert(stats_capture_requests(stats) == requests + 1);
+
+    stats_capture_free(cap);
+    stats_cl_free(cl);
+    close_stats(stats);
+
+    return 0;
+}
+
+int run_tests()
+{
+    int failed = 0;
+
+    failed += find_test();
+    failed += reset_test();
+    failed += sample_test();
+    failed += sketch_test();
+    failed += quantile_test();
+    failed += timer_test();
+    failed += trace_test();
+    failed += rollup_test();
+    failed += derived_test();
+    failed += provider_test();
+    failed += provider_exit_test();
+    failed += process_test();
+    failed += real_test();
+    failed += attach_test();
+    failed += migrate_test();
+    failed += registry_test();
+    failed += merge_test();
+    failed += record_test();
+    failed += capture_test();
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    printf("shared stats\n");
+    stats_flags = 0;
+    failed += run_tests();
+
+    printf("private stats\n");
+    stats_flags = STATS_FLAG_PRIVATE;
+    failed += run_tests();
+
+    /* private stats must not leave anything behind in the filesystem */
+    assert(access(SHARED_MEMORY_DIRECTORY "/ctrtest.mem", F_OK) != 0);
+    assert(access(SEMAPHORE_DIRECTORY "/ctrtest.sem", F_OK) != 0);
+    assert(access(SHARED_MEMORY_DIRECTORY "/ctrtest.trc", F_OK) != 0);
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+
+    return failed;
+}
@@ -0,0 +1,316 @@
+/* statscapture.c */
+
+/*
+ * Captures the counters of a stats object at a high frequency (see
+ * capture.h), to see bursts which once a second samples hide.
+ *
+ * statscapture waits for a capture to be requested, with SIGUSR1 or
+ * stats_request_capture, then samples the counters whose keys start with
+ * any of the -k prefixes (all counters if none are given) every
+ * INTERVAL_US microseconds (1000 to 10000) for SECONDS, and writes the
+ * samples to PATH.1, PATH.2, ... With -n it captures once right away,
+ * writes PATH and exits. The counters are selected when statscapture
+ * starts; counters allocated later are not captured.
+ *
+ * Samples are timed with a timerfd, or with -b by busy polling the
+ * clock, which is more accurate but takes a whole cpu while capturing.
+ * -c pins statscapture to a cpu. The jitter of each capture (how late
+ * the samples were taken) is written with it and printed.
+ *
+ * usage: statscapture [-i INTERVAL_US] [-d SECONDS] [-c CPU] [-b] [-n] [-k PREFIX]... STATS PATH
+ */
+
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#ifdef LINUX
+#include <sched.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "stats/stats.h"
+#include "stats/capture.h"
+#include "stats/error.h"
+
+#define DEFAULT_INTERVAL_US 1000
+#define MIN_INTERVAL_US     1000
+#define MAX_INTERVAL_US     10000
+#define DEFAULT_SECONDS     5
+#define MAX_PREFIXES        64
+#define TRIGGER_POLL_US     10000
+
+static volatile int done = 0;
+static volatile int triggered = 0;
+
+static void sigfunc(int sig_no)
+{
+    done = 1;
+}
+
+static void sigusr1(int sig_no)
+{
+    triggered = 1;
+}
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to create stats %s: %s\n", name, error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to open stats %s: %s\n", name, error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+/* samples until the ring is full, waiting for each sample on a timerfd
+   or by spinning on the clock */
+static int capture(struct stats_capture *cap, struct stats *stats, struct stats_counter_list *cl,
+    int interval_us, int busy)
+{
+    long long interval = interval_us * 1000ll, due, now;
+    int err = S_OK;
+#ifdef LINUX
+    struct itimerspec its;
+    uint64_t expirations;
+    int tfd = -1;
+#endif
+
+    err = stats_capture_reset(cap);
+    if (err != S_OK)
+        return err;
+
+    due = current_time() + interval;
+
+#ifdef LINUX
+    if (!busy)
+    {
+        tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+        if (tfd < 0)
+            return ERROR_FAIL;
+
+        its.it_value.tv_sec = due / 1000000000ll;
+        its.it_value.tv_nsec = due % 1000000000ll;
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = interval;
+        if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+        {
+            close(tfd);
+            return ERROR_FAIL;
+        }
+    }
+#else
+    busy = 1;
+#endif
+
+    while (!done && cap->cap_samples < cap->cap_capacity)
+    {
+#ifdef LINUX
+        if (!busy)
+        {
+            /* each expiration beyond the first is a sample missed */
+            if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
+            due += (expirations - 1) * interval;
+            cap->cap_missed += expirations - 1;
+        }
+#endif
+        while (busy && current_time() < due)
+            ;
+
+        err = stats_capture_sample(cap, stats, cl, due);
+        if (err != S_OK)
+            break;
+
+        due += interval;
+        if (busy)
+        {
+            now = current_time();
+            while (due <= now)
+            {
+                due += interval;
+                cap->cap_missed++;
+            }
+        }
+    }
+
+#ifdef LINUX
+    if (tfd >= 0)
+        close(tfd);
+#endif
+
+    return err;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: statscapture [-i INTERVAL_US] [-d SECONDS] [-c CPU] [-b] [-n] [-k PREFIX]... STATS PATH\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL;
+    struct stats_capture *cap = NULL;
+    struct sigaction sa;
+    const char *prefixes[MAX_PREFIXES];
+    char path[MAX_PATH + 16];
+    int c, i, err, interval_us = DEFAULT_INTERVAL_US, seconds = DEFAULT_SECONDS, cpu = -1, busy = 0, now = 0;
+    int nprefixes = 0, requests, captures = 0;
+    double mean;
+#ifdef LINUX
+    cpu_set_t cpus;
+#endif
+
+    while ((c = getopt(argc, argv, "i:d:c:bnk:")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            interval_us = atoi(optarg);
+            if (interval_us < MIN_INTERVAL_US || interval_us > MAX_INTERVAL_US)
+                usage();
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            if (seconds < 1)
+                usage();
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'b':
+            busy = 1;
+            break;
+        case 'n':
+            now = 1;
+            break;
+        case 'k':
+            if (nprefixes == MAX_PREFIXES)
+                usage();
+            prefixes[nprefixes++] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2 || strlen(argv[optind + 1]) >= MAX_PATH)
+        usage();
+
+    stats = open_stats(argv[optind]);
+    if (stats == NULL)
+        return 1;
+
+    if (cpu >= 0)
+    {
+#ifdef LINUX
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+            fprintf(stderr, "Failed to pin to cpu %d\n", cpu);
+#else
+        fprintf(stderr, "Pinning to a cpu is not supported\n");
+#endif
+    }
+
+    /* select from the counters there are now */
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    err = stats_get_sample(stats, cl, sample);
+    if (err == S_OK)
+        err = stats_capture_create(seconds * (1000000 / interval_us), &cap);
+    for (i = 0; err == S_OK && i < nprefixes; i++)
+        err = stats_capture_select(cap, stats, cl, prefixes[i]);
+    if (err == S_OK && nprefixes == 0)
+        err = stats_capture_select(cap, stats, cl, NULL);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to set up the capture: %s\n", error_message(err));
+        return 1;
+    }
+    stats_sample_free(sample);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sigfunc;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = &sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (!now)
+        printf("Capturing %d counters of %s every %d us for %d s on SIGUSR1 or request\n", cap->cap_count,
+            argv[optind], interval_us, seconds);
+
+    requests = stats_capture_requests(stats);
+
+    while (!done)
+    {
+        if (!now && !triggered && stats_capture_requests(stats) == requests)
+        {
+            usleep(TRIGGER_POLL_US);
+            continue;
+        }
+        triggered = 0;
+        requests = stats_capture_requests(stats);
+
+        err = capture(cap, stats, cl, interval_us, busy);
+        if (err != S_OK)
+        {
+            fprintf(stderr, "Failed to capture: %s\n", error_message(err));
+            break;
+        }
+
+        if (now)
+            snprintf(path, sizeof(path), "%s", argv[optind + 1]);
+        else
+            snprintf(path, sizeof(path), "%s.%d", argv[optind + 1], ++captures);
+
+        err = stats_capture_write(cap, argv[optind], interval_us, path);
+        if (err != S_OK)
+        {
+            fprintf(stderr, "Failed to write %s: %s\n", path, error_message(err));
+            break;
+        }
+
+        mean = cap->cap_samples ? (double) cap->cap_jitter_sum / cap->cap_samples : 0.0;
+        printf("%s: %lld samples, %lld missed, jitter us min %.1f mean %.1f max %.1f\n", path, cap->cap_samples,
+            cap->cap_missed, cap->cap_jitter_min / 1000.0, mean / 1000.0, cap->cap_jitter_max / 1000.0);
+        fflush(stdout);
+
+        if (now)
+            break;
+    }
+
+    stats_capture_free(cap);
+    stats_cl_free(cl);
+    stats_close(stats);
+    stats_free(stats);
+
+    return err == S_OK ? 0 : 1;
+}
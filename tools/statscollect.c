@@ -0,0 +1,570 @@
+/* statscollect.c */
+
+/*
+ * Publishes system metrics as counters in a stats object, so they can be
+ * sampled and correlated with the application counters.
+ *
+ * Every interval statscollect reads
+ *
+ *      /proc/stat          sys.cpu.* (ms), sys.ctxt, sys.forks and the
+ *                          sys.procs_running / sys.procs_blocked gauges
+ *      /proc/meminfo       sys.mem.*_kb gauges
+ *      /proc/<pid>/stat    proc.<pid>.* for each PID given, plus the
+ *      /proc/<pid>/status  context switch counts
+ *      /proc/[0-9]*        with -a, the proc.all.* gauges summed over all
+ *                          processes
+ *      CGROUP/cpu.stat     with -c CGROUP, cg.cpu.* (cgroup v2), and the
+ *      CGROUP/memory.current, pids.current gauges
+ *
+ * Kernel counters which only go up are published as plain counters, so
+ * sample deltas give rates; levels are CTR_FLAG_GAUGE counters. Counters
+ * are allocated once and updated with counter_set. Files are read into a
+ * buffer and parsed in place. The buffer grows to fit the largest file
+ * read (/proc/stat has a line per cpu), up to READ_BUFFER_MAX, so once it
+ * has a pass does not allocate memory. collect.pass_us is the time the
+ * last pass took, and collect.truncated counts files which did not fit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+
+#define MAX_PIDS            64
+#define READ_BUFFER_SIZE    16384
+#define READ_BUFFER_MAX     (16 * 1024 * 1024)
+#define PATH_SIZE           512
+
+static volatile int done = 0;
+
+static char *read_buffer;
+static int read_buffer_size;
+static struct stats_counter *truncated;
+
+static long clock_ticks;
+static long page_kb;
+
+/* a value in a "key value" file and the counter it is published to */
+struct metric
+{
+    const char *m_key;
+    const char *m_name;
+    int m_flags;
+    struct stats_counter *m_ctr;
+};
+
+static struct metric proc_stat_metrics[] =
+{
+    { "ctxt",           "sys.ctxt",             0,              NULL },
+    { "processes",      "sys.forks",            0,              NULL },
+    { "procs_running",  "sys.procs_running",    CTR_FLAG_GAUGE, NULL },
+    { "procs_blocked",  "sys.procs_blocked",    CTR_FLAG_GAUGE, NULL },
+    { NULL }
+};
+
+/* the fields of the "cpu" line of /proc/stat, in order */
+static struct metric cpu_metrics[] =
+{
+    { "user",           "sys.cpu.user_ms",      0,              NULL },
+    { "nice",           "sys.cpu.nice_ms",      0,              NULL },
+    { "system",         "sys.cpu.system_ms",    0,              NULL },
+    { "idle",           "sys.cpu.idle_ms",      0,              NULL },
+    { "iowait",         "sys.cpu.iowait_ms",    0,              NULL },
+    { "irq",            "sys.cpu.irq_ms",       0,              NULL },
+    { "softirq",        "sys.cpu.softirq_ms",   0,              NULL },
+    { "steal",          "sys.cpu.steal_ms",     0,              NULL },
+    { NULL }
+};
+
+static struct metric meminfo_metrics[] =
+{
+    { "MemTotal",       "sys.mem.total_kb",     CTR_FLAG_GAUGE, NULL },
+    { "MemFree",        "sys.mem.free_kb",      CTR_FLAG_GAUGE, NULL },
+    { "MemAvailable",   "sys.mem.available_kb", CTR_FLAG_GAUGE, NULL },
+    { "Buffers",        "sys.mem.buffers_kb",   CTR_FLAG_GAUGE, NULL },
+    { "Cached",         "sys.mem.cached_kb",    CTR_FLAG_GAUGE, NULL },
+    { "SwapTotal",      "sys.mem.swaptotal_kb", CTR_FLAG_GAUGE, NULL },
+    { "SwapFree",       "sys.mem.swapfree_kb",  CTR_FLAG_GAUGE, NULL },
+    { NULL }
+};
+
+static struct metric cgroup_cpu_metrics[] =
+{
+    { "usage_usec",     "cg.cpu.usage_us",      0,              NULL },
+    { "user_usec",      "cg.cpu.user_us",       0,              NULL },
+    { "system_usec",    "cg.cpu.system_us",     0,              NULL },
+    { "nr_periods",     "cg.cpu.periods",       0,              NULL },
+    { "nr_throttled",   "cg.cpu.throttled",     0,              NULL },
+    { "throttled_usec", "cg.cpu.throttled_us",  0,              NULL },
+    { NULL }
+};
+
+/* the counters of one process given on the command line */
+struct proc_counters
+{
+    int pc_pid;
+    struct stats_counter *pc_user_ms;
+    struct stats_counter *pc_system_ms;
+    struct stats_counter *pc_threads;
+    struct stats_counter *pc_rss_kb;
+    struct stats_counter *pc_ctxsw_vol;
+    struct stats_counter *pc_ctxsw_invol;
+};
+
+/* fields of /proc/<pid>/stat, counted from the state field after the comm */
+#define PROC_STAT_UTIME         11
+#define PROC_STAT_STIME         12
+#define PROC_STAT_NUM_THREADS   17
+#define PROC_STAT_RSS           21
+
+struct proc_stat
+{
+    long long ps_utime;
+    long long ps_stime;
+    long long ps_threads;
+    long long ps_rss;
+};
+
+
+static void sigint_handler(int sig)
+{
+    done = 1;
+}
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        printf("Failed to create stats: %s\n", error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        printf("Failed to open stats: %s\n", error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static struct stats_counter *allocate(struct stats *stats, const char *name, int flags)
+{
+    struct stats_counter *ctr = NULL;
+    int err;
+
+    err = stats_allocate_counter_with_flags(stats, name, flags | CTR_FLAG_64BIT, &ctr);
+    if (err != S_OK)
+    {
+        printf("Failed to allocate counter %s: %s\n", name, error_message(err));
+        return NULL;
+    }
+
+    return ctr;
+}
+
+static void allocate_metrics(struct stats *stats, struct metric *m)
+{
+    for (; m->m_key; m++)
+        m->m_ctr = allocate(stats, m->m_name, m->m_flags);
+}
+
+static void set(struct stats_counter *ctr, long long value)
+{
+    if (ctr)
+        counter_set(ctr, value);
+}
+
+/* reads path into read_buffer, growing it if the file does not fit.
+   returns the length, or -1 */
+static int read_file(const char *path)
+{
+    char *buffer;
+    int fd, n, len = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    for (;;)
+    {
+        if (len == read_buffer_size - 1)
+        {
+            /* proc files have no size, so grow when the buffer is full */
+            buffer = read_buffer_size < READ_BUFFER_MAX ? (char *) realloc(read_buffer, read_buffer_size * 2) : NULL;
+            if (buffer == NULL)
+            {
+                if (truncated)
+                    counter_increment(truncated);
+                break;
+            }
+            read_buffer = buffer;
+            read_buffer_size *= 2;
+        }
+
+        n = read(fd, read_buffer + len, read_buffer_size - 1 - len);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+
+    close(fd);
+
+    read_buffer[len] = '\0';
+
+    return len;
+}
+
+/* parses the unsigned number at or after *p, and advances *p past it */
+static long long parse_number(const char **p)
+{
+    const char *s = *p;
+    long long v = 0;
+
+    while (*s == ' ' || *s == '\t' || *s == ':')
+        s++;
+    while (*s >= '0' && *s <= '9')
+        v = v * 10 + (*s++ - '0');
+
+    *p = s;
+
+    return v;
+}
+
+static const char *next_line(const char *p)
+{
+    while (*p && *p != '\n')
+        p++;
+
+    return *p ? p + 1 : p;
+}
+
+/* returns the end of the key at the start of line p */
+static const char *key_end(const char *p)
+{
+    while (*p && *p != ' ' && *p != '\t' && *p != ':' && *p != '\n')
+        p++;
+
+    return p;
+}
+
+static int key_is(const char *p, const char *end, const char *key)
+{
+    return strncmp(key, p, end - p) == 0 && key[end - p] == '\0';
+}
+
+/* sets the metrics found in a file of "key value" or "key: value" lines */
+static void collect_keyed(struct metric *metrics, const char *p)
+{
+    struct metric *m;
+    const char *end;
+
+    for (; *p; p = next_line(p))
+    {
+        end = key_end(p);
+
+        for (m = metrics; m->m_key; m++)
+        {
+            if (key_is(p, end, m->m_key))
+            {
+                set(m->m_ctr, parse_number(&end));
+                break;
+            }
+        }
+    }
+}
+
+static void collect_proc_stat()
+{
+    struct metric *m;
+    const char *p;
+
+    if (read_file("/proc/stat") < 0 || strncmp(read_buffer, "cpu ", 4) != 0)
+        return;
+
+    p = read_buffer + 4;
+    for (m = cpu_metrics; m->m_key; m++)
+        set(m->m_ctr, parse_number(&p) * 1000 / clock_ticks);
+
+    collect_keyed(proc_stat_metrics, next_line(p));
+}
+
+static void collect_meminfo()
+{
+    if (read_file("/proc/meminfo") >= 0)
+        collect_keyed(meminfo_metrics, read_buffer);
+}
+
+/* parses /proc/<pid>/stat. returns 0 on success */
+static int read_proc_stat(const char *pid, struct proc_stat *ps)
+{
+    char path[PATH_SIZE];
+    const char *p;
+    int field;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    if (read_file(path) < 0)
+        return -1;
+
+    /* the comm field may contain spaces and parentheses */
+    p = strrchr(read_buffer, ')');
+    if (p == NULL)
+        return -1;
+    p += 2;
+
+    memset(ps, 0, sizeof(struct proc_stat));
+
+    for (field = 0; *p && field <= PROC_STAT_RSS; field++)
+    {
+        if (field == PROC_STAT_UTIME)
+            ps->ps_utime = parse_number(&p);
+        else if (field == PROC_STAT_STIME)
+            ps->ps_stime = parse_number(&p);
+        else if (field == PROC_STAT_NUM_THREADS)
+            ps->ps_threads = parse_number(&p);
+        else if (field == PROC_STAT_RSS)
+            ps->ps_rss = parse_number(&p);
+
+        while (*p && *p != ' ')
+            p++;
+        while (*p == ' ')
+            p++;
+    }
+
+    return field > PROC_STAT_RSS ? 0 : -1;
+}
+
+static void collect_proc(struct proc_counters *pc)
+{
+    struct proc_stat ps;
+    char pid[16], path[PATH_SIZE];
+    const char *p, *end;
+
+    snprintf(pid, sizeof(pid), "%d", pc->pc_pid);
+    if (read_proc_stat(pid, &ps) != 0)
+        return;
+
+    set(pc->pc_user_ms, ps.ps_utime * 1000 / clock_ticks);
+    set(pc->pc_system_ms, ps.ps_stime * 1000 / clock_ticks);
+    set(pc->pc_threads, ps.ps_threads);
+    set(pc->pc_rss_kb, ps.ps_rss * page_kb);
+
+    snprintf(path, sizeof(path), "/proc/%s/status", pid);
+    if (read_file(path) < 0)
+        return;
+
+    for (p = read_buffer; *p; p = next_line(p))
+    {
+        end = key_end(p);
+        if (key_is(p, end, "voluntary_ctxt_switches"))
+            set(pc->pc_ctxsw_vol, parse_number(&end));
+        else if (key_is(p, end, "nonvoluntary_ctxt_switches"))
+            set(pc->pc_ctxsw_invol, parse_number(&end));
+    }
+}
+
+static void collect_all_procs(struct stats_counter **all)
+{
+    struct proc_stat ps;
+    struct dirent *de;
+    DIR *dir;
+    long long count = 0, threads = 0, rss = 0;
+
+    dir = opendir("/proc");
+    if (dir == NULL)
+        return;
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9')
+            continue;
+
+        /* the process may have exited since the directory was read */
+        if (read_proc_stat(de->d_name, &ps) != 0)
+            continue;
+
+        count++;
+        threads += ps.ps_threads;
+        rss += ps.ps_rss;
+    }
+
+    closedir(dir);
+
+    set(all[0], count);
+    set(all[1], threads);
+    set(all[2], rss * page_kb);
+}
+
+static void collect_cgroup(const char *cgroup, struct stats_counter *mem, struct stats_counter *pids)
+{
+    char path[PATH_SIZE];
+    const char *p;
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", cgroup);
+    if (read_file(path) >= 0)
+        collect_keyed(cgroup_cpu_metrics, read_buffer);
+
+    snprintf(path, sizeof(path), "%s/memory.current", cgroup);
+    if (read_file(path) >= 0)
+    {
+        p = read_buffer;
+        set(mem, parse_number(&p));
+    }
+
+    snprintf(path, sizeof(path), "%s/pids.current", cgroup);
+    if (read_file(path) >= 0)
+    {
+        p = read_buffer;
+        set(pids, parse_number(&p));
+    }
+}
+
+static void allocate_proc(struct stats *stats, struct proc_counters *pc, int pid)
+{
+    char name[MAX_COUNTER_KEY_LENGTH+1];
+
+    pc->pc_pid = pid;
+
+    snprintf(name, sizeof(name), "proc.%d.user_ms", pid);
+    pc->pc_user_ms = allocate(stats, name, 0);
+    snprintf(name, sizeof(name), "proc.%d.system_ms", pid);
+    pc->pc_system_ms = allocate(stats, name, 0);
+    snprintf(name, sizeof(name), "proc.%d.threads", pid);
+    pc->pc_threads = allocate(stats, name, CTR_FLAG_GAUGE);
+    snprintf(name, sizeof(name), "proc.%d.rss_kb", pid);
+    pc->pc_rss_kb = allocate(stats, name, CTR_FLAG_GAUGE);
+    snprintf(name, sizeof(name), "proc.%d.ctxsw_vol", pid);
+    pc->pc_ctxsw_vol = allocate(stats, name, 0);
+    snprintf(name, sizeof(name), "proc.%d.ctxsw_invol", pid);
+    pc->pc_ctxsw_invol = allocate(stats, name, 0);
+}
+
+static void usage()
+{
+    printf("usage: statscollect [-i INTERVAL_MS] [-a] [-c CGROUP] STATS [PID...]\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats = NULL;
+    struct proc_counters procs[MAX_PIDS];
+    struct stats_counter *all[3] = { NULL, NULL, NULL };
+    struct stats_counter *cg_mem = NULL, *cg_pids = NULL, *pass_us;
+    const char *cgroup = NULL;
+    struct timespec delay;
+    long long interval_ms = 1000, start, elapsed;
+    int all_procs = 0, nprocs = 0, i, ch;
+
+    while ((ch = getopt(argc, argv, "i:ac:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'i':
+            interval_ms = atoll(optarg);
+            break;
+        case 'a':
+            all_procs = 1;
+            break;
+        case 'c':
+            cgroup = optarg;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (optind >= argc || interval_ms <= 0 || argc - optind - 1 > MAX_PIDS)
+    {
+        usage();
+        return -1;
+    }
+
+    clock_ticks = sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    read_buffer = (char *) malloc(READ_BUFFER_SIZE);
+    if (read_buffer == NULL)
+    {
+        printf("Failed to allocate memory\n");
+        return ERROR_FAIL;
+    }
+    read_buffer_size = READ_BUFFER_SIZE;
+
+    stats = open_stats(argv[optind]);
+    if (!stats)
+        return ERROR_FAIL;
+
+    allocate_metrics(stats, cpu_metrics);
+    allocate_metrics(stats, proc_stat_metrics);
+    allocate_metrics(stats, meminfo_metrics);
+
+    for (i = optind + 1; i < argc; i++)
+        allocate_proc(stats, procs + nprocs++, atoi(argv[i]));
+
+    if (all_procs)
+    {
+        all[0] = allocate(stats, "proc.all.count", CTR_FLAG_GAUGE);
+        all[1] = allocate(stats, "proc.all.threads", CTR_FLAG_GAUGE);
+        all[2] = allocate(stats, "proc.all.rss_kb", CTR_FLAG_GAUGE);
+    }
+
+    if (cgroup)
+    {
+        allocate_metrics(stats, cgroup_cpu_metrics);
+        cg_mem = allocate(stats, "cg.mem.current", CTR_FLAG_GAUGE);
+        cg_pids = allocate(stats, "cg.pids.current", CTR_FLAG_GAUGE);
+    }
+
+    pass_us = allocate(stats, "collect.pass_us", CTR_FLAG_GAUGE);
+    truncated = allocate(stats, "collect.truncated", 0);
+
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
+
+    while (!done)
+    {
+        start = current_time();
+
+        collect_proc_stat();
+        collect_meminfo();
+
+        for (i = 0; i < nprocs; i++)
+            collect_proc(procs + i);
+
+        if (all_procs)
+            collect_all_procs(all);
+
+        if (cgroup)
+            collect_cgroup(cgroup, cg_mem, cg_pids);
+
+        elapsed = TIME_DELTA_TO_NANOS(start, current_time()) / 1000;
+        set(pass_us, elapsed);
+
+        if (elapsed < interval_ms * 1000)
+        {
+            delay.tv_sec = (interval_ms * 1000 - elapsed) / 1000000;
+            delay.tv_nsec = ((interval_ms * 1000 - elapsed) % 1000000) * 1000;
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    stats_close(stats);
+    stats_free(stats);
+    free(read_buffer);
+
+    return 0;
+}
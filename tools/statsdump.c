@@ -0,0 +1,571 @@
+/* statsdump.c */
+
+/*
+ * Streams the samples of a stats object to stdout, for piping into other
+ * tools (statsview is the interactive viewer).
+ *
+ * statsdump samples STATS every INTERVAL_MS and writes the counters whose
+ * keys match any of the -k globs (all counters if none are given), as
+ * values or with -d as the change since the previous sample. It stops
+ * after COUNT samples, or when interrupted.
+ *
+ * usage: statsdump [-i INTERVAL_MS] [-c COUNT] [-f csv|json|bin] [-d] [-k GLOB]... STATS
+ *
+ * Times are milliseconds since the epoch. The formats are:
+ *
+ *      csv     a header line "time,KEY,..." and a line per sample. A new
+ *              header line is written when matching counters are added.
+ *      json    a line per sample: {"time":T,"values":{"KEY":V,...}}
+ *      bin     the magic "SDMP" and a version (int32), followed by records
+ *              of a type byte and its fields, in host byte order:
+ *              'K' the counters: count (int32), then for each the
+ *                  ctr_flags (int32), key length (uint8) and key
+ *              'S' a sample: time (int64), count (int32) and the values
+ *                  (int64), as stored in the sample (see
+ *                  stats_value_to_double); deltas of double counters are
+ *                  written as doubles
+ *
+ * Double and fixed point counters are written with a fraction in csv and
+ * json. Globs match with * and ?.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+#define MAX_GLOBS           64
+
+#define FORMAT_CSV          0
+#define FORMAT_JSON         1
+#define FORMAT_BIN          2
+
+#define DUMP_MAGIC          "SDMP"
+#define DUMP_VERSION        1
+
+/* the output buffer is flushed before a field when fewer than
+   OUT_RESERVE bytes are left, which is room for any one field */
+#define OUT_SIZE            65536
+#define OUT_RESERVE         256
+
+static volatile int done = 0;
+
+static void sigfunc(int sig_no)
+{
+    done = 1;
+}
+
+/* A glob compiled for matching many keys: the literal prefix up to the
+ * first wildcard is compared first, and a pattern without wildcards is
+ * compared as a whole.
+ */
+struct glob
+{
+    const char *g_pattern;
+    int g_len;
+    int g_prefix_len;
+};
+
+struct glob_set
+{
+    int gs_count;
+    struct glob gs_glob[MAX_GLOBS];
+};
+
+/* dc_index is the index of the counter in the counter list
+ * dc_key is the key quoted for the output format (csv or json)
+ */
+struct dump_counter
+{
+    int dc_index;
+    int dc_flags;
+    int dc_key_len;
+    int dc_quoted_len;
+    char dc_key[MAX_COUNTER_KEY_LENGTH+1];
+    char dc_quoted[2*MAX_COUNTER_KEY_LENGTH+8];
+};
+
+static char out_buf[OUT_SIZE];
+static int out_len = 0;
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static void out_flush()
+{
+    if (out_len > 0 && fwrite(out_buf, 1, out_len, stdout) != out_len)
+        done = 1;
+    fflush(stdout);
+    out_len = 0;
+}
+
+static void out_reserve()
+{
+    if (out_len > OUT_SIZE - OUT_RESERVE)
+        out_flush();
+}
+
+static void out_char(char c)
+{
+    out_buf[out_len++] = c;
+}
+
+static void out_bytes(const void *p, int len)
+{
+    memcpy(out_buf + out_len, p, len);
+    out_len += len;
+}
+
+/* integers are converted two digits at a time, from the right */
+static void out_ll(long long value)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long v;
+
+    v = value < 0 ? -(unsigned long long) value : (unsigned long long) value;
+    while (v >= 100)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    }
+    else
+    {
+        *--p = '0' + v;
+    }
+    if (value < 0)
+        *--p = '-';
+
+    out_bytes(p, tmp + sizeof(tmp) - p);
+}
+
+static void out_double(double d, int digits, int json)
+{
+    if (d != d || d - d != 0.0)
+    {
+        if (json)
+            out_bytes("null", 4);
+        return;
+    }
+    if (digits < 0)
+        out_len += snprintf(out_buf + out_len, OUT_RESERVE, "%.17g", d);
+    else
+        out_len += snprintf(out_buf + out_len, OUT_RESERVE, "%.*f", digits, d);
+}
+
+static void glob_set_add(struct glob_set *gs, const char *pattern)
+{
+    struct glob *g = &gs->gs_glob[gs->gs_count++];
+
+    g->g_pattern = pattern;
+    g->g_len = strlen(pattern);
+    g->g_prefix_len = strcspn(pattern, "*?");
+}
+
+static int glob_match(const char *p, const char *s)
+{
+    const char *star = NULL, *retry = NULL;
+
+    while (*s)
+    {
+        if (*p == '*')
+        {
+            star = ++p;
+            retry = s;
+        }
+        else if (*p == '?' || *p == *s)
+        {
+            p++;
+            s++;
+        }
+        else if (star)
+        {
+            p = star;
+            s = ++retry;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    while (*p == '*')
+        p++;
+    return *p == '\0';
+}
+
+/* an empty set matches every key */
+static int glob_set_match(struct glob_set *gs, const char *key, int key_len)
+{
+    struct glob *g;
+    int i;
+
+    if (gs->gs_count == 0)
+        return 1;
+
+    for (i = 0; i < gs->gs_count; i++)
+    {
+        g = &gs->gs_glob[i];
+        if (key_len < g->g_prefix_len || memcmp(key, g->g_pattern, g->g_prefix_len) != 0)
+            continue;
+        if (g->g_prefix_len == g->g_len)
+        {
+            if (key_len == g->g_len)
+                return 1;
+        }
+        else if (glob_match(g->g_pattern + g->g_prefix_len, key + g->g_prefix_len))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void quote_key(struct dump_counter *dc, int format)
+{
+    char *q = dc->dc_quoted;
+    int i;
+
+    if (format == FORMAT_CSV)
+    {
+        /* csv keys are quoted only if they have to be */
+        if (strpbrk(dc->dc_key, ",\"\r\n") == NULL)
+        {
+            strcpy(q, dc->dc_key);
+            dc->dc_quoted_len = dc->dc_key_len;
+            return;
+        }
+        *q++ = '"';
+        for (i = 0; i < dc->dc_key_len; i++)
+        {
+            if (dc->dc_key[i] == '"')
+                *q++ = '"';
+            *q++ = dc->dc_key[i];
+        }
+        *q++ = '"';
+    }
+    else
+    {
+        /* json keys are written with the quotes and colon */
+        *q++ = '"';
+        for (i = 0; i < dc->dc_key_len; i++)
+        {
+            if (dc->dc_key[i] == '"' || dc->dc_key[i] == '\\')
+                *q++ = '\\';
+            *q++ = (unsigned char) dc->dc_key[i] < ' ' ? '?' : dc->dc_key[i];
+        }
+        *q++ = '"';
+        *q++ = ':';
+    }
+    dc->dc_quoted_len = q - dc->dc_quoted;
+}
+
+static void write_counters(struct dump_counter *dc, int n, int format)
+{
+    int i;
+
+    if (format == FORMAT_CSV)
+    {
+        out_reserve();
+        out_bytes("time", 4);
+        for (i = 0; i < n; i++)
+        {
+            out_reserve();
+            out_char(',');
+            out_bytes(dc[i].dc_quoted, dc[i].dc_quoted_len);
+        }
+        out_char('\n');
+    }
+    else if (format == FORMAT_BIN)
+    {
+        out_reserve();
+        out_char('K');
+        out_bytes(&n, sizeof(n));
+        for (i = 0; i < n; i++)
+        {
+            out_reserve();
+            out_bytes(&dc[i].dc_flags, sizeof(dc[i].dc_flags));
+            out_char((unsigned char) dc[i].dc_key_len);
+            out_bytes(dc[i].dc_key, dc[i].dc_key_len);
+        }
+    }
+}
+
+static void write_value(struct dump_counter *dc, struct stats_sample *sample, struct stats_sample *prev_sample,
+    int deltas, int format)
+{
+    long long value;
+    double d;
+    int json = format == FORMAT_JSON;
+
+    if (dc->dc_flags & CTR_FLAG_REAL_MASK)
+    {
+        if (deltas)
+            d = stats_sample_get_delta_double(sample, prev_sample, dc->dc_flags, dc->dc_index);
+        else
+            d = stats_sample_get_double(sample, dc->dc_flags, dc->dc_index);
+
+        if (format == FORMAT_BIN)
+        {
+            if (deltas && (dc->dc_flags & CTR_FLAG_DOUBLE))
+                out_bytes(&d, sizeof(d));
+            else
+            {
+                value = deltas ? stats_sample_get_delta(sample, prev_sample, dc->dc_index) :
+                    stats_sample_get_value(sample, dc->dc_index);
+                out_bytes(&value, sizeof(value));
+            }
+        }
+        else
+        {
+            out_double(d, (dc->dc_flags & CTR_FLAG_FIXED) ? CTR_FLAG_FIXED_DIGITS(dc->dc_flags) : -1, json);
+        }
+        return;
+    }
+
+    value = deltas ? stats_sample_get_delta(sample, prev_sample, dc->dc_index) :
+        stats_sample_get_value(sample, dc->dc_index);
+    if (format == FORMAT_BIN)
+        out_bytes(&value, sizeof(value));
+    else
+        out_ll(value);
+}
+
+static void write_sample(struct dump_counter *dc, int n, struct stats_sample *sample, struct stats_sample *prev_sample,
+    long long time_ms, int deltas, int format)
+{
+    long long time_ns;
+    int i;
+
+    out_reserve();
+    if (format == FORMAT_CSV)
+    {
+        out_ll(time_ms);
+    }
+    else if (format == FORMAT_JSON)
+    {
+        out_bytes("{\"time\":", 8);
+        out_ll(time_ms);
+        out_bytes(",\"values\":{", 11);
+    }
+    else
+    {
+        time_ns = time_ms * 1000000ll;
+        out_char('S');
+        out_bytes(&time_ns, sizeof(time_ns));
+        out_bytes(&n, sizeof(n));
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        out_reserve();
+        if (format == FORMAT_CSV)
+        {
+            out_char(',');
+        }
+        else if (format == FORMAT_JSON)
+        {
+            if (i > 0)
+                out_char(',');
+            out_bytes(dc[i].dc_quoted, dc[i].dc_quoted_len);
+        }
+        write_value(&dc[i], sample, prev_sample, deltas, format);
+    }
+
+    if (format == FORMAT_JSON)
+        out_bytes("}}\n", 3);
+    else if (format == FORMAT_CSV)
+        out_char('\n');
+}
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to create stats %s: %s\n", name, error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to open stats %s: %s\n", name, error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: statsdump [-i INTERVAL_MS] [-c COUNT] [-f csv|json|bin] [-d] [-k GLOB]... STATS\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *prev_sample = NULL, *tmp;
+    struct stats_counter *ctr;
+    struct dump_counter *dc;
+    struct glob_set globs;
+    struct sigaction sa;
+    struct timeval tv;
+    int c, i, err = S_OK, interval_ms = DEFAULT_INTERVAL_MS, format = FORMAT_CSV, deltas = 0, n = 0, matched = 0, added;
+    long long count = 0, samples = 0, next, now, wall_offset_ms;
+
+    memset(&globs, 0, sizeof(globs));
+
+    while ((c = getopt(argc, argv, "i:c:f:dk:")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms < 1)
+                usage();
+            break;
+        case 'c':
+            count = atoll(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0)
+                format = FORMAT_CSV;
+            else if (strcmp(optarg, "json") == 0)
+                format = FORMAT_JSON;
+            else if (strcmp(optarg, "bin") == 0)
+                format = FORMAT_BIN;
+            else
+                usage();
+            break;
+        case 'd':
+            deltas = 1;
+            break;
+        case 'k':
+            if (globs.gs_count == MAX_GLOBS)
+                usage();
+            glob_set_add(&globs, optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 1)
+        usage();
+
+    stats = open_stats(argv[optind]);
+    if (stats == NULL)
+        return 1;
+
+    dc = (struct dump_counter *) calloc(COUNTER_TABLE_SIZE, sizeof(struct dump_counter));
+    if (dc == NULL || stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK ||
+        stats_sample_create(&prev_sample) != S_OK)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sigfunc;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* sample times are current_time(); the output has wall clock times */
+    gettimeofday(&tv, NULL);
+    wall_offset_ms = tv.tv_sec * 1000ll + tv.tv_usec / 1000 - current_time() / 1000000ll;
+
+    if (format == FORMAT_BIN)
+    {
+        i = DUMP_VERSION;
+        out_bytes(DUMP_MAGIC, 4);
+        out_bytes(&i, sizeof(i));
+    }
+
+    next = current_time();
+
+    while (!done)
+    {
+        err = stats_get_sample(stats, cl, sample);
+        if (err != S_OK)
+        {
+            fprintf(stderr, "Failed to get sample: %s\n", error_message(err));
+            break;
+        }
+
+        /* counter lists only grow, so only the counters added since the
+           last sample are matched against the globs */
+        added = 0;
+        for (; matched < cl->cl_count; matched++)
+        {
+            ctr = stats_cl_get_counter(stats, cl, matched);
+            counter_get_key(ctr, dc[n].dc_key, MAX_COUNTER_KEY_LENGTH+1);
+            dc[n].dc_key_len = strlen(dc[n].dc_key);
+            if (!glob_set_match(&globs, dc[n].dc_key, dc[n].dc_key_len))
+                continue;
+            dc[n].dc_index = matched;
+            dc[n].dc_flags = ctr->ctr_flags;
+            quote_key(&dc[n], format);
+            n++;
+            added = 1;
+        }
+        if (added || samples == 0)
+            write_counters(dc, n, format);
+
+        /* the first sample has no deltas */
+        if (!deltas || samples > 0)
+            write_sample(dc, n, sample, prev_sample, sample->sample_time / 1000000ll + wall_offset_ms, deltas, format);
+        out_flush();
+
+        tmp = prev_sample;
+        prev_sample = sample;
+        sample = tmp;
+
+        samples++;
+        if (count > 0 && samples == count + deltas)
+            break;
+
+        next += interval_ms * 1000000ll;
+        now = current_time();
+        while (next <= now)
+            next += interval_ms * 1000000ll;
+        usleep((next - now) / 1000);
+    }
+
+    out_flush();
+
+    free(dc);
+    stats_sample_free(prev_sample);
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+    stats_close(stats);
+    stats_free(stats);
+
+    return err == S_OK ? 0 : 1;
+}
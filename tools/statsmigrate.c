@@ -0,0 +1,127 @@
+/* statsmigrate.c */
+
+/*
+ * Moves the counters of one stats object into another (see migrate.h).
+ *
+ * statsmigrate copies the counters of FROM into TO, then keeps adding
+ * what is written to FROM every INTERVAL_MS while the processes using it
+ * are restarted against TO. Once it is the last process attached to FROM
+ * it makes a final pass and exits, which removes FROM. With -1 it makes
+ * one pass and exits.
+ *
+ * usage: statsmigrate [-i INTERVAL_MS] [-1] FROM TO
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats/stats.h"
+#include "stats/migrate.h"
+#include "stats/error.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        printf("Failed to create stats %s: %s\n", name, error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        printf("Failed to open stats %s: %s\n", name, error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: statsmigrate [-i INTERVAL_MS] [-1] FROM TO\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *from, *to;
+    struct stats_migration *mg = NULL;
+    int c, err, n, attached, once = 0, interval_ms = DEFAULT_INTERVAL_MS, passes = 0;
+
+    while ((c = getopt(argc, argv, "i:1")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms < 1)
+                usage();
+            break;
+        case '1':
+            once = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2 || strcmp(argv[optind], argv[optind + 1]) == 0)
+        usage();
+
+    from = open_stats(argv[optind]);
+    if (from == NULL)
+        return 1;
+
+    to = open_stats(argv[optind + 1]);
+    if (to == NULL)
+        return 1;
+
+    if (stats_migration_create(&mg) != S_OK)
+    {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (;;)
+    {
+        /* check before the pass, so the last pass sees every write */
+        if (shared_memory_nattach(&from->shmem, &attached) != S_OK)
+            attached = 1;
+
+        err = stats_migrate(from, to, mg, &n);
+        if (err != S_OK)
+        {
+            printf("Failed to migrate %s to %s: %s\n", argv[optind], argv[optind + 1], error_message(err));
+            return 1;
+        }
+
+        if (passes++ == 0)
+            printf("Migrated %d counters from %s to %s\n", n, argv[optind], argv[optind + 1]);
+
+        if (once || attached <= 1)
+            break;
+
+        usleep(interval_ms * 1000);
+    }
+
+    printf("Finished after %d passes\n", passes);
+
+    stats_migration_free(mg);
+
+    stats_close(to);
+    stats_free(to);
+    stats_close(from);
+    stats_free(from);
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/* statsprof.c */
+
+/*
+ * Reports the counters which cause the most cross-cpu contention.
+ *
+ * statsprof reads the contention profiling side table twice, INTERVAL
+ * seconds apart, and reports the counters with the most writes from
+ * different cpus and the highest write rates. The processes writing the
+ * counters must be built with PROFILE=1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+
+#define DEFAULT_INTERVAL 5
+#define MAX_REPORT 20
+
+/* thresholds used to recommend a fix for a counter */
+#define SHARD_MIN_RATE          100000.0
+#define SHARD_MIN_SWITCH_RATIO  0.25
+#define BATCH_MIN_RATE          1000000.0
+
+struct counter_report
+{
+    int slot;
+    double write_rate;
+    double switch_rate;
+    double switch_ratio;
+    int ncpus;
+};
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        printf("Failed to create stats: %s\n", error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        printf("Failed to open stats: %s\n", error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static int count_cpus(unsigned long long mask)
+{
+    int n = 0;
+
+    while (mask)
+    {
+        mask &= mask - 1;
+        n++;
+    }
+
+    return n;
+}
+
+static int report_compare(const void *a, const void *b)
+{
+    const struct counter_report *ra = (const struct counter_report *)a;
+    const struct counter_report *rb = (const struct counter_report *)b;
+
+    if (ra->switch_rate != rb->switch_rate)
+        return ra->switch_rate < rb->switch_rate ? 1 : -1;
+    if (ra->write_rate != rb->write_rate)
+        return ra->write_rate < rb->write_rate ? 1 : -1;
+    return 0;
+}
+
+static const char *recommend(struct counter_report *r)
+{
+    if (r->ncpus > 1 && r->write_rate >= SHARD_MIN_RATE && r->switch_ratio >= SHARD_MIN_SWITCH_RATIO)
+        return "shard";
+    if (r->write_rate >= BATCH_MIN_RATE)
+        return "batch";
+    return "-";
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats = NULL;
+    struct stats_counter_list *cl = NULL;
+    struct stats_profile_entry *before = NULL, *after, *b, *a;
+    struct counter_report *reports = NULL;
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+    long long start_time, end_time;
+    double seconds;
+    int interval = DEFAULT_INTERVAL;
+    int i, n, rate, slot;
+
+    if (argc < 2 || argc > 3)
+    {
+        printf("usage: statsprof STATS [INTERVAL]\n");
+        return -1;
+    }
+
+    if (argc == 3)
+        interval = atoi(argv[2]);
+    if (interval <= 0)
+        interval = DEFAULT_INTERVAL;
+
+    if (stats_cl_create(&cl) != S_OK)
+    {
+        printf("Failed to allocate stats counter list\n");
+        return ERROR_FAIL;
+    }
+
+    before = (struct stats_profile_entry *) malloc(sizeof(struct stats_profile_entry) * COUNTER_TABLE_SIZE);
+    reports = (struct counter_report *) malloc(sizeof(struct counter_report) * COUNTER_TABLE_SIZE);
+    if (!before || !reports)
+    {
+        printf("Failed to allocate memory\n");
+        return ERROR_FAIL;
+    }
+
+    stats = open_stats(argv[1]);
+    if (!stats)
+    {
+        printf("Failed to open stats %s\n", argv[1]);
+        return ERROR_FAIL;
+    }
+
+    memcpy(before, stats->data->prof.prof_entry, sizeof(struct stats_profile_entry) * COUNTER_TABLE_SIZE);
+    start_time = current_time();
+
+    sleep(interval);
+
+    end_time = current_time();
+    after = stats->data->prof.prof_entry;
+    rate = stats->data->prof.prof_sample_rate;
+
+    if (rate == 0)
+    {
+        printf("No profile data in %s. Build the writing processes with PROFILE=1.\n", argv[1]);
+        goto exit;
+    }
+
+    if (stats_get_counter_list(stats, cl) != S_OK)
+    {
+        printf("Failed to get counter list\n");
+        goto exit;
+    }
+
+    seconds = TIME_DELTA_TO_NANOS(start_time, end_time) / 1000000000.0;
+
+    n = 0;
+    for (i = 0; i < cl->cl_count; i++)
+    {
+        slot = cl->cl_slot[i];
+        b = before + slot;
+        a = after + slot;
+
+        if (a->prof_writes <= b->prof_writes)
+            continue;
+
+        reports[n].slot = slot;
+        reports[n].write_rate = (a->prof_writes - b->prof_writes) * (double) rate / seconds;
+        reports[n].switch_rate = (a->prof_cpu_switches - b->prof_cpu_switches) * (double) rate / seconds;
+        reports[n].switch_ratio = (double)(a->prof_cpu_switches - b->prof_cpu_switches) / (double)(a->prof_writes - b->prof_writes);
+        reports[n].ncpus = count_cpus(a->prof_cpu_mask);
+        n++;
+    }
+
+    qsort(reports, n, sizeof(struct counter_report), report_compare);
+
+    printf("%d counters written in %.1fs (1 in %d writes sampled)\n\n", n, seconds, rate);
+    printf("%-32s %14s %14s %8s %5s  %s\n", "COUNTER", "WRITES/S", "XCPU/S", "XCPU%", "CPUS", "ADVICE");
+
+    for (i = 0; i < n && i < MAX_REPORT; i++)
+    {
+        counter_get_key(stats->data->ctr + reports[i].slot, counter_name, MAX_COUNTER_KEY_LENGTH+1);
+        printf("%-32s %14.0f %14.0f %7.1f%% %5d  %s\n", counter_name,
+            reports[i].write_rate, reports[i].switch_rate, reports[i].switch_ratio * 100.0,
+            reports[i].ncpus, recommend(reports + i));
+    }
+
+exit:
+    stats_close(stats);
+    stats_free(stats);
+    stats_cl_free(cl);
+    free(before);
+    free(reports);
+
+    return 0;
+}
@@ -0,0 +1,448 @@
+/* statspush.c */
+
+/*
+ * Pushes the counters of a stats object to histd.
+ *
+ * statspush samples STATS every INTERVAL seconds and sends the counters
+ * to histd at HOST:PORT as update messages, each datagram as large as
+ * histd receives. histd keeps a value per metric per second and records
+ * 0 for the seconds a metric is not sent, so only values which are not
+ * already implied are sent:
+ *
+ *      counters are sent as their change over the interval, and only if
+ *          they changed. The whole change is recorded in the last second
+ *          of the interval, so with -i above 1 the other seconds read 0.
+ *      gauges (and HLL estimates) are sent as their value, if it is not
+ *          0 or was not 0 the previous interval, for every second of the
+ *          interval, so they do not read 0 between samples.
+ *
+ * HOST must have an IPv4 address, as histd only listens on IPv4.
+ *
+ * Double and fixed point values are rounded to integers. Keys longer than
+ * a histd metric name are truncated.
+ *
+ * With -v the number of counters, values sent, datagrams and cpu time of
+ * each interval are printed; on exit the totals and the cpu time per 10k
+ * counters per sample are.
+ *
+ * usage: statspush [-i INTERVAL] [-p PORT] [-v] STATS HOST
+ */
+
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+#include "histd/protocol.h"
+
+#define DEFAULT_INTERVAL    1
+#define DEFAULT_PORT        "7010"
+
+#define PUSH_HEADER_SIZE    (sizeof(struct histd_proto_message_header) + sizeof(struct histd_proto_update_message))
+#define PUSH_MAX_METRICS    ((HISTD_PROTO_MAX_MESSAGE_SIZE - PUSH_HEADER_SIZE) / sizeof(struct histd_proto_metric_update))
+#define PUSH_MAX_MESSAGES   ((COUNTER_TABLE_SIZE + PUSH_MAX_METRICS - 1) / PUSH_MAX_METRICS)
+
+/* counters whose value is a level rather than a count */
+#define PUSH_LEVEL_MASK     (CTR_FLAG_GAUGE | CTR_FLAG_HLL)
+
+static volatile int done = 0;
+
+static void sigfunc(int sig_no)
+{
+    done = 1;
+}
+
+/* the byte order histd_client writes and histd reads */
+static uint64_t htonll(uint64_t ll)
+{
+    union {
+        uint64_t ll;
+        struct {
+            uint32_t h;
+            uint32_t l;
+        } s;
+    } u;
+
+    u.ll = ll;
+    u.s.h = htonl(u.s.h);
+    u.s.l = htonl(u.s.l);
+    return u.ll;
+}
+
+/* pm_name is the counter's key as a histd metric name, NUL terminated */
+struct push_metric
+{
+    int pm_flags;
+    char pm_name[HISTD_PROTO_MAX_METRIC_NAME_LEN];
+};
+
+struct push_context
+{
+    int pc_socket;
+    struct sockaddr_storage pc_addr;
+    socklen_t pc_addr_len;
+    int pc_messages;
+    char pc_buf[PUSH_MAX_MESSAGES][HISTD_PROTO_MAX_MESSAGE_SIZE];
+    int pc_len[PUSH_MAX_MESSAGES];
+    long long pc_sent;
+    long long pc_datagrams;
+    long long pc_dropped;
+};
+
+static long long rounded(double d)
+{
+    return d == d ? llround(d) : 0;
+}
+
+/* the value to send for a counter, returning 0 if nothing needs to be sent */
+static int push_value(struct push_metric *pm, struct stats_sample *sample, struct stats_sample *prev_sample,
+    int j, long long *value_out)
+{
+    long long value, prev;
+
+    if (pm->pm_flags & PUSH_LEVEL_MASK)
+    {
+        if (pm->pm_flags & CTR_FLAG_REAL_MASK)
+        {
+            value = rounded(stats_sample_get_double(sample, pm->pm_flags, j));
+            prev = j < prev_sample->sample_count ? rounded(stats_sample_get_double(prev_sample, pm->pm_flags, j)) : 0;
+        }
+        else
+        {
+            value = stats_sample_get_value(sample, j);
+            prev = j < prev_sample->sample_count ? stats_sample_get_value(prev_sample, j) : 0;
+        }
+        *value_out = value;
+        return value != 0 || prev != 0;
+    }
+
+    /* a counter added since the previous sample changed by its value */
+    if (j >= prev_sample->sample_count)
+        value = (pm->pm_flags & CTR_FLAG_REAL_MASK) ? rounded(stats_sample_get_double(sample, pm->pm_flags, j)) :
+            stats_sample_get_value(sample, j);
+    else if (pm->pm_flags & CTR_FLAG_REAL_MASK)
+        value = rounded(stats_sample_get_delta_double(sample, prev_sample, pm->pm_flags, j));
+    else
+        value = stats_sample_get_delta(sample, prev_sample, j);
+    *value_out = value;
+    return value != 0;
+}
+
+static struct histd_proto_update_message *message_body(struct push_context *pc, int m)
+{
+    return (struct histd_proto_update_message *) (pc->pc_buf[m] + sizeof(struct histd_proto_message_header));
+}
+
+/* fills the update messages with the values to send, only those of gauges
+   if levels_only is set */
+static int encode(struct push_context *pc, struct push_metric *pm, struct stats_sample *sample,
+    struct stats_sample *prev_sample, uint32_t timestamp, int levels_only)
+{
+    struct histd_proto_message_header *hdr;
+    struct histd_proto_update_message *msg;
+    struct histd_proto_metric_update *upd;
+    long long value;
+    int j, m = 0, n = 0, sent = 0;
+
+    for (j = 0; j < sample->sample_count; j++)
+    {
+        if (levels_only && !(pm[j].pm_flags & PUSH_LEVEL_MASK))
+            continue;
+        if (!push_value(&pm[j], sample, prev_sample, j, &value))
+            continue;
+
+        if (n == PUSH_MAX_METRICS)
+        {
+            m++;
+            n = 0;
+        }
+        upd = &message_body(pc, m)->metrics[n++];
+        memcpy(upd->metric_name, pm[j].pm_name, HISTD_PROTO_MAX_METRIC_NAME_LEN);
+        upd->metric_value = htonll((uint64_t) value);
+        pc->pc_len[m] = n;
+        sent++;
+    }
+
+    pc->pc_messages = n > 0 ? m + 1 : 0;
+    for (m = 0; m < pc->pc_messages; m++)
+    {
+        n = pc->pc_len[m];
+        hdr = (struct histd_proto_message_header *) pc->pc_buf[m];
+        msg = message_body(pc, m);
+        pc->pc_len[m] = PUSH_HEADER_SIZE + n * sizeof(struct histd_proto_metric_update);
+        hdr->message_type = htonl(HISTD_PROTO_UPDATE_MESSAGE_TYPE);
+        hdr->message_length = htonl(pc->pc_len[m]);
+        msg->timestamp = htonl(timestamp);
+        msg->metric_count = htonl(n);
+    }
+
+    pc->pc_sent += sent;
+    return sent;
+}
+
+static void send_messages(struct push_context *pc)
+{
+#ifdef LINUX
+    struct mmsghdr mmsg[PUSH_MAX_MESSAGES];
+    struct iovec iov[PUSH_MAX_MESSAGES];
+    int m, n, i = 0;
+
+    memset(mmsg, 0, sizeof(mmsg));
+    for (m = 0; m < pc->pc_messages; m++)
+    {
+        iov[m].iov_base = pc->pc_buf[m];
+        iov[m].iov_len = pc->pc_len[m];
+        mmsg[m].msg_hdr.msg_name = &pc->pc_addr;
+        mmsg[m].msg_hdr.msg_namelen = pc->pc_addr_len;
+        mmsg[m].msg_hdr.msg_iov = &iov[m];
+        mmsg[m].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* a datagram which fails is dropped, and the rest are sent */
+    while (i < pc->pc_messages)
+    {
+        n = sendmmsg(pc->pc_socket, mmsg + i, pc->pc_messages - i, 0);
+        if (n <= 0)
+        {
+            pc->pc_dropped++;
+            n = 1;
+        }
+        else
+        {
+            pc->pc_datagrams += n;
+        }
+        i += n;
+    }
+#else
+    int m;
+
+    for (m = 0; m < pc->pc_messages; m++)
+    {
+        if (sendto(pc->pc_socket, pc->pc_buf[m], pc->pc_len[m], 0, (struct sockaddr *) &pc->pc_addr, pc->pc_addr_len) < 0)
+            pc->pc_dropped++;
+        else
+            pc->pc_datagrams++;
+    }
+#endif
+}
+
+static int open_socket(struct push_context *pc, const char *host, const char *port)
+{
+    struct addrinfo hints, *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    /* histd only listens on IPv4, so a name which resolves to ::1 first
+       must not be sent to over IPv6, where nothing would receive it */
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0)
+    {
+        fprintf(stderr, "Failed to resolve %s: %s\n", host, gai_strerror(err));
+        return 1;
+    }
+
+    pc->pc_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (pc->pc_socket < 0)
+    {
+        fprintf(stderr, "Failed to create socket\n");
+        freeaddrinfo(res);
+        return 1;
+    }
+
+    memcpy(&pc->pc_addr, res->ai_addr, res->ai_addrlen);
+    pc->pc_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static long long cpu_usec()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ll + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to create stats %s: %s\n", name, error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        fprintf(stderr, "Failed to open stats %s: %s\n", name, error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: statspush [-i INTERVAL] [-p PORT] [-v] STATS HOST\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL, *prev_sample = NULL, *tmp;
+    struct stats_counter *ctr;
+    struct push_context *pc;
+    struct push_metric *pm;
+    struct sigaction sa;
+    struct timeval tv;
+    const char *port = DEFAULT_PORT;
+    int c, k, err = S_OK, interval = DEFAULT_INTERVAL, verbose = 0, named = 0, sent, datagrams;
+    long long start, next, now, wall_start, timestamp, samples = 0, counters = 0, cpu, cpu_total = 0;
+
+    while ((c = getopt(argc, argv, "i:p:v")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            if (interval < 1)
+                usage();
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2)
+        usage();
+
+    stats = open_stats(argv[optind]);
+    if (stats == NULL)
+        return 1;
+
+    pc = (struct push_context *) calloc(1, sizeof(struct push_context));
+    pm = (struct push_metric *) calloc(COUNTER_TABLE_SIZE, sizeof(struct push_metric));
+    if (pc == NULL || pm == NULL || stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK ||
+        stats_sample_create(&prev_sample) != S_OK)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    if (open_socket(pc, argv[optind + 1], port) != 0)
+        return 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sigfunc;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* the timestamps are the wall clock seconds of the schedule, so they
+       advance by exactly the interval however late a sample is taken */
+    gettimeofday(&tv, NULL);
+    wall_start = tv.tv_sec + 1;
+    usleep(1000000 - tv.tv_usec);
+    start = next = current_time();
+
+    while (!done)
+    {
+        cpu = cpu_usec();
+
+        err = stats_get_sample(stats, cl, sample);
+        if (err != S_OK)
+        {
+            fprintf(stderr, "Failed to get sample: %s\n", error_message(err));
+            break;
+        }
+
+        for (; named < cl->cl_count; named++)
+        {
+            ctr = stats_cl_get_counter(stats, cl, named);
+            pm[named].pm_flags = ctr->ctr_flags;
+            counter_get_key(ctr, pm[named].pm_name, HISTD_PROTO_MAX_METRIC_NAME_LEN);
+        }
+
+        /* the first sample is the baseline for the counters. histd records
+           0 for each second a metric is not sent, so gauges are sent for
+           every second of the interval and counters for its last */
+        sent = datagrams = 0;
+        if (samples > 0)
+        {
+            timestamp = wall_start + (next - start) / 1000000000ll;
+            for (k = interval - 1; k >= 0; k--)
+            {
+                sent += encode(pc, pm, sample, prev_sample, timestamp - k, k > 0);
+                send_messages(pc);
+                datagrams += pc->pc_messages;
+            }
+        }
+
+        cpu = cpu_usec() - cpu;
+        cpu_total += cpu;
+        counters += sample->sample_count;
+        samples++;
+
+        if (verbose)
+        {
+            printf("%d counters, %d sent in %d datagrams, %lld us cpu\n", sample->sample_count, sent,
+                datagrams, cpu);
+            fflush(stdout);
+        }
+
+        tmp = prev_sample;
+        prev_sample = sample;
+        sample = tmp;
+
+        next += interval * 1000000000ll;
+        now = current_time();
+        while (next <= now)
+            next += interval * 1000000000ll;
+        usleep((next - now) / 1000);
+    }
+
+    printf("%lld samples, %lld values sent in %lld datagrams (%lld dropped), %.1f us cpu per sample, "
+        "%.1f us cpu per 10k counters\n", samples, pc->pc_sent, pc->pc_datagrams, pc->pc_dropped,
+        samples ? (double) cpu_total / samples : 0.0, counters ? cpu_total * 10000.0 / counters : 0.0);
+
+    close(pc->pc_socket);
+    free(pc);
+    free(pm);
+    stats_sample_free(prev_sample);
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+    stats_close(stats);
+    stats_free(stats);
+
+    return err == S_OK ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/* statsrecord.c */
+
+/*
+ * Records the samples of a stats object to disk (see record.h), for
+ * playback with statsview --replay PATH.
+ *
+ * statsrecord samples STATS every INTERVAL_MS (at least 10) and appends
+ * the samples to PATH.0 ... PATH.(FILES-1), each FILE_MB megabytes, until
+ * it is interrupted or has run for SECONDS. When it stops it prints the
+ * number of bytes written per sample and per hour.
+ *
+ * usage: statsrecord [-i INTERVAL_MS] [-s FILE_MB] [-n FILES] [-d SECONDS] STATS PATH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "stats/stats.h"
+#include "stats/record.h"
+#include "stats/error.h"
+
+#define DEFAULT_INTERVAL_MS 100
+#define MIN_INTERVAL_MS     10
+#define DEFAULT_FILE_MB     16
+#define DEFAULT_FILES       4
+
+static volatile int done = 0;
+
+static void sigfunc(int sig_no)
+{
+    done = 1;
+}
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        printf("Failed to create stats %s: %s\n", name, error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        printf("Failed to open stats %s: %s\n", name, error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: statsrecord [-i INTERVAL_MS] [-s FILE_MB] [-n FILES] [-d SECONDS] STATS PATH\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats;
+    struct stats_counter_list *cl = NULL;
+    struct stats_sample *sample = NULL;
+    struct stats_recorder *rec = NULL;
+    struct sigaction sa;
+    int c, err, interval_ms = DEFAULT_INTERVAL_MS, file_mb = DEFAULT_FILE_MB, files = DEFAULT_FILES, seconds = 0;
+    long long start, next, now, samples = 0;
+    double elapsed;
+
+    while ((c = getopt(argc, argv, "i:s:n:d:")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms < MIN_INTERVAL_MS)
+                usage();
+            break;
+        case 's':
+            file_mb = atoi(optarg);
+            if (file_mb < 1 || file_mb > 1024)
+                usage();
+            break;
+        case 'n':
+            files = atoi(optarg);
+            if (files < 1 || files > STATS_RECORD_MAX_FILES)
+                usage();
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2)
+        usage();
+
+    stats = open_stats(argv[optind]);
+    if (stats == NULL)
+        return 1;
+
+    if (stats_cl_create(&cl) != S_OK || stats_sample_create(&sample) != S_OK)
+    {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    err = stats_recorder_create(argv[optind + 1], file_mb * 1024 * 1024, files, &rec);
+    if (err == S_OK)
+        err = stats_recorder_open(rec, argv[optind], interval_ms);
+    if (err != S_OK)
+    {
+        printf("Failed to open recording %s: %s\n", argv[optind + 1], error_message(err));
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sigfunc;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    start = next = current_time();
+
+    while (!done)
+    {
+        err = stats_get_sample(stats, cl, sample);
+        if (err == S_OK)
+            err = stats_record_sample(rec, stats, cl, sample);
+        if (err != S_OK)
+        {
+            printf("Failed to record sample: %s\n", error_message(err));
+            break;
+        }
+        samples++;
+
+        if (seconds > 0 && sample->sample_time - start >= seconds * 1000000000ll)
+            break;
+
+        /* keep to the interval, skipping the samples we are too late for */
+        next += interval_ms * 1000000ll;
+        now = current_time();
+        while (next <= now)
+            next += interval_ms * 1000000ll;
+        usleep((next - now) / 1000);
+    }
+
+    elapsed = (current_time() - start) / 1e9;
+    printf("Recorded %lld samples in %.1fs: %lld bytes, %.1f bytes/sample, %.2f MB/hour\n", samples, elapsed,
+        rec->rec_bytes, samples ? (double) rec->rec_bytes / samples : 0.0,
+        elapsed > 0 ? rec->rec_bytes / elapsed * 3600 / (1024 * 1024) : 0.0);
+
+    stats_recorder_close(rec);
+    stats_recorder_free(rec);
+    stats_sample_free(sample);
+    stats_cl_free(cl);
+    stats_close(stats);
+    stats_free(stats);
+
+    return err == S_OK ? 0 : 1;
+}
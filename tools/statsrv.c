@@ -1,7 +1,12 @@
 /* statsrv.c */
 
 /*
- * An HTTP server that allows clients to receive a sample of stats data
+ * An HTTP server that allows clients to receive a sample of stats data.
+ * If a DERIVED_FILE is given, the derived counters it defines (see
+ * derived.h) are evaluated with each sample and returned with it.
+ *
+ * /segments lists every stats segment on the host and /sample/all
+ * samples all of them (see registry.h).
  */
 
 #include <stdio.h>
@@ -19,6 +24,9 @@
 #include <event2/keyvalq_struct.h>
 
 #include "stats/stats.h"
+#include "stats/rollup.h"
+#include "stats/derived.h"
+#include "stats/registry.h"
 #include "stats/error.h"
 
 struct context
@@ -29,6 +37,9 @@ struct context
     struct stats_counter_list *cl;
     struct stats_sample *sample;
     struct stats_sample *prev_sample;
+    struct stats_rollup *rollup;
+    struct stats_derived *derived;
+    struct stats_group *group;
 };
 
 static struct stats *open_stats(const char *name)
@@ -65,32 +76,215 @@ static void sigint_cb(evutil_socket_t fd, short event, void *arg)
 
 static int get_sample(struct context *ctx)
 {
+    struct stats_sample *tmp;
     int err;
 
-    err = stats_get_sample(ctx->stats, ctx->cl, ctx->sample);
+    /* keep the previous sample for the derived rates */
+    tmp = ctx->prev_sample;
+    ctx->prev_sample = ctx->sample;
+    ctx->sample = tmp;
+
+    err = stats_get_fresh_sample(ctx->stats, ctx->cl, ctx->sample);
     if (err != S_OK)
     {
         printf("Error %08x (%s) getting sample\n",err,error_message(err));
         return 1;
     }
 
+    if (ctx->derived)
+    {
+        err = stats_derived_evaluate(ctx->stats, ctx->derived, ctx->cl, ctx->sample, ctx->prev_sample);
+        if (err != S_OK)
+        {
+            printf("Error %08x (%s) evaluating derived counters\n",err,error_message(err));
+            return 1;
+        }
+    }
+
     return 0;
 }
 
 
+/* quantile counters also report these percentiles as <name>.p50 etc */
+static const int quantile_percentiles[] = { 50, 90, 99 };
+
+static void format_quantiles(struct stats *stats, struct evbuffer *evb, struct stats_counter *ctr, const char *counter_name)
+{
+    struct stats_quantile *qs;
+    int i;
+
+    qs = stats_counter_get_quantile(stats, ctr);
+    if (qs == NULL)
+        return;
+
+    for (i = 0; i < sizeof(quantile_percentiles) / sizeof(quantile_percentiles[0]); i++)
+    {
+        evbuffer_add_printf(evb, ",\"%s.p%d\":%.0f", counter_name, quantile_percentiles[i],
+            stats_quantile_get(qs, quantile_percentiles[i] / 100.0));
+    }
+}
+
+/* double and fixed point counters are written as JSON numbers with a fraction */
+static void format_value(struct evbuffer *evb, struct stats_counter *ctr, const char *counter_name, long long value)
+{
+    double d;
+
+    if (ctr->ctr_flags & CTR_FLAG_DOUBLE)
+    {
+        d = stats_value_to_double(ctr->ctr_flags, value);
+        if (d == d && d - d == 0.0)
+            evbuffer_add_printf(evb,"\"%s\":%.17g", counter_name, d);
+        else
+            evbuffer_add_printf(evb,"\"%s\":null", counter_name);
+    }
+    else if (ctr->ctr_flags & CTR_FLAG_FIXED)
+    {
+        evbuffer_add_printf(evb,"\"%s\":%.*f", counter_name, CTR_FLAG_FIXED_DIGITS(ctr->ctr_flags),
+            stats_value_to_double(ctr->ctr_flags, value));
+    }
+    else
+    {
+        evbuffer_add_printf(evb,"\"%s\":%lld", counter_name, value);
+    }
+}
+
 static int format_sample_response(struct context *ctx, struct evbuffer *evb)
 {
+    double d;
     int i;
+    struct stats_counter *ctr;
     char counter_name[MAX_COUNTER_KEY_LENGTH+1];
 
     evbuffer_add_printf(evb, "{\"status\":\"ok\",\"sample_time\":%lld,\"sample\":{",
         ctx->sample->sample_time);
     for (i = 0; i < ctx->cl->cl_count; i++)
     {
-        counter_get_key(ctx->cl->cl_ctr[i],counter_name,MAX_COUNTER_KEY_LENGTH+1);
+        ctr = stats_cl_get_counter(ctx->stats,ctx->cl,i);
+        counter_get_key(ctr,counter_name,MAX_COUNTER_KEY_LENGTH+1);
+        if (i > 0)
+            evbuffer_add_printf(evb, ",");
+        format_value(evb, ctr, counter_name, stats_sample_get_value(ctx->sample,i));
+        if (ctr->ctr_flags & CTR_FLAG_QUANTILE)
+            format_quantiles(ctx->stats, evb, ctr, counter_name);
+    }
+    for (i = 0; ctx->derived && i < stats_derived_count(ctx->derived); i++)
+    {
+        if (i > 0 || ctx->cl->cl_count > 0)
+            evbuffer_add_printf(evb, ",");
+        d = stats_sample_get_derived_double(ctx->sample,i);
+        if (d == d && d - d == 0.0)
+            evbuffer_add_printf(evb,"\"%s\":%.17g", stats_derived_get_name(ctx->derived,i), d);
+        else
+            evbuffer_add_printf(evb,"\"%s\":null", stats_derived_get_name(ctx->derived,i));
+    }
+    evbuffer_add_printf(evb, "}}");
+    return 0;
+}
+
+static void format_segment_info(struct evbuffer *evb, struct stats_segment_info *si)
+{
+    evbuffer_add_printf(evb, "\"%s\":{\"owner_pid\":%d,\"owner_uid\":%d,\"size\":%d,\"attached\":%d,\"version\":%d}",
+        si->si_name, si->si_owner_pid, si->si_owner_uid, si->si_size, si->si_attached, si->si_version);
+}
+
+static int format_segments_response(struct context *ctx, struct evbuffer *evb)
+{
+    struct stats_segment_info infos[STATS_REGISTRY_SIZE];
+    int i, n;
+
+    if (stats_enumerate(infos, STATS_REGISTRY_SIZE, &n) != S_OK)
+        return 1;
+
+    evbuffer_add_printf(evb, "{\"status\":\"ok\",\"segments\":{");
+    for (i = 0; i < n; i++)
+    {
         if (i > 0)
             evbuffer_add_printf(evb, ",");
-        evbuffer_add_printf(evb,"\"%s\":%lld", counter_name, stats_sample_get_value(ctx->sample,i));
+        format_segment_info(evb, &infos[i]);
+    }
+    evbuffer_add_printf(evb, "}}");
+    return 0;
+}
+
+/* one object per segment, holding the sample of its counters */
+static int format_sample_all_response(struct context *ctx, struct evbuffer *evb)
+{
+    struct stats_group_member *gm;
+    struct stats_counter *ctr;
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+    int i, j;
+
+    if (stats_group_refresh(ctx->group) != S_OK)
+        return 1;
+
+    /* a segment which cannot be sampled keeps its previous sample */
+    stats_group_sample(ctx->group);
+
+    evbuffer_add_printf(evb, "{\"status\":\"ok\",\"sample_time\":%lld,\"segments\":{", current_time());
+    for (i = 0; i < stats_group_count(ctx->group); i++)
+    {
+        gm = stats_group_get_member(ctx->group, i);
+        evbuffer_add_printf(evb, "%s\"%s\":{\"sample_time\":%lld,\"sample\":{", i > 0 ? "," : "",
+            gm->gm_info.si_name, gm->gm_sample->sample_time);
+        for (j = 0; j < gm->gm_cl->cl_count; j++)
+        {
+            ctr = stats_cl_get_counter(gm->gm_stats,gm->gm_cl,j);
+            counter_get_key(ctr,counter_name,MAX_COUNTER_KEY_LENGTH+1);
+            if (j > 0)
+                evbuffer_add_printf(evb, ",");
+            format_value(evb, ctr, counter_name, stats_sample_get_value(gm->gm_sample,j));
+            if (ctr->ctr_flags & CTR_FLAG_QUANTILE)
+                format_quantiles(gm->gm_stats, evb, ctr, counter_name);
+        }
+        evbuffer_add_printf(evb, "}}");
+    }
+    evbuffer_add_printf(evb, "}}");
+    return 0;
+}
+
+static int format_rollup_response(struct context *ctx, struct evbuffer *evb)
+{
+    int i;
+
+    if (stats_rollup_update(ctx->stats, ctx->rollup, ctx->cl) != S_OK)
+        return 1;
+    if (stats_rollup_compute(ctx->rollup, ctx->sample, NULL) != S_OK)
+        return 1;
+
+    evbuffer_add_printf(evb, "{\"status\":\"ok\",\"sample_time\":%lld,\"rollup\":{",
+        ctx->sample->sample_time);
+    for (i = 0; i < stats_rollup_count(ctx->rollup); i++)
+    {
+        if (i > 0)
+            evbuffer_add_printf(evb, ",");
+        evbuffer_add_printf(evb,"\"%s%s\":%lld", stats_rollup_get_prefix(ctx->rollup,i), STATS_ROLLUP_SUFFIX,
+            stats_rollup_get_value(ctx->rollup,i));
+    }
+    evbuffer_add_printf(evb, "}}");
+    return 0;
+}
+
+static int format_breakdown_response(struct context *ctx, struct evbuffer *evb)
+{
+    struct stats_process_value values[STATS_PROCESS_TABLE_SIZE];
+    struct stats_counter *ctr;
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+    int i, j, n, first = 1;
+
+    evbuffer_add_printf(evb, "{\"status\":\"ok\",\"sample_time\":%lld,\"breakdown\":{",
+        ctx->sample->sample_time);
+    for (i = 0; i < ctx->cl->cl_count; i++)
+    {
+        ctr = stats_cl_get_counter(ctx->stats,ctx->cl,i);
+        if (stats_counter_get_breakdown(ctx->stats, ctr, values, STATS_PROCESS_TABLE_SIZE, &n) != S_OK)
+            continue;
+
+        counter_get_key(ctr,counter_name,MAX_COUNTER_KEY_LENGTH+1);
+        evbuffer_add_printf(evb, "%s\"%s\":{", first ? "" : ",", counter_name);
+        for (j = 0; j < n; j++)
+            evbuffer_add_printf(evb, "%s\"%d\":%lld", j > 0 ? "," : "", values[j].pv_pid, values[j].pv_value);
+        evbuffer_add_printf(evb, "}");
+        first = 0;
     }
     evbuffer_add_printf(evb, "}}");
     return 0;
@@ -149,6 +343,48 @@ static void http_request_cb(struct evhttp_request *req, void *arg)
             internal_error(req, evb);
         }
     }
+    else if (strcmp(uri,"/rollup") == 0)
+    {
+        evb = evbuffer_new();
+        if (get_sample(ctx) == 0 && format_rollup_response(ctx, evb) == 0)
+        {
+            evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json");
+            evhttp_send_reply(req, 200, "OK", evb);
+            printf(" - 200 - ok\n");
+        }
+        else
+        {
+            internal_error(req, evb);
+        }
+    }
+    else if (strcmp(uri,"/segments") == 0 || strcmp(uri,"/sample/all") == 0)
+    {
+        evb = evbuffer_new();
+        if ((strcmp(uri,"/segments") == 0 ? format_segments_response(ctx, evb) : format_sample_all_response(ctx, evb)) == 0)
+        {
+            evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json");
+            evhttp_send_reply(req, 200, "OK", evb);
+            printf(" - 200 - ok\n");
+        }
+        else
+        {
+            internal_error(req, evb);
+        }
+    }
+    else if (strcmp(uri,"/breakdown") == 0)
+    {
+        evb = evbuffer_new();
+        if (get_sample(ctx) == 0 && format_breakdown_response(ctx, evb) == 0)
+        {
+            evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json");
+            evhttp_send_reply(req, 200, "OK", evb);
+            printf(" - 200 - ok\n");
+        }
+        else
+        {
+            internal_error(req, evb);
+        }
+    }
     else
     {
         type = "text/plain";
@@ -218,10 +454,11 @@ int main(int argc, char **argv)
     struct event *signal_int;
     struct evhttp_bound_socket *handle;
     char listen_addr[256];
+    int err, line = 0;
 
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("usage: statsrv STATS\n");
+        printf("usage: statsrv STATS [DERIVED_FILE]\n");
         return -1;
     }
 
@@ -243,6 +480,34 @@ int main(int argc, char **argv)
         return ERROR_FAIL;
     }
 
+    if (stats_rollup_create(&ctx.rollup) != S_OK)
+    {
+        printf("Failed to allocate stats rollup\n");
+        return ERROR_FAIL;
+    }
+
+    if (stats_group_create(&ctx.group) != S_OK)
+    {
+        printf("Failed to allocate stats group\n");
+        return ERROR_FAIL;
+    }
+
+    if (argc == 3)
+    {
+        if (stats_derived_create(&ctx.derived) != S_OK)
+        {
+            printf("Failed to allocate derived counters\n");
+            return ERROR_FAIL;
+        }
+
+        err = stats_derived_load(ctx.derived, argv[2], &line);
+        if (err != S_OK)
+        {
+            printf("Failed to load derived counters from %s line %d: %s\n", argv[2], line, error_message(err));
+            return ERROR_FAIL;
+        }
+    }
+
     ctx.stats = open_stats(argv[1]);
     if (!ctx.stats)
     {
@@ -308,7 +573,7 @@ int main(int argc, char **argv)
         col = 0;
         for (j = 0; j < cl->cl_count; j++)
         {
-            counter_get_key(cl->cl_ctr[j],counter_name,MAX_COUNTER_KEY_LENGTH+1);
+            counter_get_key(stats_cl_get_counter(stats,cl,j),counter_name,MAX_COUNTER_KEY_LENGTH+1);
             mvprintw(n,col+0,"%s", counter_name);
             mvprintw(n,col+29,"%15lld", stats_sample_get_value(sample,j));
             mvprintw(n,col+46,"%15lld", stats_sample_get_delta(sample,prev_sample,j));
@@ -367,6 +632,15 @@ int main(int argc, char **argv)
     if (ctx.prev_sample)
         stats_sample_free(ctx.prev_sample);
 
+    if (ctx.rollup)
+        stats_rollup_free(ctx.rollup);
+
+    if (ctx.derived)
+        stats_derived_free(ctx.derived);
+
+    if (ctx.group)
+        stats_group_free(ctx.group);
+
     return 0;
 }
 
@@ -0,0 +1,175 @@
+/* statstrace.c */
+
+/*
+ * Dumps or follows the event trace ring of a stats object.
+ *
+ * statstrace prints the records in the "<STATS>.trc" ring, oldest first,
+ * with times relative to the first record printed. Events written with
+ * stats_trace_counter are shown with the name of their counter. With -f
+ * statstrace keeps following the ring until interrupted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "stats/stats.h"
+#include "stats/error.h"
+
+#define READ_BATCH 256
+#define FOLLOW_INTERVAL_US 10000
+
+static volatile int done = 0;
+
+static void sigint_handler(int sig)
+{
+    done = 1;
+}
+
+static struct stats *open_stats(const char *name)
+{
+    struct stats *stats = NULL;
+    int err;
+
+    err = stats_create(name,&stats);
+    if (err != S_OK)
+    {
+        printf("Failed to create stats: %s\n", error_message(err));
+        return NULL;
+    }
+
+    err = stats_open(stats);
+    if (err != S_OK)
+    {
+        printf("Failed to open stats: %s\n", error_message(err));
+        stats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+static struct stats_trace *open_trace(const char *name)
+{
+    struct stats_trace *trace = NULL;
+    int err;
+
+    err = stats_trace_create(name,0,&trace);
+    if (err != S_OK)
+    {
+        printf("Failed to create trace: %s\n", error_message(err));
+        return NULL;
+    }
+
+    err = stats_trace_open(trace);
+    if (err != S_OK)
+    {
+        printf("Failed to open trace: %s\n", error_message(err));
+        stats_trace_free(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+static void print_record(struct stats *stats, struct stats_trace_record *r, long long base_time)
+{
+    struct stats_counter *ctr;
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+
+    if (r->tr_id >= 0 && r->tr_id < COUNTER_TABLE_SIZE &&
+        stats->data->ctr[r->tr_id].ctr_allocation_status == ALLOCATION_STATUS_ALLOCATED)
+    {
+        ctr = stats->data->ctr + r->tr_id;
+        counter_get_key(ctr, counter_name, MAX_COUNTER_KEY_LENGTH+1);
+    }
+    else
+    {
+        snprintf(counter_name, sizeof(counter_name), "#%d", r->tr_id);
+    }
+
+    printf("%12lld %14.3f %7d %-32s %lld\n", r->tr_seq - 1,
+        TIME_DELTA_TO_NANOS(base_time, r->tr_time) / 1000.0, r->tr_pid, counter_name, r->tr_arg);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats *stats = NULL;
+    struct stats_trace *trace = NULL;
+    struct stats_trace_record records[READ_BATCH];
+    long long cursor, dropped, total_dropped = 0, base_time = 0;
+    int follow = 0, i, n;
+    const char *name;
+
+    if (argc == 3 && strcmp(argv[1], "-f") == 0)
+    {
+        follow = 1;
+        name = argv[2];
+    }
+    else if (argc == 2)
+    {
+        name = argv[1];
+    }
+    else
+    {
+        printf("usage: statstrace [-f] STATS\n");
+        return -1;
+    }
+
+    stats = open_stats(name);
+    if (!stats)
+        return ERROR_FAIL;
+
+    trace = open_trace(name);
+    if (!trace)
+    {
+        stats_close(stats);
+        stats_free(stats);
+        return ERROR_FAIL;
+    }
+
+    signal(SIGINT, sigint_handler);
+
+    printf("%12s %14s %7s %-32s %s\n", "SEQ", "TIME(US)", "PID", "EVENT", "ARG");
+
+    cursor = stats_trace_oldest(trace);
+
+    while (!done)
+    {
+        if (stats_trace_read(trace, &cursor, records, READ_BATCH, &n, &dropped) != S_OK)
+            break;
+
+        if (dropped > 0)
+        {
+            printf("-- %lld records overwritten before they were read\n", dropped);
+            total_dropped += dropped;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (base_time == 0)
+                base_time = records[i].tr_time;
+            print_record(stats, records + i, base_time);
+        }
+
+        if (n < READ_BATCH)
+        {
+            if (!follow)
+                break;
+            fflush(stdout);
+            usleep(FOLLOW_INTERVAL_US);
+        }
+    }
+
+    if (total_dropped > 0)
+        printf("%lld records dropped\n", total_dropped);
+
+    stats_trace_close(trace);
+    stats_trace_free(trace);
+    stats_close(stats);
+    stats_free(stats);
+
+    return 0;
+}
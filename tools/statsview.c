@@ -10,6 +10,10 @@
 #include <sys/time.h>
 
 #include "stats/stats.h"
+#include "stats/rollup.h"
+#include "stats/derived.h"
+#include "stats/registry.h"
+#include "stats/record.h"
 #include "stats/error.h"
 #include "screenutil.h"
 
@@ -43,21 +47,274 @@ static struct stats *open_stats(const char *name)
     return stats;
 }
 
+/* prints a counter of a sample at line n, returning the next line */
+static int print_counter(struct stats_counter *ctr, struct stats_sample *sample, struct stats_sample *prev_sample,
+    int j, int n, int col, int indent)
+{
+    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
+    int digits;
+
+    counter_get_key(ctr,counter_name,MAX_COUNTER_KEY_LENGTH+1);
+    mvprintw(n,col+indent,"%s", counter_name);
+    if (ctr->ctr_flags & CTR_FLAG_REAL_MASK)
+    {
+        digits = (ctr->ctr_flags & CTR_FLAG_FIXED) ? CTR_FLAG_FIXED_DIGITS(ctr->ctr_flags) : 3;
+        mvprintw(n,col+29,"%15.*f", digits, stats_sample_get_double(sample,ctr->ctr_flags,j));
+        mvprintw(n,col+46,"%15.*f", digits, stats_sample_get_delta_double(sample,prev_sample,ctr->ctr_flags,j));
+    }
+    else
+    {
+        mvprintw(n,col+29,"%15lld", stats_sample_get_value(sample,j));
+        mvprintw(n,col+46,"%15lld", stats_sample_get_delta(sample,prev_sample,j));
+    }
+    return n + 1;
+}
+
+/* waits up to usec microseconds for a key, returning it or -1 */
+static int wait_for_key(long long usec)
+{
+    struct timeval tv;
+    fd_set fds;
+
+    FD_ZERO(&fds);
+    FD_SET(0,&fds);
+
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+
+    if (select(1, &fds, NULL, NULL, &tv) == 1)
+        return getch();
+    return -1;
+}
+
+/* waits for the start of the next second, returning the key pressed or -1 */
+static int wait_for_next_sample()
+{
+    return wait_for_key(1000000 - (current_time() % 1000000000) / 1000);
+}
+
+/*
+ * view_all
+ *
+ * Shows every stats segment on the host (see registry.h), one section per
+ * segment, sampling all of them once per second. Segments which are
+ * created while running are added.
+ */
+static int view_all()
+{
+    struct stats_group *group = NULL;
+    struct stats_group_member *gm;
+    struct sigaction sa;
+    int i, j, n, maxy, col, err;
+    long long start_time, sample_time;
+
+    if (stats_group_create(&group) != S_OK)
+    {
+        printf("Failed to allocate stats group\n");
+        return ERROR_FAIL;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sigfunc;
+    sigaction(SIGINT, &sa, NULL);
+
+    init_screen();
+
+    start_time = current_time();
+
+    while (!signal_received)
+    {
+        err = stats_group_refresh(group);
+        if (err == S_OK)
+            err = stats_group_sample(group);
+
+        clear();
+
+        sample_time = TIME_DELTA_TO_NANOS(start_time, current_time());
+
+        mvprintw(0,0,"SAMPLE @ %6lld.%03llds  SEGMENTS:%d%s\n", sample_time / 1000000000ll, (sample_time % 1000000000ll) / 1000000ll,
+            stats_group_count(group), err == S_OK ? "" : "  (error)");
+
+        n = 1;
+        maxy = getmaxy(stdscr);
+        col = 0;
+        for (i = 0; i < stats_group_count(group); i++)
+        {
+            gm = stats_group_get_member(group, i);
+            mvprintw(n,col+0,"%s", gm->gm_info.si_name);
+            mvprintw(n,col+29,"pid %d, %d attached", gm->gm_info.si_owner_pid, gm->gm_info.si_attached);
+            if (++n == maxy)
+            {
+                col += 66;
+                n = 1;
+            }
+
+            for (j = 0; j < gm->gm_cl->cl_count; j++)
+            {
+                n = print_counter(stats_cl_get_counter(gm->gm_stats,gm->gm_cl,j), gm->gm_sample, gm->gm_prev_sample, j, n, col, 2);
+                if (n == maxy)
+                {
+                    col += 66;
+                    n = 1;
+                }
+            }
+        }
+        refresh();
+
+        wait_for_next_sample();
+    }
+
+    close_screen();
+
+    stats_group_free(group);
+
+    if (signal_received)
+        printf("Exiting on signal.\n");
+
+    return signal_received;
+}
+
+/*
+ * replay
+ *
+ * Plays back a recording made by statsrecord (see record.h) at the speed
+ * it was recorded. Space pauses, + and - change the speed and q quits.
+ */
+static int replay(const char *path)
+{
+    struct stats_replay *rp = NULL;
+    struct stats_record_header *hdr;
+    struct stats_sample *sample = NULL, *prev_sample = NULL, *tmp;
+    struct sigaction sa;
+    struct tm tm;
+    time_t wall_sec;
+    char wall[32];
+    int j, n, maxy, col, ch, err, speed = 1, paused = 0, end = 0;
+    long long wall_time, wait_us;
+
+    err = stats_replay_create(path, &rp);
+    if (err != S_OK)
+    {
+        printf("Failed to open recording %s: %s\n", path, error_message(err));
+        return ERROR_FAIL;
+    }
+
+    if (stats_sample_create(&sample) != S_OK || stats_sample_create(&prev_sample) != S_OK)
+    {
+        printf("Failed to allocate stats sample\n");
+        return ERROR_FAIL;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sigfunc;
+    sigaction(SIGINT, &sa, NULL);
+
+    init_screen();
+
+    while (!signal_received)
+    {
+        if (!paused && !end)
+        {
+            tmp = prev_sample;
+            prev_sample = sample;
+            sample = tmp;
+
+            err = stats_replay_next(rp, sample);
+            if (err != S_OK)
+            {
+                /* keep showing the last sample */
+                tmp = prev_sample;
+                prev_sample = sample;
+                sample = tmp;
+                end = 1;
+            }
+        }
+
+        clear();
+
+        hdr = stats_replay_get_header(rp);
+        wall_time = hdr ? hdr->rf_wall_time + (sample->sample_time - hdr->rf_start_time) : 0;
+        wall_sec = wall_time / 1000000000ll;
+        localtime_r(&wall_sec, &tm);
+        strftime(wall, sizeof(wall), "%Y-%m-%d %H:%M:%S", &tm);
+
+        mvprintw(0,0,"REPLAY %s @ %s.%03lld  SEQ:%d  x%d%s%s\n", hdr ? hdr->rf_name : path, wall,
+            (wall_time % 1000000000ll) / 1000000ll, sample->sample_seq_no, speed, paused ? "  PAUSED" : "",
+            end ? (err == ERROR_STATS_RECORD_END ? "  END" : "  ERROR") : "");
+
+        n = 1;
+        maxy = getmaxy(stdscr);
+        col = 0;
+        for (j = 0; j < sample->sample_count; j++)
+        {
+            n = print_counter(stats_replay_get_counter(rp,j), sample, prev_sample, j, n, col, 0);
+            if (n == maxy)
+            {
+                col += 66;
+                n = 1;
+            }
+        }
+        refresh();
+
+        /* wait the recording interval for the next sample */
+        wait_us = 1000000;
+        if (!paused && !end && hdr)
+            wait_us = (long long) hdr->rf_interval_ms * 1000 / speed;
+
+        ch = wait_for_key(wait_us);
+        if (ch == ' ')
+        {
+            paused = !paused;
+        }
+        else if (ch == '+' && speed < 1024)
+        {
+            speed *= 2;
+        }
+        else if (ch == '-' && speed > 1)
+        {
+            speed /= 2;
+        }
+        else if (ch == 'q' || ch == 'Q')
+        {
+            break;
+        }
+    }
+
+    close_screen();
+
+    stats_replay_free(rp);
+    stats_sample_free(sample);
+    stats_sample_free(prev_sample);
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct stats *stats = NULL;
     struct stats_counter_list *cl = NULL;
     struct stats_sample *sample = NULL, *prev_sample = NULL, *tmp = NULL;
+    struct stats_rollup *rollup = NULL;
+    struct stats_derived *derived = NULL;
+    long long *rollup_delta = NULL;
+    int show_rollup = 0, show_processes = 0, rollup_delta_size = 0;
+    struct stats_process_value values[STATS_PROCESS_TABLE_SIZE];
+    struct stats_counter *ctr;
     struct sigaction sa;
-    char counter_name[MAX_COUNTER_KEY_LENGTH+1];
-    int j, err, n, maxy, col, ret, ch;
-    struct timeval tv;
-    long long start_time, sample_time, now;
-    fd_set fds;
+    int j, k, err, n, maxy, col, ch, line = 0, nvalues;
+    long long start_time, sample_time;
+
+    if (argc == 2 && strcmp(argv[1], "-a") == 0)
+        return view_all();
+
+    if (argc == 3 && strcmp(argv[1], "--replay") == 0)
+        return replay(argv[2]);
 
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("usage: statsview STATS\n");
+        printf("usage: statsview STATS [DERIVED_FILE]\n");
+        printf("       statsview -a\n");
+        printf("       statsview --replay PATH\n");
         return -1;
     }
 
@@ -79,6 +336,28 @@ int main(int argc, char **argv)
         return ERROR_FAIL;
     }
 
+    if (stats_rollup_create(&rollup) != S_OK)
+    {
+        printf("Failed to allocate stats rollup\n");
+        return ERROR_FAIL;
+    }
+
+    if (argc == 3)
+    {
+        if (stats_derived_create(&derived) != S_OK)
+        {
+            printf("Failed to allocate derived counters\n");
+            return ERROR_FAIL;
+        }
+
+        err = stats_derived_load(derived, argv[2], &line);
+        if (err != S_OK)
+        {
+            printf("Failed to load derived counters from %s line %d: %s\n", argv[2], line, error_message(err));
+            return ERROR_FAIL;
+        }
+    }
+
     stats = open_stats(argv[1]);
     if (!stats)
     {
@@ -96,11 +375,15 @@ int main(int argc, char **argv)
 
     while (!signal_received)
     {
-        err = stats_get_sample(stats,cl,sample);
+        err = stats_get_fresh_sample(stats,cl,sample);
         if (err != S_OK)
         {
             printf("Error %08x (%s) getting sample\n",err,error_message(err));
         }
+        else if (derived)
+        {
+            stats_derived_evaluate(stats,derived,cl,sample,prev_sample);
+        }
 
         clear();
 
@@ -111,16 +394,68 @@ int main(int argc, char **argv)
         n = 1;
         maxy = getmaxy(stdscr);
         col = 0;
-        for (j = 0; j < cl->cl_count; j++)
+        if (show_rollup)
         {
-            counter_get_key(cl->cl_ctr[j],counter_name,MAX_COUNTER_KEY_LENGTH+1);
-            mvprintw(n,col+0,"%s", counter_name);
-            mvprintw(n,col+29,"%15lld", stats_sample_get_value(sample,j));
-            mvprintw(n,col+46,"%15lld", stats_sample_get_delta(sample,prev_sample,j));
-            if (++n == maxy)
+            /* compute the deltas first and keep them, then the totals */
+            stats_rollup_update(stats,rollup,cl);
+            if (stats_rollup_count(rollup) > rollup_delta_size)
             {
-                col += 66;
-                n = 1;
+                rollup_delta_size = stats_rollup_count(rollup);
+                rollup_delta = (long long *) realloc(rollup_delta, rollup_delta_size * sizeof(long long));
+            }
+            stats_rollup_compute(rollup,sample,prev_sample);
+            if (rollup_delta)
+                memcpy(rollup_delta, rollup->ru_value, stats_rollup_count(rollup) * sizeof(long long));
+            stats_rollup_compute(rollup,sample,NULL);
+
+            for (j = 0; j < stats_rollup_count(rollup) && rollup_delta; j++)
+            {
+                mvprintw(n,col+0,"%s%s", stats_rollup_get_prefix(rollup,j), STATS_ROLLUP_SUFFIX);
+                mvprintw(n,col+29,"%15lld", stats_rollup_get_value(rollup,j));
+                mvprintw(n,col+46,"%15lld", rollup_delta[j]);
+                if (++n == maxy)
+                {
+                    col += 66;
+                    n = 1;
+                }
+            }
+        }
+        else
+        {
+            for (j = 0; j < cl->cl_count; j++)
+            {
+                ctr = stats_cl_get_counter(stats,cl,j);
+                n = print_counter(ctr, sample, prev_sample, j, n, col, 0);
+                if (n == maxy)
+                {
+                    col += 66;
+                    n = 1;
+                }
+
+                /* the per-process columns are current values, not sampled */
+                if (show_processes && stats_counter_get_breakdown(stats,ctr,values,STATS_PROCESS_TABLE_SIZE,&nvalues) == S_OK)
+                {
+                    for (k = 0; k < nvalues; k++)
+                    {
+                        mvprintw(n,col+2,"[%d]", values[k].pv_pid);
+                        mvprintw(n,col+29,"%15lld", values[k].pv_value);
+                        if (++n == maxy)
+                        {
+                            col += 66;
+                            n = 1;
+                        }
+                    }
+                }
+            }
+            for (j = 0; j < sample->sample_derived_count; j++)
+            {
+                mvprintw(n,col+0,"%s", stats_derived_get_name(derived,j));
+                mvprintw(n,col+29,"%15.3f", stats_sample_get_derived_double(sample,j));
+                if (++n == maxy)
+                {
+                    col += 66;
+                    n = 1;
+                }
             }
         }
         refresh();
@@ -129,22 +464,18 @@ int main(int argc, char **argv)
         prev_sample = sample;
         sample = tmp;
 
-        FD_ZERO(&fds);
-        FD_SET(0,&fds);
-
-        now = current_time();
-
-        tv.tv_sec = 0;
-        tv.tv_usec = 1000000 - (now % 1000000000) / 1000;
-
-        ret = select(1, &fds, NULL, NULL, &tv);
-        if (ret == 1)
+        ch = wait_for_next_sample();
+        if (ch == 'c' || ch == 'C')
         {
-            ch = getch();
-            if (ch == 'c' || ch == 'C')
-            {
-                stats_reset_counters(stats);
-            }
+            stats_reset_counters(stats);
+        }
+        else if (ch == 'r' || ch == 'R')
+        {
+            show_rollup = !show_rollup;
+        }
+        else if (ch == 'p' || ch == 'P')
+        {
+            show_processes = !show_processes;
         }
     }
 
@@ -165,6 +496,14 @@ int main(int argc, char **argv)
     if (prev_sample)
         stats_sample_free(prev_sample);
 
+    if (rollup)
+        stats_rollup_free(rollup);
+
+    free(rollup_delta);
+
+    if (derived)
+        stats_derived_free(derived);
+
     if (signal_received)
         printf("Exiting on signal.\n");
 